@@ -90,10 +90,13 @@ int main(int argc, char **argv) {
   string pmem = result["pmem"].as<string>();
   std::string sync = result["sync"].as<string>();
   std::string cache_size = result["cache_size"].as<string>();
+  install_pcache(result["pcache"].as<string>(), result["pcache_size"].as<size_t>(),
+                 result["pcache_dram"].as<size_t>());
 
   int rc;
   if (result.count("load")) {
     sqlite3* db = open_db(path.c_str(), pmem, sync, cache_size);
+    set_logging(db, result["logging"].as<string>());
 
     rc = sqlite3_exec(db,"DROP TABLE IF EXISTS t", NULL,NULL,NULL);
      if(rc){cout << "DROP: " << rc << endl;}
@@ -120,6 +123,7 @@ int main(int argc, char **argv) {
 
   if (result.count("run")) {
     sqlite3* db = open_db(path.c_str(), pmem, sync, cache_size);
+    set_logging(db, result["logging"].as<string>());
 
     // rc = sqlite3_exec(db,"PRAGMA cache_size=-1000000", NULL,NULL,NULL);
     // if (rc != SQLITE_OK) {throw std::runtime_error(sqlite3_errmsg(db));}
@@ -127,8 +131,12 @@ int main(int argc, char **argv) {
     std::vector<Worker> workers;
     workers.emplace_back(db, size, mix);
 
+    sqlite3_pmem_config(PMEM_CONFIG_TRACE, result["trace"].as<int>());
     double throughput = dbbench::run(workers, result["warmup"].as<size_t>(),
                                      result["measure"].as<size_t>());
+    if (result["trace"].as<int>()) {
+      sqlite3_pmem_trace_dump((path + "-heat").c_str(), 0);
+    }
 
     ofstream result_file {"../../results/master_results.csv", std::ios::app};
 
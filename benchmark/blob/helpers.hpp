@@ -22,6 +22,14 @@ cxxopts::Options blob_options(const std::string &program,
   adder("cache_size", "Cache size", cxxopts::value<std::string>()->default_value("0"));
   adder("sync", "Pmem", cxxopts::value<std::string>()->default_value("FULL"));
   adder("memory_limit", "Memory limit",cxxopts::value<std::string>()->default_value("1GB"));
+  adder("logging", "PMem WAL logging: copy, combine, stream or adaptive",
+        cxxopts::value<std::string>()->default_value(""));
+  adder("trace", "Sample one in N PMem page accesses into PATH-heat, 0 disables it",
+        cxxopts::value<int>()->default_value("0"));
+  adder("pcache", "Directory on PMem for the page cache, empty keeps SQLite's",
+        cxxopts::value<std::string>()->default_value(""));
+  adder("pcache_size", "PMem page cache size in MiB", cxxopts::value<size_t>()->default_value("65536"));
+  adder("pcache_dram", "DRAM for the hottest cached pages in MiB", cxxopts::value<size_t>()->default_value("1024"));
 
   return options;
 }
@@ -0,0 +1,235 @@
+/*
+** Delta logging against full page logging of the WAL.
+**
+** Runs TATP UpdateSubscriberData, one bit of a subscriber and one byte of
+** a special facility per transaction, on every --vfs, usually "X+delta"
+** and "X+fullpage" (see vfs/pmem_delta_vfs.c):
+**
+**     run       --transactions transactions on a freshly loaded database,
+**               throughput and the bytes logged per transaction
+**     recovery  a child process runs --crash_transactions transactions and
+**               exits without closing the database, the time to reopen it
+**               and answer the first query includes the replay of the log
+**
+** The child leaves the WAL file in the page cache, the replay rewrites
+** what is already there; its cost is that of a restart after power loss.
+** Every vfs writes one JSON object to --out.
+**
+**     delta_bench --vfs +delta,+fullpage --records 100000
+*/
+#include "cxxopts.hpp"
+
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../sqlite_helper.hpp"
+#include "../tatp/helpers.hpp"
+
+using namespace std;
+
+static ofstream out;
+static bool first_result = true;
+
+static uint64_t now_ns(){
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void exec(sqlite3 *db, const string &sql){
+  char *err = NULL;
+  if(sqlite3_exec(db, sql.c_str(), NULL, NULL, &err)){
+    cout << sql << ": " << (err ? err : "error") << endl;
+    sqlite3_free(err);
+    exit(1);
+  }
+}
+
+static sqlite3 *open_bench(const string &path, const string &vfs, const string &delta_file,
+                           const string &sync, uint64_t wal_limit){
+  sqlite3 *db;
+  string uri = "file:" + path;
+  if(!delta_file.empty()){
+    uri += "?delta_file=" + delta_file;
+  }
+  int flags = SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI;
+  if(sqlite3_open_v2(uri.c_str(), &db, flags, vfs.c_str())){
+    cout << "Open " << vfs << ": " << sqlite3_errmsg(db) << endl;
+    exit(1);
+  }
+  exec(db, "PRAGMA journal_mode=WAL");
+  exec(db, "PRAGMA synchronous=" + sync);
+  exec(db, "PRAGMA wal_autocheckpoint=" + to_string(wal_limit));
+  return db;
+}
+
+static void load(sqlite3 *db, uint64_t records){
+  mt19937_64 gen(42);
+  for(const string &sql : tatp_create_sql("INTEGER", "INTEGER", "INTEGER", "INTEGER", "TEXT", false)){
+    exec(db, sql);
+  }
+  sqlite3_stmt *sub, *sf;
+  string cols = "?";
+  for(int i = 0; i < 33; i++){
+    cols += ", ?";
+  }
+  sqlite3_prepare_v2(db, ("INSERT INTO subscriber VALUES (" + cols + ")").c_str(), -1, &sub, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO special_facility VALUES (?, ?, ?, ?, ?, ?)", -1, &sf, NULL);
+  exec(db, "BEGIN");
+  for(uint64_t s_id = 1; s_id <= records; s_id++){
+    char nbr[16];
+    snprintf(nbr, sizeof(nbr), "%015llu", (unsigned long long)s_id);
+    sqlite3_bind_int64(sub, 1, s_id);
+    sqlite3_bind_text(sub, 2, nbr, -1, SQLITE_TRANSIENT);
+    for(int i = 0; i < 10; i++){
+      sqlite3_bind_int(sub, 3 + i, gen() % 2);
+      sqlite3_bind_int(sub, 13 + i, gen() % 16);
+      sqlite3_bind_int(sub, 23 + i, gen() % 256);
+    }
+    sqlite3_bind_int64(sub, 33, gen() % 0xffffffff);
+    sqlite3_bind_int64(sub, 34, gen() % 0xffffffff);
+    sqlite3_step(sub);
+    sqlite3_reset(sub);
+    for(int sf_type = 1; sf_type <= 4; sf_type++){
+      sqlite3_bind_int64(sf, 1, s_id);
+      sqlite3_bind_int(sf, 2, sf_type);
+      sqlite3_bind_int(sf, 3, gen() % 100 < 85);
+      sqlite3_bind_int(sf, 4, gen() % 256);
+      sqlite3_bind_int(sf, 5, gen() % 256);
+      sqlite3_bind_text(sf, 6, "abcde", -1, SQLITE_STATIC);
+      sqlite3_step(sf);
+      sqlite3_reset(sf);
+    }
+  }
+  exec(db, "COMMIT");
+  sqlite3_finalize(sub);
+  sqlite3_finalize(sf);
+  sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+}
+
+/* UpdateSubscriberData, n transactions */
+static void update_subscriber_data(sqlite3 *db, uint64_t records, uint64_t n, uint64_t seed){
+  auto sql = tatp_statement_sql();
+  sqlite3_stmt *bit, *data;
+  sqlite3_prepare_v2(db, sql[3].c_str(), -1, &bit, NULL);
+  sqlite3_prepare_v2(db, sql[4].c_str(), -1, &data, NULL);
+  mt19937_64 gen(seed);
+  for(uint64_t i = 0; i < n; i++){
+    uint64_t s_id = gen() % records + 1;
+    exec(db, "BEGIN");
+    sqlite3_bind_int(bit, 1, gen() % 2);
+    sqlite3_bind_int64(bit, 2, s_id);
+    sqlite3_step(bit);
+    sqlite3_reset(bit);
+    sqlite3_bind_int(data, 1, gen() % 256);
+    sqlite3_bind_int64(data, 2, s_id);
+    sqlite3_bind_int(data, 3, gen() % 4 + 1);
+    sqlite3_step(data);
+    sqlite3_reset(data);
+    exec(db, "COMMIT");
+  }
+  sqlite3_finalize(bit);
+  sqlite3_finalize(data);
+}
+
+static void remove_db(const string &path){
+  unlink(path.c_str());
+  unlink((path + "-wal").c_str());
+  unlink((path + "-shm").c_str());
+}
+
+int main(int argc, char **argv){
+  cxxopts::Options options("delta_bench", "Delta logging against full page logging of the WAL");
+  cxxopts::OptionAdder adder = options.add_options();
+  adder("vfs", "Comma separated --pmem values, see register_vfs()",
+        cxxopts::value<string>()->default_value("+delta,+fullpage"));
+  adder("path", "Database file", cxxopts::value<string>()->default_value("delta_bench.db"));
+  adder("delta_file", "Delta log, empty for PMEM_DELTA_DIR/<WAL name>-delta",
+        cxxopts::value<string>()->default_value(""));
+  adder("records", "Number of subscriber records", cxxopts::value<uint64_t>()->default_value("100000"));
+  adder("transactions", "Transactions of the run", cxxopts::value<uint64_t>()->default_value("100000"));
+  adder("crash_transactions", "Transactions before the crash",
+        cxxopts::value<uint64_t>()->default_value("10000"));
+  adder("wal_limit", "WAL frames before a checkpoint, the pre-images of a delta",
+        cxxopts::value<uint64_t>()->default_value("1000"));
+  adder("sync", "PRAGMA synchronous", cxxopts::value<string>()->default_value("FULL"));
+  adder("out", "JSON result file", cxxopts::value<string>()->default_value("delta_bench.json"));
+  adder("help", "Print help");
+  auto result = options.parse(argc, argv);
+
+  if(result.count("help")){
+    cout << options.help();
+    return 0;
+  }
+  string path = result["path"].as<string>();
+  string delta_file = result["delta_file"].as<string>();
+  string sync = result["sync"].as<string>();
+  uint64_t records = result["records"].as<uint64_t>();
+  uint64_t transactions = result["transactions"].as<uint64_t>();
+  uint64_t crash_transactions = result["crash_transactions"].as<uint64_t>();
+  uint64_t wal_limit = result["wal_limit"].as<uint64_t>();
+
+  sqlite3_initialize();
+  out.open(result["out"].as<string>());
+  out << "[";
+  stringstream list(result["vfs"].as<string>());
+  string pmem;
+  while(getline(list, pmem, ',')){
+    string vfs = register_vfs(pmem);
+    remove_db(path);
+    sqlite3 *db = open_bench(path, vfs, delta_file, sync, wal_limit);
+    load(db, records);
+
+    pmem_delta_stats run;
+    sqlite3_pmem_delta_stats(&run, 1);
+    uint64_t start = now_ns();
+    update_subscriber_data(db, records, transactions, 1);
+    uint64_t run_ns = now_ns() - start;
+    sqlite3_pmem_delta_stats(&run, 1);
+    sqlite3_close(db);
+
+    /* no sqlite3 handle may cross the fork */
+    pid_t pid = fork();
+    if(pid == 0){
+      sqlite3 *child = open_bench(path, vfs, delta_file, sync, wal_limit);
+      update_subscriber_data(child, records, crash_transactions, 2);
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    pmem_delta_stats rec;
+    sqlite3_pmem_delta_stats(&rec, 1);
+    start = now_ns();
+    db = open_bench(path, vfs, delta_file, sync, wal_limit);
+    exec(db, "SELECT bit_1 FROM subscriber WHERE s_id = 1");
+    uint64_t reopen_ns = now_ns() - start;
+    sqlite3_pmem_delta_stats(&rec, 1);
+    sqlite3_close(db);
+
+    double tps = transactions / (run_ns / 1e9);
+    double logged = run.commits ? (double)run.bytes_logged / run.commits : 0;
+    double submitted = run.commits ? (double)run.bytes_submitted / run.commits : 0;
+    double lines = run.frames ? (double)run.lines / run.frames : 0;
+    out << (first_result ? "\n" : ",\n");
+    first_result = false;
+    out << "  {\"vfs\": \"" << vfs << "\", \"records\": " << records
+        << ", \"wal_limit\": " << wal_limit << ", \"transactions\": " << transactions << ", \"tps\": " << tps
+        << ", \"log_bytes_per_txn\": " << logged << ", \"wal_bytes_per_txn\": " << submitted
+        << ", \"frames\": " << run.frames << ", \"full_frames\": " << run.full_frames
+        << ", \"lines_per_frame\": " << lines << ", \"image_syncs\": " << run.image_syncs
+        << ", \"recovered_records\": " << rec.recovered_records
+        << ", \"recovery_ms\": " << rec.recovery_ns / 1e6 << ", \"reopen_ms\": " << reopen_ns / 1e6 << "}";
+    cout << vfs << ": " << tps << " txn/s, " << logged << " log bytes/txn (" << submitted
+         << " WAL bytes), " << lines << " lines/frame, recovery of " << rec.recovered_records
+         << " records " << rec.recovery_ns / 1e6 << " ms, reopen " << reopen_ns / 1e6 << " ms" << endl;
+  }
+  out << "\n]" << endl;
+  remove_db(path);
+  return 0;
+}
@@ -25,3 +25,6 @@ set(BLOB_MSC_DENSE_MAIN_FILE  ${CMAKE_SOURCE_DIR}/benchmark/blob/blob_msc_dense.
 set(BLOB_MSC_LARGE_MAIN_FILE  ${CMAKE_SOURCE_DIR}/benchmark/blob/blob_msc_large.cpp)
 set(BLOB_DUCKDB_MAIN_FILE  ${CMAKE_SOURCE_DIR}/benchmark/blob/blob_duckdb.cpp)
 
+set(VFS_BENCH_MAIN_FILE  ${CMAKE_SOURCE_DIR}/benchmark/vfs/vfs_bench.cpp)
+
+set(DELTA_BENCH_MAIN_FILE  ${CMAKE_SOURCE_DIR}/benchmark/delta/delta_bench.cpp)
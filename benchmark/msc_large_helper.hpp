@@ -1,5 +1,6 @@
 #include "../sqlite/msc-log-large/sqlite3.h"
 #include "../vfs/pmem_vfs.h"
+#include "../vfs/pmem_tiered_vfs.h"
 
 namespace std{
 
@@ -13,6 +14,10 @@ sqlite3* open_db(const char* path, string pmem){
     sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
     rc = sqlite3_open_v2(path, &db, flags, "PMem_VFS");
   }
+  else if(pmem == "tiered"){
+    sqlite3_vfs_register(sqlite3_pmem_tiered_vfs(), 0);
+    rc = sqlite3_open_v2(path, &db, flags, "PMem_VFS_tiered");
+  }
   else{
     rc = sqlite3_open_v2(path, &db, flags, "unix");
   }
@@ -39,6 +44,10 @@ sqlite3* open_db(const char* path, string pmem, string sync, string cache){
     sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
     rc = sqlite3_open_v2(path, &db, flags, "PMem_VFS");
   }
+  else if(pmem == "tiered"){
+    sqlite3_vfs_register(sqlite3_pmem_tiered_vfs(), 0);
+    rc = sqlite3_open_v2(path, &db, flags, "PMem_VFS_tiered");
+  }
   else{
     rc = sqlite3_open_v2(path, &db, flags, "unix");
   }
@@ -0,0 +1,13 @@
+#!/bin/bash
+# Commit latency breakdown of a benchmark run from the USDT probes of the
+# PMem VFS (build with -DPMEM_VFS_USDT=ON), e.g.
+#   sudo ./commit_breakdown.sh ./tatp_sqlite --run --records=100000 --pmem=PMem
+if [ $# -lt 1 ]; then
+  echo "usage: $0 BINARY [ARGS...]" >&2
+  exit 1
+fi
+binary=$(realpath "$1")
+script=$(dirname "$(realpath "$0")")/commit_breakdown.bt
+sed "s|BINARY|$binary|g" "$script" > /tmp/commit_breakdown.$$.bt
+bpftrace -c "$*" /tmp/commit_breakdown.$$.bt
+rm -f /tmp/commit_breakdown.$$.bt
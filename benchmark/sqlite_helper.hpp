@@ -1,23 +1,115 @@
 #include "../sqlite/sqlite/sqlite3.h"
 #include "../vfs/pmem_vfs.h"
+#include "../vfs/pmem_tiered_vfs.h"
+#include "../vfs/pmem_shadow_vfs.h"
+#include "../vfs/pmem_wb_vfs.h"
+#include "../vfs/pmem_pool_vfs.h"
+#include "../vfs/pmem_hist_vfs.h"
+#include "../vfs/pmem_delta_vfs.h"
+#include "../vfs/pmem_pcache.h"
+#include "../vfs/pmem_emulation.h"
 
 namespace std{
 
+/*
+** Register the VFS selected by --pmem and return its name. "X+hist" opens
+** X through the profiling shim of vfs/pmem_hist_vfs.c, close_db() prints
+** its histograms. "X+delta" and "X+fullpage" make the WAL of X durable
+** with the delta log of vfs/pmem_delta_vfs.c, in that order before +hist.
+*/
+string register_vfs(string pmem){
+  bool hist = pmem.size() > 5 && pmem.compare(pmem.size() - 5, 5, "+hist") == 0;
+  if(hist){
+    pmem.resize(pmem.size() - 5);
+  }
+  int delta = -1;
+  if(pmem.size() >= 6 && pmem.compare(pmem.size() - 6, 6, "+delta") == 0){
+    pmem.resize(pmem.size() - 6);
+    delta = 0;
+  }
+  else if(pmem.size() >= 9 && pmem.compare(pmem.size() - 9, 9, "+fullpage") == 0){
+    pmem.resize(pmem.size() - 9);
+    delta = 1;
+  }
+  string name = "unix";
+  if(pmem == "PMem" || pmem == "pmem-nvme"){
+    sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
+    name = "PMem_VFS";
+  }
+  else if(pmem == "tiered"){
+    sqlite3_vfs_register(sqlite3_pmem_tiered_vfs(), 0);
+    name = "PMem_VFS_tiered";
+  }
+  else if(pmem == "shadow"){
+    sqlite3_vfs_register(sqlite3_pmem_shadow_vfs(), 0);
+    name = "PMem_VFS_shadow";
+  }
+  else if(pmem == "wb"){
+    sqlite3_vfs_register(sqlite3_pmem_wb_vfs(), 0);
+    name = "PMem_VFS_wb";
+  }
+  else if(pmem == "pool"){
+    sqlite3_vfs_register(sqlite3_pmem_pool_vfs(), 0);
+    name = "PMem_VFS_pool";
+  }
+  if(delta >= 0){
+    sqlite3_vfs_register(sqlite3_pmem_delta_vfs(name.c_str(), delta), 0);
+    name += delta ? "+fullpage" : "+delta";
+  }
+  if(hist){
+    sqlite3_vfs_register(sqlite3_pmem_hist_vfs(name.c_str()), 0);
+    name += "+hist";
+  }
+  return name;
+}
+
+/*
+** With --pcache DIR the page cache of all connections moves to an unnamed
+** file of pmem_mb MiB in DIR, with pages used often in up to dram_mb MiB
+** of DRAM (see vfs/pmem_pcache.c). Must run before the first open_db().
+*/
+void install_pcache(const string &dir, size_t pmem_mb, size_t dram_mb){
+  if(dir.empty()){
+    return;
+  }
+  int rc = sqlite3_pmem_pcache_install(dir.c_str(), (u64)pmem_mb << 20, (u64)dram_mb << 20);
+  if(rc){cout << "PMem page cache not working: " << rc << endl;}
+}
+
+/*
+** PMem_VFS_shadow and PMem_VFS_wb commit whole transactions themselves, a
+** WAL would only add the second copy of every page they are there to avoid.
+*/
+string journal_mode_pragma(const string &vfs){
+  if(vfs.compare(0, 15, "PMem_VFS_shadow") == 0 || vfs.compare(0, 11, "PMem_VFS_wb") == 0){
+    return "PRAGMA journal_mode=MEMORY";
+  }
+  return "PRAGMA journal_mode=WAL";
+}
+
+/*
+** --logging picks how PMem_VFS writes the WAL of db: copy, combine, stream
+** or adaptive (PRAGMA pmem_logging, see vfs/pmem_vfs.h). Empty keeps the
+** default.
+*/
+void set_logging(sqlite3 *db, const string &mode){
+  if(mode.empty()){
+    return;
+  }
+  string s = "PRAGMA pmem_logging=" + mode;
+  int rc = sqlite3_exec(db, s.c_str(), NULL,NULL,NULL);
+  if(rc){cout << "Pragma pmem_logging not working: " << rc << endl;}
+}
 
 sqlite3* open_db(const char* path, string pmem){
   sqlite3 *db;
   int rc = sqlite3_initialize();
   if(rc){cout << "Init not working: " << rc << endl;}
   int flags = SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE;
-  if(pmem == "PMem" || pmem == "pmem-nvme"){
-    sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
-    rc = sqlite3_open_v2(path, &db, flags, "PMem_VFS");
-  }
-  else{
-    rc = sqlite3_open_v2(path, &db, flags, "unix");
-  }
+  string vfs = register_vfs(pmem);
+  rc = sqlite3_open_v2(path, &db, flags, vfs.c_str());
   if(rc){cout <<"Open:\t" << rc << endl;}
-  rc = sqlite3_exec(db,"PRAGMA journal_mode=WAL", NULL,NULL,NULL);
+  rc = sqlite3_exec(db,journal_mode_pragma(vfs).c_str(), NULL,NULL,NULL);
   if(rc){cout << "Pragma WAL not working: " << rc << endl;}
   rc = sqlite3_exec(db,"PRAGMA synchronous=FULL", NULL,NULL,NULL);
   if(rc){cout << "Pragma synchronous not working: " << rc << endl;}
@@ -36,15 +128,10 @@ sqlite3* open_db(const char* path, string pmem, string sync, string cache){
   int rc = sqlite3_initialize();
   if(rc){cout << "Init not working: " << rc << endl;}
   int flags = SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE;
-  if(pmem == "PMem" || pmem == "pmem-nvme"){
-    sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
-    rc = sqlite3_open_v2(path, &db, flags, "PMem_VFS");
-  }
-  else{
-    rc = sqlite3_open_v2(path, &db, flags, "unix");
-  }
+  string vfs = register_vfs(pmem);
+  rc = sqlite3_open_v2(path, &db, flags, vfs.c_str());
   if(rc){cout <<"Open:\t" << rc << endl;}
-  rc = sqlite3_exec(db,"PRAGMA journal_mode=WAL", NULL,NULL,NULL);
+  rc = sqlite3_exec(db,journal_mode_pragma(vfs).c_str(), NULL,NULL,NULL);
   if(rc){cout << "Pragma WAL not working: " << rc << endl;}
   string s = "PRAGMA synchronous=" + sync;
   rc = sqlite3_exec(db,s.c_str(), NULL,NULL,NULL);
@@ -65,11 +152,68 @@ void close_db(sqlite3* db){
   int *frames;
   rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
   if(rc){cout <<"WAL-Checkpoint: " << rc << endl;}
+  sqlite3_pmem_hist_dump(db, stdout, 1);
+  pmem_shadow_stats shadow;
+  if(sqlite3_file_control(db, "main", SQLITE_FCNTL_PMEM_SHADOW_STATS, &shadow) == SQLITE_OK){
+    cout << "shadow paging: " << shadow.commits << " commits, " << shadow.page_writes
+         << " page writes, " << shadow.data_bytes << " data bytes, " << shadow.meta_bytes
+         << " meta bytes, " << shadow.slots_used << "/" << shadow.slots << " slots" << endl;
+  }
+  pmem_wb_stats wb;
+  if(sqlite3_file_control(db, "main", SQLITE_FCNTL_PMEM_WB_STATS, &wb) == SQLITE_OK){
+    cout << "write-back cache: " << wb.commits << " commits, " << wb.log_writes << " log writes, "
+         << wb.cache_reads << " cache reads, " << wb.backing_reads << " backing reads, "
+         << wb.destaged << " destaged, " << wb.superseded << " superseded, " << wb.destage_writes
+         << " writes in " << wb.destage_rounds << " rounds, " << wb.stalls << " stalls, "
+         << wb.slots_used << "/" << wb.slots << " slots" << endl;
+  }
+  pmem_pool_stats pool;
+  if(sqlite3_file_control(db, "main", SQLITE_FCNTL_PMEM_POOL_STATS, &pool) == SQLITE_OK){
+    cout << "pool: " << pool.opens << " opens, " << pool.creates << " creates, " << pool.deletes
+         << " deletes, " << pool.extent_allocs << " extent allocs, " << pool.extent_frees
+         << " extent frees, " << pool.meta_fences << " meta fences, " << pool.files << "/"
+         << pool.max_files << " files, " << pool.used_bytes << "/" << pool.pool_bytes << " bytes" << endl;
+  }
+
+  pmem_logging_stats logging;
+  sqlite3_pmem_logging_stats(&logging, 1);
+  if(logging.copied + logging.combined + logging.streamed){
+    cout << "wal logging: " << logging.copied << " copied, " << logging.combined << " combined, "
+         << logging.streamed << " streamed (" << logging.switched << " switched) transactions, "
+         << logging.bytes_copied << "/" << logging.bytes_combined << "/" << logging.bytes_streamed
+         << " bytes" << endl;
+  }
+
+  pmem_delta_stats deltas;
+  sqlite3_pmem_delta_stats(&deltas, 1);
+  if(deltas.bytes_submitted){
+    cout << "delta log: " << deltas.commits << " commits, " << deltas.frames << " frames ("
+         << deltas.full_frames << " full), " << deltas.lines << " lines, " << deltas.bytes_logged
+         << "/" << deltas.bytes_submitted << " bytes logged, " << deltas.log_resets << " resets, "
+         << deltas.image_syncs << " image syncs" << endl;
+  }
+
+  pmem_pcache_stats pcache;
+  sqlite3_pmem_pcache_stats(&pcache, 1);
+  if(pcache.fetches){
+    cout << "pmem page cache: " << pcache.fetches << " fetches, " << pcache.hot_hits << " dram hits, "
+         << pcache.cold_hits << " pmem hits, " << pcache.misses << " misses, " << pcache.promotions
+         << " promotions, " << pcache.hot_bytes << " dram bytes, " << pcache.cold_bytes
+         << "/" << pcache.pmem_bytes << " pmem bytes" << endl;
+  }
 
   rc = sqlite3_close_v2(db);
   if(rc){cout <<"Close:\t" << rc << endl;}
   rc = sqlite3_shutdown();
   if(rc){cout << "Shutdown not working: " << rc << endl;}
+  if(pmem_emu_enabled()){
+    pmem_emu_stats emu;
+    pmem_emu_get_stats(&emu, 1);
+    cout << "pmem emulation: " << emu.reads << " reads, " << emu.fences << " fences, "
+         << emu.flushed_bytes << " bytes flushed, " << emu.media_bytes << " media bytes ("
+         << (emu.flushed_bytes ? (double)emu.media_bytes / emu.flushed_bytes : 0) << "x), "
+         << emu.delay_ns / 1000000 << " ms delay" << endl;
+  }
 }
 
 } // namespace std
\ No newline at end of file
@@ -24,6 +24,14 @@ cxxopts::Options ssb_options(const std::string &program,
   adder("cache_size", "Cache size", cxxopts::value<std::string>()->default_value("0"));
   adder("sync", "Pmem", cxxopts::value<std::string>()->default_value("FULL"));
   adder("bloom_filter", "Use Bloom filters", cxxopts::value<bool>()->default_value("false"));
+  adder("trace", "Sample one in N PMem page accesses into PATH-heat, 0 disables it",
+        cxxopts::value<int>()->default_value("0"));
+  adder("readahead", "Read-ahead window of strided PMem reads in bytes, 0 disables it",
+        cxxopts::value<int>()->default_value("262144"));
+  adder("pcache", "Directory on PMem for the page cache, empty keeps SQLite's",
+        cxxopts::value<std::string>()->default_value(""));
+  adder("pcache_size", "PMem page cache size in MiB", cxxopts::value<size_t>()->default_value("65536"));
+  adder("pcache_dram", "DRAM for the hottest cached pages in MiB", cxxopts::value<size_t>()->default_value("1024"));
   return options;
 }
 
@@ -29,6 +29,9 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  sqlite3_pmem_config(PMEM_CONFIG_READAHEAD, result["readahead"].as<int>());
+  install_pcache(result["pcache"].as<string>(), result["pcache_size"].as<size_t>(),
+                 result["pcache_dram"].as<size_t>());
   sqlite3* db = open_db(path.c_str(), pmem, sync, cache_size);
 
   uint64_t mask = result["bloom_filter"].as<bool>() ? 0 : 0x00080000;
@@ -50,6 +53,9 @@ int main(int argc, char **argv) {
 
   std::ofstream result_file {"../../results/master_results.csv", std::ios::app};
 
+  sqlite3_pmem_config(PMEM_CONFIG_TRACE, result["trace"].as<int>());
+  pmem_read_stats read_stats;
+  sqlite3_pmem_read_stats(&read_stats, 1);
   for (const std::string &query :
        {"q1.1", "q1.2", "q1.3", "q2.1", "q2.2", "q2.3", "q3.1", "q3.2", "q3.3",
         "q3.4", "q4.1", "q4.2", "q4.3"}) {
@@ -75,6 +81,16 @@ int main(int argc, char **argv) {
     
   }
 
+  sqlite3_pmem_read_stats(&read_stats, 0);
+  cout << "reads: " << read_stats.reads
+       << " strided: " << read_stats.strided
+       << " prefetched: " << read_stats.prefetched_bytes
+       << " madvised: " << read_stats.madvised_bytes
+       << " wide copies: " << read_stats.wide_copies << endl;
+
+  if (result["trace"].as<int>()) {
+    sqlite3_pmem_trace_dump((path + "-heat").c_str(), 0);
+  }
   close_db(db);
   return 0;
 }
@@ -27,6 +27,14 @@ cxxopts::Options tatp_options(const std::string &program,
   adder("pmem", "Pmem", cxxopts::value<std::string>()->default_value("PMem"));
   adder("sync", "Pmem", cxxopts::value<std::string>()->default_value("FULL"));
   adder("wal_limit", "wal limit", cxxopts::value<uint64_t>()->default_value("1000"));
+  adder("write_combine", "Combine PMem writes into 256 byte XPLines");
+  adder("logging", "PMem WAL logging: copy, combine, stream or adaptive",
+        cxxopts::value<std::string>()->default_value(""));
+  adder("group_commit", "Max group commit wait in us, 0 disables it",
+        cxxopts::value<int>()->default_value("0"));
+  adder("async_commit", "Acknowledge commits before the WAL flush completed");
+  adder("trace", "Sample one in N PMem page accesses into PATH-heat, 0 disables it",
+        cxxopts::value<int>()->default_value("0"));
 
 
   return options;
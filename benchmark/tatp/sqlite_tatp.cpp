@@ -6,7 +6,11 @@
 #include <fstream>
 #include <chrono>
 #include <filesystem>
+#include <atomic>
 #include "../sqlite_helper.hpp"
+#ifdef PMEM_VFS_USDT
+#include <x86intrin.h>
+#endif
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -34,6 +38,75 @@ int step_single(sqlite3_stmt *stmt){
   return step(stmt, count);
 }
 
+bool async_commit = false;
+std::atomic<uint64_t> durable_commits{0};
+
+void commit_durable(void *){
+  durable_commits++;
+}
+
+#ifdef PMEM_VFS_USDT
+/* rdtsc cycles of write transactions, from BEGIN until COMMIT returned */
+uint64_t txn_start;
+uint64_t txn_cycles = 0;
+uint64_t txn_count = 0;
+#endif
+
+int begin(sqlite3 *db){
+#ifdef PMEM_VFS_USDT
+  txn_start = __rdtsc();
+#endif
+  return sqlite3_exec(db, "BEGIN DEFERRED;", NULL,NULL,NULL);
+}
+
+/* with --async_commit the worker continues before the WAL flush completed */
+int commit(sqlite3 *db){
+  int rc;
+  if(async_commit){
+    rc = sqlite3_pmem_commit_async(db, commit_durable, nullptr);
+  }
+  else{
+    rc = sqlite3_exec(db, "COMMIT;", NULL,NULL,NULL);
+  }
+#ifdef PMEM_VFS_USDT
+  txn_cycles += __rdtsc() - txn_start;
+  txn_count++;
+#endif
+  return rc;
+}
+
+#ifdef PMEM_VFS_USDT
+/*
+** Mean write transaction latency split by the VFS probe counters. SQL
+** execution is what remains after the VFS components; WAL sync wait is
+** the part of WAL syncs not spent flushing or fencing, e.g. waiting for a
+** group commit leader. Checkpoints are charged to the commit running them.
+*/
+void print_commit_breakdown(){
+  pmem_probe_stats stats;
+  sqlite3_pmem_probe_stats(&stats, 0);
+  if(txn_count == 0 || stats.cycles_per_us == 0){
+    return;
+  }
+  double per_txn = stats.cycles_per_us * txn_count;
+  double total = txn_cycles / per_txn;
+  double append = stats.cycles[PMEM_PROBE_WAL_APPEND] / per_txn;
+  double flush = stats.cycles[PMEM_PROBE_FLUSH] / per_txn;
+  double fence = stats.cycles[PMEM_PROBE_FENCE] / per_txn;
+  double wait = stats.cycles[PMEM_PROBE_WAL_SYNC] / per_txn - flush - fence;
+  double checkpoint = stats.cycles[PMEM_PROBE_CHECKPOINT] / per_txn;
+  double sql = total - append - flush - fence - (wait > 0 ? wait : 0) - checkpoint;
+  cout << "commit breakdown over " << txn_count << " write transactions (us):" << endl
+       << "  total          " << total << endl
+       << "  sql execution  " << sql << endl
+       << "  wal append     " << append << endl
+       << "  flush          " << flush << endl
+       << "  fence          " << fence << endl
+       << "  wal sync wait  " << (wait > 0 ? wait : 0) << endl
+       << "  checkpoint     " << checkpoint << endl;
+}
+#endif
+
 class Worker {
 public:
   Worker(sqlite3 *db_, size_t db_size) : db(db_), procedure_generator_(db_size) {
@@ -99,7 +172,7 @@ public:
 
             [&](const dbbench::tatp::UpdateSubscriberData &p) {
               int rc;
-              rc = sqlite3_exec(db, "BEGIN DEFERRED;", NULL,NULL,NULL);
+              rc = begin(db);
               if(rc){cout << "Transition_4 init "<< rc << endl;}
 
               sqlite3_stmt *stmnt = stmts_[3];
@@ -120,7 +193,7 @@ public:
               rc = step_single(stmnt);
               if(rc){cout << "Transition_4 step2 "<< rc << endl;}
 
-              rc = sqlite3_exec(db, "COMMIT;", NULL,NULL,NULL);
+              rc = commit(db);
               if(rc){cout << "Transition_4 commit "<< rc << endl;}
  
               return sqlite3_changes(db) > 0;
@@ -129,7 +202,7 @@ public:
             [&](const dbbench::tatp::UpdateLocation &p) {
               
               int rc;
-              rc = sqlite3_exec(db, "BEGIN DEFERRED;", NULL,NULL,NULL);
+              rc = begin(db);
               if(rc){cout << "Transition_6 init "<< rc << endl;}
 
               sqlite3_stmt *stmnt = stmts_[5];
@@ -140,7 +213,7 @@ public:
               rc = step_single(stmnt);
               if(rc){cout << "Transition_5 step "<< rc << endl;}
 
-              rc = sqlite3_exec(db, "COMMIT;", NULL,NULL,NULL);
+              rc = commit(db);
               if(rc){cout << "Transition_6 commit "<< rc << endl;}
 
               return true;
@@ -148,7 +221,7 @@ public:
 
             [&](const dbbench::tatp::InsertCallForwarding &p) {
               int rc;
-              rc = sqlite3_exec(db, "BEGIN DEFERRED;", NULL,NULL,NULL);
+              rc = begin(db);
               if(rc){cout << "Transition_6 init "<< rc << endl;}
 
               sqlite3_stmt *stmnt = stmts_[6];;
@@ -189,14 +262,14 @@ public:
                 if(rc != SQLITE_CONSTRAINT){cout << "Transition_6 step3 "<< rc << endl;}
                 success =  false;
               }
-              rc = sqlite3_exec(db, "COMMIT;", NULL,NULL,NULL);
+              rc = commit(db);
               if(rc){cout << "Transition_6 commit "<< rc << endl;}
               return success;
             },
 
             [&](const dbbench::tatp::DeleteCallForwarding &p) {
               int rc;
-              rc = sqlite3_exec(db, "BEGIN DEFERRED;", NULL,NULL,NULL);
+              rc = begin(db);
               if(rc){cout << "Transition_7 init "<< rc << endl;}
 
               sqlite3_stmt *stmnt = stmts_[6];
@@ -223,7 +296,7 @@ public:
               rc = step_single(stmnt);
               if(rc){cout << "Transition_7 step2 "<< rc << endl;}
 
-              rc = sqlite3_exec(db, "COMMIT;", NULL,NULL,NULL);
+              rc = commit(db);
               if(rc){cout << "Transition_7 commit "<< rc << endl;}
               return sqlite3_changes(db) > 0;
             },
@@ -392,8 +465,15 @@ int main (int argc, char** argv){
   string cache_size = result["cache_size"].as<std::string>();
   string sync = result["sync"].as<string>();
 
+  if (result.count("write_combine")) {
+    sqlite3_pmem_config(PMEM_CONFIG_WRITE_COMBINE, 1);
+  }
+  sqlite3_pmem_config(PMEM_CONFIG_GROUP_COMMIT_US, result["group_commit"].as<int>());
+  async_commit = result.count("async_commit");
+
   if (result.count("load")) {
     sqlite3* db = open_db(path.c_str(), pmem, sync, cache_size);
+    set_logging(db, result["logging"].as<string>());
     auto start = chrono::steady_clock::now();
     load_db_1(db, n_subscriber_records);
     auto end = chrono::steady_clock::now();
@@ -418,11 +498,29 @@ int main (int argc, char** argv){
     int rc;
     std::vector<Worker> workers;
     sqlite3 *db = open_db(path.c_str(), pmem, sync, cache_size);
+    set_logging(db, result["logging"].as<string>());
 
     workers.emplace_back(db, n_subscriber_records);
 
+    sqlite3_pmem_config(PMEM_CONFIG_TRACE, result["trace"].as<int>());
     double throughput = dbbench::run(workers, result["warmup"].as<size_t>(),result["measure"].as<size_t>());
+    if (result["trace"].as<int>()) {
+      sqlite3_pmem_trace_dump((path + "-heat").c_str(), 0);
+    }
     close_db(db);
+    if (result.count("write_combine")) {
+      pmem_xpline_stats stats;
+      sqlite3_pmem_xpline_stats(&stats, 0);
+      cout << "xpline submitted: " << stats.bytes_submitted
+           << " uncombined: " << stats.media_uncombined
+           << " combined: " << stats.media_combined << endl;
+    }
+    if (async_commit) {
+      cout << "durable async commits: " << durable_commits << endl;
+    }
+#ifdef PMEM_VFS_USDT
+    print_commit_breakdown();
+#endif
     ofstream result_file {"../../results/master_results.csv", ios::app};
 
     result_file <<"\"TATP\",\"SQLite\",\""
@@ -0,0 +1,382 @@
+/*
+** Microbenchmark of the VFS methods.
+**
+** Drives a registered VFS directly through its sqlite3_io_methods, no SQL
+** involved, so changes of vfs/pmem_vfs.c show up without a TATP run:
+**
+**     write     write sizes 64 B .. 1 MiB, sequential or random offsets,
+**               aligned to the size or shifted by MISALIGN bytes
+**     sync      4 KiB sequential writes with an xSync() every N writes
+**     read      the same sizes and patterns as write
+**     grow      4 KiB appends to an empty file up to --file_size
+**     shm       xShmBarrier() on the first wal-index region
+**     open      xOpen() and xClose() of the existing file
+**     create    a new file created, written 4 KiB, synced, closed and
+**               deleted, the life of a rollback journal
+**
+** Every case writes one JSON object with ops, throughput and the p50/p99
+** latency of a single call to --out. Writes of more than 64 KiB are issued
+** as 64 KiB xWrite() calls (the unix VFS takes less than 128 KiB at once),
+** their latency is that of the whole write.
+**
+**     vfs_bench --vfs PMem_VFS,unix --path /mnt/pmem0/vfs_bench.db
+*/
+#include "cxxopts.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../../sqlite/sqlite/sqlite3.h"
+#include "../../vfs/pmem_vfs.h"
+#include "../../vfs/pmem_wal_only_vfs.h"
+#include "../../vfs/pmem_pool_vfs.h"
+#include "../../vfs/test_demovfs.h"
+
+using namespace std;
+
+#define MISALIGN 100
+#define MAX_WRITE (64 * 1024)
+
+struct Case {
+  string vfs;
+  string name;
+  string op;
+  size_t size;
+  string pattern;
+  bool aligned;
+  int sync_every;
+};
+
+static ofstream out;
+static bool first_result = true;
+
+static uint64_t now_ns(){
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* one JSON object per case and operation, latencies in ns */
+static void report(const Case &c, vector<uint64_t> &lat, uint64_t total_ns){
+  if(lat.empty()){
+    return;
+  }
+  sort(lat.begin(), lat.end());
+  size_t n = lat.size();
+  double secs = total_ns / 1e9;
+  out << (first_result ? "\n" : ",\n");
+  first_result = false;
+  out << "  {\"vfs\": \"" << c.vfs << "\", \"case\": \"" << c.name
+      << "\", \"op\": \"" << c.op << "\", \"size\": " << c.size
+      << ", \"pattern\": \"" << c.pattern << "\", \"aligned\": " << (c.aligned ? "true" : "false")
+      << ", \"sync_every\": " << c.sync_every << ", \"ops\": " << n
+      << ", \"ops_per_s\": " << (secs > 0 ? n / secs : 0)
+      << ", \"mb_per_s\": " << (secs > 0 ? (double)n * c.size / secs / 1e6 : 0)
+      << ", \"p50_ns\": " << lat[n / 2]
+      << ", \"p99_ns\": " << lat[min(n - 1, n * 99 / 100)] << "}";
+  cout << c.vfs << " " << c.name << " " << c.op << " size " << c.size << " " << c.pattern
+       << (c.aligned ? "" : " unaligned") << " sync/" << c.sync_every
+       << ": p50 " << lat[n / 2] << " ns, p99 " << lat[min(n - 1, n * 99 / 100)] << " ns" << endl;
+}
+
+class Bench {
+public:
+  Bench(sqlite3_vfs *vfs, const string &path, bool wal, size_t file_size, size_t ops)
+      : vfs_(vfs), wal_(wal), file_size_(file_size), ops_(ops), gen_(42) {
+    char full[4096];
+    vfs_->xFullPathname(vfs_, path.c_str(), sizeof(full), full);
+    string wal_path = string(full) + "-wal";
+    name_ = sqlite3_create_filename(full, "", wal_path.c_str(), 0, NULL);
+    buffer_.assign(1 << 20 | MISALIGN, 'x');
+    for(size_t i = 0; i < buffer_.size(); i++){
+      buffer_[i] = (char)gen_();
+    }
+  }
+
+  ~Bench(){ sqlite3_free_filename(name_); }
+
+  sqlite3_file *open(bool fresh){
+    if(fresh){
+      vfs_->xDelete(vfs_, file_name(), 0);
+    }
+    sqlite3_file *f = (sqlite3_file*)calloc(1, vfs_->szOsFile);
+    int flags = SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE
+              | (wal_ ? SQLITE_OPEN_WAL : SQLITE_OPEN_MAIN_DB);
+    int out_flags;
+    if(vfs_->xOpen(vfs_, file_name(), f, flags, &out_flags) != SQLITE_OK){
+      cout << "open " << file_name() << " failed" << endl;
+      free(f);
+      return nullptr;
+    }
+    return f;
+  }
+
+  void close(sqlite3_file *f){
+    f->pMethods->xClose(f);
+    free(f);
+  }
+
+  void remove(){
+    vfs_->xDelete(vfs_, file_name(), 0);
+    string shm = string(name_) + "-shm";
+    vfs_->xDelete(vfs_, shm.c_str(), 0);
+  }
+
+  int write(sqlite3_file *f, size_t size, sqlite3_int64 offset, size_t from){
+    for(size_t done = 0; done < size; done += MAX_WRITE){
+      int n = (int)min(size - done, (size_t)MAX_WRITE);
+      int rc = f->pMethods->xWrite(f, &buffer_[from + done], n, offset + done);
+      if(rc != SQLITE_OK){
+        return rc;
+      }
+    }
+    return SQLITE_OK;
+  }
+
+  /* grow the file to file_size outside of any measurement */
+  void prefill(sqlite3_file *f){
+    for(size_t off = 0; off < file_size_; off += 1 << 20){
+      write(f, min((size_t)1 << 20, file_size_ - off), off, 0);
+    }
+    f->pMethods->xSync(f, SQLITE_SYNC_FULL);
+  }
+
+  sqlite3_int64 offset(size_t i, size_t size, bool random, bool aligned){
+    size_t slots = (file_size_ - MISALIGN) / size;
+    size_t slot = random ? gen_() % slots : i % slots;
+    return slot * size + (aligned ? 0 : MISALIGN);
+  }
+
+  size_t ops_for(size_t size){
+    /* do not write the file more than 4 times over per case */
+    return max((size_t)16, min(ops_, 4 * file_size_ / size));
+  }
+
+  void write_case(Case c, bool random){
+    sqlite3_file *f = open(false);
+    if(f == nullptr){
+      return;
+    }
+    vector<uint64_t> lat;
+    vector<uint64_t> sync_lat;
+    uint64_t sync_total = 0;
+    size_t n = ops_for(c.size);
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < n; i++){
+      sqlite3_int64 off = offset(i, c.size, random, c.aligned);
+      uint64_t t = now_ns();
+      if(write(f, c.size, off, i % 16) != SQLITE_OK){
+        cout << "write at " << off << " failed" << endl;
+        break;
+      }
+      lat.push_back(now_ns() - t);
+      if(c.sync_every && (i + 1) % c.sync_every == 0){
+        t = now_ns();
+        f->pMethods->xSync(f, SQLITE_SYNC_FULL);
+        sync_lat.push_back(now_ns() - t);
+        sync_total += sync_lat.back();
+      }
+    }
+    uint64_t total = now_ns() - start;
+    report(c, lat, total);
+    if(!sync_lat.empty()){
+      c.op = "sync";
+      report(c, sync_lat, sync_total);
+    }
+    close(f);
+  }
+
+  void read_case(Case c, bool random){
+    sqlite3_file *f = open(false);
+    if(f == nullptr){
+      return;
+    }
+    vector<char> into(c.size);
+    vector<uint64_t> lat;
+    size_t n = ops_for(c.size);
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < n; i++){
+      sqlite3_int64 off = offset(i, c.size, random, c.aligned);
+      uint64_t t = now_ns();
+      f->pMethods->xRead(f, into.data(), (int)c.size, off);
+      lat.push_back(now_ns() - t);
+    }
+    report(c, lat, now_ns() - start);
+    close(f);
+  }
+
+  void grow_case(Case c){
+    sqlite3_file *f = open(true);
+    if(f == nullptr){
+      return;
+    }
+    vector<uint64_t> lat;
+    uint64_t start = now_ns();
+    for(size_t off = 0; off + c.size <= file_size_; off += c.size){
+      uint64_t t = now_ns();
+      if(write(f, c.size, off, 0) != SQLITE_OK){
+        break;
+      }
+      lat.push_back(now_ns() - t);
+    }
+    f->pMethods->xSync(f, SQLITE_SYNC_FULL);
+    report(c, lat, now_ns() - start);
+    close(f);
+  }
+
+  void shm_case(Case c){
+    sqlite3_file *f = open(false);
+    if(f == nullptr){
+      return;
+    }
+    volatile void *region;
+    if(f->pMethods->iVersion < 2 || f->pMethods->xShmMap == nullptr
+       || f->pMethods->xShmMap(f, 0, 32768, 1, &region) != SQLITE_OK){
+      close(f);
+      return;
+    }
+    vector<uint64_t> lat;
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < ops_; i++){
+      uint64_t t = now_ns();
+      f->pMethods->xShmBarrier(f);
+      lat.push_back(now_ns() - t);
+    }
+    report(c, lat, now_ns() - start);
+    f->pMethods->xShmUnmap(f, 1);
+    close(f);
+  }
+
+  void open_case(Case c){
+    vector<uint64_t> lat;
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < ops_; i++){
+      uint64_t t = now_ns();
+      sqlite3_file *f = open(false);
+      if(f == nullptr){
+        break;
+      }
+      close(f);
+      lat.push_back(now_ns() - t);
+    }
+    report(c, lat, now_ns() - start);
+  }
+
+  void create_case(Case c){
+    vector<uint64_t> lat;
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < ops_; i++){
+      uint64_t t = now_ns();
+      sqlite3_file *f = open(true);
+      if(f == nullptr || write(f, c.size, 0, 0) != SQLITE_OK){
+        break;
+      }
+      f->pMethods->xSync(f, SQLITE_SYNC_FULL);
+      close(f);
+      vfs_->xDelete(vfs_, file_name(), 0);
+      lat.push_back(now_ns() - t);
+    }
+    report(c, lat, now_ns() - start);
+  }
+
+  const char *file_name(){ return wal_ ? sqlite3_filename_wal(name_) : name_; }
+
+private:
+  sqlite3_vfs *vfs_;
+  bool wal_;
+  size_t file_size_;
+  size_t ops_;
+  sqlite3_filename name_;
+  vector<char> buffer_;
+  minstd_rand gen_;
+};
+
+static void run_vfs(const string &vfs_name, const cxxopts::ParseResult &result){
+  sqlite3_vfs *vfs = sqlite3_vfs_find(vfs_name.c_str());
+  if(vfs == nullptr){
+    cout << "no VFS " << vfs_name << endl;
+    return;
+  }
+  static const size_t sizes[] = {64, 256, 1024, 4096, 16384, 65536, 262144, 1048576};
+  static const int syncs[] = {1, 4, 16, 64};
+  bool wal = result["file"].as<string>() == "wal";
+  Bench bench(vfs, result["path"].as<string>(), wal,
+              result["file_size"].as<size_t>() << 20, result["ops"].as<size_t>());
+
+  sqlite3_file *f = bench.open(true);
+  if(f == nullptr){
+    return;
+  }
+  bench.prefill(f);
+  bench.close(f);
+
+  for(size_t size : sizes){
+    for(int random = 0; random < 2; random++){
+      for(int aligned = 1; aligned >= 0; aligned--){
+        Case c{vfs_name, "write", "write", size, random ? "random" : "sequential", aligned != 0, 0};
+        bench.write_case(c, random);
+      }
+    }
+  }
+  for(int every : syncs){
+    Case c{vfs_name, "sync", "write", 4096, "sequential", true, every};
+    bench.write_case(c, false);
+  }
+  for(size_t size : sizes){
+    for(int random = 0; random < 2; random++){
+      for(int aligned = 1; aligned >= 0; aligned--){
+        Case c{vfs_name, "read", "read", size, random ? "random" : "sequential", aligned != 0, 0};
+        bench.read_case(c, random);
+      }
+    }
+  }
+  if(!wal){
+    bench.shm_case(Case{vfs_name, "shm", "barrier", 0, "none", true, 0});
+  }
+  bench.open_case(Case{vfs_name, "open", "open", 0, "none", true, 0});
+  bench.grow_case(Case{vfs_name, "grow", "write", 4096, "append", true, 0});
+  bench.create_case(Case{vfs_name, "create", "create", 4096, "none", true, 0});
+  bench.remove();
+}
+
+int main(int argc, char **argv){
+  cxxopts::Options options("vfs_bench", "Microbenchmark of the VFS methods");
+  cxxopts::OptionAdder adder = options.add_options();
+  adder("vfs", "Comma separated VFS names",
+        cxxopts::value<string>()->default_value("unix,PMem_VFS,PMem_VFS_wal_only,demo"));
+  adder("path", "Test file", cxxopts::value<string>()->default_value("/mnt/pmem0/scheinost/vfs_bench.db"));
+  adder("file", "Open the test file as main database (main) or WAL (wal)",
+        cxxopts::value<string>()->default_value("main"));
+  adder("file_size", "Size of the test file in MiB", cxxopts::value<size_t>()->default_value("64"));
+  adder("ops", "Operations per case", cxxopts::value<size_t>()->default_value("10000"));
+  adder("out", "JSON result file", cxxopts::value<string>()->default_value("vfs_bench.json"));
+  adder("help", "Print help");
+  auto result = options.parse(argc, argv);
+
+  if(result.count("help")){
+    cout << options.help();
+    return 0;
+  }
+
+  sqlite3_initialize();
+  sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
+  sqlite3_vfs_register(sqlite3_pmem_wal_only_vfs(), 0);
+  sqlite3_vfs_register(sqlite3_pmem_pool_vfs(), 0);
+  sqlite3_vfs_register(sqlite3_demovfs(), 0);
+
+  out.open(result["out"].as<string>());
+  out << "[";
+  stringstream names(result["vfs"].as<string>());
+  string name;
+  while(getline(names, name, ',')){
+    run_vfs(name, result);
+  }
+  out << "\n]" << endl;
+  sqlite3_shutdown();
+  return 0;
+}
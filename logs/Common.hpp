@@ -8,6 +8,7 @@
 #include <cstring>
 #include <iostream>
 #include "libpmem.h"
+#include "../vfs/pmem_emulation.h"
 // -------------------------------------------------------------------------------------
 #define a_mm_clflush(addr)\
     asm volatile("clflush %0" : "+m" (*(volatile char *)addr));
@@ -37,12 +38,14 @@ inline void alex_WriteBack(void *addr, ub4 len)
    for (uintptr_t uptr = (uintptr_t) addr & ~(64 - 1); uptr<(uintptr_t) addr + len; uptr += 64) {
       a_mm_clwb((char *) uptr);
    }
+   pmem_emu_media(addr, len);
 }
 // -------------------------------------------------------------------------------------
 inline void alex_WriteBack(void *addr)
 {
    addr = (ub1 *) ((uintptr_t) addr & ~(64 - 1));
    a_mm_clwb((char *) addr);
+   pmem_emu_media(addr, 64);
 }
 // -------------------------------------------------------------------------------------
 inline void alex_FlushOpt(void *addr, ub4 len)
@@ -50,16 +53,19 @@ inline void alex_FlushOpt(void *addr, ub4 len)
    for (uintptr_t uptr = (uintptr_t) addr & ~(64 - 1); uptr<(uintptr_t) addr + len; uptr += 64) {
       a_mm_clflushopt((char *) uptr);
    }
+   pmem_emu_media(addr, len);
 }
 // -------------------------------------------------------------------------------------
 inline void alex_FlushOpt(void *addr)
 {
    a_mm_clflushopt((char *) addr);
+   pmem_emu_media(addr, 64);
 }
 // -------------------------------------------------------------------------------------
 inline void alex_SFence()
 {
    _mm_sfence();
+   pmem_emu_fence();
 }
 // -------------------------------------------------------------------------------------
 inline ub8 alex_PopCount(ub8 value)
@@ -73,6 +79,7 @@ inline void alex_FlushClToNvm(void *dest, void *src)
    assert(((ub8) src) % 64 == 0);
    __m512i reg = _mm512_load_si512(src);
    _mm512_stream_si512((__m512i *) dest, reg);
+   pmem_emu_media(dest, 64);
 }
 // -------------------------------------------------------------------------------------
 void FastCopy512(ub1 *dest, const ub1 *src)
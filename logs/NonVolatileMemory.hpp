@@ -24,12 +24,14 @@ public:
    ub8 GetByteCount() { return byte_count; }
 
    bool IsNvm() const { return is_nvm; }
+   bool IsEmulated() const { return is_emulated; }
 
 private:
    ub1 *data_ptr;
    std::string file_name;
    const ub8 byte_count;
    bool is_nvm;
+   bool is_emulated = false;
    bool is_mapped_file;
    int file_fd;
 };
@@ -62,6 +64,8 @@ NonVolatileMemory::NonVolatileMemory(const std::string &file_name, ub8 byte_coun
       exit(-1);
    }
    data_ptr = (ub1 *) mmap(nullptr, byte_count, PROT_WRITE, MAP_SHARED, file_fd, 0);
+   // With PMEM_EMULATE set flushes and fences to the file pay emulated pmem costs, see vfs/pmem_emulation.h
+   is_emulated = pmem_emu_enabled();
 }
 // -------------------------------------------------------------------------------------
 NonVolatileMemory::~NonVolatileMemory()
@@ -59,6 +59,12 @@ void PrintResult(string name, ub4 entry_size, double ns_per_entry, uint64_t writ
    cout << " runs: " << RUNS;
    cout << " entry_size: " << entry_size;
    cout << " ns_per_entry(ns): " << ns_per_entry;
+   if (pmem_emu_enabled()) {
+      pmem_emu_stats emu;
+      pmem_emu_get_stats(&emu, 1);
+      cout << " emu_media_byte_count(byte): " << emu.media_bytes;
+      cout << " emu_delay(ns): " << emu.delay_ns;
+   }
    cout << endl;
    //@formatter:on
 }
@@ -99,7 +105,7 @@ int main(int argc, char **argv)
 #else
    cout << "NDEBUG              " << "release" << endl;
 #endif
-   cout << "nvm                 " << (nvm.IsNvm() ? "yes" : "no") << endl;
+   cout << "nvm                 " << (nvm.IsNvm() ? "yes" : "no") << (nvm.IsEmulated() ? " (emulated)" : "") << endl;
    cout << "------" << endl;
 
    if (TABLE_VIEW) {
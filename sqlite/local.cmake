@@ -23,6 +23,9 @@ add_library(sqlite ${SQLITE_FILES})
 target_compile_options(
         sqlite
         PRIVATE
+        -DSQLITE_ENABLE_DBSTAT_VTAB
+        -DSQLITE_ENABLE_DBPAGE_VTAB
+        -DSQLITE_ENABLE_BATCH_ATOMIC_WRITE
         -DSQLITE_DQS=0
         -DSQLITE_THREADSAFE=0
         -DSQLITE_OMIT_LOAD_EXTENSION
@@ -118,6 +118,7 @@ typedef unsigned short int u16;
 #include <stdio.h>
 #include <assert.h>
 #include "sqlite3.h"
+#include "../../vfs/pmem_fcntl.h"
 typedef sqlite3_int64 i64;
 typedef sqlite3_uint64 u64;
 typedef unsigned char u8;
@@ -18962,6 +18963,11 @@ static const char *(azHelp[]) = {
   ".shell CMD ARGS...       Run CMD ARGS... in a system shell",
 #endif
   ".show                    Show the current values for various settings",
+#ifndef SQLITE_SHELL_FIDDLE
+  ".snapshot FILE           Write a point-in-time image of the database to FILE",
+  "   Needs the PMem VFS. Checkpoints the WAL, then clones or copies the",
+  "   database file while writers continue",
+#endif
   ".stats ?ARG?             Show stats or turn stats on or off",
   "   off                      Turn off automatic stat display",
   "   on                       Turn on automatic stat display",
@@ -24572,6 +24578,38 @@ static int do_meta_command(char *zLine, ShellState *p){
   }else
 #endif /* !defined(SQLITE_NOHAVE_SYSTEM) && !defined(SQLITE_SHELL_FIDDLE) */
 
+#ifndef SQLITE_SHELL_FIDDLE
+  if( c=='s' && n>=2 && cli_strncmp(azArg[0], "snapshot", n)==0 ){
+    sqlite3_int64 iStart, iFixed;
+    failIfSafeMode(p, "cannot run .snapshot in safe mode");
+    if( nArg!=2 ){
+      raw_printf(stderr, "Usage: .snapshot FILE\n");
+      rc = 1;
+      goto meta_command_exit;
+    }
+    open_db(p, 0);
+    iStart = timeOfDay();
+    sqlite3_exec(p->db, "PRAGMA main.wal_checkpoint(TRUNCATE);", 0, 0, 0);
+    rc = sqlite3_file_control(p->db, "main", SQLITE_FCNTL_PMEM_SNAPSHOT, (void*)azArg[1]);
+    if( rc==SQLITE_NOTFOUND ){
+      raw_printf(stderr, "Error: .snapshot needs the PMem VFS (-vfs PMem_VFS)\n");
+      rc = 1;
+      goto meta_command_exit;
+    }
+    iFixed = timeOfDay();
+    if( rc==SQLITE_OK ){
+      rc = sqlite3_file_control(p->db, "main", SQLITE_FCNTL_PMEM_SNAPSHOT_WAIT, 0);
+    }
+    if( rc!=SQLITE_OK ){
+      utf8_printf(stderr, "Error: snapshot failed: %s\n", sqlite3_errstr(rc));
+      rc = 1;
+    }else{
+      utf8_printf(p->out, "snapshot fixed after %lld ms, complete after %lld ms\n",
+                  iFixed - iStart, timeOfDay() - iStart);
+    }
+  }else
+#endif
+
   if( c=='s' && cli_strncmp(azArg[0], "show", n)==0 ){
     static const char *azBool[] = { "off", "on", "trigger", "full"};
     const char *zOut;
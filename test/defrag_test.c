@@ -0,0 +1,166 @@
+/*
+** Regression test of the online defragmentation (vfs/pmem_defrag.c), run
+** by ctest. The application changes the database between the step that
+** plans and the steps that swap, the swaps must leave a database that
+** passes the integrity check and holds every row.
+**
+** pages freed and reused after the plan
+**   Half way through, emptying the planned table frees all of its pages
+**   but the root, the rows of another table take some of them over. The
+**   freed parents keep their old images (no secure_delete), which still
+**   point to the reused children.
+**
+** btree dropped after the plan
+**   Dropping the planned table frees its root too, a new table gets its
+**   pages.
+**
+**     defrag_test [DIR]    database in DIR, default /tmp
+*/
+#include "../sqlite/sqlite/sqlite3.h"
+#include "../vfs/pmem_defrag.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char db_path[512];
+
+static void check(sqlite3 *db, int rc, const char *what){
+  if(rc != SQLITE_OK){
+    fprintf(stderr, "%s: %d %s\n", what, rc, sqlite3_errmsg(db));
+    exit(1);
+  }
+}
+
+static void exec(sqlite3 *db, const char *sql){
+  check(db, sqlite3_exec(db, sql, NULL, NULL, NULL), sql);
+}
+
+static sqlite3_int64 query_int(sqlite3 *db, const char *sql){
+  sqlite3_stmt *stmt;
+  sqlite3_int64 v = -1;
+  check(db, sqlite3_prepare_v2(db, sql, -1, &stmt, NULL), sql);
+  if(sqlite3_step(stmt) == SQLITE_ROW){
+    v = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return v;
+}
+
+/*
+** Fresh database with t, whose keys are inserted out of order so that its
+** leaves are scattered, and u behind it.
+*/
+static sqlite3 *setup(void){
+  sqlite3 *db;
+  unlink(db_path);
+  check(NULL, sqlite3_open(db_path, &db), "open");
+  exec(db, "PRAGMA page_size=1024;");
+  exec(db, "PRAGMA secure_delete=OFF;");
+  exec(db, "CREATE TABLE t(k INTEGER PRIMARY KEY, v BLOB);");
+  exec(db, "WITH RECURSIVE c(i) AS (SELECT 0 UNION ALL SELECT i+1 FROM c WHERE i<7999)"
+           " INSERT INTO t SELECT (i * 2903) % 8000, randomblob(100) FROM c;");
+  exec(db, "CREATE TABLE u(k INTEGER PRIMARY KEY, v BLOB);");
+  return db;
+}
+
+/*
+** Plans the moves of t, makes half of them, so that the next page to move
+** is a leaf, calls change, then steps until done.
+*/
+static int defrag_around(sqlite3 *db, void (*change)(sqlite3*)){
+  pmem_defrag *p;
+  pmem_defrag_progress pr;
+  check(db, sqlite3_pmem_defrag_init(db, "t", &p), "defrag init");
+  check(db, sqlite3_pmem_defrag_step(p, 4), "plan");
+  do{
+    check(db, sqlite3_pmem_defrag_step(p, 16), "step");
+    sqlite3_pmem_defrag_progress(p, &pr);
+  }while(pr.placed < pr.pages / 2);
+  change(db);
+  int rc = SQLITE_OK;
+  for(int i = 0; i < 100000 && rc == SQLITE_OK; i++){
+    rc = sqlite3_pmem_defrag_step(p, 4);
+  }
+  sqlite3_pmem_defrag_finish(p);
+  if(rc != SQLITE_DONE){
+    fprintf(stderr, "defrag step: %d\n", rc);
+    return 0;
+  }
+  return 1;
+}
+
+/* 1 if the integrity check passes and t and u hold what they should */
+static int verify(sqlite3 *db, const char *t_rows, sqlite3_int64 t_expected,
+                  sqlite3_int64 u_expected){
+  int ok = 1;
+  sqlite3_stmt *stmt;
+  check(db, sqlite3_prepare_v2(db, "PRAGMA integrity_check;", -1, &stmt, NULL), "integrity_check");
+  while(sqlite3_step(stmt) == SQLITE_ROW){
+    const char *msg = (const char*)sqlite3_column_text(stmt, 0);
+    if(strcmp(msg, "ok") != 0){
+      fprintf(stderr, "integrity_check: %s\n", msg);
+      ok = 0;
+    }
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_int64 n = query_int(db, t_rows);
+  if(n != t_expected){
+    fprintf(stderr, "t: %lld rows, expected %lld\n", n, t_expected);
+    ok = 0;
+  }
+  n = query_int(db, "SELECT count(*) FROM u;");
+  if(n != u_expected){
+    fprintf(stderr, "u: %lld rows, expected %lld\n", n, u_expected);
+    ok = 0;
+  }
+  return ok;
+}
+
+static void free_and_reuse(sqlite3 *db){
+  exec(db, "DELETE FROM t;");
+  exec(db, "WITH RECURSIVE c(i) AS (SELECT 0 UNION ALL SELECT i+1 FROM c WHERE i<799)"
+           " INSERT INTO u SELECT i, randomblob(100) FROM c;");
+}
+
+static int test_free_and_reuse(void){
+  sqlite3 *db = setup();
+  int ok = defrag_around(db, free_and_reuse);
+  ok &= verify(db, "SELECT count(*) FROM t;", 0, 800);
+  sqlite3_close(db);
+  return ok;
+}
+
+static void drop_and_create(sqlite3 *db){
+  exec(db, "DROP TABLE t;");
+  exec(db, "CREATE TABLE t2(k INTEGER PRIMARY KEY, v BLOB);");
+  exec(db, "WITH RECURSIVE c(i) AS (SELECT 0 UNION ALL SELECT i+1 FROM c WHERE i<1999)"
+           " INSERT INTO u SELECT (i * 1999) % 2000, randomblob(100) FROM c;");
+  exec(db, "WITH RECURSIVE c(i) AS (SELECT 0 UNION ALL SELECT i+1 FROM c WHERE i<999)"
+           " INSERT INTO t2 SELECT i, randomblob(100) FROM c;");
+}
+
+static int test_drop_and_create(void){
+  sqlite3 *db = setup();
+  int ok = defrag_around(db, drop_and_create);
+  ok &= verify(db, "SELECT count(*) FROM t2;", 1000, 2000);
+  sqlite3_close(db);
+  return ok;
+}
+
+int main(int argc, char **argv){
+  const char *dir = argc > 1 ? argv[1] : "/tmp";
+  snprintf(db_path, sizeof(db_path), "%s/defrag_test.db", dir);
+
+  int failed = 0;
+  if(!test_free_and_reuse()){
+    fprintf(stderr, "pages freed and reused after the plan: FAILED\n");
+    failed++;
+  }
+  if(!test_drop_and_create()){
+    fprintf(stderr, "btree dropped after the plan: FAILED\n");
+    failed++;
+  }
+  unlink(db_path);
+  return failed != 0;
+}
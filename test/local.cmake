@@ -0,0 +1,2 @@
+set(WB_TEST_MAIN_FILE  ${CMAKE_SOURCE_DIR}/test/wb_test.c)
+set(DEFRAG_TEST_MAIN_FILE  ${CMAKE_SOURCE_DIR}/test/defrag_test.c)
@@ -0,0 +1,282 @@
+/*
+** Regression test of PMem_VFS_wb (vfs/pmem_wb_vfs.c), run by ctest. It
+** drives the VFS methods directly, SQLite only rolls a batch back when a
+** batch atomic commit fails.
+**
+** rollback after a forced destage
+**   A batch writes a page with a committed copy in the log, then so many
+**   other pages that the writer waits for the destager. The destager
+**   must write the committed copy back although the open batch has a
+**   newer one. After SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE the page must
+**   read the committed content, from the cache and, after the last
+**   close, from the backing file.
+**
+** close with an open batch
+**   A handle closed in the middle of a batch drops it, the backing file
+**   keeps the committed pages.
+**
+** recovery after a crash
+**   A child process commits a batch, writes into the next one and exits
+**   without closing. Opening the database again rebuilds the index from
+**   the log: committed pages are back, the open batch is gone.
+**
+** cache file of another database
+**   A cache file that still holds committed pages of one database must
+**   not be opened for another one, the open fails with SQLITE_CANTOPEN.
+**
+**     wb_test [DIR]        database and cache file in DIR, default /tmp
+*/
+#include "../sqlite/sqlite/sqlite3.h"
+#include "../vfs/pmem_wb_vfs.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PS PMEM_WB_PAGE_SIZE
+
+/* log capacity, the destager wakes above half of it */
+#define SLOTS 16
+
+static char db_path[512];
+static char other_path[512];
+static char cache_path[512];
+static char page[PS];
+
+static void check(int rc, const char *what){
+  if(rc != SQLITE_OK){
+    fprintf(stderr, "%s: %d\n", what, rc);
+    exit(1);
+  }
+}
+
+/* open path with the cache file of the tests, *pp is 0 on failure */
+static int try_open(sqlite3_vfs *vfs, const char *path, sqlite3_file **pp){
+  char slots[16];
+  snprintf(slots, sizeof(slots), "%d", SLOTS);
+  const char *params[] = {"cache_file", cache_path, "cache_pages", slots};
+  sqlite3_filename name = sqlite3_create_filename(path, "", "", 2, params);
+  sqlite3_file *f = calloc(1, vfs->szOsFile);
+  int flags = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  /* name has to outlive the file, it is never freed */
+  int rc = vfs->xOpen(vfs, name, f, flags, &flags);
+  if(rc != SQLITE_OK){
+    free(f);
+    f = 0;
+  }
+  *pp = f;
+  return rc;
+}
+
+static sqlite3_file *open_wb(sqlite3_vfs *vfs){
+  sqlite3_file *f;
+  check(try_open(vfs, db_path, &f), "open");
+  return f;
+}
+
+static void close_wb(sqlite3_file *f){
+  check(f->pMethods->xClose(f), "close");
+  free(f);
+}
+
+/* fill page pgno with byte v and write it into the open batch */
+static void write_page(sqlite3_file *f, int pgno, int v){
+  memset(page, v, PS);
+  check(f->pMethods->xWrite(f, page, PS, (sqlite3_int64)pgno * PS), "write");
+}
+
+static int first_byte(sqlite3_file *f, int pgno){
+  check(f->pMethods->xRead(f, page, PS, (sqlite3_int64)pgno * PS), "read");
+  return page[0];
+}
+
+/* first byte of page pgno in the backing file, -1 if it cannot be read */
+static int backing_byte(int pgno){
+  int v = -1;
+  int fd = open(db_path, O_RDONLY);
+  if(fd >= 0 && pread(fd, page, PS, (off_t)pgno * PS) == PS){
+    v = page[0];
+  }
+  if(fd >= 0){
+    close(fd);
+  }
+  return v;
+}
+
+/* fresh database whose pages 0 to 3 hold 'o' in the backing file */
+static void setup(sqlite3_vfs *vfs){
+  unlink(db_path);
+  unlink(cache_path);
+  sqlite3_file *f = open_wb(vfs);
+  for(int i = 0; i < 4; i++){
+    write_page(f, i, 'o');
+  }
+  check(f->pMethods->xSync(f, SQLITE_SYNC_NORMAL), "commit");
+  close_wb(f);
+}
+
+/*
+** In a child: commit 'c' to pages 0 to 3, write 'u' to page 1 in the
+** next batch and exit without closing anything.
+*/
+static void crash_with_open_batch(sqlite3_vfs *vfs){
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if(pid == 0){
+    sqlite3_file *f = open_wb(vfs);
+    for(int i = 0; i < 4; i++){
+      write_page(f, i, 'c');
+    }
+    check(f->pMethods->xSync(f, SQLITE_SYNC_NORMAL), "commit");
+    write_page(f, 1, 'u');
+    _exit(0);
+  }
+  int status;
+  if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)){
+    fprintf(stderr, "crashing child failed\n");
+    exit(1);
+  }
+}
+
+static int test_close_with_open_batch(sqlite3_vfs *vfs){
+  setup(vfs);
+  sqlite3_file *f = open_wb(vfs);
+  write_page(f, 0, 'x');
+  write_page(f, 4, 'x');
+  close_wb(f);
+
+  int ok = 1;
+  int v = backing_byte(0);
+  if(v != 'o'){
+    fprintf(stderr, "backing file: page 0 has '%c', expected 'o'\n", v);
+    ok = 0;
+  }
+  f = open_wb(vfs);
+  sqlite3_int64 size;
+  check(f->pMethods->xFileSize(f, &size), "size");
+  if(size != 4 * PS){
+    fprintf(stderr, "after close: size %lld, expected %d\n", size, 4 * PS);
+    ok = 0;
+  }
+  close_wb(f);
+  return ok;
+}
+
+static int test_recovery_after_crash(sqlite3_vfs *vfs){
+  setup(vfs);
+  crash_with_open_batch(vfs);
+
+  int ok = 1;
+  sqlite3_file *f = open_wb(vfs);
+  for(int i = 0; i < 4; i++){
+    int v = first_byte(f, i);
+    if(v != 'c'){
+      fprintf(stderr, "after recovery: page %d has '%c', expected 'c'\n", i, v);
+      ok = 0;
+    }
+  }
+  close_wb(f);
+  for(int i = 0; i < 4; i++){
+    int v = backing_byte(i);
+    if(v != 'c'){
+      fprintf(stderr, "backing file: page %d has '%c', expected 'c'\n", i, v);
+      ok = 0;
+    }
+  }
+  return ok;
+}
+
+static int test_foreign_cache(sqlite3_vfs *vfs){
+  setup(vfs);
+  crash_with_open_batch(vfs);
+
+  int ok = 1;
+  unlink(other_path);
+  sqlite3_file *f;
+  int rc = try_open(vfs, other_path, &f);
+  if(rc != SQLITE_CANTOPEN){
+    fprintf(stderr, "other database: open returned %d, expected %d\n", rc, SQLITE_CANTOPEN);
+    ok = 0;
+    if(f){
+      close_wb(f);
+    }
+  }
+
+  /* the pages of the owner survived the attempt */
+  f = open_wb(vfs);
+  int v = first_byte(f, 2);
+  if(v != 'c'){
+    fprintf(stderr, "owner: page 2 has '%c', expected 'c'\n", v);
+    ok = 0;
+  }
+  close_wb(f);
+  unlink(other_path);
+  return ok;
+}
+
+static int test_rollback_after_destage(sqlite3_vfs *vfs){
+  /* the last close writes everything back, the backing file has 'o' */
+  setup(vfs);
+
+  /* 'n' is committed to the log only, below the destage mark */
+  sqlite3_file *f = open_wb(vfs);
+  for(int i = 0; i < 6; i++){
+    write_page(f, i, 'n');
+  }
+  check(f->pMethods->xSync(f, SQLITE_SYNC_NORMAL), "commit");
+
+  /* page 0 again, then more than the log has left forces a destage */
+  write_page(f, 0, 'x');
+  for(int i = 6; i < SLOTS; i++){
+    write_page(f, i, 'x');
+  }
+  check(f->pMethods->xFileControl(f, SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE, 0), "rollback");
+
+  int ok = 1;
+  int v = first_byte(f, 0);
+  if(v != 'n'){
+    fprintf(stderr, "after rollback: page 0 has '%c', expected 'n'\n", v);
+    ok = 0;
+  }
+  close_wb(f);
+
+  v = backing_byte(0);
+  if(v != 'n'){
+    fprintf(stderr, "backing file: page 0 has '%c', expected 'n'\n", v);
+    ok = 0;
+  }
+  return ok;
+}
+
+int main(int argc, char **argv){
+  const char *dir = argc > 1 ? argv[1] : "/tmp";
+  snprintf(db_path, sizeof(db_path), "%s/wb_test.db", dir);
+  snprintf(other_path, sizeof(other_path), "%s/wb_test_other.db", dir);
+  snprintf(cache_path, sizeof(cache_path), "%s/wb_test.db-wb", dir);
+  sqlite3_initialize();
+  sqlite3_vfs *vfs = sqlite3_pmem_wb_vfs();
+
+  int failed = 0;
+  if(!test_rollback_after_destage(vfs)){
+    fprintf(stderr, "rollback after a forced destage: FAILED\n");
+    failed++;
+  }
+  if(!test_close_with_open_batch(vfs)){
+    fprintf(stderr, "close with an open batch: FAILED\n");
+    failed++;
+  }
+  if(!test_recovery_after_crash(vfs)){
+    fprintf(stderr, "recovery after a crash: FAILED\n");
+    failed++;
+  }
+  if(!test_foreign_cache(vfs)){
+    fprintf(stderr, "cache file of another database: FAILED\n");
+    failed++;
+  }
+  unlink(db_path);
+  unlink(cache_path);
+  return failed != 0;
+}
@@ -0,0 +1,4 @@
+set(PMEM_BACKUP_MAIN_FILE  ${CMAKE_SOURCE_DIR}/tools/pmem_backup.c)
+set(PMEM_FOLLOWER_MAIN_FILE  ${CMAKE_SOURCE_DIR}/tools/pmem_follower.c)
+set(PMEM_HEATMAP_MAIN_FILE  ${CMAKE_SOURCE_DIR}/tools/pmem_heatmap.c)
+set(PMEM_DEFRAG_MAIN_FILE  ${CMAKE_SOURCE_DIR}/tools/pmem_defrag.c)
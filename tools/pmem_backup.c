@@ -0,0 +1,167 @@
+/*
+** Incremental backup of a database on the PMem VFS.
+**
+**     pmem_backup DATABASE BACKUP
+**
+** Copies the pages of DATABASE marked in its dirty page map
+** ("DATABASE-dirtymap", see PMEM_CONFIG_DIRTY_MAP) into the file BACKUP and
+** clears the map afterwards. The epoch of the map the backup is based on is
+** kept in "BACKUP-epoch". Without a backup, or if the epochs do not match,
+** every page is copied.
+**
+** The database is checkpointed first, so BACKUP is a plain database file.
+** From the copy of the map until it is cleared, writes to the database
+** from other connections wait; while one of them has unsynced writes the
+** tool retries for up to BUSY_RETRIES milliseconds.
+*/
+#include "../vfs/pmem_vfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BUSY_RETRIES 5000
+
+static int read_epoch(const char *path, u64 *epoch){
+  FILE *f = fopen(path, "r");
+  unsigned long long e;
+  int ok;
+  if(f == NULL){
+    return 0;
+  }
+  ok = fscanf(f, "%llu", &e) == 1;
+  fclose(f);
+  *epoch = e;
+  return ok;
+}
+
+static int write_epoch(const char *path, u64 epoch){
+  char tmp[MAXPATHNAME + 16];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "w");
+  if(f == NULL){
+    return 0;
+  }
+  fprintf(f, "%llu\n", (unsigned long long)epoch);
+  if(fflush(f) || fsync(fileno(f))){
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+  return rename(tmp, path) == 0;
+}
+
+static sqlite3_int64 query_int(sqlite3 *db, const char *sql){
+  sqlite3_stmt *stmt;
+  sqlite3_int64 v = 0;
+  if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW){
+    v = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return v;
+}
+
+/* copy the pages of src that are dirty in map, or all with full set */
+static int copy_pages(const char *src_path, const char *dst_path, pmem_dirtymap *map,
+                      sqlite3_int64 db_size, int full, u64 *copied){
+  u64 n_pages = (db_size + map->page_size - 1) / map->page_size;
+  int src = open(src_path, O_RDONLY);
+  int dst = open(dst_path, O_RDWR | O_CREAT, 0644);
+  char *page = malloc(map->page_size);
+  int ok = src >= 0 && dst >= 0 && page != NULL;
+
+  if(!ok){
+    fprintf(stderr, "cannot open %s or %s\n", src_path, dst_path);
+  }
+  for(u64 i = 0; ok && i < n_pages; i++){
+    int dirty = i >= map->n_pages || (map->bits[i / 8] & (1 << (i % 8)));
+    if(!full && !dirty){
+      continue;
+    }
+    off_t off = (off_t)i * map->page_size;
+    size_t len = db_size - off < map->page_size ? db_size - off : map->page_size;
+    if(pread(src, page, len, off) != (ssize_t)len || pwrite(dst, page, len, off) != (ssize_t)len){
+      fprintf(stderr, "copy of page %llu failed\n", (unsigned long long)i);
+      ok = 0;
+    }
+    else{
+      (*copied)++;
+    }
+  }
+  if(ok && (ftruncate(dst, db_size) || fsync(dst))){
+    fprintf(stderr, "sync of %s failed\n", dst_path);
+    ok = 0;
+  }
+  free(page);
+  if(dst >= 0){
+    close(dst);
+  }
+  if(src >= 0){
+    close(src);
+  }
+  return ok;
+}
+
+int main(int argc, char **argv){
+  char uri[MAXPATHNAME + 32];
+  char epoch_path[MAXPATHNAME + 16];
+  pmem_dirtymap map;
+  sqlite3 *db;
+  u64 backup_epoch = 0;
+  u64 copied = 0;
+  int full;
+  int rc;
+
+  if(argc != 3){
+    fprintf(stderr, "usage: %s DATABASE BACKUP\n", argv[0]);
+    return 1;
+  }
+  sqlite3_initialize();
+  sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
+
+  snprintf(uri, sizeof(uri), "file:%s?dirtymap=1", argv[1]);
+  rc = sqlite3_open_v2(uri, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, "PMem_VFS");
+  if(rc){
+    fprintf(stderr, "open %s: %s\n", argv[1], sqlite3_errstr(rc));
+    sqlite3_close(db);
+    return 1;
+  }
+  sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", NULL, NULL, NULL);
+
+  /* from here on until the reset no other handle writes */
+  for(int i = 0; (rc = sqlite3_file_control(db, "main", SQLITE_FCNTL_PMEM_DIRTYMAP_GET, &map)) == SQLITE_BUSY
+                 && i < BUSY_RETRIES; i++){
+    usleep(1000);
+  }
+  if(rc){
+    fprintf(stderr, "dirty map: %s\n", sqlite3_errstr(rc));
+    sqlite3_close(db);
+    return 1;
+  }
+
+  /* the logical size, the file itself is as large as its mapping */
+  sqlite3_int64 db_size = query_int(db, "PRAGMA page_count;") * query_int(db, "PRAGMA page_size;");
+
+  snprintf(epoch_path, sizeof(epoch_path), "%s-epoch", argv[2]);
+  full = access(argv[2], F_OK) != 0 || !read_epoch(epoch_path, &backup_epoch) || backup_epoch != map.epoch;
+
+  int ok = copy_pages(argv[1], argv[2], &map, db_size, full, &copied);
+  sqlite3_free(map.bits);
+  if(!ok){
+    /* nothing is reset, the next backup copies these pages again */
+    sqlite3_close(db);
+    return 1;
+  }
+
+  /* only now may the copied pages be forgotten */
+  rc = sqlite3_file_control(db, "main", SQLITE_FCNTL_PMEM_DIRTYMAP_RESET, &map.epoch);
+  if(rc || !write_epoch(epoch_path, map.epoch)){
+    fprintf(stderr, "reset of the dirty map failed, the next backup is a full one\n");
+  }
+  sqlite3_close(db);
+
+  printf("%s backup: %llu of %llu pages (%.1f of %.1f MB), epoch %llu\n",
+         full ? "full" : "incremental",
+         (unsigned long long)copied, (unsigned long long)((db_size + map.page_size - 1) / map.page_size),
+         copied * (double)map.page_size / (1 << 20), db_size / (double)(1 << 20),
+         (unsigned long long)map.epoch);
+  return 0;
+}
@@ -0,0 +1,172 @@
+/*
+** Online defragmentation of a database.
+**
+**     pmem_defrag DATABASE ?TABLE? ?--vfs NAME? ?--batch SWAPS? ?--rate PAGES?
+**                 ?--seconds S?
+**
+** Moves the pages of the table or index TABLE, or of all of them, into key
+** order with sqlite3_pmem_defrag_step() (see vfs/pmem_defrag.c) while other
+** connections keep using the database. Each step swaps up to --batch pairs
+** of pages in one transaction (default 16), --rate caps the pages written
+** per second (default 2000, 0 for no cap) and --seconds the run time
+** (default until done). A locked database is retried after a backoff that
+** doubles up to 100 ms. Progress is printed once a second, at the end the
+** share of leaves followed by their successor in key order before and after
+** the run, taken from dbstat.
+**
+** The VFS defaults to "unix". The locks of PMem_VFS are no-ops, with
+** --vfs PMem_VFS no other process may use the database during the run.
+** Applications on PMem_VFS call sqlite3_pmem_defrag_step() themselves
+** between their transactions.
+*/
+#include "../vfs/pmem_vfs.h"
+#include "../vfs/pmem_defrag.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_BACKOFF_US 100000
+
+static u64 now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* percentage of leaves directly followed by the next leaf of their btree */
+static double leaf_order(sqlite3 *db, const char *name){
+  sqlite3_stmt *stmt;
+  char prev_name[256] = "";
+  sqlite3_int64 prev = 0;
+  u64 pairs = 0;
+  u64 in_order = 0;
+  if(sqlite3_prepare_v2(db, "SELECT name, pageno FROM dbstat WHERE pagetype = 'leaf'"
+                            " AND (?1 IS NULL OR name = ?1);", -1, &stmt, NULL)){
+    return 0;
+  }
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  while(sqlite3_step(stmt) == SQLITE_ROW){
+    const char *n = (const char*)sqlite3_column_text(stmt, 0);
+    sqlite3_int64 pgno = sqlite3_column_int64(stmt, 1);
+    if(strcmp(n, prev_name) == 0){
+      pairs++;
+      in_order += pgno == prev + 1;
+    }else{
+      snprintf(prev_name, sizeof(prev_name), "%s", n);
+    }
+    prev = pgno;
+  }
+  sqlite3_finalize(stmt);
+  return pairs ? 100.0 * in_order / pairs : 100.0;
+}
+
+static void print_progress(pmem_defrag *d, u64 elapsed_us){
+  pmem_defrag_progress pr;
+  sqlite3_pmem_defrag_progress(d, &pr);
+  printf("%6.1fs  btree %d/%d %-20s placed %u/%u  swaps %llu  pages/s %.0f  busy %llu  replans %llu\n",
+         elapsed_us / 1e6, pr.btree + (pr.name != NULL), pr.n_btrees, pr.name ? pr.name : "-",
+         pr.placed, pr.pages, (unsigned long long)pr.swaps,
+         elapsed_us ? pr.pages_written * 1e6 / elapsed_us : 0.0,
+         (unsigned long long)pr.busy, (unsigned long long)pr.replans);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv){
+  char uri[MAXPATHNAME + 32];
+  const char *path = NULL;
+  const char *name = NULL;
+  const char *vfs = "unix";
+  int batch = 16;
+  double rate = 2000;
+  double seconds = 0;
+  sqlite3 *db;
+  pmem_defrag *d;
+  int rc;
+
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i], "--vfs") == 0 && i + 1 < argc){
+      vfs = argv[++i];
+    }else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc){
+      batch = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "--rate") == 0 && i + 1 < argc){
+      rate = atof(argv[++i]);
+    }else if(strcmp(argv[i], "--seconds") == 0 && i + 1 < argc){
+      seconds = atof(argv[++i]);
+    }else if(argv[i][0] != '-' && path == NULL){
+      path = argv[i];
+    }else if(argv[i][0] != '-' && name == NULL){
+      name = argv[i];
+    }else{
+      path = NULL;
+      break;
+    }
+  }
+  if(path == NULL || batch < 1){
+    fprintf(stderr, "usage: %s DATABASE ?TABLE? ?--vfs NAME? ?--batch SWAPS? ?--rate PAGES? ?--seconds S?\n",
+            argv[0]);
+    return 1;
+  }
+  sqlite3_initialize();
+  sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
+
+  snprintf(uri, sizeof(uri), "file:%s", path);
+  rc = sqlite3_open_v2(uri, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, vfs);
+  if(rc){
+    fprintf(stderr, "open %s: %s\n", path, sqlite3_errstr(rc));
+    return 1;
+  }
+  rc = sqlite3_pmem_defrag_init(db, name, &d);
+  if(rc == SQLITE_MISUSE){
+    fprintf(stderr, "%s: auto_vacuum databases are not supported\n", path);
+    return 1;
+  }else if(rc == SQLITE_NOTFOUND){
+    fprintf(stderr, "%s: no table or index %s\n", path, name);
+    return 1;
+  }else if(rc){
+    fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+    return 1;
+  }
+  double before = leaf_order(db, name);
+
+  u64 start = now_us();
+  u64 last_report = start;
+  u64 backoff = 1000;
+  for(;;){
+    rc = sqlite3_pmem_defrag_step(d, batch);
+    if(rc == SQLITE_DONE){
+      rc = SQLITE_OK;
+      break;
+    }
+    u64 now = now_us();
+    if(rc == SQLITE_BUSY){
+      usleep(backoff);
+      backoff = backoff * 2 < MAX_BACKOFF_US ? backoff * 2 : MAX_BACKOFF_US;
+    }else if(rc){
+      fprintf(stderr, "step: %s\n", sqlite3_errstr(rc));
+      break;
+    }else{
+      backoff = 1000;
+      if(rate > 0){
+        pmem_defrag_progress pr;
+        sqlite3_pmem_defrag_progress(d, &pr);
+        double due_us = pr.pages_written * 1e6 / rate;
+        if(due_us > now - start){
+          usleep(due_us - (now - start));
+        }
+      }
+    }
+    now = now_us();
+    if(now - last_report >= 1000000){
+      print_progress(d, now - start);
+      last_report = now;
+    }
+    if(seconds > 0 && now - start >= seconds * 1e6){
+      break;
+    }
+  }
+  print_progress(d, now_us() - start);
+  sqlite3_pmem_defrag_finish(d);
+
+  printf("leaves in order: %.1f%% before, %.1f%% after\n", before, leaf_order(db, name));
+  sqlite3_close(db);
+  return rc != SQLITE_OK;
+}
@@ -0,0 +1,468 @@
+/*
+** Local WAL-shipping follower.
+**
+**     pmem_follower RING PRIMARY REPLICA ?--interval MS? ?--query SQL?
+**
+** Keeps REPLICA, an ordinary rollback-journal database, up to date with
+** PRIMARY, a database on the PMem VFS whose WAL is published into the
+** shared memory ring RING (open the primary with "ship=RING", see
+** vfs/pmem_ship.h). Other processes can run read-only queries on REPLICA
+** with the default VFS at any time.
+**
+** The follower keeps a DRAM image of the primary's WAL, updated from the
+** ring, and scans it for frames. The frames of a transaction are written
+** to REPLICA once its commit frame arrived, under an exclusive lock on
+** REPLICA, so readers only ever see committed states. Page 1 is patched to
+** rollback mode (bytes 18 and 19) and its change counter is bumped, which
+** makes readers drop their caches.
+**
+** On start, whenever it fell behind by more than the ring capacity and
+** when a frame of its WAL image fails the checksum although a commit
+** frame follows it, the follower copies the primary's WAL and then the database file and
+** replays the ring from the position read before the copy. Replaying
+** writes the copies already contain is harmless, and frames the copy caught
+** half written fail their checksum until the ring completed them, so the
+** replica converges to the primary before the lock is released.
+**
+** Every interval the current lag is printed: how old the oldest write of
+** the last applied batch was when it reached the replica, and the bytes of
+** ring not applied yet.
+*/
+#include "../vfs/pmem_ship.h"
+#include "../sqlite/sqlite/sqlite3.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WAL_HEADER 32
+#define FRAME_HEADER 24
+
+/* SQLite writes the WAL a header or a page of up to 64KiB at a time */
+#define MAX_RECORD (FRAME_HEADER + 65536)
+
+typedef struct Follower Follower;
+struct Follower {
+  Ship_Ring *ring;
+  const char *primary;
+  sqlite3 *db;                /* replica connection, used for its file */
+  sqlite3_file *file;         /* replica database file */
+  char *wal;                  /* DRAM image of the primary's WAL */
+  uint64_t wal_alloc;
+  uint64_t wal_extent;        /* bytes of wal[] written */
+  uint64_t scan;              /* next frame to look at */
+  uint32_t page_size;
+  uint32_t salt[2];
+  int native_cksum;           /* checksums use the byte order of this machine */
+  uint32_t cksum[2];          /* running checksum up to scan */
+  uint64_t *pending;          /* WAL offsets of the open transaction */
+  int n_pending;
+  int alloc_pending;
+  int lost;                   /* the WAL image can never be scanned further */
+  uint64_t pos;               /* next ring position to read */
+  uint64_t generation;
+  uint64_t txns;              /* transactions applied */
+  uint64_t lag_ns;            /* age of the oldest write of the last batch when applied */
+};
+
+static uint32_t get32(const unsigned char *p){
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v){
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *msg){
+  fprintf(stderr, "pmem_follower: %s\n", msg);
+  exit(1);
+}
+
+/* the WAL checksum of SQLite over n bytes (a multiple of 8), continuing from s */
+static void wal_checksum(int native, const unsigned char *data, uint32_t n, uint32_t s[2]){
+  const uint32_t *a = (const uint32_t*)data;
+  const uint32_t *end = (const uint32_t*)(data + n);
+  uint32_t s1 = s[0];
+  uint32_t s2 = s[1];
+  if(native){
+    do{
+      s1 += *a++ + s2;
+      s2 += *a++ + s1;
+    }while(a < end);
+  }
+  else{
+    do{
+      s1 += __builtin_bswap32(a[0]) + s2;
+      s2 += __builtin_bswap32(a[1]) + s1;
+      a += 2;
+    }while(a < end);
+  }
+  s[0] = s1;
+  s[1] = s2;
+}
+
+static void scan_frames(Follower *f);
+
+static void wal_put(Follower *f, uint64_t offset, const void *data, uint64_t len){
+  if(offset == 0 && len >= WAL_HEADER){
+    /* the old generation may still hold committed frames not scanned yet */
+    scan_frames(f);
+  }
+  if(offset + len > f->wal_alloc){
+    uint64_t n = f->wal_alloc ? f->wal_alloc : 1 << 20;
+    while(n < offset + len){
+      n *= 2;
+    }
+    f->wal = realloc(f->wal, n);
+    if(f->wal == NULL){
+      die("out of memory");
+    }
+    memset(f->wal + f->wal_alloc, 0, n - f->wal_alloc);
+    f->wal_alloc = n;
+  }
+  memcpy(f->wal + offset, data, len);
+  if(offset == 0 && len >= WAL_HEADER){
+    /* a new WAL header starts the next generation of frames */
+    const unsigned char *h = (const unsigned char*)f->wal;
+    f->page_size = get32(h + 8);
+    if(f->page_size == 1){
+      f->page_size = 65536;
+    }
+    f->salt[0] = get32(h + 16);
+    f->salt[1] = get32(h + 20);
+    /* magic 0x377f0682 means little endian checksums, 0x377f0683 big endian */
+    f->native_cksum = (get32(h) & 1) == (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+    f->cksum[0] = get32(h + 24);
+    f->cksum[1] = get32(h + 28);
+    f->scan = WAL_HEADER;
+    f->wal_extent = len;
+    f->n_pending = 0;
+  }
+  else if(offset + len > f->wal_extent){
+    f->wal_extent = offset + len;
+  }
+}
+
+static void replica_write(Follower *f, const void *data, int len, sqlite3_int64 offset){
+  if(f->file->pMethods->xWrite(f->file, data, len, offset) != SQLITE_OK){
+    die("write to the replica failed");
+  }
+}
+
+/* make page 1 of the replica a rollback-mode header with a new counter */
+static void patch_header(Follower *f, uint32_t n_pages){
+  unsigned char page1[100];
+  if(f->file->pMethods->xRead(f->file, page1, sizeof(page1), 0) != SQLITE_OK){
+    return;
+  }
+  uint32_t counter = get32(page1 + 24) + 1;
+  page1[18] = 1;
+  page1[19] = 1;
+  put32(page1 + 24, counter);
+  put32(page1 + 28, n_pages);
+  put32(page1 + 92, counter);
+  replica_write(f, page1, sizeof(page1), 0);
+}
+
+/*
+** True if a commit frame of the current generation starts at or after
+** offset. SQLite rewrites the checksums of its open transaction before it
+** writes the commit frame, so frames before one are final.
+*/
+static int committed_after(Follower *f, uint64_t offset){
+  for(; offset + FRAME_HEADER <= f->wal_extent; offset += FRAME_HEADER + f->page_size){
+    const unsigned char *h = (const unsigned char*)f->wal + offset;
+    if(get32(h + 8) != f->salt[0] || get32(h + 12) != f->salt[1]){
+      return 0;
+    }
+    if(get32(h + 4)){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Apply every complete, committed transaction in the WAL image. Frames are
+** checked like SQLite's recovery does, a frame whose checksum does not
+** match is not written completely yet (or is left from an older
+** generation) and ends the scan until more of the ring arrived. If a
+** commit frame follows it, it never will match: the image is lost and the
+** follower copies the primary again.
+*/
+static void scan_frames(Follower *f){
+  while(f->page_size && f->scan + FRAME_HEADER + f->page_size <= f->wal_extent){
+    const unsigned char *h = (const unsigned char*)f->wal + f->scan;
+    uint32_t cksum[2] = {f->cksum[0], f->cksum[1]};
+    if(get32(h) == 0 || get32(h + 8) != f->salt[0] || get32(h + 12) != f->salt[1]){
+      break;
+    }
+    wal_checksum(f->native_cksum, h, 8, cksum);
+    wal_checksum(f->native_cksum, h + FRAME_HEADER, f->page_size, cksum);
+    if(cksum[0] != get32(h + 16) || cksum[1] != get32(h + 20)){
+      if(committed_after(f, f->scan + FRAME_HEADER + f->page_size)){
+        f->lost = 1;
+      }
+      break;
+    }
+    f->cksum[0] = cksum[0];
+    f->cksum[1] = cksum[1];
+    if(f->n_pending == f->alloc_pending){
+      f->alloc_pending = f->alloc_pending ? 2 * f->alloc_pending : 64;
+      f->pending = realloc(f->pending, f->alloc_pending * sizeof(uint64_t));
+      if(f->pending == NULL){
+        die("out of memory");
+      }
+    }
+    f->pending[f->n_pending++] = f->scan;
+    f->scan += FRAME_HEADER + f->page_size;
+
+    uint32_t commit = get32(h + 4);
+    if(commit){
+      for(int i = 0; i < f->n_pending; i++){
+        const unsigned char *fh = (const unsigned char*)f->wal + f->pending[i];
+        sqlite3_int64 at = (sqlite3_int64)(get32(fh) - 1) * f->page_size;
+        replica_write(f, fh + FRAME_HEADER, f->page_size, at);
+      }
+      f->file->pMethods->xTruncate(f->file, (sqlite3_int64)commit * f->page_size);
+      patch_header(f, commit);
+      f->n_pending = 0;
+      f->txns++;
+    }
+  }
+}
+
+static void lock_replica(Follower *f){
+  if(f->file->pMethods->xLock(f->file, SQLITE_LOCK_SHARED) != SQLITE_OK
+      || f->file->pMethods->xLock(f->file, SQLITE_LOCK_RESERVED) != SQLITE_OK){
+    die("cannot lock the replica");
+  }
+  /* readers finish their transactions, new ones wait for the lock */
+  while(f->file->pMethods->xLock(f->file, SQLITE_LOCK_EXCLUSIVE) == SQLITE_BUSY){
+    usleep(100);
+  }
+}
+
+static void unlock_replica(Follower *f){
+  f->file->pMethods->xSync(f->file, SQLITE_SYNC_NORMAL);
+  f->file->pMethods->xUnlock(f->file, SQLITE_LOCK_NONE);
+}
+
+/* read a whole file, returns its size or -1 */
+static sqlite3_int64 read_file(const char *path, char **out){
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st)){
+    if(fd >= 0){
+      close(fd);
+    }
+    return -1;
+  }
+  *out = malloc(st.st_size ? st.st_size : 1);
+  if(*out == NULL || pread(fd, *out, st.st_size, 0) != st.st_size){
+    die("cannot read the primary");
+  }
+  close(fd);
+  return st.st_size;
+}
+
+/* rebuild the replica from the primary's files, the lock is held */
+static void bootstrap(Follower *f){
+  char wal_path[1024];
+  char *data;
+  sqlite3_int64 n;
+
+  f->pos = __atomic_load_n(&f->ring->head, __ATOMIC_ACQUIRE);
+  f->generation = f->ring->generation;
+  f->lost = 0;
+  f->wal_extent = 0;
+  f->scan = 0;
+  f->page_size = 0;
+  f->n_pending = 0;
+
+  /* the WAL first: whatever it loses to a checkpoint is in the database */
+  snprintf(wal_path, sizeof(wal_path), "%s-wal", f->primary);
+  n = read_file(wal_path, &data);
+  if(n >= WAL_HEADER){
+    wal_put(f, 0, data, n);
+  }
+  if(n >= 0){
+    free(data);
+  }
+
+  n = read_file(f->primary, &data);
+  if(n < 0){
+    die("cannot open the primary database");
+  }
+  if(n >= 100){
+    /* the file is as large as its pmem mapping, the header knows better */
+    sqlite3_int64 pages = get32((unsigned char*)data + 28);
+    uint32_t page_size = (((unsigned char*)data)[16] << 8) | ((unsigned char*)data)[17];
+    if(page_size == 1){
+      page_size = 65536;
+    }
+    if(pages > 0 && pages * page_size < n){
+      n = pages * page_size;
+    }
+    /* page by page, the unix VFS does not take arbitrarily large writes */
+    for(sqlite3_int64 off = 0; off < n; off += page_size){
+      replica_write(f, data + off, n - off < page_size ? n - off : page_size, off);
+    }
+    f->file->pMethods->xTruncate(f->file, n);
+    patch_header(f, n / page_size);
+  }
+  free(data);
+}
+
+/* true if the writer may have overwritten ring bytes from pos on */
+static int lapped(Follower *f){
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&f->ring->reserved, __ATOMIC_RELAXED) - f->pos > f->ring->capacity;
+}
+
+/*
+** Apply everything published up to now. Returns 0 if the ring was lapped
+** or the WAL image is lost, the caller copies the primary again.
+*/
+static int follow(Follower *f){
+  uint64_t head = __atomic_load_n(&f->ring->head, __ATOMIC_ACQUIRE);
+  uint64_t oldest = 0;
+  char *buffer = malloc(MAX_RECORD);
+  int ok = buffer != NULL;
+
+  while(ok && f->pos < head){
+    Ship_Record rec;
+    if(head - f->pos > f->ring->capacity || f->ring->generation != f->generation){
+      ok = 0;
+      break;
+    }
+    pmem_ship_read(f->ring, f->pos, &rec, sizeof(rec));
+    /* a torn header may claim anything, check it before copying */
+    if(rec.len > MAX_RECORD || pmem_ship_record_size(rec.len) > head - f->pos){
+      ok = 0;
+      break;
+    }
+    pmem_ship_read(f->ring, f->pos + sizeof(rec), buffer, rec.len);
+    if(lapped(f)){
+      ok = 0;
+      break;
+    }
+    if(oldest == 0){
+      oldest = rec.ts_ns;
+    }
+    wal_put(f, rec.offset, buffer, rec.len);
+    f->pos += pmem_ship_record_size(rec.len);
+  }
+  free(buffer);
+  if(ok){
+    scan_frames(f);
+  }
+  if(ok && oldest){
+    f->lag_ns = now_ns() - oldest;
+  }
+  return ok && !f->lost;
+}
+
+static int print_row(void *unused, int n, char **values, char **names){
+  for(int i = 0; i < n; i++){
+    printf("%s%s", i ? "|" : "  ", values[i] ? values[i] : "NULL");
+  }
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char **argv){
+  Follower f;
+  const char *query = NULL;
+  int interval_ms = 1000;
+  struct stat st;
+
+  if(argc < 4){
+    fprintf(stderr, "usage: %s RING PRIMARY REPLICA ?--interval MS? ?--query SQL?\n", argv[0]);
+    return 1;
+  }
+  for(int i = 4; i + 1 < argc; i += 2){
+    if(strcmp(argv[i], "--interval") == 0){
+      interval_ms = atoi(argv[i + 1]);
+    }
+    else if(strcmp(argv[i], "--query") == 0){
+      query = argv[i + 1];
+    }
+  }
+  memset(&f, 0, sizeof(f));
+  f.primary = argv[2];
+
+  int fd = shm_open(argv[1], O_RDONLY, 0);
+  if(fd < 0 || fstat(fd, &st) || st.st_size <= PMEM_SHIP_DATA){
+    die("cannot open the ring, is the primary running with ship=RING?");
+  }
+  f.ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(f.ring == MAP_FAILED || f.ring->magic != PMEM_SHIP_MAGIC){
+    die("not a WAL shipping ring");
+  }
+
+  sqlite3_initialize();
+  if(sqlite3_open_v2(argv[3], &f.db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "unix") != SQLITE_OK
+      || sqlite3_file_control(f.db, "main", SQLITE_FCNTL_FILE_POINTER, &f.file) != SQLITE_OK
+      || f.file == NULL || f.file->pMethods == NULL){
+    die("cannot open the replica");
+  }
+
+  sqlite3 *reader = NULL;
+  if(query && sqlite3_open_v2(argv[3], &reader, SQLITE_OPEN_READONLY, "unix") != SQLITE_OK){
+    die("cannot open the replica for queries");
+  }
+
+  lock_replica(&f);
+  bootstrap(&f);
+  while(!follow(&f)){
+    bootstrap(&f);
+  }
+  unlock_replica(&f);
+
+  uint64_t next_report = now_ns();
+  for(;;){
+    uint64_t head = __atomic_load_n(&f.ring->head, __ATOMIC_ACQUIRE);
+    if(head != f.pos || f.ring->generation != f.generation){
+      lock_replica(&f);
+      if(!follow(&f)){
+        fprintf(stderr, "pmem_follower: fell behind the ring, copying the primary\n");
+        do{
+          bootstrap(&f);
+        }while(!follow(&f));
+      }
+      unlock_replica(&f);
+    }
+    else{
+      usleep(1000);
+    }
+
+    uint64_t now = now_ns();
+    if(now >= next_report){
+      head = __atomic_load_n(&f.ring->head, __ATOMIC_ACQUIRE);
+      double lag_ms = f.lag_ns / 1e6;
+      printf("txns %llu  lag %.3f ms  behind %llu bytes\n", (unsigned long long)f.txns,
+             lag_ms, (unsigned long long)(head - f.pos));
+      if(query){
+        sqlite3_exec(reader, query, print_row, NULL, NULL);
+      }
+      fflush(stdout);
+      next_report = now + (uint64_t)interval_ms * 1000000;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,256 @@
+/*
+** Per table and index heatmap of a page access trace.
+**
+**     pmem_heatmap TRACE DATABASE ?--csv?
+**
+** TRACE is written by sqlite3_pmem_trace_dump() (see PMEM_CONFIG_TRACE) of
+** a run against DATABASE. The pages of the trace are mapped to the btree
+** owning them with the dbstat virtual table, and one line is printed per
+** table or index:
+**
+**     pages     size of the btree in pages
+**     touched   percentage of its pages accessed at least once
+**     reads     sampled reads, writes: sampled writes
+**     share     percentage of all sampled accesses of the database
+**     gap_us    mean time between sampled accesses of its pages
+**     heat      the pages of the btree in page number order, squeezed into
+**               HEAT_COLUMNS columns, darker is hotter relative to the
+**               hottest page of the database (log scale)
+**
+** Shares and the relative heat do not depend on the length of a run or its
+** sampling period, which keeps TATP, SSB and Blob runs comparable. --csv
+** prints the same columns without the heat strip as CSV.
+**
+** Trace pages are PMEM_TRACE_PAGE bytes. A database page collects all
+** trace pages it overlaps, with pages smaller than PMEM_TRACE_PAGE every
+** page of a trace page gets its counts.
+*/
+#include "../vfs/pmem_vfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define HEAT_COLUMNS 40
+
+typedef struct Page_Heat Page_Heat;
+struct Page_Heat {
+  u64 reads;
+  u64 writes;
+  double gap_us;
+};
+
+typedef struct Btree Btree;
+struct Btree {
+  char *name;
+  u32 *pages;
+  int n_pages;
+  int alloc;
+  u64 reads;
+  u64 writes;
+  u64 touched;
+  double gap_weighted;    /* sum of gap_us * accesses */
+};
+
+/* the trace of one file as heat per trace page */
+static Page_Heat *load_trace(const char *trace, const char *path, u64 *n_out, int *sample, int *trace_page){
+  FILE *f = fopen(trace, "r");
+  char line[MAXPATHNAME + 64];
+  Page_Heat *heat = NULL;
+  u64 n = 0;
+  int match = 0;
+
+  if(f == NULL){
+    return NULL;
+  }
+  while(fgets(line, sizeof(line), f)){
+    unsigned long long page, reads, writes;
+    double gap;
+    line[strcspn(line, "\n")] = 0;
+    if(sscanf(line, "# pmem heat trace, sample 1/%d, page %d", sample, trace_page) == 2){
+      continue;
+    }
+    if(strncmp(line, "file ", 5) == 0){
+      match = strcmp(line + 5, path) == 0;
+      continue;
+    }
+    if(!match || sscanf(line, "%llu %llu %llu %lf", &page, &reads, &writes, &gap) != 4){
+      continue;
+    }
+    if(page >= n){
+      u64 grow = n ? n : 1024;
+      while(grow <= page){
+        grow *= 2;
+      }
+      heat = realloc(heat, grow * sizeof(Page_Heat));
+      memset(heat + n, 0, (grow - n) * sizeof(Page_Heat));
+      n = grow;
+    }
+    heat[page].reads += reads;
+    heat[page].writes += writes;
+    heat[page].gap_us = gap;
+  }
+  fclose(f);
+  *n_out = n;
+  return heat;
+}
+
+static Btree *btree_get(Btree **all, int *n, int *alloc, const char *name){
+  for(int i = 0; i < *n; i++){
+    if(strcmp((*all)[i].name, name) == 0){
+      return &(*all)[i];
+    }
+  }
+  if(*n == *alloc){
+    *alloc = *alloc ? 2 * *alloc : 16;
+    *all = realloc(*all, *alloc * sizeof(Btree));
+  }
+  Btree *b = &(*all)[(*n)++];
+  memset(b, 0, sizeof(Btree));
+  b->name = strdup(name);
+  return b;
+}
+
+static int cmp_page(const void *a, const void *b){
+  u32 x = *(const u32*)a;
+  u32 y = *(const u32*)b;
+  return x < y ? -1 : x > y;
+}
+
+static int cmp_btree(const void *a, const void *b){
+  const Btree *x = a;
+  const Btree *y = b;
+  u64 ax = x->reads + x->writes;
+  u64 ay = y->reads + y->writes;
+  return ax > ay ? -1 : ax < ay;
+}
+
+int main(int argc, char **argv){
+  static const char shades[] = " .:-=+*#%@";
+  char uri[MAXPATHNAME + 32];
+  char wal[MAXPATHNAME + 8];
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  int sample = 0;
+  int trace_page = PMEM_TRACE_PAGE;
+  int csv = argc == 4 && strcmp(argv[3], "--csv") == 0;
+  u64 n_trace;
+  u64 n_wal;
+
+  if(argc != 3 && !csv){
+    fprintf(stderr, "usage: %s TRACE DATABASE ?--csv?\n", argv[0]);
+    return 1;
+  }
+  Page_Heat *trace = load_trace(argv[1], argv[2], &n_trace, &sample, &trace_page);
+  if(trace == NULL){
+    fprintf(stderr, "no accesses to %s in %s\n", argv[2], argv[1]);
+    return 1;
+  }
+  snprintf(wal, sizeof(wal), "%s-wal", argv[2]);
+  Page_Heat *wal_trace = load_trace(argv[1], wal, &n_wal, &sample, &trace_page);
+
+  sqlite3_initialize();
+  sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
+  snprintf(uri, sizeof(uri), "file:%s", argv[2]);
+  if(sqlite3_open_v2(uri, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, "PMem_VFS")
+      || sqlite3_prepare_v2(db, "SELECT name, pageno FROM dbstat;", -1, &stmt, NULL)){
+    fprintf(stderr, "dbstat of %s: %s\n", argv[2], sqlite3_errmsg(db));
+    return 1;
+  }
+  sqlite3_stmt *ps;
+  int page_size = 4096;
+  if(sqlite3_prepare_v2(db, "PRAGMA page_size;", -1, &ps, NULL) == SQLITE_OK && sqlite3_step(ps) == SQLITE_ROW){
+    page_size = sqlite3_column_int(ps, 0);
+  }
+  sqlite3_finalize(ps);
+
+  Btree *all = NULL;
+  int n_btrees = 0;
+  int alloc = 0;
+  u64 max_page = 0;
+  u64 total = 0;
+  u64 n_db_pages = 0;
+  while(sqlite3_step(stmt) == SQLITE_ROW){
+    Btree *b = btree_get(&all, &n_btrees, &alloc, (const char*)sqlite3_column_text(stmt, 0));
+    if(b->n_pages == b->alloc){
+      b->alloc = b->alloc ? 2 * b->alloc : 64;
+      b->pages = realloc(b->pages, b->alloc * sizeof(u32));
+    }
+    b->pages[b->n_pages++] = sqlite3_column_int64(stmt, 1);
+    n_db_pages++;
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+
+  /* heat of database page pgno, summed over the trace pages it overlaps */
+  #define PAGE_FIRST(pgno) ((u64)((pgno) - 1) * page_size / trace_page)
+  #define PAGE_LAST(pgno) (((u64)(pgno) * page_size - 1) / trace_page)
+  for(int i = 0; i < n_btrees; i++){
+    Btree *b = &all[i];
+    qsort(b->pages, b->n_pages, sizeof(u32), cmp_page);
+    for(int j = 0; j < b->n_pages; j++){
+      u64 acc = 0;
+      for(u64 t = PAGE_FIRST(b->pages[j]); t <= PAGE_LAST(b->pages[j]) && t < n_trace; t++){
+        b->reads += trace[t].reads;
+        b->writes += trace[t].writes;
+        b->gap_weighted += trace[t].gap_us * (trace[t].reads + trace[t].writes);
+        acc += trace[t].reads + trace[t].writes;
+      }
+      b->touched += acc > 0;
+      max_page = acc > max_page ? acc : max_page;
+    }
+    total += b->reads + b->writes;
+  }
+  qsort(all, n_btrees, sizeof(Btree), cmp_btree);
+
+  if(csv){
+    printf("object,pages,touched,reads,writes,share,gap_us\n");
+  }
+  else{
+    printf("# %s on %s: %llu pages of %d bytes, sample 1/%d, %llu sampled accesses\n",
+           argv[1], argv[2], (unsigned long long)n_db_pages, page_size, sample,
+           (unsigned long long)total);
+    printf("%-32s %8s %8s %10s %10s %7s %10s  heat\n",
+           "object", "pages", "touched", "reads", "writes", "share", "gap_us");
+  }
+  for(int i = 0; i < n_btrees; i++){
+    Btree *b = &all[i];
+    u64 acc = b->reads + b->writes;
+    double touched = 100.0 * b->touched / b->n_pages;
+    double share = total ? 100.0 * acc / total : 0;
+    double gap = acc ? b->gap_weighted / acc : 0;
+    if(csv){
+      printf("\"%s\",%d,%.2f,%llu,%llu,%.3f,%.1f\n", b->name, b->n_pages, touched,
+             (unsigned long long)b->reads, (unsigned long long)b->writes, share, gap);
+      continue;
+    }
+    char strip[HEAT_COLUMNS + 1];
+    int columns = b->n_pages < HEAT_COLUMNS ? b->n_pages : HEAT_COLUMNS;
+    for(int c = 0; c < columns; c++){
+      int from = (u64)c * b->n_pages / columns;
+      int to = (u64)(c + 1) * b->n_pages / columns;
+      double sum = 0;
+      for(int j = from; j < to; j++){
+        for(u64 t = PAGE_FIRST(b->pages[j]); t <= PAGE_LAST(b->pages[j]) && t < n_trace; t++){
+          sum += trace[t].reads + trace[t].writes;
+        }
+      }
+      double level = max_page ? log1p(sum / (to - from)) / log1p(max_page) : 0;
+      int shade = sum > 0 ? 1 + (int)(level * (sizeof(shades) - 3)) : 0;
+      strip[c] = shades[shade];
+    }
+    strip[columns] = 0;
+    printf("%-32s %8d %7.1f%% %10llu %10llu %6.2f%% %10.1f  |%s|\n", b->name, b->n_pages, touched,
+           (unsigned long long)b->reads, (unsigned long long)b->writes, share, gap, strip);
+  }
+  if(wal_trace && !csv){
+    u64 reads = 0;
+    u64 writes = 0;
+    for(u64 t = 0; t < n_wal; t++){
+      reads += wal_trace[t].reads;
+      writes += wal_trace[t].writes;
+    }
+    printf("%-32s %8s %8s %10llu %10llu\n", "(wal)", "", "",
+           (unsigned long long)reads, (unsigned long long)writes);
+  }
+  return 0;
+}
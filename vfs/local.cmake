@@ -1,8 +1,28 @@
 set(VFS_FILES
     ${CMAKE_SOURCE_DIR}/vfs/pmem_vfs.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_fcntl.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_probes.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_emulation.h
     ${CMAKE_SOURCE_DIR}/vfs/pmem_vfs.c
     ${CMAKE_SOURCE_DIR}/vfs/pmem_wal_only_vfs.c
     ${CMAKE_SOURCE_DIR}/vfs/pmem_wal_only_vfs.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_tiered_vfs.c
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_tiered_vfs.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_shadow_vfs.c
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_shadow_vfs.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_wb_vfs.c
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_wb_vfs.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_pool_vfs.c
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_pool_vfs.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_hist_vfs.c
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_hist_vfs.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_delta_vfs.c
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_delta_vfs.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_pcache.c
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_pcache.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_defrag.c
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_defrag.h
+    ${CMAKE_SOURCE_DIR}/vfs/pmem_shell.c
     ${CMAKE_SOURCE_DIR}/vfs/test_demovfs.c
     ${CMAKE_SOURCE_DIR}/vfs/test_demovfs.h
 )
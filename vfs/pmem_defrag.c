@@ -0,0 +1,687 @@
+/*
+** Online, incremental defragmentation of the btrees of a database.
+**
+** A btree grown by random inserts has its pages scattered over the file and
+** a range scan reading its leaves in key order jumps from page to page. On
+** pmem every page costs a few XPLine reads wherever it is, but readahead
+** (PMEM_CONFIG_READAHEAD), the XPBuffer and a copy of the database on an
+** SSD all do better with neighbouring pages.
+**
+** A plan walks the btrees, reading only their interior pages, and lays them
+** out one after the other, each with its interior pages first and then its
+** leaves in key order, on the page numbers they already own. Roots stay
+** where sqlite_schema expects them, overflow and free pages are not moved,
+** the file neither grows nor shrinks. The permutation is applied by
+** swapping pages: the images of pages a and b are exchanged, and so are the
+** child pointers to a and b in their parents. Nothing else points to a
+** btree page without auto_vacuum, so a swap writes at most four pages.
+**
+** Each step does a few swaps in one BEGIN IMMEDIATE transaction through the
+** sqlite_dbpage virtual table. The moves are journaled or logged like any
+** other write and are safe next to the application, a crash leaves the
+** database either before or after a step. Moving a page by copying it
+** within the mapping would be cheaper but bypass the pager, its locks and
+** the WAL of every other connection.
+**
+** The plan is made from a snapshot that the application may change between
+** steps. A parent that still points to its child proves little: a freed
+** page keeps its old image, and the child may have been reused by another
+** btree. So before a swap the whole path of each page is checked, from the
+** root down, every page on it still an interior page with the child
+** pointer the plan expects. A page reachable from a live root has exactly
+** one parent, the last one on its path, so the swap is right whatever else
+** changed. Roots are live while the schema cookie is the one the plan saw,
+** a step that finds another one or a broken path drops the plan and the
+** btrees are walked again in the next step.
+*/
+#include "pmem_defrag.h"
+#include <stdlib.h>
+
+#define DEFRAG_ROOT 0
+#define DEFRAG_INTERIOR 1
+#define DEFRAG_LEAF 2
+
+typedef struct Defrag_Btree Defrag_Btree;
+struct Defrag_Btree {
+  char *name;
+  u32 root;
+};
+
+/* a page read by a swap, written back under pgno */
+typedef struct Defrag_Page Defrag_Page;
+struct Defrag_Page {
+  u32 pgno;
+  u8 *data;
+};
+
+struct pmem_defrag {
+  sqlite3 *db;
+  sqlite3_stmt *read;     /* SELECT data FROM sqlite_dbpage */
+  sqlite3_stmt *write;    /* UPDATE sqlite_dbpage */
+  int page_size;
+  char *name;             /* btree to move, NULL for all */
+  Defrag_Btree *btrees;
+  int n_btrees;
+  int done;
+
+  /* the plan, pages are numbered in walk order */
+  int planned;
+  u32 n;                  /* pages of all btrees */
+  u32 alloc;
+  u32 *at;                /* at[k]: page number of page k now */
+  u32 *parent;            /* parent[k]: its parent, for a root itself */
+  u8 *kind;               /* kind[k]: DEFRAG_ROOT, _INTERIOR or _LEAF */
+  int *btree;             /* btree[k]: index into btrees */
+  u32 *target;            /* target[k]: page number it is moved to */
+  u32 *order;             /* pages to move in the order they are placed */
+  u32 n_order;
+  u32 *index;             /* index[pgno]: page at pgno, for pgno a target */
+  u32 placed;             /* order[0..placed) are at their target */
+
+  sqlite3_int64 schema;   /* schema cookie btrees and the plan were made with */
+
+  Defrag_Page pages[4];   /* a, b and their parents */
+  int n_pages;
+  u8 *path;               /* page of a path being checked */
+  pmem_defrag_progress stats;
+};
+
+static u32 defrag_get2(const u8 *a){
+  return ((u32)a[0] << 8) | a[1];
+}
+
+static u32 defrag_get4(const u8 *a){
+  return ((u32)a[0] << 24) | ((u32)a[1] << 16) | ((u32)a[2] << 8) | a[3];
+}
+
+static void defrag_put4(u8 *a, u32 v){
+  a[0] = v >> 24;
+  a[1] = v >> 16;
+  a[2] = v >> 8;
+  a[3] = v;
+}
+
+/* offset of the btree page header, page 1 starts with the database header */
+static int defrag_hdr(u32 pgno){
+  return pgno == 1 ? 100 : 0;
+}
+
+static int defrag_is_interior(const u8 *data, u32 pgno){
+  u8 flags = data[defrag_hdr(pgno)];
+  return flags == 2 || flags == 5;
+}
+
+static u32 defrag_cells(const u8 *data, u32 pgno){
+  return defrag_get2(data + defrag_hdr(pgno) + 3);
+}
+
+/*
+** Location of the i-th child pointer of an interior page, each cell starts
+** with one, i == cells is the right child in the page header. NULL if the
+** cell pointer is out of the page.
+*/
+static u8 *defrag_child(pmem_defrag *p, u8 *data, u32 pgno, u32 i){
+  int hdr = defrag_hdr(pgno);
+  if(i == defrag_cells(data, pgno)){
+    return data + hdr + 8;
+  }
+  u32 ptr = hdr + 12 + 2 * i;
+  if(ptr + 2 > (u32)p->page_size){
+    return NULL;
+  }
+  u32 off = defrag_get2(data + ptr);
+  if(off < hdr + 12 + 2 * i || off + 4 > (u32)p->page_size){
+    return NULL;
+  }
+  return data + off;
+}
+
+/* is pgno an interior page with a child pointer to child */
+static int defrag_refers(pmem_defrag *p, Defrag_Page *pg, u32 child){
+  if(!defrag_is_interior(pg->data, pg->pgno)){
+    return 0;
+  }
+  u32 cells = defrag_cells(pg->data, pg->pgno);
+  for(u32 i = 0; i <= cells; i++){
+    u8 *c = defrag_child(p, pg->data, pg->pgno, i);
+    if(c && defrag_get4(c) == child){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* turn child pointers to a into ones to b and the other way round */
+static void defrag_exchange(pmem_defrag *p, Defrag_Page *pg, u32 a, u32 b){
+  u32 cells = defrag_cells(pg->data, pg->pgno);
+  for(u32 i = 0; i <= cells; i++){
+    u8 *c = defrag_child(p, pg->data, pg->pgno, i);
+    if(c == NULL){
+      continue;
+    }
+    u32 v = defrag_get4(c);
+    if(v == a){
+      defrag_put4(c, b);
+    }else if(v == b){
+      defrag_put4(c, a);
+    }
+  }
+}
+
+static int defrag_read(pmem_defrag *p, u32 pgno, u8 *data){
+  int rc;
+  sqlite3_bind_int64(p->read, 1, pgno);
+  rc = sqlite3_step(p->read);
+  if(rc == SQLITE_ROW){
+    if(sqlite3_column_bytes(p->read, 0) == p->page_size){
+      memcpy(data, sqlite3_column_blob(p->read, 0), p->page_size);
+      rc = SQLITE_OK;
+    }else{
+      rc = SQLITE_CORRUPT;
+    }
+  }else if(rc == SQLITE_DONE){
+    rc = SQLITE_CORRUPT;
+  }
+  sqlite3_reset(p->read);
+  return rc;
+}
+
+/*
+** Is page k still reachable from its root along the path of the plan? Sets
+** *rc and returns 0 if a page cannot be read.
+*/
+static int defrag_reachable(pmem_defrag *p, u32 k, int *rc){
+  for(; p->kind[k] != DEFRAG_ROOT; k = p->parent[k]){
+    Defrag_Page pg = {p->at[p->parent[k]], p->path};
+    *rc = defrag_read(p, pg.pgno, pg.data);
+    if(*rc || !defrag_refers(p, &pg, p->at[k])){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int defrag_write(pmem_defrag *p, u32 pgno, const u8 *data){
+  int rc;
+  sqlite3_bind_int64(p->write, 1, pgno);
+  sqlite3_bind_blob(p->write, 2, data, p->page_size, SQLITE_STATIC);
+  rc = sqlite3_step(p->write);
+  sqlite3_reset(p->write);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/* page pgno read by the current swap, read now if it is not yet */
+static Defrag_Page *defrag_page(pmem_defrag *p, u32 pgno, int *rc){
+  for(int i = 0; i < p->n_pages; i++){
+    if(p->pages[i].pgno == pgno){
+      return &p->pages[i];
+    }
+  }
+  Defrag_Page *pg = &p->pages[p->n_pages];
+  *rc = defrag_read(p, pgno, pg->data);
+  if(*rc){
+    return NULL;
+  }
+  pg->pgno = pgno;
+  p->n_pages++;
+  return pg;
+}
+
+static int defrag_query_int(sqlite3 *db, const char *sql, sqlite3_int64 *v){
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if(rc){
+    return rc;
+  }
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW){
+    *v = sqlite3_column_int64(stmt, 0);
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_ERROR : rc;
+}
+
+static void defrag_drop(pmem_defrag *p){
+  sqlite3_free(p->at);
+  sqlite3_free(p->parent);
+  sqlite3_free(p->kind);
+  sqlite3_free(p->btree);
+  sqlite3_free(p->target);
+  sqlite3_free(p->order);
+  sqlite3_free(p->index);
+  p->at = p->parent = p->target = p->order = p->index = NULL;
+  p->kind = NULL;
+  p->btree = NULL;
+  p->n = p->alloc = p->n_order = p->placed = 0;
+  p->planned = 0;
+}
+
+static int defrag_append(pmem_defrag *p, u32 pgno, u32 parent, int kind, int btree){
+  if(p->n == p->alloc){
+    u32 alloc = p->alloc ? 2 * p->alloc : 256;
+    u32 *at = sqlite3_realloc64(p->at, alloc * sizeof(u32));
+    if(at){
+      p->at = at;
+    }
+    u32 *pa = sqlite3_realloc64(p->parent, alloc * sizeof(u32));
+    if(pa){
+      p->parent = pa;
+    }
+    u8 *kd = sqlite3_realloc64(p->kind, alloc);
+    if(kd){
+      p->kind = kd;
+    }
+    int *bt = sqlite3_realloc64(p->btree, alloc * sizeof(int));
+    if(bt){
+      p->btree = bt;
+    }
+    if(at == NULL || pa == NULL || kd == NULL || bt == NULL){
+      return SQLITE_NOMEM;
+    }
+    p->alloc = alloc;
+  }
+  p->at[p->n] = pgno;
+  p->parent[p->n] = parent;
+  p->kind[p->n] = kind;
+  p->btree[p->n] = btree;
+  p->n++;
+  return SQLITE_OK;
+}
+
+/*
+** Appends the children of the interior page numbered self at depth, each
+** followed by its own subtree. Leaves are at depth height and are not read.
+*/
+static int defrag_walk(pmem_defrag *p, u32 self, int depth, int height, u32 n_db){
+  u8 *data = sqlite3_malloc(p->page_size);
+  u32 pgno = p->at[self];
+  int btree = p->btree[self];
+  int rc;
+  if(data == NULL){
+    return SQLITE_NOMEM;
+  }
+  rc = defrag_read(p, pgno, data);
+  if(rc == SQLITE_OK && !defrag_is_interior(data, pgno)){
+    rc = SQLITE_CORRUPT;
+  }
+  u32 cells = rc ? 0 : defrag_cells(data, pgno);
+  for(u32 i = 0; rc == SQLITE_OK && i <= cells; i++){
+    u8 *c = defrag_child(p, data, pgno, i);
+    u32 child = c ? defrag_get4(c) : 0;
+    if(child < 2 || child > n_db || p->n >= n_db){
+      rc = SQLITE_CORRUPT;
+      break;
+    }
+    u32 k = p->n;
+    rc = defrag_append(p, child, self, depth + 1 == height ? DEFRAG_LEAF : DEFRAG_INTERIOR, btree);
+    if(rc == SQLITE_OK && depth + 1 < height){
+      rc = defrag_walk(p, k, depth + 1, height, n_db);
+    }
+  }
+  sqlite3_free(data);
+  return rc;
+}
+
+static int defrag_cmp_u32(const void *a, const void *b){
+  u32 x = *(const u32*)a;
+  u32 y = *(const u32*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* reads the roots of the btrees to move from sqlite_schema */
+static int defrag_load_btrees(pmem_defrag *p){
+  sqlite3_stmt *stmt;
+  int alloc = 0;
+  for(int i = 0; i < p->n_btrees; i++){
+    sqlite3_free(p->btrees[i].name);
+  }
+  sqlite3_free(p->btrees);
+  p->btrees = NULL;
+  p->n_btrees = 0;
+
+  /* the schema btree on page 1 is left alone */
+  int rc = sqlite3_prepare_v2(p->db, "SELECT name, rootpage FROM main.sqlite_schema"
+                                     " WHERE rootpage > 1 AND (?1 IS NULL OR name = ?1) ORDER BY rootpage;",
+                              -1, &stmt, NULL);
+  if(rc){
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, p->name, -1, SQLITE_STATIC);
+  while((rc = sqlite3_step(stmt)) == SQLITE_ROW){
+    if(p->n_btrees == alloc){
+      alloc = alloc ? 2 * alloc : 16;
+      Defrag_Btree *bt = sqlite3_realloc64(p->btrees, alloc * sizeof(Defrag_Btree));
+      if(bt == NULL){
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      p->btrees = bt;
+    }
+    Defrag_Btree *bt = &p->btrees[p->n_btrees];
+    bt->name = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+    bt->root = sqlite3_column_int64(stmt, 1);
+    if(bt->name == NULL){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    p->n_btrees++;
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/* walks every btree in one read transaction, appending its pages */
+static int defrag_walk_all(pmem_defrag *p){
+  sqlite3_int64 n_db = 0;
+  u8 *data = p->pages[0].data;
+  int rc;
+
+  rc = sqlite3_exec(p->db, "BEGIN;", NULL, NULL, NULL);
+  if(rc){
+    return rc;
+  }
+  rc = defrag_query_int(p->db, "PRAGMA main.page_count;", &n_db);
+  sqlite3_int64 schema = p->schema;
+  if(rc == SQLITE_OK){
+    rc = defrag_query_int(p->db, "PRAGMA main.schema_version;", &schema);
+  }
+  /* tables and indexes were created or dropped since the last plan */
+  if(rc == SQLITE_OK && schema != p->schema){
+    rc = defrag_load_btrees(p);
+    p->schema = schema;
+  }
+  for(int t = 0; t < p->n_btrees && rc == SQLITE_OK; t++){
+    u32 pgno = p->btrees[t].root;
+    int height = 0;
+
+    /* all leaves of a btree are at the same depth */
+    while(rc == SQLITE_OK){
+      rc = defrag_read(p, pgno, data);
+      if(rc || !defrag_is_interior(data, pgno)){
+        break;
+      }
+      u8 *c = defrag_child(p, data, pgno, 0);
+      pgno = c ? defrag_get4(c) : 0;
+      if(++height > 64 || pgno < 2 || pgno > n_db){
+        rc = SQLITE_CORRUPT;
+      }
+    }
+    u32 k = p->n;
+    if(rc == SQLITE_OK){
+      rc = defrag_append(p, p->btrees[t].root, k, DEFRAG_ROOT, t);
+    }
+    if(rc == SQLITE_OK && height > 0){
+      rc = defrag_walk(p, k, 0, height, (u32)n_db);
+    }
+  }
+  if(rc == SQLITE_OK && p->n > 0){
+    p->target = sqlite3_malloc64(p->n * sizeof(u32));
+    p->order = sqlite3_malloc64(p->n * sizeof(u32));
+    p->index = sqlite3_malloc64(((u64)n_db + 1) * sizeof(u32));
+    if(p->target == NULL || p->order == NULL || p->index == NULL){
+      rc = SQLITE_NOMEM;
+    }
+  }
+  sqlite3_exec(p->db, rc ? "ROLLBACK;" : "COMMIT;", NULL, NULL, NULL);
+  return rc;
+}
+
+/* walks the btrees and works out where their pages go */
+static int defrag_plan(pmem_defrag *p){
+  int rc = defrag_walk_all(p);
+  if(rc){
+    defrag_drop(p);
+    return rc;
+  }
+
+  /* per btree, which are contiguous in walk order, interior pages first */
+  for(u32 k = 0; k < p->n;){
+    u32 end = k + 1;
+    while(end < p->n && p->kind[end] != DEFRAG_ROOT){
+      end++;
+    }
+    for(u32 i = k; i < end; i++){
+      if(p->kind[i] == DEFRAG_INTERIOR){
+        p->order[p->n_order++] = i;
+      }
+    }
+    for(u32 i = k; i < end; i++){
+      if(p->kind[i] == DEFRAG_LEAF){
+        p->order[p->n_order++] = i;
+      }
+    }
+    k = end;
+  }
+
+  /* the page numbers of all pages but the roots, in ascending order */
+  u32 *sorted = sqlite3_malloc64((p->n_order + 1) * sizeof(u32));
+  if(sorted == NULL){
+    defrag_drop(p);
+    return SQLITE_NOMEM;
+  }
+  for(u32 i = 0; i < p->n_order; i++){
+    sorted[i] = p->at[p->order[i]];
+  }
+  qsort(sorted, p->n_order, sizeof(u32), defrag_cmp_u32);
+  for(u32 k = 0; k < p->n; k++){
+    p->target[k] = p->at[k];
+    p->index[p->at[k]] = k;
+  }
+  for(u32 i = 0; i < p->n_order; i++){
+    p->target[p->order[i]] = sorted[i];
+  }
+  sqlite3_free(sorted);
+  p->planned = 1;
+  return SQLITE_OK;
+}
+
+static void defrag_skip(pmem_defrag *p){
+  while(p->placed < p->n_order && p->at[p->order[p->placed]] == p->target[p->order[p->placed]]){
+    p->placed++;
+  }
+}
+
+/*
+** Moves the next page to its target by swapping it with the page there.
+** Returns SQLITE_ABORT if either page is no longer where the plan has it.
+*/
+static int defrag_swap(pmem_defrag *p){
+  u32 k = p->order[p->placed];
+  u32 b = p->target[k];
+  u32 j = p->index[b];
+  u32 a = p->at[k];
+  u32 pa = p->at[p->parent[k]];
+  u32 pb = p->at[p->parent[j]];
+  Defrag_Page *pg_a, *pg_b, *pg_pa, *pg_pb;
+  int rc = SQLITE_OK;
+
+  if(!defrag_reachable(p, k, &rc) || !defrag_reachable(p, j, &rc)){
+    return rc ? rc : SQLITE_ABORT;
+  }
+  p->n_pages = 0;
+  if((pg_a = defrag_page(p, a, &rc)) == NULL || (pg_b = defrag_page(p, b, &rc)) == NULL
+      || (pg_pa = defrag_page(p, pa, &rc)) == NULL || (pg_pb = defrag_page(p, pb, &rc)) == NULL){
+    return rc;
+  }
+  /* if b is the parent of a its image is fixed up before it moves */
+  defrag_exchange(p, pg_pa, a, b);
+  if(pg_pb != pg_pa){
+    defrag_exchange(p, pg_pb, a, b);
+  }
+  pg_a->pgno = b;
+  pg_b->pgno = a;
+  for(int i = 0; i < p->n_pages && rc == SQLITE_OK; i++){
+    rc = defrag_write(p, p->pages[i].pgno, p->pages[i].data);
+  }
+  if(rc){
+    return rc;
+  }
+  p->at[k] = b;
+  p->at[j] = a;
+  p->index[b] = k;
+  p->index[a] = j;
+  p->stats.swaps++;
+  p->stats.pages_written += p->n_pages;
+  return SQLITE_OK;
+}
+
+int sqlite3_pmem_defrag_step(pmem_defrag *p, int n_swaps){
+  int rc;
+  if(p->done){
+    return SQLITE_DONE;
+  }
+  if(!sqlite3_get_autocommit(p->db)){
+    p->stats.busy++;
+    return SQLITE_BUSY;
+  }
+  if(!p->planned){
+    rc = defrag_plan(p);
+    if(rc == SQLITE_BUSY){
+      p->stats.busy++;
+    }
+    return rc;
+  }
+  defrag_skip(p);
+  if(p->placed == p->n_order){
+    defrag_drop(p);
+    p->done = 1;
+    return SQLITE_DONE;
+  }
+
+  rc = sqlite3_exec(p->db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+  if(rc){
+    if(rc == SQLITE_BUSY){
+      p->stats.busy++;
+    }
+    return rc;
+  }
+  /* a dropped btree may have left its root to another one */
+  sqlite3_int64 schema = 0;
+  rc = defrag_query_int(p->db, "PRAGMA main.schema_version;", &schema);
+  if(rc == SQLITE_OK && schema != p->schema){
+    rc = SQLITE_ABORT;
+  }
+  for(int i = 0; i < n_swaps && p->placed < p->n_order && rc == SQLITE_OK; i++){
+    rc = defrag_swap(p);
+    defrag_skip(p);
+  }
+  if(rc == SQLITE_OK || rc == SQLITE_ABORT){
+    int rc2 = sqlite3_exec(p->db, "COMMIT;", NULL, NULL, NULL);
+    if(rc2 == SQLITE_OK){
+      if(rc == SQLITE_ABORT){
+        defrag_drop(p);
+        p->stats.replans++;
+      }
+      p->stats.transactions++;
+      /*
+      ** The btree layer of db keeps decoded headers of cached pages that
+      ** sqlite_dbpage does not reset, drop the clean pages of the cache.
+      */
+      sqlite3_db_release_memory(p->db);
+      return SQLITE_OK;
+    }
+    rc = rc2;
+  }
+  /* the moves of this step are undone, the plan no longer matches the file */
+  sqlite3_exec(p->db, "ROLLBACK;", NULL, NULL, NULL);
+  defrag_drop(p);
+  if(rc == SQLITE_BUSY){
+    p->stats.busy++;
+  }
+  return rc;
+}
+
+int sqlite3_pmem_defrag_init(sqlite3 *db, const char *name, pmem_defrag **out){
+  pmem_defrag *p;
+  sqlite3_int64 v = 0;
+  int rc;
+
+  *out = NULL;
+  rc = defrag_query_int(db, "PRAGMA main.auto_vacuum;", &v);
+  if(rc){
+    return rc;
+  }
+  if(v != 0){
+    return SQLITE_MISUSE;
+  }
+  p = sqlite3_malloc(sizeof(*p));
+  if(p == NULL){
+    return SQLITE_NOMEM;
+  }
+  memset(p, 0, sizeof(*p));
+  p->db = db;
+  rc = defrag_query_int(db, "PRAGMA main.page_size;", &v);
+  p->page_size = (int)v;
+  if(rc == SQLITE_OK){
+    rc = sqlite3_prepare_v2(db, "SELECT data FROM main.sqlite_dbpage WHERE pgno=?1;", -1, &p->read, NULL);
+  }
+  if(rc == SQLITE_OK){
+    rc = sqlite3_prepare_v2(db, "UPDATE main.sqlite_dbpage SET data=?2 WHERE pgno=?1;", -1, &p->write, NULL);
+  }
+  for(int i = 0; i < 4 && rc == SQLITE_OK; i++){
+    p->pages[i].data = sqlite3_malloc(p->page_size);
+    if(p->pages[i].data == NULL){
+      rc = SQLITE_NOMEM;
+    }
+  }
+  if(rc == SQLITE_OK){
+    p->path = sqlite3_malloc(p->page_size);
+    if(p->path == NULL){
+      rc = SQLITE_NOMEM;
+    }
+  }
+
+  if(rc == SQLITE_OK && name){
+    p->name = sqlite3_mprintf("%s", name);
+    if(p->name == NULL){
+      rc = SQLITE_NOMEM;
+    }
+  }
+  if(rc == SQLITE_OK){
+    rc = defrag_query_int(db, "PRAGMA main.schema_version;", &p->schema);
+  }
+  if(rc == SQLITE_OK){
+    rc = defrag_load_btrees(p);
+  }
+  if(rc == SQLITE_OK && name && p->n_btrees == 0){
+    rc = SQLITE_NOTFOUND;
+  }
+  if(rc){
+    sqlite3_pmem_defrag_finish(p);
+    return rc;
+  }
+  *out = p;
+  return SQLITE_OK;
+}
+
+void sqlite3_pmem_defrag_progress(pmem_defrag *p, pmem_defrag_progress *out){
+  *out = p->stats;
+  out->btree = p->done ? p->n_btrees : 0;
+  if(p->placed < p->n_order){
+    out->btree = p->btree[p->order[p->placed]];
+  }
+  out->n_btrees = p->n_btrees;
+  out->name = out->btree < p->n_btrees ? p->btrees[out->btree].name : NULL;
+  out->placed = p->placed;
+  out->pages = p->n_order;
+}
+
+void sqlite3_pmem_defrag_finish(pmem_defrag *p){
+  if(p == NULL){
+    return;
+  }
+  defrag_drop(p);
+  sqlite3_finalize(p->read);
+  sqlite3_finalize(p->write);
+  for(int i = 0; i < 4; i++){
+    sqlite3_free(p->pages[i].data);
+  }
+  sqlite3_free(p->path);
+  sqlite3_free(p->name);
+  for(int i = 0; i < p->n_btrees; i++){
+    sqlite3_free(p->btrees[i].name);
+  }
+  sqlite3_free(p->btrees);
+  sqlite3_free(p);
+}
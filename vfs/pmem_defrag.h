@@ -0,0 +1,62 @@
+#ifndef PMEM_DEFRAG_H
+#define PMEM_DEFRAG_H
+#include "pmem_vfs.h"
+
+typedef struct pmem_defrag pmem_defrag;
+
+/*
+** Progress of a defragmentation, see sqlite3_pmem_defrag_progress(). The
+** counters cover the whole run, placed and pages the current plan.
+*/
+typedef struct pmem_defrag_progress pmem_defrag_progress;
+struct pmem_defrag_progress {
+  u64 swaps;              /* pairs of pages exchanged */
+  u64 pages_written;      /* pages written, swapped pages and their parents */
+  u64 transactions;       /* steps that committed page moves */
+  u64 busy;               /* steps that found the database locked */
+  u64 replans;            /* plans dropped because a btree changed under them */
+  int btree;              /* btree being moved, counting from 0 */
+  int n_btrees;           /* btrees to move */
+  const char *name;       /* its table or index, NULL when done */
+  u32 placed;             /* pages at their place */
+  u32 pages;              /* pages of all btrees but their roots */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Prepares the online defragmentation of the table or index name of the
+** main database of db, of all tables and indexes if name is NULL. The pages
+** of the btrees are moved to the page numbers they already own such that
+** each btree is laid out as its interior pages followed by its leaves in
+** key order, the file neither grows nor shrinks. Roots, overflow and free
+** pages stay where they are. Needs the sqlite_dbpage virtual table
+** (SQLITE_ENABLE_DBPAGE_VTAB). Returns SQLITE_MISUSE for auto_vacuum
+** databases, whose pointer map would have to follow every move, and
+** SQLITE_NOTFOUND if there is no btree name.
+*/
+int sqlite3_pmem_defrag_init(sqlite3 *db, const char *name, pmem_defrag **out);
+
+/*
+** Moves up to n_swaps pairs of pages in one write transaction. Returns
+** SQLITE_OK while pages are left to move, SQLITE_DONE once every btree is
+** in order and SQLITE_BUSY, having done nothing, if db is inside a
+** transaction or the database is locked. Planning reads the interior
+** pages of all btrees in a step of its own, and is redone when the
+** application changed a page on the path from a root to a page a swap
+** moves, or created or dropped a table or index.
+*/
+int sqlite3_pmem_defrag_step(pmem_defrag *p, int n_swaps);
+
+void sqlite3_pmem_defrag_progress(pmem_defrag *p, pmem_defrag_progress *out);
+
+/* frees p, db stays open */
+void sqlite3_pmem_defrag_finish(pmem_defrag *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PMEM_DEFRAG_H
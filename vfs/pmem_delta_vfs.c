@@ -0,0 +1,1127 @@
+/*
+** This file implements a shim VFS that makes WAL files durable with a
+** sub-page redo log on pmem.
+**
+** OVERVIEW
+**
+**   sqlite3_pmem_delta_vfs("NAME", 0) creates the VFS "NAME+delta" on top
+**   of the registered VFS NAME. Main databases, journals and temp files
+**   are files of NAME. A WAL file is a file of NAME too, the image, but
+**   every write to it is also appended to a delta log on pmem and xSync()
+**   makes the log durable instead of the image. The image is only synced
+**   when the log is full and at the last close.
+**
+**   A small update changes a few bytes of a page, yet SQLite writes the
+**   whole page as the next WAL frame. The shim knows the page of every
+**   frame from its header and remembers the newest frame of each page.
+**   When a page is written again it reads that frame back from the image,
+**   the pre-image, and logs only the PMEM_DELTA_LINE byte lines that
+**   differ, a bitmap of them and the 24 byte frame header in one record:
+**
+**        Delta_Record  [frame header]  bitmap  changed lines
+**
+**   The first frame of a page in a generation has no pre-image in the log,
+**   its lines that are not zero are logged. Records are written with
+**   non-temporal stores and fenced at xSync(), WAL headers, checksum
+**   rewrites and any other write become RAW records of the bytes written.
+**   "NAME+fullpage" (full_pages set) logs every line of every frame, the
+**   page granular baseline with the same recovery.
+**
+**   Records carry the generation of the log. A new WAL header means
+**   SQLite restarted the WAL after a complete checkpoint, the old frames
+**   are dead and a new generation starts at the front of the log; so does
+**   a full log after a sync of the image. The generation and the image
+**   size that is durable without records are persisted with a fence
+**   before the first record of a generation is written.
+**
+**   The first open of a WAL in a process replays the valid records of the
+**   current generation in order onto the image: RAW records as they are,
+**   page records as their pre-image (zeros without one) with the logged
+**   lines patched in, which rebuilds every frame exactly as written. The
+**   image is cut back to what was logged and synced, and SQLite's own WAL
+**   recovery and checkpoints read the rebuilt frames. Another process
+**   opening the same log gets SQLITE_BUSY. A log is tied to the device and
+**   inode of its WAL file; one that still has records of another file is
+**   not opened, SQLITE_CANTOPEN.
+**
+** URI PARAMETERS
+**
+**     delta_file=PATH    location of the delta log
+**                        (default PMEM_DELTA_DIR/<WAL name>-<hash>-delta,
+**                        hash of the full path of the WAL)
+**     delta_size=N       size of a newly created delta log in bytes
+*/
+
+#if !defined(SQLITE_TEST) || SQLITE_OS_UNIX
+
+#include "pmem_delta_vfs.h"
+#include "pmem_emulation.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* "PMHPDLTA" */
+#define DELTA_MAGIC 0x41544c4450484d50ULL
+
+/* number of shims that can be created */
+#define DELTA_MAX_VFS 8
+
+/* offset of the first record, the header has the cache lines before */
+#define DELTA_DATA 256
+
+/* smallest log, a record of the largest page has to fit many times */
+#define DELTA_MIN_SIZE (4 * 1024 * 1024)
+
+/* largest page, and largest RAW record, bigger writes are split */
+#define DELTA_MAX_PAGE 65536
+
+#define DELTA_WAL_HDR 32
+#define DELTA_FRAME_HDR 24
+
+/* record types */
+#define DELTA_RAW 1
+#define DELTA_PAGE 2
+#define DELTA_TRUNCATE 3
+
+/* record flags */
+#define DELTA_F_HEADER 1        /* a page record that starts with its frame header */
+
+/*
+** Header at offset 0 of the log file.
+*/
+typedef struct Delta_Header Delta_Header;
+struct Delta_Header {
+  u64 magic;              /* DELTA_MAGIC once the header is valid */
+  u64 size;               /* of the log file */
+  u64 gen;                /* generation of the valid records */
+  u64 image_ino;          /* inode of the WAL file the records belong to */
+  u64 image_dev;          /* and its device */
+  u64 base[2];            /* durable image size at the start of a gen, by gen & 1 */
+};
+
+/*
+** A record, followed by its payload, 8 byte aligned. check covers all
+** of it after the check itself.
+*/
+typedef struct Delta_Record Delta_Record;
+struct Delta_Record {
+  u64 check;
+  u32 len;                /* bytes including this header */
+  u16 type;               /* DELTA_RAW, DELTA_PAGE or DELTA_TRUNCATE */
+  u16 flags;
+  u64 gen;
+  u64 offset;             /* in the image: of the data, the page or the new size */
+  u64 base;               /* page records: offset + 1 of the pre-image, 0 for zeros */
+  u32 size;               /* bytes of data, the page size for page records */
+  u32 n_lines;            /* lines logged by a page record */
+};
+
+/*
+** The log of one WAL file, shared by all handles of the process that have
+** it open.
+*/
+typedef struct Delta_Log Delta_Log;
+struct Delta_Log {
+  Delta_Log *next;        /* list of open logs */
+  int refs;               /* handles using the log */
+  char image[MAXPATHNAME+1];
+  char path[MAXPATHNAME+1];
+  int lock_fd;            /* holds the flock() of the log file */
+  char *file;             /* the mapped log file */
+  size_t size;
+  int is_pmem;
+  Delta_Header *hdr;
+  u64 gen;
+  u64 ino;                /* identity of the WAL file */
+  u64 dev;
+  u64 head;               /* offset of the next record */
+  u64 synced;             /* head at the last sync */
+  int full_pages;         /* log every line, no pre-images */
+  u32 page_size;          /* of the WAL, 0 while unknown */
+  u32 *frame_pgno;        /* page of each frame written in this generation */
+  u32 n_frames;           /* frames in frame_pgno, the rest are unknown */
+  u32 n_frame_alloc;
+  u32 *page_frame;        /* frame + 1 of the newest frame of each page */
+  u32 n_page_alloc;
+  u8 pending[DELTA_FRAME_HDR];  /* frame header waiting for its page */
+  sqlite3_int64 pending_offset;
+  int has_pending;
+  u8 last_commit[8];      /* page and size of the last commit frame */
+  u32 last_commit_frame;  /* its frame + 1, 0 after a sync */
+  char *scratch;          /* the record being built */
+  char *pre;              /* a pre-image */
+  pthread_mutex_t mutex;  /* guards the log against the other handles */
+};
+
+typedef struct Delta_Vfs Delta_Vfs;
+struct Delta_Vfs {
+  sqlite3_vfs base;
+  sqlite3_vfs *root;          /* the VFS of all files and the image */
+  char name[64];
+  int full_pages;
+};
+
+/*
+** The handle of a WAL file. The file of root is placed directly behind
+** it, other files are files of root only.
+*/
+typedef struct Delta_File Delta_File;
+struct Delta_File {
+  sqlite3_file base;
+  Delta_Log *log;
+  sqlite3_file *real;         /* the image */
+};
+
+static struct {
+  pthread_mutex_t mutex;      /* guards everything below but the stats */
+  Delta_Vfs vfs[DELTA_MAX_VFS];
+  int n_vfs;
+  Delta_Log *logs;
+  pmem_delta_stats stats;     /* relaxed atomics */
+} delta = { PTHREAD_MUTEX_INITIALIZER };
+
+#define DELTA_STAT(field, n) __atomic_fetch_add(&delta.stats.field, (n), __ATOMIC_RELAXED)
+
+static u32 delta_get4(const u8 *p){
+  return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static u32 delta_bitmap_words(u32 page_size){
+  return (page_size / PMEM_DELTA_LINE + 63) / 64;
+}
+
+static u64 delta_check(const Delta_Record *r){
+  const u64 *w = (const u64*)r + 1;
+  u64 h = 0xcbf29ce484222325ULL;
+  for(u32 i = 0; i < (r->len - sizeof(u64)) / sizeof(u64); i++){
+    h = (h ^ w[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/*
+** Persist a range of the header, pmem_msync() on mappings that are not
+** pmem.
+*/
+static int delta_persist(Delta_Log *l, const void *addr, size_t len){
+  if(l->is_pmem){
+    pmem_emu_persist(addr, len);
+    return SQLITE_OK;
+  }
+  return pmem_msync(addr, len) ? SQLITE_IOERR_FSYNC : SQLITE_OK;
+}
+
+/*
+** Make the records appended since the last sync durable. They were
+** written with non-temporal stores, a fence is all they need on pmem.
+*/
+static int delta_log_sync(Delta_Log *l){
+  if(l->head > l->synced){
+    if(l->is_pmem){
+      pmem_emu_drain();
+    }
+    else if(pmem_msync(l->file + l->synced, l->head - l->synced)){
+      return SQLITE_IOERR_FSYNC;
+    }
+  }
+  l->synced = l->head;
+  return SQLITE_OK;
+}
+
+/*
+** Start a new generation whose records apply to an image of which the
+** first image_size bytes are durable. The records of the old generation
+** are void once the new one is.
+*/
+static int delta_new_gen(Delta_Log *l, u64 image_size){
+  Delta_Header *h = l->hdr;
+  u64 gen = l->gen + 1;
+  h->base[gen & 1] = image_size;
+  h->image_ino = l->ino;
+  h->image_dev = l->dev;
+  int rc = delta_persist(l, &h->image_ino, 4 * sizeof(u64));
+  if(rc == SQLITE_OK){
+    h->gen = gen;
+    rc = delta_persist(l, &h->gen, sizeof(u64));
+  }
+  if(rc){
+    return rc;
+  }
+  l->gen = gen;
+  l->head = l->synced = DELTA_DATA;
+  l->n_frames = 0;
+  l->last_commit_frame = 0;
+  DELTA_STAT(log_resets, 1);
+  return SQLITE_OK;
+}
+
+/*
+** Sync the image so that the log can start over, for a full log and at
+** the last close.
+*/
+static int delta_checkpoint_image(Delta_File *p){
+  sqlite3_int64 size;
+  int rc = p->real->pMethods->xSync(p->real, SQLITE_SYNC_NORMAL);
+  if(rc == SQLITE_OK){
+    rc = p->real->pMethods->xFileSize(p->real, &size);
+  }
+  if(rc == SQLITE_OK){
+    DELTA_STAT(image_syncs, 1);
+    rc = delta_new_gen(p->log, size);
+  }
+  return rc;
+}
+
+/*
+** Append the record of len bytes built in scratch at the head of the log.
+** Returns SQLITE_FULL if it does not fit.
+*/
+static int delta_append(Delta_Log *l, u32 len){
+  Delta_Record *r = (Delta_Record*)l->scratch;
+  if(l->head + len > l->size){
+    return SQLITE_FULL;
+  }
+  r->len = len;
+  r->gen = l->gen;
+  r->check = delta_check(r);
+  char *dst = l->file + l->head;
+  if(l->is_pmem){
+    pmem_memcpy(dst, r, len, PMEM_F_MEM_NONTEMPORAL | PMEM_F_MEM_NODRAIN);
+    pmem_emu_media(dst, len);
+  }
+  else{
+    memcpy(dst, r, len);
+  }
+  l->head += len;
+  DELTA_STAT(bytes_logged, len);
+  return SQLITE_OK;
+}
+
+/*
+** Log a RAW or TRUNCATE record. A full log syncs the image and starts a
+** new generation first.
+*/
+static int delta_log_raw(Delta_File *p, int type, const void *buffer, u32 amount, sqlite3_int64 offset){
+  Delta_Log *l = p->log;
+  Delta_Record *r = (Delta_Record*)l->scratch;
+  memset(r, 0, sizeof(Delta_Record));
+  r->type = type;
+  r->offset = offset;
+  r->size = amount;
+  memcpy(&r[1], buffer, amount);
+  u32 len = (sizeof(Delta_Record) + amount + 7) & ~7u;
+  memset((char*)&r[1] + amount, 0, len - sizeof(Delta_Record) - amount);
+  int rc = delta_append(l, len);
+  if(rc == SQLITE_FULL){
+    rc = delta_checkpoint_image(p);
+    if(rc == SQLITE_OK){
+      rc = delta_append(l, len);
+    }
+  }
+  return rc;
+}
+
+static int delta_log_write(Delta_File *p, const void *buffer, int amount, sqlite3_int64 offset){
+  const char *b = (const char*)buffer;
+  int rc = SQLITE_OK;
+  while(amount > 0 && rc == SQLITE_OK){
+    int n = amount < DELTA_MAX_PAGE ? amount : DELTA_MAX_PAGE;
+    rc = delta_log_raw(p, DELTA_RAW, b, n, offset);
+    b += n;
+    offset += n;
+    amount -= n;
+  }
+  return rc;
+}
+
+/* a frame header not followed by its page, e.g. a rewritten checksum */
+static int delta_flush_pending(Delta_File *p){
+  Delta_Log *l = p->log;
+  if(!l->has_pending){
+    return SQLITE_OK;
+  }
+  l->has_pending = 0;
+  return delta_log_write(p, l->pending, DELTA_FRAME_HDR, l->pending_offset);
+}
+
+static int delta_grow(u32 **a, u32 *n_alloc, u64 need){
+  if(need <= *n_alloc){
+    return SQLITE_OK;
+  }
+  u64 n = *n_alloc ? *n_alloc : 1024;
+  while(n < need){
+    n *= 2;
+  }
+  if(n > 0xffffffffULL){
+    return SQLITE_FULL;
+  }
+  u32 *grown = realloc(*a, n * sizeof(u32));
+  if(grown == 0){
+    return SQLITE_NOMEM;
+  }
+  memset(&grown[*n_alloc], 0, (n - *n_alloc) * sizeof(u32));
+  *a = grown;
+  *n_alloc = n;
+  return SQLITE_OK;
+}
+
+/* remember that frame now holds pgno */
+static int delta_map(Delta_Log *l, u32 frame, u32 pgno){
+  int rc = delta_grow(&l->frame_pgno, &l->n_frame_alloc, (u64)frame + 1);
+  if(rc == SQLITE_OK){
+    rc = delta_grow(&l->page_frame, &l->n_page_alloc, (u64)pgno + 1);
+  }
+  if(rc){
+    return rc;
+  }
+  if(frame >= l->n_frames){
+    memset(&l->frame_pgno[l->n_frames], 0, (frame - l->n_frames) * sizeof(u32));
+    l->n_frames = frame + 1;
+  }
+  l->frame_pgno[frame] = pgno;
+  l->page_frame[pgno] = frame + 1;
+  return SQLITE_OK;
+}
+
+/* frame + 1 of the newest frame of pgno written in this generation, or 0 */
+static u32 delta_pre_image(Delta_Log *l, u32 pgno){
+  u32 f = pgno < l->n_page_alloc ? l->page_frame[pgno] : 0;
+  if(f == 0 || f - 1 >= l->n_frames || l->frame_pgno[f - 1] != pgno){
+    return 0;
+  }
+  return f;
+}
+
+static sqlite3_int64 delta_page_offset(Delta_Log *l, u32 frame){
+  return DELTA_WAL_HDR + (sqlite3_int64)frame * (l->page_size + DELTA_FRAME_HDR) + DELTA_FRAME_HDR;
+}
+
+/*
+** Build the page record of a frame in scratch, with the lines of page
+** that differ from the pre-image. Returns its length in *len.
+*/
+static int delta_build_page(Delta_File *p, const u8 *page, u32 pgno, int with_header,
+                            sqlite3_int64 offset, u32 *len){
+  Delta_Log *l = p->log;
+  u32 ps = l->page_size;
+  u32 base = l->full_pages ? 0 : delta_pre_image(l, pgno);
+  Delta_Record *r = (Delta_Record*)l->scratch;
+  memset(r, 0, sizeof(Delta_Record));
+  r->type = DELTA_PAGE;
+  r->offset = offset;
+  r->size = ps;
+  char *q = (char*)&r[1];
+  if(with_header){
+    r->flags = DELTA_F_HEADER;
+    memcpy(q, l->pending, DELTA_FRAME_HDR);
+    q += DELTA_FRAME_HDR;
+  }
+  u64 *bitmap = (u64*)q;
+  memset(bitmap, 0, delta_bitmap_words(ps) * sizeof(u64));
+  q += delta_bitmap_words(ps) * sizeof(u64);
+
+  const u8 *pre = 0;
+  if(base){
+    sqlite3_int64 base_offset = delta_page_offset(l, base - 1);
+    int rc = p->real->pMethods->xRead(p->real, l->pre, ps, base_offset);
+    if(rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ){
+      return rc;
+    }
+    r->base = base_offset + 1;
+    pre = (const u8*)l->pre;
+  }
+  static const u8 zeros[PMEM_DELTA_LINE];
+  for(u32 i = 0; i < ps / PMEM_DELTA_LINE; i++){
+    const u8 *line = page + (size_t)i * PMEM_DELTA_LINE;
+    const u8 *old = pre ? pre + (size_t)i * PMEM_DELTA_LINE : zeros;
+    if(l->full_pages || memcmp(line, old, PMEM_DELTA_LINE)){
+      bitmap[i / 64] |= 1ULL << (i % 64);
+      memcpy(q, line, PMEM_DELTA_LINE);
+      q += PMEM_DELTA_LINE;
+      r->n_lines++;
+    }
+  }
+  *len = q - l->scratch;
+  return SQLITE_OK;
+}
+
+/*
+** Log the page of a frame as a page record. Its frame header is pending
+** unless SQLite overwrites the page of a frame in place.
+*/
+static int delta_log_page(Delta_File *p, const u8 *page, u32 frame, sqlite3_int64 offset){
+  Delta_Log *l = p->log;
+  int with_header = l->has_pending && l->pending_offset == offset - DELTA_FRAME_HDR;
+  u32 pgno = with_header ? delta_get4(l->pending)
+                         : frame < l->n_frames ? l->frame_pgno[frame] : 0;
+  int rc;
+  if(pgno == 0){
+    rc = delta_flush_pending(p);
+    return rc ? rc : delta_log_write(p, page, l->page_size, offset);
+  }
+
+  u32 len;
+  rc = delta_build_page(p, page, pgno, with_header, offset, &len);
+  if(rc == SQLITE_OK){
+    rc = delta_append(l, len);
+  }
+  if(rc == SQLITE_FULL){
+    /* the pre-image is gone with the generation */
+    rc = delta_checkpoint_image(p);
+    if(rc == SQLITE_OK){
+      rc = delta_build_page(p, page, pgno, with_header, offset, &len);
+    }
+    if(rc == SQLITE_OK){
+      rc = delta_append(l, len);
+    }
+  }
+  if(rc){
+    return rc;
+  }
+  Delta_Record *r = (Delta_Record*)l->scratch;
+  DELTA_STAT(frames, 1);
+  DELTA_STAT(full_frames, r->base == 0);
+  DELTA_STAT(lines, r->n_lines);
+  if(with_header){
+    l->has_pending = 0;
+    if(delta_get4(&l->pending[4])){
+      /* sector padding repeats the commit frame before the sync */
+      if(l->last_commit_frame != frame || memcmp(l->last_commit, l->pending, 8)){
+        DELTA_STAT(commits, 1);
+      }
+      memcpy(l->last_commit, l->pending, 8);
+      l->last_commit_frame = frame + 1;
+    }
+  }
+  return delta_map(l, frame, pgno);
+}
+
+/* the page size of the WAL from its header, 0 if it has none yet */
+static u32 delta_header_page_size(const u8 *hdr){
+  u32 ps = delta_get4(&hdr[8]);
+  if(ps < 512 || ps > DELTA_MAX_PAGE || (ps & (ps - 1))){
+    return 0;
+  }
+  return ps;
+}
+
+static int delta_log_io(Delta_File *p, const void *buffer, int amount, sqlite3_int64 offset){
+  Delta_Log *l = p->log;
+  int rc;
+  DELTA_STAT(bytes_submitted, amount);
+
+  if(offset == 0 && amount >= DELTA_WAL_HDR){
+    /* a new WAL header, SQLite restarts the WAL after a full checkpoint */
+    rc = delta_flush_pending(p);
+    if(rc == SQLITE_OK){
+      rc = delta_new_gen(l, 0);
+    }
+    if(rc == SQLITE_OK){
+      l->page_size = delta_header_page_size(buffer);
+      rc = delta_log_write(p, buffer, amount, offset);
+    }
+    return rc;
+  }
+
+  u32 ps = l->page_size;
+  if(ps && offset >= DELTA_WAL_HDR){
+    sqlite3_int64 frame = (offset - DELTA_WAL_HDR) / (ps + DELTA_FRAME_HDR);
+    sqlite3_int64 in_frame = (offset - DELTA_WAL_HDR) % (ps + DELTA_FRAME_HDR);
+    if(frame < 0xffffffffLL && amount == DELTA_FRAME_HDR && in_frame == 0){
+      /* logged together with its page */
+      rc = delta_flush_pending(p);
+      memcpy(l->pending, buffer, DELTA_FRAME_HDR);
+      l->pending_offset = offset;
+      l->has_pending = 1;
+      return rc;
+    }
+    if(frame < 0xffffffffLL && amount == (int)ps && in_frame == DELTA_FRAME_HDR){
+      return delta_log_page(p, buffer, frame, offset);
+    }
+  }
+  rc = delta_flush_pending(p);
+  return rc ? rc : delta_log_write(p, buffer, amount, offset);
+}
+
+/*
+** Read the page size from the header of an existing WAL. SQLite appends
+** to a WAL that survived a close without writing the header again.
+*/
+static void delta_read_page_size(Delta_File *p){
+  u8 hdr[DELTA_WAL_HDR];
+  if(p->real->pMethods->xRead(p->real, hdr, DELTA_WAL_HDR, 0) == SQLITE_OK){
+    p->log->page_size = delta_header_page_size(hdr);
+  }
+}
+
+/*
+** Apply one record to the image. *end tracks the size of the image.
+*/
+static int delta_apply(Delta_File *p, const Delta_Record *r, sqlite3_int64 *end){
+  Delta_Log *l = p->log;
+  sqlite3_file *real = p->real;
+  const char *q = (const char*)&r[1];
+  sqlite3_int64 offset = r->offset;
+  int rc;
+
+  if(r->type == DELTA_TRUNCATE){
+    *end = offset;
+    return real->pMethods->xTruncate(real, offset);
+  }
+  if(r->type == DELTA_RAW){
+    rc = real->pMethods->xWrite(real, q, r->size, offset);
+  }
+  else{
+    u32 ps = r->size;
+    if(r->flags & DELTA_F_HEADER){
+      rc = real->pMethods->xWrite(real, q, DELTA_FRAME_HDR, offset - DELTA_FRAME_HDR);
+      if(rc){
+        return rc;
+      }
+      q += DELTA_FRAME_HDR;
+    }
+    const u64 *bitmap = (const u64*)q;
+    q += delta_bitmap_words(ps) * sizeof(u64);
+    if(r->base){
+      rc = real->pMethods->xRead(real, l->pre, ps, r->base - 1);
+      if(rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ){
+        return rc;
+      }
+    }
+    else{
+      memset(l->pre, 0, ps);
+    }
+    for(u32 i = 0; i < ps / PMEM_DELTA_LINE; i++){
+      if(bitmap[i / 64] & (1ULL << (i % 64))){
+        memcpy(&l->pre[(size_t)i * PMEM_DELTA_LINE], q, PMEM_DELTA_LINE);
+        q += PMEM_DELTA_LINE;
+      }
+    }
+    rc = real->pMethods->xWrite(real, l->pre, ps, offset);
+  }
+  if(offset + r->size > *end){
+    *end = offset + r->size;
+  }
+  return rc;
+}
+
+/* 1 if the record at pos is one of generation gen and intact */
+static int delta_valid(Delta_Log *l, u64 pos, u64 gen){
+  const Delta_Record *r = (const Delta_Record*)(l->file + pos);
+  if(pos + sizeof(Delta_Record) > l->size || r->gen != gen || r->len < sizeof(Delta_Record)
+      || r->len % 8 || r->len > l->size - pos){
+    return 0;
+  }
+  u64 need;
+  if(r->type == DELTA_PAGE){
+    if(r->size < 512 || r->size > DELTA_MAX_PAGE || (r->size & (r->size - 1))){
+      return 0;
+    }
+    need = sizeof(Delta_Record) + (r->flags & DELTA_F_HEADER ? DELTA_FRAME_HDR : 0)
+         + delta_bitmap_words(r->size) * sizeof(u64) + (u64)r->n_lines * PMEM_DELTA_LINE;
+  }
+  else if(r->type == DELTA_RAW || r->type == DELTA_TRUNCATE){
+    need = (sizeof(Delta_Record) + r->size + 7) & ~7ULL;
+  }
+  else{
+    return 0;
+  }
+  return need == r->len && r->check == delta_check(r);
+}
+
+/*
+** Replay the current generation onto the image, cut it to the durable
+** size, sync it and start the next generation.
+*/
+static int delta_recover(Delta_File *p){
+  Delta_Log *l = p->log;
+  Delta_Header *h = l->hdr;
+  sqlite3_file *real = p->real;
+  u64 start = pmem_emu_now();
+  u64 n = 0;
+  sqlite3_int64 size;
+  int rc = real->pMethods->xFileSize(real, &size);
+  if(rc){
+    return rc;
+  }
+
+  l->gen = h->gen;
+  sqlite3_int64 end = size;
+  if(h->image_ino != l->ino || h->image_dev != l->dev){
+    /* a clean close leaves no records, a deleted WAL is no loss then */
+    if(delta_valid(l, DELTA_DATA, l->gen)){
+      return SQLITE_CANTOPEN;
+    }
+  }
+  else{
+    end = h->base[l->gen & 1];
+    for(u64 pos = DELTA_DATA; rc == SQLITE_OK && delta_valid(l, pos, l->gen);
+        pos += ((Delta_Record*)(l->file + pos))->len){
+      rc = delta_apply(p, (Delta_Record*)(l->file + pos), &end);
+      n++;
+    }
+  }
+  /* what was written but never logged was never durable either */
+  if(rc == SQLITE_OK && size > end){
+    rc = real->pMethods->xTruncate(real, end);
+  }
+  if(rc == SQLITE_OK){
+    rc = real->pMethods->xSync(real, SQLITE_SYNC_NORMAL);
+  }
+  if(rc == SQLITE_OK){
+    rc = real->pMethods->xFileSize(real, &size);
+  }
+  if(rc == SQLITE_OK){
+    rc = delta_new_gen(l, size);
+  }
+  if(n){
+    DELTA_STAT(recoveries, 1);
+    DELTA_STAT(recovered_records, n);
+    DELTA_STAT(recovery_ns, pmem_emu_now() - start);
+  }
+  return rc;
+}
+
+static int delta_map_log(Delta_Log *l, sqlite3_int64 size, sqlite3_int64 image_size){
+  struct stat st;
+  int is_pmem;
+  if(stat(l->path, &st) == 0 && st.st_size >= DELTA_MIN_SIZE){
+    l->file = (char *)pmem_map_file(l->path, 0, 0, 0666, &l->size, &is_pmem);
+    if(l->file == 0){
+      return SQLITE_CANTOPEN;
+    }
+    l->is_pmem = pmem_emu_is_pmem(is_pmem);
+    Delta_Header *h = (Delta_Header*)l->file;
+    if(h->magic == DELTA_MAGIC && h->size == l->size){
+      l->hdr = h;
+      return SQLITE_OK;
+    }
+    /* laid out again in place, lock_fd holds the lock of this file */
+    pmem_unmap(l->file, l->size);
+    l->file = 0;
+  }
+
+  l->file = (char *)pmem_map_file(l->path, size, PMEM_FILE_CREATE, 0666, &l->size, &is_pmem);
+  if(l->file == 0){
+    return SQLITE_CANTOPEN;
+  }
+  l->is_pmem = pmem_emu_is_pmem(is_pmem);
+  Delta_Header *h = (Delta_Header*)l->file;
+  memset(h, 0, DELTA_DATA);
+  h->size = l->size;
+  h->gen = 1;
+  h->image_ino = l->ino;
+  h->image_dev = l->dev;
+  /* a WAL from before the log is kept as it is */
+  h->base[1] = image_size;
+  int rc = delta_persist(l, h, DELTA_DATA);
+  if(rc == SQLITE_OK){
+    h->magic = DELTA_MAGIC;
+    rc = delta_persist(l, &h->magic, sizeof(u64));
+  }
+  l->hdr = h;
+  return rc;
+}
+
+static void delta_log_free(Delta_Log *l){
+  if(l->file){
+    pmem_unmap(l->file, l->size);
+  }
+  if(l->lock_fd >= 0){
+    close(l->lock_fd);
+  }
+  pthread_mutex_destroy(&l->mutex);
+  free(l->frame_pgno);
+  free(l->page_frame);
+  free(l->scratch);
+  free(l->pre);
+  free(l);
+}
+
+/*
+** Open the log of the WAL file_path, whose image p->real is open, and
+** recover it. Called with delta.mutex held.
+*/
+static int delta_log_open(Delta_Vfs *v, Delta_File *p, const char *file_path, Delta_Log **pp){
+  Delta_Log *l = calloc(1, sizeof(Delta_Log));
+  if(l == 0){
+    return SQLITE_NOMEM;
+  }
+  l->lock_fd = -1;
+  l->full_pages = v->full_pages;
+  pthread_mutex_init(&l->mutex, 0);
+  sqlite3_snprintf(MAXPATHNAME, l->image, "%s", file_path);
+  struct stat st;
+  if(stat(file_path, &st) == 0){
+    l->ino = st.st_ino;
+    l->dev = st.st_dev;
+  }
+
+  const char *path = sqlite3_uri_parameter(file_path, "delta_file");
+  if(path){
+    sqlite3_snprintf(MAXPATHNAME, l->path, "%s", path);
+  }
+  else{
+    /* WAL files of the same name in other directories get their own */
+    u64 hash = 0xcbf29ce484222325ULL;
+    for(const char *c = file_path; *c; c++){
+      hash = (hash ^ (u8)*c) * 0x100000001b3ULL;
+    }
+    const char *base = strrchr(file_path, '/');
+    sqlite3_snprintf(MAXPATHNAME, l->path, "%s/%s-%016llx-delta", PMEM_DELTA_DIR,
+                     base ? base + 1 : file_path, hash);
+  }
+  sqlite3_int64 size = sqlite3_uri_int64(file_path, "delta_size", PMEM_DELTA_LOG_SIZE);
+  int rc = size < DELTA_MIN_SIZE ? SQLITE_MISUSE : SQLITE_OK;
+
+  l->scratch = malloc(sizeof(Delta_Record) + DELTA_FRAME_HDR
+                      + delta_bitmap_words(DELTA_MAX_PAGE) * sizeof(u64) + DELTA_MAX_PAGE + 8);
+  l->pre = malloc(DELTA_MAX_PAGE);
+  if(rc == SQLITE_OK && (l->scratch == 0 || l->pre == 0)){
+    rc = SQLITE_NOMEM;
+  }
+  if(rc == SQLITE_OK){
+    /* the map of frames lives in this process only */
+    l->lock_fd = open(l->path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(l->lock_fd < 0){
+      rc = SQLITE_CANTOPEN;
+    }
+    else if(flock(l->lock_fd, LOCK_EX | LOCK_NB)){
+      rc = SQLITE_BUSY;
+    }
+  }
+  sqlite3_int64 image_size = 0;
+  if(rc == SQLITE_OK){
+    rc = p->real->pMethods->xFileSize(p->real, &image_size);
+  }
+  if(rc == SQLITE_OK){
+    rc = delta_map_log(l, size, image_size);
+  }
+  if(rc == SQLITE_OK){
+    p->log = l;
+    rc = delta_recover(p);
+  }
+  if(rc){
+    p->log = 0;
+    delta_log_free(l);
+    return rc;
+  }
+  delta_read_page_size(p);
+  *pp = l;
+  return SQLITE_OK;
+}
+
+static int delta_close(sqlite3_file *pFile){
+  Delta_File *p = (Delta_File*)pFile;
+  Delta_Log *l = p->log;
+  int rc;
+
+  pthread_mutex_lock(&delta.mutex);
+  pthread_mutex_lock(&l->mutex);
+  rc = delta_flush_pending(p);
+  if(rc == SQLITE_OK){
+    rc = delta_log_sync(l);
+  }
+  if(--l->refs == 0){
+    Delta_Log **pp = &delta.logs;
+    while(*pp != l){
+      pp = &(*pp)->next;
+    }
+    *pp = l->next;
+    /* nothing to replay after a clean close */
+    if(rc == SQLITE_OK){
+      rc = delta_checkpoint_image(p);
+    }
+  }
+  else{
+    l = 0;
+  }
+  pthread_mutex_unlock(&p->log->mutex);
+  pthread_mutex_unlock(&delta.mutex);
+  if(l){
+    delta_log_free(l);
+  }
+  int rc2 = p->real->pMethods->xClose(p->real);
+  return rc ? rc : rc2;
+}
+
+static int delta_read(sqlite3_file *pFile, void *buffer, int amount, sqlite_int64 offset){
+  Delta_File *p = (Delta_File*)pFile;
+  return p->real->pMethods->xRead(p->real, buffer, amount, offset);
+}
+
+/*
+** Log the write, then apply it to the image. Page records read their
+** pre-image from the image, it must not have the new page yet.
+*/
+static int delta_write(sqlite3_file *pFile, const void *buffer, int amount, sqlite_int64 offset){
+  Delta_File *p = (Delta_File*)pFile;
+  Delta_Log *l = p->log;
+  pthread_mutex_lock(&l->mutex);
+  int rc = delta_log_io(p, buffer, amount, offset);
+  if(rc == SQLITE_OK){
+    rc = p->real->pMethods->xWrite(p->real, buffer, amount, offset);
+  }
+  pthread_mutex_unlock(&l->mutex);
+  return rc;
+}
+
+/*
+** A WAL truncated to 0 has nothing to redo once the truncate is durable,
+** other sizes are logged and forget the frames.
+*/
+static int delta_truncate(sqlite3_file *pFile, sqlite_int64 size){
+  Delta_File *p = (Delta_File*)pFile;
+  Delta_Log *l = p->log;
+  pthread_mutex_lock(&l->mutex);
+  int rc = delta_flush_pending(p);
+  if(rc == SQLITE_OK && size > 0){
+    rc = delta_log_raw(p, DELTA_TRUNCATE, "", 0, size);
+    l->n_frames = 0;
+  }
+  if(rc == SQLITE_OK){
+    rc = p->real->pMethods->xTruncate(p->real, size);
+  }
+  if(rc == SQLITE_OK && size == 0){
+    rc = delta_checkpoint_image(p);
+  }
+  pthread_mutex_unlock(&l->mutex);
+  return rc;
+}
+
+static int delta_sync(sqlite3_file *pFile, int flags){
+  Delta_File *p = (Delta_File*)pFile;
+  Delta_Log *l = p->log;
+  pthread_mutex_lock(&l->mutex);
+  int rc = delta_flush_pending(p);
+  if(rc == SQLITE_OK){
+    rc = delta_log_sync(l);
+  }
+  l->last_commit_frame = 0;
+  pthread_mutex_unlock(&l->mutex);
+  return rc;
+}
+
+static int delta_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
+  Delta_File *p = (Delta_File*)pFile;
+  return p->real->pMethods->xFileSize(p->real, pSize);
+}
+
+static int delta_lock(sqlite3_file *pFile, int eLock){
+  Delta_File *p = (Delta_File*)pFile;
+  return p->real->pMethods->xLock(p->real, eLock);
+}
+
+static int delta_unlock(sqlite3_file *pFile, int eLock){
+  Delta_File *p = (Delta_File*)pFile;
+  return p->real->pMethods->xUnlock(p->real, eLock);
+}
+
+static int delta_check_reserved_lock(sqlite3_file *pFile, int *pResOut){
+  Delta_File *p = (Delta_File*)pFile;
+  return p->real->pMethods->xCheckReservedLock(p->real, pResOut);
+}
+
+static int delta_file_control(sqlite3_file *pFile, int op, void *pArg){
+  Delta_File *p = (Delta_File*)pFile;
+  int rc = p->real->pMethods->xFileControl(p->real, op, pArg);
+  if(op == SQLITE_FCNTL_VFSNAME && rc == SQLITE_OK){
+    *(char**)pArg = sqlite3_mprintf("delta/%z", *(char**)pArg);
+  }
+  return rc;
+}
+
+static int delta_sector_size(sqlite3_file *pFile){
+  Delta_File *p = (Delta_File*)pFile;
+  return p->real->pMethods->xSectorSize(p->real);
+}
+
+static int delta_device_characteristics(sqlite3_file *pFile){
+  Delta_File *p = (Delta_File*)pFile;
+  return p->real->pMethods->xDeviceCharacteristics(p->real);
+}
+
+/*
+** WAL files never see xShm* or xFetch calls, version 1 is enough.
+*/
+static const sqlite3_io_methods delta_io = {
+  1,                            /* iVersion */
+  delta_close,                  /* xClose */
+  delta_read,                   /* xRead */
+  delta_write,                  /* xWrite */
+  delta_truncate,               /* xTruncate */
+  delta_sync,                   /* xSync */
+  delta_file_size,              /* xFileSize */
+  delta_lock,                   /* xLock */
+  delta_unlock,                 /* xUnlock */
+  delta_check_reserved_lock,    /* xCheckReservedLock */
+  delta_file_control,           /* xFileControl */
+  delta_sector_size,            /* xSectorSize */
+  delta_device_characteristics, /* xDeviceCharacteristics */
+};
+
+/*
+** Open a file handle. Only WAL files get a log.
+*/
+static int delta_open(
+  sqlite3_vfs *pVfs,
+  const char *file_path,
+  sqlite3_file *pFile,
+  int flags,
+  int *pOutFlags
+){
+  Delta_Vfs *v = (Delta_Vfs*)pVfs;
+  if(file_path == 0 || (flags & SQLITE_OPEN_WAL) == 0){
+    return v->root->xOpen(v->root, file_path, pFile, flags, pOutFlags);
+  }
+
+  Delta_File *p = (Delta_File*)pFile;
+  memset(p, 0, sizeof(Delta_File));
+  p->real = (sqlite3_file*)&p[1];
+  int rc = v->root->xOpen(v->root, file_path, p->real, flags, pOutFlags);
+  if(p->real->pMethods == 0){
+    return rc ? rc : SQLITE_CANTOPEN;
+  }
+  if(rc){
+    p->real->pMethods->xClose(p->real);
+    return rc;
+  }
+
+  pthread_mutex_lock(&delta.mutex);
+  Delta_Log *l = delta.logs;
+  while(l && strcmp(l->image, file_path)){
+    l = l->next;
+  }
+  if(l == 0){
+    rc = delta_log_open(v, p, file_path, &l);
+    if(rc == SQLITE_OK){
+      l->next = delta.logs;
+      delta.logs = l;
+    }
+  }
+  if(rc == SQLITE_OK){
+    l->refs++;
+  }
+  pthread_mutex_unlock(&delta.mutex);
+  if(rc){
+    p->real->pMethods->xClose(p->real);
+    return rc;
+  }
+  p->log = l;
+  p->base.pMethods = &delta_io;
+  return SQLITE_OK;
+}
+
+/*
+** Everything except xOpen is forwarded to the VFS below.
+*/
+#define ROOT(v) (((Delta_Vfs*)(v))->root)
+
+static int delta_delete(sqlite3_vfs *pVfs, const char *zPath, int dirSync){
+  return ROOT(pVfs)->xDelete(ROOT(pVfs), zPath, dirSync);
+}
+static int delta_access(sqlite3_vfs *pVfs, const char *zPath, int flags, int *pResOut){
+  return ROOT(pVfs)->xAccess(ROOT(pVfs), zPath, flags, pResOut);
+}
+static int delta_full_pathname(sqlite3_vfs *pVfs, const char *zPath, int nOut, char *zOut){
+  return ROOT(pVfs)->xFullPathname(ROOT(pVfs), zPath, nOut, zOut);
+}
+static void *delta_dl_open(sqlite3_vfs *pVfs, const char *zPath){
+  return ROOT(pVfs)->xDlOpen(ROOT(pVfs), zPath);
+}
+static void delta_dl_error(sqlite3_vfs *pVfs, int nByte, char *zErrMsg){
+  ROOT(pVfs)->xDlError(ROOT(pVfs), nByte, zErrMsg);
+}
+static void (*delta_dl_sym(sqlite3_vfs *pVfs, void *pH, const char *z))(void){
+  return ROOT(pVfs)->xDlSym(ROOT(pVfs), pH, z);
+}
+static void delta_dl_close(sqlite3_vfs *pVfs, void *pHandle){
+  ROOT(pVfs)->xDlClose(ROOT(pVfs), pHandle);
+}
+static int delta_randomness(sqlite3_vfs *pVfs, int nByte, char *zByte){
+  return ROOT(pVfs)->xRandomness(ROOT(pVfs), nByte, zByte);
+}
+static int delta_sleep(sqlite3_vfs *pVfs, int microseconds){
+  return ROOT(pVfs)->xSleep(ROOT(pVfs), microseconds);
+}
+static int delta_current_time(sqlite3_vfs *pVfs, double *pTime){
+  return ROOT(pVfs)->xCurrentTime(ROOT(pVfs), pTime);
+}
+static int delta_get_last_error(sqlite3_vfs *pVfs, int nBuf, char *zBuf){
+  return ROOT(pVfs)->xGetLastError(ROOT(pVfs), nBuf, zBuf);
+}
+static int delta_current_time_int64(sqlite3_vfs *pVfs, sqlite3_int64 *piNow){
+  return ROOT(pVfs)->xCurrentTimeInt64(ROOT(pVfs), piNow);
+}
+
+sqlite3_vfs *sqlite3_pmem_delta_vfs(const char *base, int full_pages){
+  static const sqlite3_vfs delta_vfs = {
+    2,                            /* iVersion */
+    0,                            /* szOsFile, set below */
+    MAXPATHNAME,                  /* mxPathname */
+    0,                            /* pNext */
+    0,                            /* zName, "base+delta" or "base+fullpage" */
+    0,                            /* pAppData */
+    delta_open,                   /* xOpen */
+    delta_delete,                 /* xDelete */
+    delta_access,                 /* xAccess */
+    delta_full_pathname,          /* xFullPathname */
+    delta_dl_open,                /* xDlOpen */
+    delta_dl_error,               /* xDlError */
+    delta_dl_sym,                 /* xDlSym */
+    delta_dl_close,               /* xDlClose */
+    delta_randomness,             /* xRandomness */
+    delta_sleep,                  /* xSleep */
+    delta_current_time,           /* xCurrentTime */
+    delta_get_last_error,         /* xGetLastError */
+    delta_current_time_int64,     /* xCurrentTimeInt64 */
+  };
+  sqlite3_vfs *root = sqlite3_vfs_find(base);
+  const char *suffix = full_pages ? "+fullpage" : "+delta";
+  Delta_Vfs *v = 0;
+
+  if(root == 0 || strlen(base) + strlen(suffix) + 1 > sizeof(v->name)){
+    return 0;
+  }
+  full_pages = full_pages != 0;
+  pthread_mutex_lock(&delta.mutex);
+  for(int i = 0; i < delta.n_vfs; i++){
+    if(delta.vfs[i].root == root && delta.vfs[i].full_pages == full_pages){
+      v = &delta.vfs[i];
+      break;
+    }
+  }
+  if(v == 0 && delta.n_vfs < DELTA_MAX_VFS){
+    v = &delta.vfs[delta.n_vfs++];
+    v->base = delta_vfs;
+    v->root = root;
+    v->full_pages = full_pages;
+    snprintf(v->name, sizeof(v->name), "%s%s", base, suffix);
+    v->base.zName = v->name;
+    v->base.szOsFile = sizeof(Delta_File) + root->szOsFile;
+    v->base.mxPathname = root->mxPathname;
+  }
+  pthread_mutex_unlock(&delta.mutex);
+  return v ? &v->base : 0;
+}
+
+void sqlite3_pmem_delta_stats(pmem_delta_stats *out, int reset){
+  pmem_delta_stats *s = &delta.stats;
+  out->commits = pmem_emu_take(&s->commits, reset);
+  out->frames = pmem_emu_take(&s->frames, reset);
+  out->full_frames = pmem_emu_take(&s->full_frames, reset);
+  out->lines = pmem_emu_take(&s->lines, reset);
+  out->bytes_submitted = pmem_emu_take(&s->bytes_submitted, reset);
+  out->bytes_logged = pmem_emu_take(&s->bytes_logged, reset);
+  out->log_resets = pmem_emu_take(&s->log_resets, reset);
+  out->image_syncs = pmem_emu_take(&s->image_syncs, reset);
+  out->recoveries = pmem_emu_take(&s->recoveries, reset);
+  out->recovered_records = pmem_emu_take(&s->recovered_records, reset);
+  out->recovery_ns = pmem_emu_take(&s->recovery_ns, reset);
+}
+
+#endif /* !defined(SQLITE_TEST) || SQLITE_OS_UNIX */
@@ -0,0 +1,62 @@
+#ifndef PMEM_DELTA_VFS_H
+#define PMEM_DELTA_VFS_H
+#include "pmem_vfs.h"
+
+/* granularity of a delta, a changed byte logs the whole line around it */
+#ifndef PMEM_DELTA_LINE
+# define PMEM_DELTA_LINE 64
+#endif
+
+/* directory of the delta log, overridden by the "delta_file" uri param */
+#ifndef PMEM_DELTA_DIR
+# define PMEM_DELTA_DIR "/mnt/pmem0/scheinost"
+#endif
+
+/* size of a new delta log, overridden by the "delta_size" uri param */
+#ifndef PMEM_DELTA_LOG_SIZE
+# define PMEM_DELTA_LOG_SIZE (256 * 1024 * 1024)
+#endif
+
+/*
+** Counters of all delta logs of the process, see sqlite3_pmem_delta_stats().
+*/
+typedef struct pmem_delta_stats pmem_delta_stats;
+struct pmem_delta_stats {
+  u64 commits;            /* WAL commit frames logged */
+  u64 frames;             /* WAL frames logged as a page record */
+  u64 full_frames;        /* of those without a pre-image, all lines logged */
+  u64 lines;              /* PMEM_DELTA_LINE byte lines logged by page records */
+  u64 bytes_submitted;    /* bytes SQLite wrote to the WAL */
+  u64 bytes_logged;       /* bytes appended to the delta logs, headers included */
+  u64 log_resets;         /* new generations, after a WAL restart or a full log */
+  u64 image_syncs;        /* syncs of the WAL file itself */
+  u64 recoveries;         /* opens that replayed a log */
+  u64 recovered_records;  /* records applied by them */
+  u64 recovery_ns;        /* time spent replaying */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Returns the shim VFS "NAME+delta" on top of the registered VFS NAME, or
+** 0 if there is no such VFS. WAL files written through it are made durable
+** by a redo log of the changed lines of every frame on pmem instead of a
+** sync of the WAL file. With full_pages set the shim is "NAME+fullpage",
+** which logs every frame whole, the baseline to compare against. Repeated
+** calls return the same VFS. To use it:
+**
+**   sqlite3_vfs_register(sqlite3_pmem_delta_vfs("unix", 0), 0);
+**   sqlite3_open_v2(path, &db, flags, "unix+delta");
+*/
+sqlite3_vfs *sqlite3_pmem_delta_vfs(const char *base, int full_pages);
+
+/* copy the counters to out, then clear them if reset is non-zero */
+void sqlite3_pmem_delta_stats(pmem_delta_stats *out, int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PMEM_DELTA_VFS_H
@@ -0,0 +1,197 @@
+#ifndef PMEM_EMULATION_H
+#define PMEM_EMULATION_H
+/*
+** PMem emulation on DRAM backed files.
+**
+** On hosts without persistent memory pmem_map_file() of a tmpfs or DRAM
+** file reports is_pmem = 0, and flushes and fences cost next to nothing.
+** With PMEM_EMULATE=1 in the environment the users of this header (the
+** PMem VFS and logs/NonVolatileMemory.hpp) treat such mappings as PMem and
+** charge them what the real device would:
+**
+**     PMEM_EMU_READ_NS     added latency of every read        (default 200)
+**     PMEM_EMU_WRITE_NS    added latency of every fence       (default 100)
+**     PMEM_EMU_WRITE_MBPS  write bandwidth of the media       (default 2300)
+**     PMEM_EMU_XPLINE      1 to account and throttle writes in whole
+**                          256 byte XPLines, 0 to count bytes  (default 1)
+**
+** The defaults are roughly a single first generation Optane DIMM, set a
+** knob to 0 to disable it. Delays are busy waits, like the stalls they
+** stand in for. The bandwidth is shared by all threads of the process: every
+** flushed range reserves its transfer time on one virtual media clock and
+** waits until the clock catches up, with PMEM_EMU_BURST_NS of slack.
+**
+** Emulation is process wide and also applies to real PMem, it is meant for
+** hosts that have none. Everything is in this header so C and C++ users
+** can include it alone; the state is a weak symbol shared by all units.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <libpmem.h>
+
+#ifndef PMEM_EMU_XPLINE_SIZE
+# define PMEM_EMU_XPLINE_SIZE 256
+#endif
+#ifndef PMEM_EMU_BURST_NS
+# define PMEM_EMU_BURST_NS 10000
+#endif
+
+typedef struct pmem_emu_stats pmem_emu_stats;
+struct pmem_emu_stats {
+  uint64_t reads;           /* emulated reads */
+  uint64_t fences;          /* emulated fences */
+  uint64_t flushed_bytes;   /* bytes flushed or streamed by the caller */
+  uint64_t media_bytes;     /* bytes written to the media, whole XPLines */
+  uint64_t delay_ns;        /* total injected delay, all threads */
+};
+
+struct pmem_emu_state {
+  int init;                 /* 1 once the environment has been read */
+  int enabled;
+  uint64_t read_ns;
+  uint64_t write_ns;
+  double ns_per_byte;       /* 0: no bandwidth limit */
+  int xpline;
+  uint64_t media_clock;     /* virtual time the media is busy until */
+  pmem_emu_stats stats;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+__attribute__((weak)) struct pmem_emu_state pmem_emu_state;
+#ifdef __cplusplus
+}
+#endif
+
+static inline uint64_t pmem_emu_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t pmem_emu_env(const char *name, uint64_t dflt){
+  const char *v = getenv(name);
+  return v && *v ? strtoull(v, NULL, 10) : dflt;
+}
+
+/*
+** Read the configuration once. Racing initializers read the same
+** environment and store the same values.
+*/
+static inline int pmem_emu_enabled(void){
+  struct pmem_emu_state *e = &pmem_emu_state;
+  if(__atomic_load_n(&e->init, __ATOMIC_ACQUIRE)){
+    return e->enabled;
+  }
+  e->enabled = pmem_emu_env("PMEM_EMULATE", 0) != 0;
+  e->read_ns = pmem_emu_env("PMEM_EMU_READ_NS", 200);
+  e->write_ns = pmem_emu_env("PMEM_EMU_WRITE_NS", 100);
+  uint64_t mbps = pmem_emu_env("PMEM_EMU_WRITE_MBPS", 2300);
+  e->ns_per_byte = mbps ? 1000.0 / mbps : 0;
+  e->xpline = pmem_emu_env("PMEM_EMU_XPLINE", 1) != 0;
+  __atomic_store_n(&e->init, 1, __ATOMIC_RELEASE);
+  return e->enabled;
+}
+
+/* the is_pmem to use for a mapping that pmem_map_file() reported as is_pmem */
+static inline int pmem_emu_is_pmem(int is_pmem){
+  return is_pmem || pmem_emu_enabled();
+}
+
+static inline void pmem_emu_spin_until(uint64_t until){
+  while(pmem_emu_now() < until){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+}
+
+static inline void pmem_emu_delay(uint64_t ns){
+  if(ns){
+    pmem_emu_spin_until(pmem_emu_now() + ns);
+    __atomic_fetch_add(&pmem_emu_state.stats.delay_ns, ns, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+** Account len bytes at addr reaching the media and wait for the bandwidth
+** they take. Called for flushed ranges and for non-temporal copies.
+*/
+static inline void pmem_emu_media(const void *addr, size_t len){
+  struct pmem_emu_state *e = &pmem_emu_state;
+  if(len == 0 || !pmem_emu_enabled()){
+    return;
+  }
+  uint64_t media = len;
+  if(e->xpline){
+    uintptr_t first = (uintptr_t)addr / PMEM_EMU_XPLINE_SIZE;
+    uintptr_t last = ((uintptr_t)addr + len - 1) / PMEM_EMU_XPLINE_SIZE;
+    media = (uint64_t)(last - first + 1) * PMEM_EMU_XPLINE_SIZE;
+  }
+  __atomic_fetch_add(&e->stats.flushed_bytes, len, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&e->stats.media_bytes, media, __ATOMIC_RELAXED);
+  if(e->ns_per_byte == 0){
+    return;
+  }
+  uint64_t cost = (uint64_t)(media * e->ns_per_byte);
+  uint64_t now = pmem_emu_now();
+  uint64_t clock = __atomic_load_n(&e->media_clock, __ATOMIC_RELAXED);
+  uint64_t done;
+  do{
+    done = (clock > now ? clock : now) + cost;
+  }while(!__atomic_compare_exchange_n(&e->media_clock, &clock, done, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  if(done > now + PMEM_EMU_BURST_NS){
+    pmem_emu_spin_until(done - PMEM_EMU_BURST_NS);
+    __atomic_fetch_add(&e->stats.delay_ns, done - PMEM_EMU_BURST_NS - now, __ATOMIC_RELAXED);
+  }
+}
+
+static inline void pmem_emu_read(size_t len){
+  if(len && pmem_emu_enabled()){
+    __atomic_fetch_add(&pmem_emu_state.stats.reads, 1, __ATOMIC_RELAXED);
+    pmem_emu_delay(pmem_emu_state.read_ns);
+  }
+}
+
+/* pmem_flush(), pmem_drain() and pmem_persist() with the emulated cost */
+static inline void pmem_emu_flush(const void *addr, size_t len){
+  pmem_flush(addr, len);
+  pmem_emu_media(addr, len);
+}
+
+/* the write latency, charged once per fence that makes stores durable */
+static inline void pmem_emu_fence(void){
+  if(pmem_emu_enabled()){
+    __atomic_fetch_add(&pmem_emu_state.stats.fences, 1, __ATOMIC_RELAXED);
+    pmem_emu_delay(pmem_emu_state.write_ns);
+  }
+}
+
+static inline void pmem_emu_drain(void){
+  pmem_drain();
+  pmem_emu_fence();
+}
+
+static inline void pmem_emu_persist(const void *addr, size_t len){
+  pmem_emu_flush(addr, len);
+  pmem_emu_drain();
+}
+
+static inline uint64_t pmem_emu_take(uint64_t *counter, int reset){
+  return reset ? __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED)
+               : __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void pmem_emu_get_stats(pmem_emu_stats *out, int reset){
+  pmem_emu_stats *s = &pmem_emu_state.stats;
+  out->reads = pmem_emu_take(&s->reads, reset);
+  out->fences = pmem_emu_take(&s->fences, reset);
+  out->flushed_bytes = pmem_emu_take(&s->flushed_bytes, reset);
+  out->media_bytes = pmem_emu_take(&s->media_bytes, reset);
+  out->delay_ns = pmem_emu_take(&s->delay_ns, reset);
+}
+
+#endif // PMEM_EMULATION_H
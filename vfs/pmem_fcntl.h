@@ -0,0 +1,22 @@
+#ifndef PMEM_FCNTL_H
+#define PMEM_FCNTL_H
+/*
+** File-control opcodes understood by the PMem VFS family. They start well
+** above SQLite's own SQLITE_FCNTL_* range so they never collide with it.
+** Every VFS in vfs/ that answers one of these opcodes takes it from here.
+** Kept apart from pmem_vfs.h so the sqlite3 shell can include it without
+** the rest of the VFS.
+*/
+#define PMEM_FCNTL_BASE 0x504d0000
+#define SQLITE_FCNTL_PMEM_TIER_STATS (PMEM_FCNTL_BASE + 1)
+#define SQLITE_FCNTL_PMEM_ASYNC_SYNC (PMEM_FCNTL_BASE + 2)
+#define SQLITE_FCNTL_PMEM_SNAPSHOT (PMEM_FCNTL_BASE + 3)
+#define SQLITE_FCNTL_PMEM_SNAPSHOT_WAIT (PMEM_FCNTL_BASE + 4)
+#define SQLITE_FCNTL_PMEM_DIRTYMAP_GET (PMEM_FCNTL_BASE + 5)
+#define SQLITE_FCNTL_PMEM_DIRTYMAP_RESET (PMEM_FCNTL_BASE + 6)
+#define SQLITE_FCNTL_PMEM_HIST (PMEM_FCNTL_BASE + 7)
+#define SQLITE_FCNTL_PMEM_SHADOW_STATS (PMEM_FCNTL_BASE + 8)
+#define SQLITE_FCNTL_PMEM_WB_STATS (PMEM_FCNTL_BASE + 9)
+#define SQLITE_FCNTL_PMEM_POOL_STATS (PMEM_FCNTL_BASE + 10)
+
+#endif // PMEM_FCNTL_H
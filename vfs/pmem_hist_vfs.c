@@ -0,0 +1,450 @@
+/*
+** This file implements a pass-through VFS that profiles another VFS.
+**
+** OVERVIEW
+**
+**   sqlite3_pmem_hist_vfs("NAME") creates the VFS "NAME+hist" on top of
+**   the registered VFS NAME. Its files wrap a file of NAME and forward every
+**   method to it. Around the forwarded call the shim takes the time and
+**   adds the call to the cell of its method and file type:
+**
+**        main db      SQLITE_OPEN_MAIN_DB
+**        WAL          SQLITE_OPEN_WAL
+**        journal      main and super journals
+**        temp         temp databases and journals, transient files and
+**                     subjournals
+**        shm          the xShm* methods of a main database
+**
+**   A cell counts calls, bytes and the latency in a log-linear histogram
+**   (see PMEM_HIST_SUB in pmem_hist_vfs.h). Cells are per VFS, not per
+**   file, so the unix baseline and a PMem VFS are profiled the same way
+**   for any workload.
+**
+**   SQLITE_FCNTL_PMEM_HIST hands out the tables, sqlite3_pmem_hist_dump()
+**   prints them. Every other file control and all VFS methods other than
+**   xOpen go to NAME unchanged. Files keep the io_methods version of the
+**   file they wrap, so SQLite sees the same capabilities as without shim.
+*/
+
+#if !defined(SQLITE_TEST) || SQLITE_OS_UNIX
+
+#include "pmem_hist_vfs.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+/* number of shims that can be created */
+#define HIST_MAX_VFS 8
+
+typedef struct Hist_Vfs Hist_Vfs;
+struct Hist_Vfs {
+  sqlite3_vfs base;
+  sqlite3_vfs *root;          /* the profiled VFS */
+  char name[64];
+  pmem_hist *hist;
+};
+
+typedef struct Hist_File Hist_File;
+struct Hist_File {
+  sqlite3_file base;
+  Hist_Vfs *vfs;
+  int type;                   /* PMEM_HIST_MAIN .. PMEM_HIST_TEMP */
+  sqlite3_file *real;         /* the file of root, follows this struct */
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  Hist_Vfs vfs[HIST_MAX_VFS];
+  int n_vfs;
+  sqlite3_io_methods io[3];   /* hist_io with iVersion 1, 2 and 3 */
+} hist = { PTHREAD_MUTEX_INITIALIZER };
+
+static u64 hist_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(u64 ns){
+  if(ns < PMEM_HIST_SUB){
+    return (int)ns;
+  }
+  int e = 63 - __builtin_clzll(ns);
+  if(e >= PMEM_HIST_OCTAVES){
+    return PMEM_HIST_BUCKETS - 1;
+  }
+  return (e - 2) * PMEM_HIST_SUB + (int)((ns >> (e - 3)) & (PMEM_HIST_SUB - 1));
+}
+
+/* the smallest latency of bucket i */
+static u64 hist_bucket_value(int i){
+  if(i < PMEM_HIST_SUB){
+    return i;
+  }
+  int e = i / PMEM_HIST_SUB + 2;
+  return (u64)(PMEM_HIST_SUB + i % PMEM_HIST_SUB) << (e - 3);
+}
+
+static void hist_add(Hist_Vfs *v, int type, int method, u64 start, u64 bytes){
+  u64 ns = hist_now() - start;
+  pmem_hist_cell *c = &v->hist->cell[type][method];
+  __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->sum_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+  u64 max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+  while(ns > max && !__atomic_compare_exchange_n(&c->max_ns, &max, ns, 1,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+  }
+}
+
+u64 sqlite3_pmem_hist_percentile(const pmem_hist_cell *cell, double q){
+  u64 total = 0;
+  for(int i = 0; i < PMEM_HIST_BUCKETS; i++){
+    total += cell->buckets[i];
+  }
+  if(total == 0){
+    return 0;
+  }
+  u64 rank = (u64)(q * total);
+  u64 seen = 0;
+  for(int i = 0; i < PMEM_HIST_BUCKETS; i++){
+    seen += cell->buckets[i];
+    if(seen > rank){
+      /* the upper end of the bucket, like HdrHistogram reports it */
+      u64 hi = i + 1 < PMEM_HIST_BUCKETS ? hist_bucket_value(i + 1) - 1 : cell->max_ns;
+      return hi < cell->max_ns ? hi : cell->max_ns;
+    }
+  }
+  return cell->max_ns;
+}
+
+#define HIST_CALL(p, method, bytes, call) do{ \
+    u64 t_ = hist_now(); \
+    rc = (call); \
+    hist_add((p)->vfs, (p)->type, (method), t_, (bytes)); \
+  }while(0)
+
+static int hist_close(sqlite3_file *pFile){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_CLOSE, 0, p->real->pMethods->xClose(p->real));
+  return rc;
+}
+
+static int hist_read(sqlite3_file *pFile, void *buffer, int amount, sqlite_int64 offset){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_READ, amount, p->real->pMethods->xRead(p->real, buffer, amount, offset));
+  return rc;
+}
+
+static int hist_write(sqlite3_file *pFile, const void *buffer, int amount, sqlite_int64 offset){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_WRITE, amount, p->real->pMethods->xWrite(p->real, buffer, amount, offset));
+  return rc;
+}
+
+static int hist_truncate(sqlite3_file *pFile, sqlite_int64 size){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_TRUNCATE, size, p->real->pMethods->xTruncate(p->real, size));
+  return rc;
+}
+
+static int hist_sync(sqlite3_file *pFile, int flags){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_SYNC, 0, p->real->pMethods->xSync(p->real, flags));
+  return rc;
+}
+
+static int hist_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_FILE_SIZE, 0, p->real->pMethods->xFileSize(p->real, pSize));
+  return rc;
+}
+
+static int hist_lock(sqlite3_file *pFile, int eLock){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_LOCK, 0, p->real->pMethods->xLock(p->real, eLock));
+  return rc;
+}
+
+static int hist_unlock(sqlite3_file *pFile, int eLock){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_UNLOCK, 0, p->real->pMethods->xUnlock(p->real, eLock));
+  return rc;
+}
+
+static int hist_check_reserved_lock(sqlite3_file *pFile, int *pResOut){
+  Hist_File *p = (Hist_File*)pFile;
+  return p->real->pMethods->xCheckReservedLock(p->real, pResOut);
+}
+
+static int hist_file_control(sqlite3_file *pFile, int op, void *pArg){
+  Hist_File *p = (Hist_File*)pFile;
+  if(op == SQLITE_FCNTL_PMEM_HIST){
+    *(pmem_hist**)pArg = p->vfs->hist;
+    return SQLITE_OK;
+  }
+  int rc = p->real->pMethods->xFileControl(p->real, op, pArg);
+  if(op == SQLITE_FCNTL_VFSNAME && rc == SQLITE_OK){
+    *(char**)pArg = sqlite3_mprintf("hist/%z", *(char**)pArg);
+  }
+  return rc;
+}
+
+static int hist_sector_size(sqlite3_file *pFile){
+  Hist_File *p = (Hist_File*)pFile;
+  return p->real->pMethods->xSectorSize(p->real);
+}
+
+static int hist_device_characteristics(sqlite3_file *pFile){
+  Hist_File *p = (Hist_File*)pFile;
+  return p->real->pMethods->xDeviceCharacteristics(p->real);
+}
+
+static int hist_shm_map(sqlite3_file *pFile, int region_number, int region_size, int extend, void volatile **pp){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  u64 t = hist_now();
+  rc = p->real->pMethods->xShmMap(p->real, region_number, region_size, extend, pp);
+  hist_add(p->vfs, PMEM_HIST_SHM, PMEM_HIST_SHM_MAP, t, region_size);
+  return rc;
+}
+
+static int hist_shm_lock(sqlite3_file *pFile, int ofst, int n, int flags){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  u64 t = hist_now();
+  rc = p->real->pMethods->xShmLock(p->real, ofst, n, flags);
+  hist_add(p->vfs, PMEM_HIST_SHM, PMEM_HIST_SHM_LOCK, t, 0);
+  return rc;
+}
+
+static void hist_shm_barrier(sqlite3_file *pFile){
+  Hist_File *p = (Hist_File*)pFile;
+  u64 t = hist_now();
+  p->real->pMethods->xShmBarrier(p->real);
+  hist_add(p->vfs, PMEM_HIST_SHM, PMEM_HIST_SHM_BARRIER, t, 0);
+}
+
+static int hist_shm_unmap(sqlite3_file *pFile, int deleteFlag){
+  Hist_File *p = (Hist_File*)pFile;
+  return p->real->pMethods->xShmUnmap(p->real, deleteFlag);
+}
+
+static int hist_fetch(sqlite3_file *pFile, sqlite3_int64 offset, int amount, void **pp){
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+  HIST_CALL(p, PMEM_HIST_FETCH, amount, p->real->pMethods->xFetch(p->real, offset, amount, pp));
+  return rc;
+}
+
+static int hist_unfetch(sqlite3_file *pFile, sqlite3_int64 offset, void *pPage){
+  Hist_File *p = (Hist_File*)pFile;
+  return p->real->pMethods->xUnfetch(p->real, offset, pPage);
+}
+
+static const sqlite3_io_methods hist_io = {
+  3,                            /* iVersion */
+  hist_close,                   /* xClose */
+  hist_read,                    /* xRead */
+  hist_write,                   /* xWrite */
+  hist_truncate,                /* xTruncate */
+  hist_sync,                    /* xSync */
+  hist_file_size,               /* xFileSize */
+  hist_lock,                    /* xLock */
+  hist_unlock,                  /* xUnlock */
+  hist_check_reserved_lock,     /* xCheckReservedLock */
+  hist_file_control,            /* xFileControl */
+  hist_sector_size,             /* xSectorSize */
+  hist_device_characteristics,  /* xDeviceCharacteristics */
+  hist_shm_map,                 /* xShmMap */
+  hist_shm_lock,                /* xShmLock */
+  hist_shm_barrier,             /* xShmBarrier */
+  hist_shm_unmap,               /* xShmUnmap */
+  hist_fetch,                   /* xFetch */
+  hist_unfetch,                 /* xUnfetch */
+};
+
+static int hist_type(int flags){
+  if(flags & SQLITE_OPEN_MAIN_DB){
+    return PMEM_HIST_MAIN;
+  }
+  if(flags & SQLITE_OPEN_WAL){
+    return PMEM_HIST_WAL;
+  }
+  if(flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_SUPER_JOURNAL)){
+    return PMEM_HIST_JOURNAL;
+  }
+  return PMEM_HIST_TEMP;
+}
+
+static int hist_open(
+  sqlite3_vfs *pVfs,
+  const char *file_path,
+  sqlite3_file *pFile,
+  int flags,
+  int *pOutFlags
+){
+  Hist_Vfs *v = (Hist_Vfs*)pVfs;
+  Hist_File *p = (Hist_File*)pFile;
+  int rc;
+
+  memset(p, 0, sizeof(Hist_File));
+  p->vfs = v;
+  p->type = hist_type(flags);
+  p->real = (sqlite3_file*)&p[1];
+  HIST_CALL(p, PMEM_HIST_OPEN, 0, v->root->xOpen(v->root, file_path, p->real, flags, pOutFlags));
+  if(p->real->pMethods == 0){
+    return rc ? rc : SQLITE_CANTOPEN;
+  }
+  if(rc != SQLITE_OK){
+    p->real->pMethods->xClose(p->real);
+    return rc;
+  }
+  int version = p->real->pMethods->iVersion;
+  p->base.pMethods = &hist.io[(version < 1 ? 1 : version > 3 ? 3 : version) - 1];
+  return SQLITE_OK;
+}
+
+/*
+** Everything except xOpen is forwarded to the profiled VFS.
+*/
+#define ROOT(v) (((Hist_Vfs*)(v))->root)
+
+static int hist_delete(sqlite3_vfs *pVfs, const char *zPath, int dirSync){
+  return ROOT(pVfs)->xDelete(ROOT(pVfs), zPath, dirSync);
+}
+static int hist_access(sqlite3_vfs *pVfs, const char *zPath, int flags, int *pResOut){
+  return ROOT(pVfs)->xAccess(ROOT(pVfs), zPath, flags, pResOut);
+}
+static int hist_full_pathname(sqlite3_vfs *pVfs, const char *zPath, int nOut, char *zOut){
+  return ROOT(pVfs)->xFullPathname(ROOT(pVfs), zPath, nOut, zOut);
+}
+static void *hist_dl_open(sqlite3_vfs *pVfs, const char *zPath){
+  return ROOT(pVfs)->xDlOpen(ROOT(pVfs), zPath);
+}
+static void hist_dl_error(sqlite3_vfs *pVfs, int nByte, char *zErrMsg){
+  ROOT(pVfs)->xDlError(ROOT(pVfs), nByte, zErrMsg);
+}
+static void (*hist_dl_sym(sqlite3_vfs *pVfs, void *pH, const char *z))(void){
+  return ROOT(pVfs)->xDlSym(ROOT(pVfs), pH, z);
+}
+static void hist_dl_close(sqlite3_vfs *pVfs, void *pHandle){
+  ROOT(pVfs)->xDlClose(ROOT(pVfs), pHandle);
+}
+static int hist_randomness(sqlite3_vfs *pVfs, int nByte, char *zByte){
+  return ROOT(pVfs)->xRandomness(ROOT(pVfs), nByte, zByte);
+}
+static int hist_sleep(sqlite3_vfs *pVfs, int microseconds){
+  return ROOT(pVfs)->xSleep(ROOT(pVfs), microseconds);
+}
+static int hist_current_time(sqlite3_vfs *pVfs, double *pTime){
+  return ROOT(pVfs)->xCurrentTime(ROOT(pVfs), pTime);
+}
+static int hist_get_last_error(sqlite3_vfs *pVfs, int nBuf, char *zBuf){
+  return ROOT(pVfs)->xGetLastError(ROOT(pVfs), nBuf, zBuf);
+}
+static int hist_current_time_int64(sqlite3_vfs *pVfs, sqlite3_int64 *piNow){
+  return ROOT(pVfs)->xCurrentTimeInt64(ROOT(pVfs), piNow);
+}
+
+sqlite3_vfs *sqlite3_pmem_hist_vfs(const char *base){
+  static const sqlite3_vfs hist_vfs = {
+    2,                            /* iVersion */
+    0,                            /* szOsFile, set below */
+    MAXPATHNAME,                  /* mxPathname */
+    0,                            /* pNext */
+    0,                            /* zName, "base+hist" */
+    0,                            /* pAppData */
+    hist_open,                    /* xOpen */
+    hist_delete,                  /* xDelete */
+    hist_access,                  /* xAccess */
+    hist_full_pathname,           /* xFullPathname */
+    hist_dl_open,                 /* xDlOpen */
+    hist_dl_error,                /* xDlError */
+    hist_dl_sym,                  /* xDlSym */
+    hist_dl_close,                /* xDlClose */
+    hist_randomness,              /* xRandomness */
+    hist_sleep,                   /* xSleep */
+    hist_current_time,            /* xCurrentTime */
+    hist_get_last_error,          /* xGetLastError */
+    hist_current_time_int64,      /* xCurrentTimeInt64 */
+  };
+  sqlite3_vfs *root = sqlite3_vfs_find(base);
+  Hist_Vfs *v = 0;
+
+  if(root == 0 || strlen(base) + sizeof("+hist") > sizeof(v->name)){
+    return 0;
+  }
+  pthread_mutex_lock(&hist.mutex);
+  for(int i = 0; i < hist.n_vfs; i++){
+    if(hist.vfs[i].root == root){
+      v = &hist.vfs[i];
+      break;
+    }
+  }
+  if(v == 0 && hist.n_vfs < HIST_MAX_VFS){
+    pmem_hist *tables = calloc(1, sizeof(pmem_hist));
+    if(tables){
+      if(hist.n_vfs == 0){
+        for(int i = 0; i < 3; i++){
+          hist.io[i] = hist_io;
+          hist.io[i].iVersion = i + 1;
+        }
+      }
+      v = &hist.vfs[hist.n_vfs++];
+      v->base = hist_vfs;
+      v->root = root;
+      v->hist = tables;
+      snprintf(v->name, sizeof(v->name), "%s+hist", base);
+      v->base.zName = v->name;
+      v->base.szOsFile = sizeof(Hist_File) + root->szOsFile;
+      v->base.mxPathname = root->mxPathname;
+    }
+  }
+  pthread_mutex_unlock(&hist.mutex);
+  return v ? &v->base : 0;
+}
+
+int sqlite3_pmem_hist_dump(sqlite3 *db, FILE *out, int reset){
+  static const char *types[PMEM_HIST_TYPES] = {"main", "wal", "journal", "temp", "shm"};
+  static const char *methods[PMEM_HIST_METHODS] = {
+    "open", "close", "read", "write", "truncate", "sync", "file_size",
+    "lock", "unlock", "shm_map", "shm_lock", "shm_barrier", "fetch",
+  };
+  pmem_hist *h = 0;
+
+  if(sqlite3_file_control(db, "main", SQLITE_FCNTL_PMEM_HIST, &h) != SQLITE_OK || h == 0){
+    return SQLITE_NOTFOUND;
+  }
+  fprintf(out, "%-8s %-12s %12s %14s %10s %10s %10s %10s %12s\n",
+          "file", "method", "calls", "bytes", "mean_ns", "p50_ns", "p99_ns", "p999_ns", "max_ns");
+  for(int t = 0; t < PMEM_HIST_TYPES; t++){
+    for(int m = 0; m < PMEM_HIST_METHODS; m++){
+      pmem_hist_cell *c = &h->cell[t][m];
+      if(c->calls == 0){
+        continue;
+      }
+      fprintf(out, "%-8s %-12s %12llu %14llu %10llu %10llu %10llu %10llu %12llu\n",
+              types[t], methods[m], (unsigned long long)c->calls, (unsigned long long)c->bytes,
+              (unsigned long long)(c->sum_ns / c->calls),
+              (unsigned long long)sqlite3_pmem_hist_percentile(c, 0.5),
+              (unsigned long long)sqlite3_pmem_hist_percentile(c, 0.99),
+              (unsigned long long)sqlite3_pmem_hist_percentile(c, 0.999),
+              (unsigned long long)c->max_ns);
+    }
+  }
+  if(reset){
+    memset(h, 0, sizeof(pmem_hist));
+  }
+  return SQLITE_OK;
+}
+
+#endif /* !defined(SQLITE_TEST) || SQLITE_OS_UNIX */
@@ -0,0 +1,88 @@
+#ifndef PMEM_HIST_VFS_H
+#define PMEM_HIST_VFS_H
+#include "pmem_vfs.h"
+#include <stdio.h>
+
+/*
+** Latency buckets: values below PMEM_HIST_SUB ns get a bucket each, above
+** that every power of two is split into PMEM_HIST_SUB linear buckets, so a
+** bucket is at most 1/PMEM_HIST_SUB of its value wide. The last bucket
+** collects everything from 2^PMEM_HIST_OCTAVES ns (~18 minutes) on.
+*/
+#define PMEM_HIST_SUB 8
+#define PMEM_HIST_OCTAVES 40
+#define PMEM_HIST_BUCKETS ((PMEM_HIST_OCTAVES - 2) * PMEM_HIST_SUB)
+
+/* file types */
+#define PMEM_HIST_MAIN 0
+#define PMEM_HIST_WAL 1
+#define PMEM_HIST_JOURNAL 2
+#define PMEM_HIST_TEMP 3
+#define PMEM_HIST_SHM 4         /* xShm* calls of the main database */
+#define PMEM_HIST_TYPES 5
+
+/* methods */
+#define PMEM_HIST_OPEN 0
+#define PMEM_HIST_CLOSE 1
+#define PMEM_HIST_READ 2
+#define PMEM_HIST_WRITE 3
+#define PMEM_HIST_TRUNCATE 4
+#define PMEM_HIST_SYNC 5
+#define PMEM_HIST_FILE_SIZE 6
+#define PMEM_HIST_LOCK 7
+#define PMEM_HIST_UNLOCK 8
+#define PMEM_HIST_SHM_MAP 9
+#define PMEM_HIST_SHM_LOCK 10
+#define PMEM_HIST_SHM_BARRIER 11
+#define PMEM_HIST_FETCH 12
+#define PMEM_HIST_METHODS 13
+
+typedef struct pmem_hist_cell pmem_hist_cell;
+struct pmem_hist_cell {
+  u64 calls;
+  u64 bytes;              /* bytes read or written, size of truncates */
+  u64 sum_ns;
+  u64 max_ns;
+  u64 buckets[PMEM_HIST_BUCKETS];
+};
+
+/*
+** The tables of one shim VFS, shared by all its files. SQLITE_FCNTL_PMEM_HIST
+** on any of them stores a pointer to the live tables into its argument, a
+** pmem_hist**. They are updated with relaxed atomics while being read.
+*/
+typedef struct pmem_hist pmem_hist;
+struct pmem_hist {
+  pmem_hist_cell cell[PMEM_HIST_TYPES][PMEM_HIST_METHODS];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Returns the shim VFS "NAME+hist" that forwards every call to the
+** registered VFS NAME and records call counts, bytes and latency histograms
+** per method and file type, or 0 if there is no VFS NAME. Repeated calls
+** return the same VFS. To use it:
+**
+**   sqlite3_vfs_register(sqlite3_pmem_hist_vfs("PMem_VFS"), 0);
+**   sqlite3_open_v2(path, &db, flags, "PMem_VFS+hist");
+*/
+sqlite3_vfs *sqlite3_pmem_hist_vfs(const char *base);
+
+/* latency in ns below which a fraction q of the calls of cell completed */
+u64 sqlite3_pmem_hist_percentile(const pmem_hist_cell *cell, double q);
+
+/*
+** Print the tables of the VFS under the main database of db to out and
+** clear them if reset is non-zero. Returns SQLITE_NOTFOUND if db is not
+** opened through a shim VFS.
+*/
+int sqlite3_pmem_hist_dump(sqlite3 *db, FILE *out, int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PMEM_HIST_VFS_H
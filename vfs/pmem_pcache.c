@@ -0,0 +1,557 @@
+/*
+** This file implements an SQLite page cache (SQLITE_CONFIG_PCACHE2) that
+** keeps most of its pages on PMem.
+**
+** OVERVIEW
+**
+**   DRAM is far smaller than PMem, and a page cache in DRAM alone caps
+**   cache_size at what DRAM can hold. sqlite3_pmem_pcache_install()
+**   replaces SQLite's page cache by one with two tiers:
+**
+**        cold    page slots in an unnamed, sparse file on a DAX file
+**                system, mapped once with pmem_map_file(PMEM_FILE_TMPFILE).
+**                The tier is volatile: nothing is flushed and the file is
+**                gone when the process exits.
+**        hot     page buffers from sqlite3_malloc(), at most dram_bytes for
+**                all caches of the process together.
+**
+**   Placement is a 2Q: a page enters the cache cold, so pages touched once
+**   by a scan never displace the hot set. After PMEM_PCACHE_PROMOTE hits
+**   a cold page moves to DRAM. Once the budget is used up, the least
+**   recently used hot page of the same cache makes room when its hits have
+**   decayed to zero. A cache at its
+**   cache_size recycles its least recently used cold page before any hot
+**   one. Caches of in-memory databases are never purged and never move
+**   pages, their pages are the only copy.
+**
+**   A page cannot take its content along when it moves. SQLite keeps
+**   pointers into the buffer in the page header it stores in pExtra, and
+**   those are only rebuilt for a page that comes back from xFetch with the
+**   first pointer of pExtra cleared, as a new page. A promotion therefore
+**   frees the cold slot and returns the page empty in DRAM, the pager
+**   reads it once more from the database file. That is also why pages
+**   are only promoted by a fetch that may create pages: SQLite expects
+**   the content of pages returned to a lookup with createFlag 0.
+**
+**   Page headers and pExtra always live in DRAM, about szExtra + 48 bytes
+**   per page. SQLITE_CONFIG_PAGECACHE could place page buffers on PMem as
+**   well, but only as one fixed array without a DRAM tier.
+**
+**   With PMEM_EMULATE=1 (see pmem_emulation.h) every hit on a cold page is
+**   charged a read and every new cold page the media time of its write.
+*/
+
+#if !defined(SQLITE_TEST) || SQLITE_OS_UNIX
+
+#include "pmem_pcache.h"
+#include "pmem_emulation.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+/* distinct page sizes that can have cold slots at the same time */
+#define PCACHE_CLASSES 8
+
+typedef struct Pcache_Page Pcache_Page;
+struct Pcache_Page {
+  sqlite3_pcache_page base;   /* pBuf is a hot or cold slot, pExtra follows this struct */
+  unsigned key;
+  u8 hot;                     /* pBuf is from sqlite3_malloc() */
+  u8 pinned;
+  u16 hits;                   /* fetches since the page was created, decaying when hot */
+  Pcache_Page *next_hash;
+  Pcache_Page *lru_prev;      /* on the hot or cold list of the cache while unpinned */
+  Pcache_Page *lru_next;
+};
+
+typedef struct Pcache Pcache;
+struct Pcache {
+  int sz_page;
+  int sz_extra;
+  int purgeable;
+  int cls;                    /* cold slot class, -1 if all classes are taken */
+  unsigned n_max;             /* cache_size in pages */
+  unsigned n_page;
+  unsigned n_hot;
+  unsigned n_hash;            /* a power of two */
+  Pcache_Page **hash;
+  Pcache_Page hot;            /* LRU lists, lru_next of the head is the oldest */
+  Pcache_Page cold;
+};
+
+typedef struct Pcache_Class Pcache_Class;
+struct Pcache_Class {
+  size_t size;                /* slot size, 0 if unused */
+  void *free;                 /* freed slots, linked through their first word */
+};
+
+static struct {
+  pthread_mutex_t mutex;      /* the arena and the slot classes */
+  char dir[512];
+  u64 pmem_bytes;
+  u64 dram_bytes;
+  char *arena;                /* the cold tier */
+  size_t arena_size;
+  size_t arena_used;          /* slots handed out so far */
+  Pcache_Class cls[PCACHE_CLASSES];
+  u64 hot_bytes;              /* DRAM held by the hot pages of all caches */
+  pmem_pcache_stats stats;
+} pcache = { PTHREAD_MUTEX_INITIALIZER };
+
+#define PCACHE_STAT(x, n) __atomic_fetch_add(&pcache.stats.x, (n), __ATOMIC_RELAXED)
+
+static int pcache_init(void *arg){
+  size_t mapped;
+  int is_pmem;
+  (void)arg;
+  pcache.arena = pmem_map_file(pcache.dir, pcache.pmem_bytes,
+                               PMEM_FILE_CREATE | PMEM_FILE_TMPFILE | PMEM_FILE_SPARSE,
+                               0600, &mapped, &is_pmem);
+  if(pcache.arena == NULL){
+    return SQLITE_CANTOPEN;
+  }
+  pcache.arena_size = mapped;
+  pcache.arena_used = 0;
+  memset(pcache.cls, 0, sizeof(pcache.cls));
+  return SQLITE_OK;
+}
+
+static void pcache_shutdown(void *arg){
+  (void)arg;
+  if(pcache.arena){
+    pmem_unmap(pcache.arena, pcache.arena_size);
+    pcache.arena = NULL;
+  }
+  pcache.arena_size = 0;
+  pcache.arena_used = 0;
+}
+
+/* the class of cold slots for pages of sz_page bytes, whole XPLines */
+static int pcache_class(int sz_page){
+  size_t size = ((size_t)sz_page + PMEM_XPLINE_SIZE - 1) / PMEM_XPLINE_SIZE * PMEM_XPLINE_SIZE;
+  int i, cls = -1;
+  pthread_mutex_lock(&pcache.mutex);
+  for(i = 0; i < PCACHE_CLASSES; i++){
+    if(pcache.cls[i].size == size){
+      cls = i;
+      break;
+    }
+    if(pcache.cls[i].size == 0 && cls < 0){
+      cls = i;
+    }
+  }
+  if(cls >= 0){
+    pcache.cls[cls].size = size;
+  }
+  pthread_mutex_unlock(&pcache.mutex);
+  return cls;
+}
+
+static void *pcache_slot_alloc(int cls){
+  void *slot = NULL;
+  if(cls < 0){
+    return NULL;
+  }
+  pthread_mutex_lock(&pcache.mutex);
+  Pcache_Class *c = &pcache.cls[cls];
+  if(c->free){
+    slot = c->free;
+    c->free = *(void **)slot;
+  }
+  else if(pcache.arena && pcache.arena_used + c->size <= pcache.arena_size){
+    slot = pcache.arena + pcache.arena_used;
+    pcache.arena_used += c->size;
+  }
+  pthread_mutex_unlock(&pcache.mutex);
+  return slot;
+}
+
+static void pcache_slot_free(int cls, void *slot){
+  pthread_mutex_lock(&pcache.mutex);
+  *(void **)slot = pcache.cls[cls].free;
+  pcache.cls[cls].free = slot;
+  pthread_mutex_unlock(&pcache.mutex);
+}
+
+/* DRAM for a hot page, NULL if the budget is used up and force is 0 */
+static void *pcache_hot_alloc(Pcache *c, int force){
+  u64 used = __atomic_add_fetch(&pcache.hot_bytes, c->sz_page, __ATOMIC_RELAXED);
+  void *buf = NULL;
+  if(force || used <= pcache.dram_bytes){
+    buf = sqlite3_malloc(c->sz_page);
+  }
+  if(buf == NULL){
+    __atomic_sub_fetch(&pcache.hot_bytes, c->sz_page, __ATOMIC_RELAXED);
+  }
+  return buf;
+}
+
+static void pcache_lru_init(Pcache_Page *head){
+  head->lru_next = head->lru_prev = head;
+}
+
+static void pcache_lru_remove(Pcache_Page *pg){
+  pg->lru_prev->lru_next = pg->lru_next;
+  pg->lru_next->lru_prev = pg->lru_prev;
+  pg->lru_next = pg->lru_prev = NULL;
+}
+
+static void pcache_lru_push(Pcache_Page *head, Pcache_Page *pg){
+  pg->lru_prev = head->lru_prev;
+  pg->lru_next = head;
+  head->lru_prev->lru_next = pg;
+  head->lru_prev = pg;
+}
+
+static Pcache_Page *pcache_lru_oldest(Pcache_Page *head){
+  return head->lru_next == head ? NULL : head->lru_next;
+}
+
+static void pcache_hash_insert(Pcache *c, Pcache_Page *pg){
+  Pcache_Page **bucket = &c->hash[pg->key & (c->n_hash - 1)];
+  pg->next_hash = *bucket;
+  *bucket = pg;
+}
+
+static void pcache_hash_remove(Pcache *c, Pcache_Page *pg){
+  Pcache_Page **pp = &c->hash[pg->key & (c->n_hash - 1)];
+  while(*pp != pg){
+    pp = &(*pp)->next_hash;
+  }
+  *pp = pg->next_hash;
+}
+
+/* double the buckets, the cache keeps working with the old ones on OOM */
+static void pcache_hash_grow(Pcache *c){
+  unsigned n_hash = c->n_hash * 2, i;
+  Pcache_Page **hash = sqlite3_malloc64(n_hash * sizeof(Pcache_Page*));
+  if(hash == NULL){
+    return;
+  }
+  memset(hash, 0, n_hash * sizeof(Pcache_Page*));
+  for(i = 0; i < c->n_hash; i++){
+    Pcache_Page *pg = c->hash[i];
+    while(pg){
+      Pcache_Page *next = pg->next_hash;
+      pg->next_hash = hash[pg->key & (n_hash - 1)];
+      hash[pg->key & (n_hash - 1)] = pg;
+      pg = next;
+    }
+  }
+  sqlite3_free(c->hash);
+  c->hash = hash;
+  c->n_hash = n_hash;
+}
+
+static void pcache_buf_free(Pcache *c, Pcache_Page *pg){
+  if(pg->hot){
+    sqlite3_free(pg->base.pBuf);
+    __atomic_sub_fetch(&pcache.hot_bytes, c->sz_page, __ATOMIC_RELAXED);
+    c->n_hot--;
+  }
+  else{
+    pcache_slot_free(c->cls, pg->base.pBuf);
+  }
+}
+
+/* take pg out of the cache, it keeps its buffer */
+static void pcache_remove(Pcache *c, Pcache_Page *pg){
+  pcache_hash_remove(c, pg);
+  if(!pg->pinned){
+    pcache_lru_remove(pg);
+  }
+  c->n_page--;
+}
+
+static void pcache_drop(Pcache *c, Pcache_Page *pg){
+  pcache_remove(c, pg);
+  pcache_buf_free(c, pg);
+  sqlite3_free(pg);
+}
+
+/* the least recently used unpinned page, cold ones first, out of the cache */
+static Pcache_Page *pcache_recycle(Pcache *c){
+  Pcache_Page *pg = pcache_lru_oldest(&c->cold);
+  if(pg == NULL){
+    pg = pcache_lru_oldest(&c->hot);
+  }
+  if(pg){
+    pcache_remove(c, pg);
+    PCACHE_STAT(recycled, 1);
+  }
+  return pg;
+}
+
+/* a new page, cold if there is a slot, otherwise hot within the budget */
+static Pcache_Page *pcache_alloc(Pcache *c, int force){
+  Pcache_Page *pg = sqlite3_malloc(sizeof(Pcache_Page) + c->sz_extra);
+  if(pg == NULL){
+    return NULL;
+  }
+  memset(pg, 0, sizeof(Pcache_Page));
+  pg->base.pExtra = &pg[1];
+  pg->base.pBuf = pcache_slot_alloc(c->cls);
+  if(pg->base.pBuf == NULL){
+    pg->base.pBuf = pcache_hot_alloc(c, force);
+    if(pg->base.pBuf == NULL){
+      sqlite3_free(pg);
+      return NULL;
+    }
+    pg->hot = 1;
+    c->n_hot++;
+  }
+  return pg;
+}
+
+/*
+** Move the unpinned cold page pg to DRAM. Its content stays behind, see
+** the overview: the page is handed back empty and SQLite rereads it.
+** Without budget left, the oldest hot page gives way once it went
+** unfetched for long enough: every time it is passed over its hits are
+** halved and it goes back to the young end, like the hand of a clock.
+** Both moves cost the promoted and later the dropped page a read.
+*/
+static void pcache_promote(Pcache *c, Pcache_Page *pg){
+  void *buf = pcache_hot_alloc(c, 0);
+  if(buf == NULL){
+    Pcache_Page *victim = pcache_lru_oldest(&c->hot);
+    if(victim == NULL){
+      return;
+    }
+    if(victim->hits){
+      victim->hits >>= 1;
+      pcache_lru_remove(victim);
+      pcache_lru_push(&c->hot, victim);
+      return;
+    }
+    pcache_drop(c, victim);
+    PCACHE_STAT(hot_drops, 1);
+    buf = pcache_hot_alloc(c, 0);
+    if(buf == NULL){
+      return;
+    }
+  }
+  pcache_slot_free(c->cls, pg->base.pBuf);
+  pg->base.pBuf = buf;
+  pg->hot = 1;
+  c->n_hot++;
+  *(void **)pg->base.pExtra = NULL;
+  PCACHE_STAT(promotions, 1);
+}
+
+static sqlite3_pcache *pcache_create(int sz_page, int sz_extra, int purgeable){
+  Pcache *c = sqlite3_malloc(sizeof(Pcache));
+  if(c == NULL){
+    return NULL;
+  }
+  memset(c, 0, sizeof(Pcache));
+  c->sz_page = sz_page;
+  c->sz_extra = (sz_extra + 7) & ~7;
+  c->purgeable = purgeable;
+  c->cls = pcache_class(sz_page);
+  c->n_hash = PMEM_PCACHE_INITIAL_BUCKETS;
+  c->hash = sqlite3_malloc64(c->n_hash * sizeof(Pcache_Page*));
+  if(c->hash == NULL){
+    sqlite3_free(c);
+    return NULL;
+  }
+  memset(c->hash, 0, c->n_hash * sizeof(Pcache_Page*));
+  pcache_lru_init(&c->hot);
+  pcache_lru_init(&c->cold);
+  return (sqlite3_pcache*)c;
+}
+
+static void pcache_cachesize(sqlite3_pcache *pc, int n_max){
+  Pcache *c = (Pcache*)pc;
+  Pcache_Page *pg;
+  c->n_max = n_max > 0 ? (unsigned)n_max : 0;
+  while(c->purgeable && c->n_page > c->n_max && (pg = pcache_recycle(c)) != NULL){
+    pcache_buf_free(c, pg);
+    sqlite3_free(pg);
+  }
+}
+
+static int pcache_pagecount(sqlite3_pcache *pc){
+  return (int)((Pcache*)pc)->n_page;
+}
+
+static sqlite3_pcache_page *pcache_fetch(sqlite3_pcache *pc, unsigned key, int create){
+  Pcache *c = (Pcache*)pc;
+  Pcache_Page *pg = c->hash[key & (c->n_hash - 1)];
+  PCACHE_STAT(fetches, 1);
+  while(pg && pg->key != key){
+    pg = pg->next_hash;
+  }
+
+  if(pg){
+    int was_pinned = pg->pinned;
+    if(!was_pinned){
+      pcache_lru_remove(pg);
+      pg->pinned = 1;
+    }
+    if(pg->hits < UINT16_MAX){
+      pg->hits++;
+    }
+    if(pg->hot){
+      PCACHE_STAT(hot_hits, 1);
+      return &pg->base;
+    }
+    PCACHE_STAT(cold_hits, 1);
+    if(create && c->purgeable && !was_pinned && pg->hits >= PMEM_PCACHE_PROMOTE){
+      pcache_promote(c, pg);
+    }
+    if(!pg->hot){
+      pmem_emu_read(c->sz_page);
+    }
+    return &pg->base;
+  }
+
+  if(!create){
+    return NULL;
+  }
+  if(c->purgeable && c->n_page >= c->n_max){
+    pg = pcache_recycle(c);
+    if(pg == NULL && create == 1){
+      return NULL;
+    }
+  }
+  if(pg == NULL){
+    pg = pcache_alloc(c, 0);
+  }
+  if(pg == NULL && c->purgeable){
+    pg = pcache_recycle(c);
+  }
+  if(pg == NULL && create == 2){
+    pg = pcache_alloc(c, 1);
+  }
+  if(pg == NULL){
+    return NULL;
+  }
+  pg->key = key;
+  pg->pinned = 1;
+  pg->hits = 0;
+  *(void **)pg->base.pExtra = NULL;
+  if(c->n_page >= c->n_hash){
+    pcache_hash_grow(c);
+  }
+  pcache_hash_insert(c, pg);
+  c->n_page++;
+  PCACHE_STAT(misses, 1);
+  if(!pg->hot){
+    pmem_emu_media(pg->base.pBuf, c->sz_page);
+  }
+  return &pg->base;
+}
+
+static void pcache_unpin(sqlite3_pcache *pc, sqlite3_pcache_page *page, int discard){
+  Pcache *c = (Pcache*)pc;
+  Pcache_Page *pg = (Pcache_Page*)page;
+  if(discard || (c->purgeable && c->n_page > c->n_max)){
+    pcache_drop(c, pg);
+    return;
+  }
+  pg->pinned = 0;
+  pcache_lru_push(pg->hot ? &c->hot : &c->cold, pg);
+}
+
+static void pcache_rekey(sqlite3_pcache *pc, sqlite3_pcache_page *page,
+                         unsigned old_key, unsigned new_key){
+  Pcache *c = (Pcache*)pc;
+  Pcache_Page *pg = (Pcache_Page*)page;
+  Pcache_Page *other = c->hash[new_key & (c->n_hash - 1)];
+  (void)old_key;
+  while(other && other->key != new_key){
+    other = other->next_hash;
+  }
+  if(other && other != pg){
+    pcache_drop(c, other);
+  }
+  pcache_hash_remove(c, pg);
+  pg->key = new_key;
+  pcache_hash_insert(c, pg);
+}
+
+/* drop all pages with a key of limit or more, pinned ones as well */
+static void pcache_truncate(sqlite3_pcache *pc, unsigned limit){
+  Pcache *c = (Pcache*)pc;
+  unsigned i;
+  for(i = 0; i < c->n_hash; i++){
+    Pcache_Page **pp = &c->hash[i];
+    while(*pp){
+      Pcache_Page *pg = *pp;
+      if(pg->key < limit){
+        pp = &pg->next_hash;
+        continue;
+      }
+      *pp = pg->next_hash;
+      if(!pg->pinned){
+        pcache_lru_remove(pg);
+      }
+      c->n_page--;
+      pcache_buf_free(c, pg);
+      sqlite3_free(pg);
+    }
+  }
+}
+
+static void pcache_destroy(sqlite3_pcache *pc){
+  Pcache *c = (Pcache*)pc;
+  pcache_truncate(pc, 0);
+  sqlite3_free(c->hash);
+  sqlite3_free(c);
+}
+
+/* give the DRAM of unpinned hot pages back */
+static void pcache_shrink(sqlite3_pcache *pc){
+  Pcache *c = (Pcache*)pc;
+  Pcache_Page *pg;
+  if(!c->purgeable){
+    return;
+  }
+  while((pg = pcache_lru_oldest(&c->hot)) != NULL){
+    pcache_drop(c, pg);
+  }
+}
+
+static const sqlite3_pcache_methods2 pcache_methods = {
+  1,                          /* iVersion */
+  NULL,                       /* pArg */
+  pcache_init,                /* xInit */
+  pcache_shutdown,            /* xShutdown */
+  pcache_create,              /* xCreate */
+  pcache_cachesize,           /* xCachesize */
+  pcache_pagecount,           /* xPagecount */
+  pcache_fetch,               /* xFetch */
+  pcache_unpin,               /* xUnpin */
+  pcache_rekey,               /* xRekey */
+  pcache_truncate,            /* xTruncate */
+  pcache_destroy,             /* xDestroy */
+  pcache_shrink               /* xShrink */
+};
+
+int sqlite3_pmem_pcache_install(const char *dir, u64 pmem_bytes, u64 dram_bytes){
+  if(dir == NULL || strlen(dir) >= sizeof(pcache.dir)){
+    return SQLITE_MISUSE;
+  }
+  strcpy(pcache.dir, dir);
+  pcache.pmem_bytes = pmem_bytes;
+  pcache.dram_bytes = dram_bytes;
+  return sqlite3_config(SQLITE_CONFIG_PCACHE2, &pcache_methods);
+}
+
+void sqlite3_pmem_pcache_stats(pmem_pcache_stats *out, int reset){
+  pmem_pcache_stats *s = &pcache.stats;
+  out->fetches = pmem_emu_take(&s->fetches, reset);
+  out->hot_hits = pmem_emu_take(&s->hot_hits, reset);
+  out->cold_hits = pmem_emu_take(&s->cold_hits, reset);
+  out->misses = pmem_emu_take(&s->misses, reset);
+  out->promotions = pmem_emu_take(&s->promotions, reset);
+  out->hot_drops = pmem_emu_take(&s->hot_drops, reset);
+  out->recycled = pmem_emu_take(&s->recycled, reset);
+  out->hot_bytes = __atomic_load_n(&pcache.hot_bytes, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&pcache.mutex);
+  out->cold_bytes = pcache.arena_used;
+  out->pmem_bytes = pcache.arena_size;
+  pthread_mutex_unlock(&pcache.mutex);
+}
+
+#endif /* !defined(SQLITE_TEST) || SQLITE_OS_UNIX */
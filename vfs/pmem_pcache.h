@@ -0,0 +1,54 @@
+#ifndef PMEM_PCACHE_H
+#define PMEM_PCACHE_H
+#include "pmem_vfs.h"
+
+/* hits a page takes on PMem before it is promoted to DRAM */
+#ifndef PMEM_PCACHE_PROMOTE
+# define PMEM_PCACHE_PROMOTE 3
+#endif
+
+/* hash buckets of a new cache, doubled as the cache grows */
+#ifndef PMEM_PCACHE_INITIAL_BUCKETS
+# define PMEM_PCACHE_INITIAL_BUCKETS 256
+#endif
+
+/*
+** Counters of all page caches, see sqlite3_pmem_pcache_stats(). The last
+** three are current sizes and are not reset.
+*/
+typedef struct pmem_pcache_stats pmem_pcache_stats;
+struct pmem_pcache_stats {
+  u64 fetches;            /* xFetch calls */
+  u64 hot_hits;           /* pages found in DRAM */
+  u64 cold_hits;          /* pages found on PMem */
+  u64 misses;             /* new pages, SQLite reads them from the database */
+  u64 promotions;         /* cold pages handed back empty to be reread into DRAM */
+  u64 hot_drops;          /* hot pages dropped to make room for a promotion */
+  u64 recycled;           /* pages reused for another page at cache_size */
+  u64 hot_bytes;          /* DRAM held by hot pages */
+  u64 cold_bytes;         /* PMem slots handed out */
+  u64 pmem_bytes;         /* size of the PMem tier */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Replaces SQLite's page cache with one that keeps its pages in an unnamed
+** sparse file of pmem_bytes in the directory dir, which should be on a DAX
+** file system, and the most used ones in up to dram_bytes of DRAM for all
+** connections together. Must be called before sqlite3_initialize(), which
+** creates the file; sqlite3_shutdown() removes it. Returns the result of
+** sqlite3_config().
+*/
+int sqlite3_pmem_pcache_install(const char *dir, u64 pmem_bytes, u64 dram_bytes);
+
+/* copy the page cache counters, reset them if reset is non-zero */
+void sqlite3_pmem_pcache_stats(pmem_pcache_stats *out, int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PMEM_PCACHE_H
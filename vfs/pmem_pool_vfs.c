@@ -0,0 +1,1307 @@
+/*
+** This file implements a VFS that keeps many small databases in one
+** preallocated pool file on pmem, for deployments with a database per
+** tenant where a file, a growing mapping and a "-shm" file per database
+** would cost more than the database itself.
+**
+** OVERVIEW
+**
+**   The pool file is laid out as
+**
+**        offset 0            Pool_Header
+**        entry_offset        Pool_Entry[n_entries], the directory
+**        data_offset         data area of n_units units of PMEM_POOL_UNIT
+**
+**   Every database, journal and WAL is a directory entry holding its name,
+**   its size and the first unit of each of its extents. Extent 0 and 1
+**   are one unit, every further extent doubles up to the largest order,
+**   after that they stay at that size. The extent and the offset within
+**   it follow from a file offset with a bit scan, and a file of n bytes
+**   takes about log2(n) extents.
+**
+**   Extents come from a buddy allocator with one order per extent size,
+**   so the slabs of one size are carved from larger ones and merge back
+**   when freed. Its free bitmaps are volatile: the used entries of the
+**   directory name every allocated extent, and attaching a pool rebuilds
+**   the free state from them. Everything persistent is ordered so the
+**   directory alone is always consistent:
+**
+**     create     write the entry, fence, set its state to used, fence
+**     grow       store the new extent numbers, fence, store n_extents
+**     shrink     store the size, fence, store n_extents, free the extents
+**     delete     clear the state, fence, free the extents
+**
+**   A crash at any point leaves every extent either named by a used entry
+**   or free after the next attach, there is no allocator log to recover.
+**   File data is copied with plain stores and flushed with the size of
+**   the file on xSync, as PMem_VFS does.
+**
+**   The pool file is mapped once per process and stays mapped, so opening
+**   and closing a database is a hash lookup in DRAM and a reference count,
+**   creating or deleting one costs one or two fences. An flock on the pool
+**   keeps other processes out, which lets locks and the WAL index of every
+**   file live in DRAM: connections of the process share a node per file
+**   with its lock state and its shm regions, the WAL index is rebuilt
+**   from the WAL like after any crash when the first connection maps it.
+**   Temp files go to the "unix" VFS.
+**
+** URI PARAMETERS
+**
+**   Only the open that attaches the pool reads them, later opens naming
+**   another pool get SQLITE_CANTOPEN.
+**
+**     pool=PATH          pool file (default PMEM_POOL_FILE)
+**     pool_size=N        size in bytes of a newly created pool file
+**     pool_files=N       directory entries of a newly created pool file
+*/
+
+#if !defined(SQLITE_TEST) || SQLITE_OS_UNIX
+
+#include "pmem_pool_vfs.h"
+#include "pmem_emulation.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* "PMHPPOOL" */
+#define POOL_MAGIC 0x4c4f4f5050484d50ULL
+
+#define POOL_UNIT ((u64)PMEM_POOL_UNIT)
+#define POOL_ORDERS (PMEM_POOL_MAX_ORDER + 1)
+#define POOL_EXTENTS 64
+#define POOL_ENTRY_SIZE 1024
+#define POOL_NAME_MAX (POOL_ENTRY_SIZE - 32 - POOL_EXTENTS * 4)
+#define POOL_NONE 0xffffffffu
+
+/* the data area starts on a huge page */
+#define POOL_ALIGN ((u64)2 << 20)
+
+#define POOL_ENTRY_FREE 0
+#define POOL_ENTRY_USED 1
+
+typedef struct Pool_Header Pool_Header;
+struct Pool_Header {
+  u64 magic;              /* POOL_MAGIC once the header is valid */
+  u32 unit;               /* PMEM_POOL_UNIT at creation time */
+  u32 max_order;          /* PMEM_POOL_MAX_ORDER at creation time */
+  u32 n_entries;          /* directory capacity */
+  u32 unused;
+  u64 entry_offset;       /* offset of the directory */
+  u64 data_offset;        /* offset of unit 0 */
+  u64 n_units;            /* units in the data area, whole largest extents */
+};
+
+/*
+** A directory entry. state, size and n_extents are each updated with a
+** single store, extent[] is only read below n_extents.
+*/
+typedef struct Pool_Entry Pool_Entry;
+struct Pool_Entry {
+  u64 state;              /* POOL_ENTRY_USED or POOL_ENTRY_FREE */
+  u64 size;               /* file size at the last xSync or xTruncate */
+  u64 hash;               /* pool_hash() of name */
+  u32 n_extents;
+  u32 unused;
+  u32 extent[POOL_EXTENTS]; /* first unit of each extent */
+  char name[POOL_NAME_MAX];
+};
+
+/*
+** Volatile state of a file while it is open, shared by all handles of the
+** process. Everything except size is protected by pool.mutex, size is
+** written under the lock SQLite holds to change the file.
+*/
+typedef struct Pool_Node Pool_Node;
+struct Pool_Node {
+  u32 entry;
+  int refs;               /* open handles */
+  int deleted;            /* removed from the directory, freed on last close */
+  int delete_on_close;
+  sqlite3_int64 size;     /* current size */
+  int n_shared;           /* handles holding SHARED or more */
+  struct Pool_File *reserved;
+  struct Pool_File *pending; /* holder of PENDING or EXCLUSIVE */
+  char **shm;             /* WAL index regions */
+  int n_shm;
+  int shm_refs;           /* handles that mapped the WAL index */
+  int shm_shared[SQLITE_SHM_NLOCK];
+  struct Pool_File *shm_excl[SQLITE_SHM_NLOCK];
+};
+
+/*
+** When using this VFS, the sqlite3_file* handles of pool files are
+** actually pointers to instances of type Pool_File. Temp files are "unix"
+** handles in the same memory.
+*/
+typedef struct Pool_File Pool_File;
+struct Pool_File {
+  sqlite3_file base;                  /* Base class. Must be first. */
+  Pool_Node *node;
+  Pool_Entry *e;
+  int lock_level;
+  sqlite3_int64 dirty_lo; /* byte range written since the last sync */
+  sqlite3_int64 dirty_hi;
+  int shm_mapped;
+  u16 shm_shared;         /* WAL index locks held by this handle */
+  u16 shm_excl;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  int fd;                 /* holds the flock of the pool */
+  pid_t pid;              /* process that attached the pool */
+  char path[MAXPATHNAME+1];
+  char *file;             /* the mapped pool file */
+  size_t size;
+  int is_pmem;
+  Pool_Header *hdr;
+  Pool_Entry *entries;
+  char *data;
+  u32 *index;             /* entry + 1 by name hash, linear probing */
+  u64 index_mask;
+  Pool_Node **nodes;      /* open files by entry */
+  u32 *free_entries;      /* stack of unused entries */
+  u32 n_free_entries;
+  u64 *free_map[POOL_ORDERS]; /* bit per free block of each order */
+  u64 free_words[POOL_ORDERS];
+  u64 free_hint[POOL_ORDERS]; /* no free block in the words below */
+  u64 n_free[POOL_ORDERS];
+  pmem_pool_stats stats;
+} pool = { PTHREAD_MUTEX_INITIALIZER, -1 };
+
+/*
+** Flush a range, pmem_msync() on mappings that are not pmem. The fence
+** of pool_drain() makes flushed ranges durable.
+*/
+static int pool_flush(const void *addr, size_t len){
+  if(pool.is_pmem){
+    pmem_emu_flush(addr, len);
+    return SQLITE_OK;
+  }
+  return pmem_msync(addr, len) ? SQLITE_IOERR_FSYNC : SQLITE_OK;
+}
+
+static void pool_drain(void){
+  if(pool.is_pmem){
+    pmem_emu_drain();
+  }
+}
+
+/* flush and fence a directory update */
+static int pool_persist(const void *addr, size_t len){
+  int rc = pool_flush(addr, len);
+  pool_drain();
+  pool.stats.meta_fences++;
+  return rc;
+}
+
+/* FNV-1a, never 0 */
+static u64 pool_hash(const char *name){
+  u64 h = 0xcbf29ce484222325ULL;
+  while(*name){
+    h = (h ^ (unsigned char)*name++) * 0x100000001b3ULL;
+  }
+  return h ? h : 1;
+}
+
+/*
+** Extent geometry in units: extent i has order 0 for i < 2 and i - 1
+** after that up to PMEM_POOL_MAX_ORDER, and starts at 2^(i-1).
+*/
+static u32 pool_extent_order(u32 i){
+  return i < 2 ? 0 : (i - 1 < PMEM_POOL_MAX_ORDER ? i - 1 : PMEM_POOL_MAX_ORDER);
+}
+static u64 pool_extent_start(u32 i){
+  if(i == 0){
+    return 0;
+  }
+  if(i <= PMEM_POOL_MAX_ORDER + 1){
+    return (u64)1 << (i - 1);
+  }
+  return (u64)(i - PMEM_POOL_MAX_ORDER) << PMEM_POOL_MAX_ORDER;
+}
+static u32 pool_extent_of(u64 unit){
+  if(unit == 0){
+    return 0;
+  }
+  if(unit < (u64)1 << PMEM_POOL_MAX_ORDER){
+    return 64 - __builtin_clzll(unit);
+  }
+  return (u32)(unit >> PMEM_POOL_MAX_ORDER) + PMEM_POOL_MAX_ORDER;
+}
+
+/* extents a file of size bytes needs */
+static u32 pool_extents_for(sqlite3_int64 size){
+  return size <= 0 ? 0 : pool_extent_of((size - 1) / POOL_UNIT) + 1;
+}
+
+/*
+** Address of byte offset of a file, *avail is set to the bytes left in
+** its extent. The extent must exist.
+*/
+static char *pool_addr(Pool_Entry *e, sqlite3_int64 offset, sqlite3_int64 *avail){
+  u32 i = pool_extent_of(offset / POOL_UNIT);
+  sqlite3_int64 in = offset - pool_extent_start(i) * POOL_UNIT;
+  *avail = (POOL_UNIT << pool_extent_order(i)) - in;
+  return pool.data + e->extent[i] * POOL_UNIT + in;
+}
+
+/*
+** Buddy allocator over the data area. A set bit b in free_map[k] is a
+** free block of 2^k units starting at unit b << k.
+*/
+static int pool_free_test(u32 order, u64 unit){
+  u64 b = unit >> order;
+  return (pool.free_map[order][b >> 6] >> (b & 63)) & 1;
+}
+static void pool_free_set(u32 order, u64 unit){
+  u64 b = unit >> order;
+  pool.free_map[order][b >> 6] |= (u64)1 << (b & 63);
+  if((b >> 6) < pool.free_hint[order]){
+    pool.free_hint[order] = b >> 6;
+  }
+  pool.n_free[order]++;
+}
+static void pool_free_clear(u32 order, u64 unit){
+  u64 b = unit >> order;
+  pool.free_map[order][b >> 6] &= ~((u64)1 << (b & 63));
+  pool.n_free[order]--;
+}
+
+/* take the lowest free block of an order */
+static int pool_free_take(u32 order, u64 *unit){
+  if(pool.n_free[order] == 0){
+    return 0;
+  }
+  u64 w = pool.free_hint[order];
+  while(pool.free_map[order][w] == 0){
+    w++;
+  }
+  pool.free_hint[order] = w;
+  *unit = ((w << 6) + __builtin_ctzll(pool.free_map[order][w])) << order;
+  pool_free_clear(order, *unit);
+  return 1;
+}
+
+static int pool_alloc(u32 order, u64 *unit){
+  u32 k = order;
+  while(k < POOL_ORDERS && !pool_free_take(k, unit)){
+    k++;
+  }
+  if(k == POOL_ORDERS){
+    return SQLITE_FULL;
+  }
+  while(k > order){
+    k--;
+    pool_free_set(k, *unit + ((u64)1 << k));
+  }
+  pool.stats.extent_allocs++;
+  pool.stats.used_bytes += POOL_UNIT << order;
+  return SQLITE_OK;
+}
+
+static void pool_release(u64 unit, u32 order){
+  pool.stats.extent_frees++;
+  pool.stats.used_bytes -= POOL_UNIT << order;
+  while(order < PMEM_POOL_MAX_ORDER){
+    u64 buddy = unit ^ ((u64)1 << order);
+    if(!pool_free_test(order, buddy)){
+      break;
+    }
+    pool_free_clear(order, buddy);
+    unit &= ~((u64)1 << order);
+    order++;
+  }
+  pool_free_set(order, unit);
+}
+
+/*
+** Mark an extent named by the directory as allocated while attaching: the
+** free block containing it is split down to its order.
+*/
+static int pool_reserve(u64 unit, u32 order){
+  if(unit & (((u64)1 << order) - 1) || unit + ((u64)1 << order) > pool.hdr->n_units){
+    return SQLITE_CORRUPT;
+  }
+  for(u32 k = order; k < POOL_ORDERS; k++){
+    u64 b = unit & ~(((u64)1 << k) - 1);
+    if(pool_free_test(k, b)){
+      pool_free_clear(k, b);
+      while(k > order){
+        k--;
+        pool_free_set(k, (unit & ~(((u64)1 << k) - 1)) ^ ((u64)1 << k));
+      }
+      pool.stats.used_bytes += POOL_UNIT << order;
+      return SQLITE_OK;
+    }
+  }
+  /* two entries name the same units */
+  return SQLITE_CORRUPT;
+}
+
+/*
+** Directory index by name.
+*/
+static u32 pool_lookup(const char *name, u64 hash){
+  u64 i = hash & pool.index_mask;
+  while(pool.index[i]){
+    Pool_Entry *e = &pool.entries[pool.index[i] - 1];
+    if(e->hash == hash && strcmp(e->name, name) == 0){
+      return pool.index[i] - 1;
+    }
+    i = (i + 1) & pool.index_mask;
+  }
+  return POOL_NONE;
+}
+static void pool_index_put(u32 entry){
+  u64 i = pool.entries[entry].hash & pool.index_mask;
+  while(pool.index[i]){
+    i = (i + 1) & pool.index_mask;
+  }
+  pool.index[i] = entry + 1;
+}
+static void pool_index_del(u32 entry){
+  u64 i = pool.entries[entry].hash & pool.index_mask;
+  while(pool.index[i] != entry + 1){
+    i = (i + 1) & pool.index_mask;
+  }
+  /* backward shift, later members of the run may move into the hole */
+  u64 j = i;
+  for(;;){
+    j = (j + 1) & pool.index_mask;
+    if(pool.index[j] == 0){
+      break;
+    }
+    u64 home = pool.entries[pool.index[j] - 1].hash & pool.index_mask;
+    if(((j - home) & pool.index_mask) >= ((j - i) & pool.index_mask)){
+      pool.index[i] = pool.index[j];
+      i = j;
+    }
+  }
+  pool.index[i] = 0;
+}
+
+/* give the extents of an entry no longer in the directory back */
+static void pool_entry_free(u32 entry){
+  Pool_Entry *e = &pool.entries[entry];
+  for(u32 i = 0; i < e->n_extents; i++){
+    pool_release(e->extent[i], pool_extent_order(i));
+  }
+  pool.free_entries[pool.n_free_entries++] = entry;
+  pool.stats.files--;
+}
+
+/* remove an entry from the directory, its extents stay with the caller */
+static int pool_entry_remove(u32 entry){
+  Pool_Entry *e = &pool.entries[entry];
+  pool_index_del(entry);
+  e->state = POOL_ENTRY_FREE;
+  pool.stats.deletes++;
+  return pool_persist(&e->state, sizeof(u64));
+}
+
+static int pool_entry_create(const char *name, u64 hash, u32 *entry){
+  if(pool.n_free_entries == 0){
+    return SQLITE_FULL;
+  }
+  u32 n = pool.free_entries[--pool.n_free_entries];
+  Pool_Entry *e = &pool.entries[n];
+  e->size = 0;
+  e->hash = hash;
+  e->n_extents = 0;
+  sqlite3_snprintf(POOL_NAME_MAX, e->name, "%s", name);
+  int rc = pool_persist(e, sizeof(Pool_Entry));
+  if(rc == SQLITE_OK){
+    e->state = POOL_ENTRY_USED;
+    rc = pool_persist(&e->state, sizeof(u64));
+  }
+  if(rc){
+    pool.free_entries[pool.n_free_entries++] = n;
+    return rc;
+  }
+  pool_index_put(n);
+  pool.stats.creates++;
+  pool.stats.files++;
+  *entry = n;
+  return SQLITE_OK;
+}
+
+/*
+** Give a file the extents for size bytes. The extent numbers are durable
+** before n_extents names them.
+*/
+static int pool_grow(Pool_Entry *e, sqlite3_int64 size){
+  u32 need = pool_extents_for(size);
+  u32 have = e->n_extents;
+  if(need <= have){
+    return SQLITE_OK;
+  }
+  if(need > POOL_EXTENTS){
+    return SQLITE_FULL;
+  }
+  for(u32 i = have; i < need; i++){
+    u64 unit;
+    int rc = pool_alloc(pool_extent_order(i), &unit);
+    if(rc){
+      while(i-- > have){
+        pool_release(e->extent[i], pool_extent_order(i));
+      }
+      return rc;
+    }
+    e->extent[i] = (u32)unit;
+  }
+  int rc = pool_persist(&e->extent[have], (need - have) * sizeof(u32));
+  if(rc == SQLITE_OK){
+    e->n_extents = need;
+    rc = pool_persist(&e->n_extents, sizeof(u32));
+  }
+  return rc;
+}
+
+/* flush the bytes [lo, hi) of a file, extent by extent */
+static int pool_flush_range(Pool_Entry *e, sqlite3_int64 lo, sqlite3_int64 hi){
+  int rc = SQLITE_OK;
+  while(lo < hi && rc == SQLITE_OK){
+    sqlite3_int64 avail;
+    char *addr = pool_addr(e, lo, &avail);
+    if(avail > hi - lo){
+      avail = hi - lo;
+    }
+    rc = pool_flush(addr, avail);
+    lo += avail;
+  }
+  return rc;
+}
+
+/* copy between a buffer and the extents of a file, zero fill if in is 0 */
+static void pool_copy_in(Pool_Entry *e, const char *in, int len, sqlite3_int64 offset){
+  while(len > 0){
+    sqlite3_int64 avail;
+    char *addr = pool_addr(e, offset, &avail);
+    int n = avail < len ? (int)avail : len;
+    if(in){
+      memcpy(addr, in, n);
+      in += n;
+    }
+    else{
+      memset(addr, 0, n);
+    }
+    offset += n;
+    len -= n;
+  }
+}
+static void pool_copy_out(Pool_Entry *e, char *out, int len, sqlite3_int64 offset){
+  while(len > 0){
+    sqlite3_int64 avail;
+    const char *addr = pool_addr(e, offset, &avail);
+    int n = avail < len ? (int)avail : len;
+    memcpy(out, addr, n);
+    out += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/*
+** Map an existing pool file or lay out a new one. Called with pool.mutex
+** held by the first open.
+*/
+static int pool_map(u64 size, u64 n_entries){
+  struct stat st;
+  int is_pmem;
+  if(fstat(pool.fd, &st)){
+    return SQLITE_IOERR_FSTAT;
+  }
+  if(st.st_size > 0){
+    pool.file = (char *)pmem_map_file(pool.path, 0, 0, 0666, &pool.size, &is_pmem);
+    if(pool.file == 0){
+      return SQLITE_CANTOPEN;
+    }
+    pool.is_pmem = pmem_emu_is_pmem(is_pmem);
+    Pool_Header *h = (Pool_Header*)pool.file;
+    if(pool.size < sizeof(Pool_Header) || h->magic != POOL_MAGIC || h->unit != PMEM_POOL_UNIT
+        || h->max_order != PMEM_POOL_MAX_ORDER
+        || h->entry_offset + (u64)h->n_entries * sizeof(Pool_Entry) > h->data_offset
+        || h->data_offset + h->n_units * POOL_UNIT > pool.size){
+      return SQLITE_NOTADB;
+    }
+    pool.hdr = h;
+    return SQLITE_OK;
+  }
+
+  u64 entry_offset = 4096;
+  u64 data_offset = entry_offset + n_entries * sizeof(Pool_Entry);
+  data_offset = (data_offset + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+  u64 largest = (u64)1 << PMEM_POOL_MAX_ORDER;
+  u64 n_units = size > data_offset ? (size - data_offset) / POOL_UNIT / largest * largest : 0;
+  if(n_units == 0){
+    return SQLITE_MISUSE;
+  }
+  /* preallocated, the data area never grows */
+  pool.file = (char *)pmem_map_file(pool.path, data_offset + n_units * POOL_UNIT, PMEM_FILE_CREATE,
+      0666, &pool.size, &is_pmem);
+  if(pool.file == 0){
+    return SQLITE_CANTOPEN;
+  }
+  pool.is_pmem = pmem_emu_is_pmem(is_pmem);
+  Pool_Header *h = (Pool_Header*)pool.file;
+  memset(h, 0, sizeof(Pool_Header));
+  h->unit = PMEM_POOL_UNIT;
+  h->max_order = PMEM_POOL_MAX_ORDER;
+  h->n_entries = n_entries;
+  h->entry_offset = entry_offset;
+  h->data_offset = data_offset;
+  h->n_units = n_units;
+  int rc = pool_persist(h, sizeof(Pool_Header));
+  h->magic = POOL_MAGIC;
+  if(rc == SQLITE_OK){
+    rc = pool_persist(&h->magic, sizeof(u64));
+  }
+  pool.hdr = h;
+  return rc;
+}
+
+/*
+** Rebuild the index, the free entries and the free bitmaps from the used
+** directory entries.
+*/
+static int pool_load(void){
+  Pool_Header *h = pool.hdr;
+  pool.entries = (Pool_Entry*)&pool.file[h->entry_offset];
+  pool.data = &pool.file[h->data_offset];
+
+  u64 n = 1;
+  while(n < 2 * (u64)h->n_entries){
+    n <<= 1;
+  }
+  pool.index_mask = n - 1;
+  pool.index = calloc(n, sizeof(u32));
+  pool.nodes = calloc(h->n_entries, sizeof(Pool_Node*));
+  pool.free_entries = malloc(h->n_entries * sizeof(u32));
+  if(pool.index == 0 || pool.nodes == 0 || pool.free_entries == 0){
+    return SQLITE_NOMEM;
+  }
+  for(u32 k = 0; k < POOL_ORDERS; k++){
+    pool.free_words[k] = ((h->n_units >> k) + 63) / 64;
+    pool.free_map[k] = calloc(pool.free_words[k], sizeof(u64));
+    if(pool.free_map[k] == 0){
+      return SQLITE_NOMEM;
+    }
+  }
+  for(u64 u = 0; u < h->n_units; u += (u64)1 << PMEM_POOL_MAX_ORDER){
+    pool_free_set(PMEM_POOL_MAX_ORDER, u);
+  }
+  pool.stats.max_files = h->n_entries;
+  pool.stats.pool_bytes = h->n_units * POOL_UNIT;
+
+  for(u32 i = h->n_entries; i-- > 0;){
+    Pool_Entry *e = &pool.entries[i];
+    if(e->state != POOL_ENTRY_USED){
+      pool.free_entries[pool.n_free_entries++] = i;
+      continue;
+    }
+    if(e->n_extents > POOL_EXTENTS || memchr(e->name, 0, POOL_NAME_MAX) == 0
+        || e->size > pool_extent_start(e->n_extents) * POOL_UNIT
+        || e->hash != pool_hash(e->name) || pool_lookup(e->name, e->hash) != POOL_NONE){
+      return SQLITE_CORRUPT;
+    }
+    for(u32 x = 0; x < e->n_extents; x++){
+      int rc = pool_reserve(e->extent[x], pool_extent_order(x));
+      if(rc){
+        return rc;
+      }
+    }
+    pool_index_put(i);
+    pool.stats.files++;
+  }
+  return SQLITE_OK;
+}
+
+static void pool_detach(void){
+  if(pool.file){
+    pmem_unmap(pool.file, pool.size);
+  }
+  free(pool.index);
+  free(pool.nodes);
+  free(pool.free_entries);
+  for(u32 k = 0; k < POOL_ORDERS; k++){
+    free(pool.free_map[k]);
+    pool.free_map[k] = 0;
+    pool.free_hint[k] = pool.n_free[k] = 0;
+  }
+  if(pool.fd >= 0){
+    close(pool.fd);
+  }
+  pool.file = 0;
+  pool.hdr = 0;
+  pool.index = 0;
+  pool.nodes = 0;
+  pool.free_entries = 0;
+  pool.n_free_entries = 0;
+  pool.fd = -1;
+  memset(&pool.stats, 0, sizeof(pool.stats));
+}
+
+/*
+** Attach the pool named by the uri parameters of file_path, or check that
+** they name the attached one. The mapping stays until the process exits.
+** A child forked later inherits the mapping and the flock but not a
+** current allocator, it must not use the pool.
+*/
+static int pool_attach(const char *file_path){
+  const char *path = sqlite3_uri_parameter(file_path, "pool");
+  if(pool.file){
+    if(pool.pid != getpid()){
+      return SQLITE_BUSY;
+    }
+    return path == 0 || strcmp(path, pool.path) == 0 ? SQLITE_OK : SQLITE_CANTOPEN;
+  }
+  if(path == 0){
+    path = PMEM_POOL_FILE;
+  }
+  sqlite3_int64 size = sqlite3_uri_int64(file_path, "pool_size", PMEM_POOL_SIZE);
+  sqlite3_int64 n_entries = sqlite3_uri_int64(file_path, "pool_files", PMEM_POOL_FILES);
+  if(size <= 0 || n_entries <= 0 || n_entries >= POOL_NONE){
+    return SQLITE_MISUSE;
+  }
+  sqlite3_snprintf(MAXPATHNAME, pool.path, "%s", path);
+  pool.fd = open(pool.path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if(pool.fd < 0){
+    return SQLITE_CANTOPEN;
+  }
+  int rc = SQLITE_OK;
+  if(flock(pool.fd, LOCK_EX | LOCK_NB)){
+    rc = errno == EWOULDBLOCK ? SQLITE_BUSY : SQLITE_IOERR_LOCK;
+  }
+  if(rc == SQLITE_OK){
+    rc = pool_map(size, n_entries);
+  }
+  if(rc == SQLITE_OK){
+    rc = pool_load();
+  }
+  if(rc){
+    pool_detach();
+  }
+  pool.pid = getpid();
+  return rc;
+}
+
+/*
+** In-process locks of a node, with the semantics of the "unix" VFS.
+*/
+static int pool_lock(sqlite3_file *pFile, int eLock){
+  Pool_File *p = (Pool_File*)pFile;
+  Pool_Node *n = p->node;
+  int rc = SQLITE_OK;
+  if(p->lock_level >= eLock){
+    return SQLITE_OK;
+  }
+  pthread_mutex_lock(&pool.mutex);
+  switch(eLock){
+    case SQLITE_LOCK_SHARED:
+      if(n->pending){
+        rc = SQLITE_BUSY;
+      }
+      else{
+        n->n_shared++;
+        p->lock_level = SQLITE_LOCK_SHARED;
+      }
+      break;
+    case SQLITE_LOCK_RESERVED:
+      if(n->reserved){
+        rc = SQLITE_BUSY;
+      }
+      else{
+        n->reserved = p;
+        p->lock_level = SQLITE_LOCK_RESERVED;
+      }
+      break;
+    default:
+      if(n->pending && n->pending != p){
+        rc = SQLITE_BUSY;
+        break;
+      }
+      /* PENDING keeps new readers out while the existing ones finish */
+      n->pending = p;
+      p->lock_level = SQLITE_LOCK_PENDING;
+      if(eLock == SQLITE_LOCK_EXCLUSIVE){
+        if(n->n_shared > 1){
+          rc = SQLITE_BUSY;
+        }
+        else{
+          p->lock_level = SQLITE_LOCK_EXCLUSIVE;
+        }
+      }
+      break;
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  return rc;
+}
+
+static void pool_unlock_locked(Pool_File *p, int eLock){
+  Pool_Node *n = p->node;
+  if(p->lock_level <= eLock){
+    return;
+  }
+  if(n->pending == p){
+    n->pending = 0;
+  }
+  if(eLock < SQLITE_LOCK_RESERVED && n->reserved == p){
+    n->reserved = 0;
+  }
+  if(eLock == SQLITE_LOCK_NONE){
+    n->n_shared--;
+  }
+  p->lock_level = eLock;
+}
+static int pool_unlock(sqlite3_file *pFile, int eLock){
+  Pool_File *p = (Pool_File*)pFile;
+  pthread_mutex_lock(&pool.mutex);
+  pool_unlock_locked(p, eLock);
+  pthread_mutex_unlock(&pool.mutex);
+  return SQLITE_OK;
+}
+static int pool_check_reserved_lock(sqlite3_file *pFile, int *pResOut){
+  Pool_File *p = (Pool_File*)pFile;
+  pthread_mutex_lock(&pool.mutex);
+  *pResOut = p->node->reserved != 0 || p->node->pending != 0;
+  pthread_mutex_unlock(&pool.mutex);
+  return SQLITE_OK;
+}
+
+static void pool_shm_release(Pool_File *p){
+  Pool_Node *n = p->node;
+  for(int i = 0; i < SQLITE_SHM_NLOCK; i++){
+    if(p->shm_excl & (1 << i)){
+      n->shm_excl[i] = 0;
+    }
+    if(p->shm_shared & (1 << i)){
+      n->shm_shared[i]--;
+    }
+  }
+  p->shm_excl = p->shm_shared = 0;
+  if(p->shm_mapped){
+    p->shm_mapped = 0;
+    if(--n->shm_refs == 0){
+      for(int i = 0; i < n->n_shm; i++){
+        free(n->shm[i]);
+      }
+      free(n->shm);
+      n->shm = 0;
+      n->n_shm = 0;
+    }
+  }
+}
+
+/*
+** Close a file. The last handle of a node frees it, and the extents of a
+** file deleted while it was open.
+*/
+static int pool_close(sqlite3_file *pFile){
+  Pool_File *p = (Pool_File*)pFile;
+  Pool_Node *n = p->node;
+  int rc = SQLITE_OK;
+  pthread_mutex_lock(&pool.mutex);
+  pool_unlock_locked(p, SQLITE_LOCK_NONE);
+  pool_shm_release(p);
+  if(--n->refs == 0){
+    if(n->delete_on_close && !n->deleted){
+      rc = pool_entry_remove(n->entry);
+      n->deleted = 1;
+    }
+    if(n->deleted){
+      pool_entry_free(n->entry);
+    }
+    pool.nodes[n->entry] = 0;
+    free(n);
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  return rc;
+}
+
+/*
+** Read data from a file. Past the end the buffer is zero filled.
+*/
+static int pool_read(
+  sqlite3_file *pFile,
+  void *buffer,
+  int buffer_size,
+  sqlite_int64 offset
+){
+  Pool_File *p = (Pool_File*)pFile;
+  sqlite3_int64 size = p->node->size;
+  int n = 0;
+  if(offset < size){
+    n = size - offset < buffer_size ? (int)(size - offset) : buffer_size;
+    pool_copy_out(p->e, (char*)buffer, n, offset);
+    if(pool.is_pmem){
+      pmem_emu_read(n);
+    }
+  }
+  if(n < buffer_size){
+    memset((char*)buffer + n, 0, buffer_size - n);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+static void pool_dirty(Pool_File *p, sqlite3_int64 lo, sqlite3_int64 hi){
+  if(p->dirty_hi == 0 || lo < p->dirty_lo){
+    p->dirty_lo = lo;
+  }
+  if(hi > p->dirty_hi){
+    p->dirty_hi = hi;
+  }
+}
+
+/* extend a file to end, the bytes between its old end and from are zeroed */
+static int pool_extend(Pool_File *p, sqlite3_int64 from, sqlite3_int64 end){
+  Pool_Node *n = p->node;
+  if(pool_extents_for(end) > p->e->n_extents){
+    pthread_mutex_lock(&pool.mutex);
+    int rc = pool_grow(p->e, end);
+    pthread_mutex_unlock(&pool.mutex);
+    if(rc){
+      return rc;
+    }
+  }
+  if(from > n->size){
+    /* extents are reused, a hole must not show an earlier file */
+    pool_copy_in(p->e, 0, (int)(from - n->size), n->size);
+    pool_dirty(p, n->size, from);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Write data to a file, growing it by the next extents if needed.
+*/
+static int pool_write(
+  sqlite3_file *pFile,
+  const void *buffer,
+  int buffer_size,
+  sqlite_int64 offset
+){
+  Pool_File *p = (Pool_File*)pFile;
+  sqlite3_int64 end = offset + buffer_size;
+  if(end > p->node->size){
+    int rc = pool_extend(p, offset, end);
+    if(rc){
+      return rc;
+    }
+  }
+  pool_copy_in(p->e, (const char*)buffer, buffer_size, offset);
+  pool_dirty(p, offset, end);
+  if(end > p->node->size){
+    p->node->size = end;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Shrinking persists the size before the extents past it are freed.
+*/
+static int pool_truncate(sqlite3_file *pFile, sqlite_int64 size){
+  Pool_File *p = (Pool_File*)pFile;
+  Pool_Node *n = p->node;
+  Pool_Entry *e = p->e;
+  int rc = SQLITE_OK;
+  if(size > n->size){
+    rc = pool_extend(p, size, size);
+    if(rc == SQLITE_OK){
+      n->size = size;
+    }
+    return rc;
+  }
+  n->size = size;
+  if(p->dirty_hi > size){
+    p->dirty_hi = size;
+  }
+  pthread_mutex_lock(&pool.mutex);
+  if((sqlite3_int64)e->size > size){
+    e->size = size;
+    rc = pool_persist(&e->size, sizeof(u64));
+  }
+  u32 keep = pool_extents_for(size);
+  if(rc == SQLITE_OK && keep < e->n_extents){
+    u32 have = e->n_extents;
+    e->n_extents = keep;
+    rc = pool_persist(&e->n_extents, sizeof(u32));
+    for(u32 i = keep; i < have; i++){
+      pool_release(e->extent[i], pool_extent_order(i));
+    }
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  return rc;
+}
+
+/*
+** Flush what this handle wrote since the last sync and then the size.
+*/
+static int pool_sync(sqlite3_file *pFile, int flags){
+  Pool_File *p = (Pool_File*)pFile;
+  Pool_Node *n = p->node;
+  int rc = SQLITE_OK;
+  sqlite3_int64 hi = p->dirty_hi < n->size ? p->dirty_hi : n->size;
+  if(hi > p->dirty_lo){
+    rc = pool_flush_range(p->e, p->dirty_lo, hi);
+  }
+  p->dirty_lo = p->dirty_hi = 0;
+  if(rc == SQLITE_OK && (sqlite3_int64)p->e->size != n->size){
+    /* the data must be durable before a size that covers it */
+    pool_drain();
+    p->e->size = n->size;
+    rc = pool_flush(&p->e->size, sizeof(u64));
+    pool.stats.meta_fences++;
+  }
+  pool_drain();
+  return rc;
+}
+
+static int pool_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
+  *pSize = ((Pool_File*)pFile)->node->size;
+  return SQLITE_OK;
+}
+
+/*
+** File control verbs implemented by this VFS:
+**
+**   SQLITE_FCNTL_SIZE_HINT     take the extents for the announced size at
+**                              once instead of one by one
+**   SQLITE_FCNTL_PMEM_POOL_STATS
+**                              copy the counters of the pool, see struct
+**                              pmem_pool_stats
+*/
+static int pool_file_control(sqlite3_file *pFile, int op, void *pArg){
+  Pool_File *p = (Pool_File*)pFile;
+  switch(op){
+    case SQLITE_FCNTL_SIZE_HINT: {
+      sqlite3_int64 hint = *(sqlite3_int64*)pArg;
+      pthread_mutex_lock(&pool.mutex);
+      int rc = pool_grow(p->e, hint);
+      pthread_mutex_unlock(&pool.mutex);
+      return rc;
+    }
+    case SQLITE_FCNTL_PMEM_POOL_STATS:
+      pthread_mutex_lock(&pool.mutex);
+      *(pmem_pool_stats*)pArg = pool.stats;
+      pthread_mutex_unlock(&pool.mutex);
+      return SQLITE_OK;
+  }
+  return SQLITE_NOTFOUND;
+}
+
+static int pool_sector_size(sqlite3_file *pFile){
+  return 64;
+}
+static int pool_device_characteristics(sqlite3_file *pFile){
+  return SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+}
+
+/*
+** The WAL index lives in DRAM regions of the node. Nothing else can map
+** it, the pool belongs to this process.
+*/
+static int pool_shm_map(
+  sqlite3_file *pFile,
+  int region_number,
+  int region_size,
+  int extend,
+  void volatile **pp
+){
+  Pool_File *p = (Pool_File*)pFile;
+  Pool_Node *n = p->node;
+  int rc = SQLITE_OK;
+  pthread_mutex_lock(&pool.mutex);
+  if(!p->shm_mapped){
+    p->shm_mapped = 1;
+    n->shm_refs++;
+  }
+  if(region_number >= n->n_shm && extend){
+    char **shm = realloc(n->shm, (region_number + 1) * sizeof(char*));
+    if(shm == 0){
+      rc = SQLITE_NOMEM;
+    }
+    else{
+      n->shm = shm;
+      while(n->n_shm <= region_number){
+        n->shm[n->n_shm] = calloc(1, region_size);
+        if(n->shm[n->n_shm] == 0){
+          rc = SQLITE_NOMEM;
+          break;
+        }
+        n->n_shm++;
+      }
+    }
+  }
+  *pp = region_number < n->n_shm ? n->shm[region_number] : 0;
+  pthread_mutex_unlock(&pool.mutex);
+  return rc;
+}
+
+static int pool_shm_lock(sqlite3_file *pFile, int ofst, int n_locks, int flags){
+  Pool_File *p = (Pool_File*)pFile;
+  Pool_Node *n = p->node;
+  u16 mask = (u16)((1 << (ofst + n_locks)) - (1 << ofst));
+  int rc = SQLITE_OK;
+  pthread_mutex_lock(&pool.mutex);
+  if(flags & SQLITE_SHM_UNLOCK){
+    for(int i = ofst; i < ofst + n_locks; i++){
+      if(p->shm_excl & (1 << i)){
+        n->shm_excl[i] = 0;
+      }
+      else if(p->shm_shared & (1 << i)){
+        n->shm_shared[i]--;
+      }
+    }
+    p->shm_excl &= ~mask;
+    p->shm_shared &= ~mask;
+  }
+  else if(flags & SQLITE_SHM_SHARED){
+    if((p->shm_shared & mask) == 0){
+      if(n->shm_excl[ofst]){
+        rc = SQLITE_BUSY;
+      }
+      else{
+        n->shm_shared[ofst]++;
+        p->shm_shared |= mask;
+      }
+    }
+  }
+  else{
+    for(int i = ofst; i < ofst + n_locks; i++){
+      if((n->shm_excl[i] && n->shm_excl[i] != p) || n->shm_shared[i] > 0){
+        rc = SQLITE_BUSY;
+      }
+    }
+    if(rc == SQLITE_OK){
+      for(int i = ofst; i < ofst + n_locks; i++){
+        n->shm_excl[i] = p;
+      }
+      p->shm_excl |= mask;
+    }
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  return rc;
+}
+
+static void pool_shm_barrier(sqlite3_file *pFile){
+  __sync_synchronize();
+}
+
+static int pool_shm_unmap(sqlite3_file *pFile, int deleteFlag){
+  pthread_mutex_lock(&pool.mutex);
+  pool_shm_release((Pool_File*)pFile);
+  pthread_mutex_unlock(&pool.mutex);
+  return SQLITE_OK;
+}
+
+/*
+** Extents are freed on truncate while SQLite may still hold a pointer, so
+** xFetch never hands one out and SQLite falls back to xRead.
+*/
+static int pool_fetch(sqlite3_file *pFile, sqlite3_int64 offset, int amount, void **pp){
+  *pp = 0;
+  return SQLITE_OK;
+}
+static int pool_unfetch(sqlite3_file *pFile, sqlite3_int64 offset, void *p){
+  return SQLITE_OK;
+}
+
+/*
+** Open a file handle. Everything with a name is a pool file.
+*/
+static int pool_open(
+  sqlite3_vfs *pVfs,
+  const char *file_path,
+  sqlite3_file *pFile,
+  int flags,
+  int *pOutFlags
+){
+  static const sqlite3_io_methods pool_io = {
+    3,                              /* iVersion */
+    pool_close,                     /* xClose */
+    pool_read,                      /* xRead */
+    pool_write,                     /* xWrite */
+    pool_truncate,                  /* xTruncate */
+    pool_sync,                      /* xSync */
+    pool_file_size,                 /* xFileSize */
+    pool_lock,                      /* xLock */
+    pool_unlock,                    /* xUnlock */
+    pool_check_reserved_lock,       /* xCheckReservedLock */
+    pool_file_control,              /* xFileControl */
+    pool_sector_size,               /* xSectorSize */
+    pool_device_characteristics,    /* xDeviceCharacteristics */
+    pool_shm_map,                   /* xShmMap */
+    pool_shm_lock,                  /* xShmLock */
+    pool_shm_barrier,               /* xShmBarrier */
+    pool_shm_unmap,                 /* xShmUnmap */
+    pool_fetch,                     /* xFetch */
+    pool_unfetch,                   /* xUnfetch */
+  };
+  sqlite3_vfs *root = (sqlite3_vfs*)pVfs->pAppData;
+
+  if(file_path == 0 || (flags & (SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TEMP_JOURNAL
+      | SQLITE_OPEN_SUBJOURNAL | SQLITE_OPEN_TRANSIENT_DB))){
+    return root->xOpen(root, file_path, pFile, flags, pOutFlags);
+  }
+  if(strlen(file_path) >= POOL_NAME_MAX){
+    return SQLITE_CANTOPEN;
+  }
+
+  Pool_File *p = (Pool_File*)pFile;
+  memset(p, 0, sizeof(Pool_File));
+  pthread_mutex_lock(&pool.mutex);
+  int rc = pool_attach(file_path);
+  u64 hash = pool_hash(file_path);
+  u32 entry = POOL_NONE;
+  if(rc == SQLITE_OK){
+    entry = pool_lookup(file_path, hash);
+    if(entry == POOL_NONE){
+      rc = flags & SQLITE_OPEN_CREATE ? pool_entry_create(file_path, hash, &entry) : SQLITE_CANTOPEN;
+    }
+    else if(flags & SQLITE_OPEN_EXCLUSIVE){
+      rc = SQLITE_CANTOPEN;
+    }
+  }
+  Pool_Node *n = 0;
+  if(rc == SQLITE_OK){
+    n = pool.nodes[entry];
+    if(n == 0){
+      n = calloc(1, sizeof(Pool_Node));
+      if(n == 0){
+        rc = SQLITE_NOMEM;
+      }
+      else{
+        n->entry = entry;
+        n->size = pool.entries[entry].size;
+        pool.nodes[entry] = n;
+      }
+    }
+  }
+  if(rc == SQLITE_OK){
+    n->refs++;
+    if(flags & SQLITE_OPEN_DELETEONCLOSE){
+      n->delete_on_close = 1;
+    }
+    pool.stats.opens++;
+    p->node = n;
+    p->e = &pool.entries[entry];
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  if(rc){
+    return rc;
+  }
+  if(pOutFlags){
+    *pOutFlags = flags;
+  }
+  p->base.pMethods = &pool_io;
+  return SQLITE_OK;
+}
+
+/*
+** Delete a file from the directory. An open file keeps its extents until
+** the last handle closes.
+*/
+static int pool_delete(sqlite3_vfs *pVfs, const char *zPath, int dirSync){
+  int rc = SQLITE_IOERR_DELETE_NOENT;
+  pthread_mutex_lock(&pool.mutex);
+  u32 entry = pool.file ? pool_lookup(zPath, pool_hash(zPath)) : POOL_NONE;
+  if(entry != POOL_NONE){
+    rc = pool_entry_remove(entry);
+    if(pool.nodes[entry]){
+      pool.nodes[entry]->deleted = 1;
+    }
+    else{
+      pool_entry_free(entry);
+    }
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  return rc;
+}
+
+static int pool_access(sqlite3_vfs *pVfs, const char *zPath, int flags, int *pResOut){
+  pthread_mutex_lock(&pool.mutex);
+  *pResOut = pool.file && pool_lookup(zPath, pool_hash(zPath)) != POOL_NONE;
+  pthread_mutex_unlock(&pool.mutex);
+  return SQLITE_OK;
+}
+
+/*
+** Everything else is forwarded to the "unix" VFS.
+*/
+#define ROOT(v) ((sqlite3_vfs*)(v)->pAppData)
+
+static int pool_full_pathname(sqlite3_vfs *pVfs, const char *zPath, int nOut, char *zOut){
+  return ROOT(pVfs)->xFullPathname(ROOT(pVfs), zPath, nOut, zOut);
+}
+static void *pool_dl_open(sqlite3_vfs *pVfs, const char *zPath){
+  return ROOT(pVfs)->xDlOpen(ROOT(pVfs), zPath);
+}
+static void pool_dl_error(sqlite3_vfs *pVfs, int nByte, char *zErrMsg){
+  ROOT(pVfs)->xDlError(ROOT(pVfs), nByte, zErrMsg);
+}
+static void (*pool_dl_sym(sqlite3_vfs *pVfs, void *pH, const char *z))(void){
+  return ROOT(pVfs)->xDlSym(ROOT(pVfs), pH, z);
+}
+static void pool_dl_close(sqlite3_vfs *pVfs, void *pHandle){
+  ROOT(pVfs)->xDlClose(ROOT(pVfs), pHandle);
+}
+static int pool_randomness(sqlite3_vfs *pVfs, int nByte, char *zByte){
+  return ROOT(pVfs)->xRandomness(ROOT(pVfs), nByte, zByte);
+}
+static int pool_sleep(sqlite3_vfs *pVfs, int microseconds){
+  return ROOT(pVfs)->xSleep(ROOT(pVfs), microseconds);
+}
+static int pool_current_time(sqlite3_vfs *pVfs, double *pTime){
+  return ROOT(pVfs)->xCurrentTime(ROOT(pVfs), pTime);
+}
+static int pool_get_last_error(sqlite3_vfs *pVfs, int nBuf, char *zBuf){
+  return ROOT(pVfs)->xGetLastError(ROOT(pVfs), nBuf, zBuf);
+}
+static int pool_current_time_int64(sqlite3_vfs *pVfs, sqlite3_int64 *piNow){
+  return ROOT(pVfs)->xCurrentTimeInt64(ROOT(pVfs), piNow);
+}
+
+/*
+** This function returns a pointer to the VFS implemented in this file.
+** To make the VFS available to SQLite:
+**
+**   sqlite3_vfs_register(sqlite3_pmem_pool_vfs(), 0);
+*/
+sqlite3_vfs *sqlite3_pmem_pool_vfs(void){
+  static sqlite3_vfs pool_vfs = {
+    2,                              /* iVersion */
+    0,                              /* szOsFile, set below */
+    MAXPATHNAME,                    /* mxPathname */
+    0,                              /* pNext */
+    "PMem_VFS_pool",                /* zName */
+    0,                              /* pAppData, the "unix" VFS */
+    pool_open,                      /* xOpen */
+    pool_delete,                    /* xDelete */
+    pool_access,                    /* xAccess */
+    pool_full_pathname,             /* xFullPathname */
+    pool_dl_open,                   /* xDlOpen */
+    pool_dl_error,                  /* xDlError */
+    pool_dl_sym,                    /* xDlSym */
+    pool_dl_close,                  /* xDlClose */
+    pool_randomness,                /* xRandomness */
+    pool_sleep,                     /* xSleep */
+    pool_current_time,              /* xCurrentTime */
+    pool_get_last_error,            /* xGetLastError */
+    pool_current_time_int64,        /* xCurrentTimeInt64 */
+  };
+  if(pool_vfs.pAppData == 0){
+    sqlite3_vfs *root = sqlite3_vfs_find("unix");
+    if(root == 0){
+      return 0;
+    }
+    pool_vfs.pAppData = root;
+    pool_vfs.szOsFile = sizeof(Pool_File) > (size_t)root->szOsFile ? sizeof(Pool_File) : root->szOsFile;
+    pool_vfs.mxPathname = root->mxPathname < POOL_NAME_MAX - 1 ? root->mxPathname : POOL_NAME_MAX - 1;
+  }
+  return &pool_vfs;
+}
+
+#endif /* !defined(SQLITE_TEST) || SQLITE_OS_UNIX */
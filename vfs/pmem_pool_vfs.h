@@ -0,0 +1,67 @@
+#ifndef PMEM_POOL_VFS_H
+#define PMEM_POOL_VFS_H
+#include "pmem_vfs.h"
+
+/* pool file attached by the first open, overridden by the "pool" uri param */
+#ifndef PMEM_POOL_FILE
+# define PMEM_POOL_FILE "/mnt/pmem0/scheinost/pool"
+#endif
+
+/* size of a new pool file, overridden by the "pool_size" uri param */
+#ifndef PMEM_POOL_SIZE
+# define PMEM_POOL_SIZE ((u64)4 << 30)
+#endif
+
+/* directory entries of a new pool file, one per database, journal or WAL */
+#ifndef PMEM_POOL_FILES
+# define PMEM_POOL_FILES 16384
+#endif
+
+/*
+** Smallest extent, the PMEM_LEN a file of PMem_VFS starts with. The first
+** two extents of a file have this size, every further one doubles up to
+** PMEM_POOL_UNIT << PMEM_POOL_MAX_ORDER.
+*/
+#ifndef PMEM_POOL_UNIT
+# define PMEM_POOL_UNIT 8192
+#endif
+
+#ifndef PMEM_POOL_MAX_ORDER
+# define PMEM_POOL_MAX_ORDER 13
+#endif
+
+/*
+** Counters returned by SQLITE_FCNTL_PMEM_POOL_STATS on any file of the
+** pool. The last four are current sizes.
+*/
+typedef struct pmem_pool_stats pmem_pool_stats;
+struct pmem_pool_stats {
+  u64 opens;              /* files opened */
+  u64 creates;            /* directory entries written for new files */
+  u64 deletes;            /* files removed from the directory */
+  u64 extent_allocs;      /* extents taken from the allocator */
+  u64 extent_frees;       /* extents given back */
+  u64 meta_fences;        /* fences persisting directory entries and sizes */
+  u32 files;              /* files in the directory */
+  u32 max_files;          /* directory capacity */
+  u64 used_bytes;         /* bytes held by extents */
+  u64 pool_bytes;         /* bytes of the data area */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Returns the "PMem_VFS_pool" VFS. Databases, journals and WALs are kept
+** as extent lists in one preallocated pool file on pmem that each process
+** maps once, temp files go to the "unix" VFS. Must be called after
+** sqlite3_initialize().
+*/
+sqlite3_vfs *sqlite3_pmem_pool_vfs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PMEM_POOL_VFS_H
@@ -0,0 +1,45 @@
+#ifndef PMEM_PROBES_H
+#define PMEM_PROBES_H
+/*
+** Static tracepoints of the PMem VFS. Built with PMEM_VFS_USDT defined
+** (cmake -DPMEM_VFS_USDT=ON, needs <sys/sdt.h> from systemtap), every entry
+** point fires the USDT probes pmem_vfs:NAME_entry and pmem_vfs:NAME_exit:
+**
+**     NAME_entry(kind, a, b, tsc)     kind: 0 main db, 1 WAL, 2 other file
+**     NAME_exit(kind, rc, tsc)        tsc: rdtsc at the probe
+**
+** with NAME one of open, close, read, write (a = offset, b = length), sync,
+** truncate (a = size), remap (a = new mapping size), shm_map (a = region),
+** shm_barrier, flush (a = length) and fence. Flush and fence of a group
+** commit batch have kind 3 and a = batch size. The exits also feed the
+** in-process counters read by sqlite3_pmem_probe_stats().
+**
+** Without PMEM_VFS_USDT all of this compiles to nothing.
+*/
+
+#define PMEM_PROBE_KIND(p) ((p)->is_main_db ? 0 : (p)->is_wal ? 1 : 2)
+#define PMEM_PROBE_FLAGS_KIND(flags) \
+    ((flags) & SQLITE_OPEN_MAIN_DB ? 0 : (flags) & SQLITE_OPEN_WAL ? 1 : 2)
+
+#ifdef PMEM_VFS_USDT
+# include <sys/sdt.h>
+# include <x86intrin.h>
+
+void pmem_probe_count(int component, u64 start, u64 end);
+
+# define PMEM_PROBE_ENTRY(t, name, kind, a, b) \
+    u64 t = __rdtsc(); \
+    STAP_PROBEV(pmem_vfs, name##_entry, (int)(kind), (i64)(a), (i64)(b), t)
+
+/* component is one of PMEM_PROBE_WAL_APPEND.., or -1 to only fire the probe */
+# define PMEM_PROBE_EXIT(t, name, kind, rc, component) do{ \
+    u64 t##_end = __rdtsc(); \
+    pmem_probe_count((component), t, t##_end); \
+    STAP_PROBEV(pmem_vfs, name##_exit, (int)(kind), (int)(rc), t##_end); \
+  }while(0)
+#else
+# define PMEM_PROBE_ENTRY(t, name, kind, a, b) ((void)0)
+# define PMEM_PROBE_EXIT(t, name, kind, rc, component) ((void)0)
+#endif
+
+#endif // PMEM_PROBES_H
@@ -0,0 +1,981 @@
+/*
+** This file implements a VFS that keeps the main database file as shadow
+** pages on pmem, so every page reaches the media once per commit instead
+** of once in the WAL and once more at checkpoint.
+**
+** OVERVIEW
+**
+**   The database file holds no plain SQLite image. It is laid out as
+**
+**        offset 0            Shadow_Header, root and the two superblocks
+**        table_offset        u64 entry[max_pages][2]  (persistent page table)
+**        slot_offset         page slots of PMEM_SHADOW_PAGE_SIZE, from slot 1
+**
+**   A page table entry is (epoch << SHADOW_SLOT_BITS) | slot. Every page
+**   has two entries, the one with the highest epoch not above the root is
+**   the committed copy of the page. The root is the epoch of the last
+**   commit, super[root & 1] holds the database size of that commit.
+**
+**   Writes never touch a committed slot. The first write of a page after a
+**   commit copies it into a free slot and later writes of the same batch
+**   go there. A commit persists the new slots, stores (epoch, slot) into
+**   the non-committed entry of every written page and the size into
+**   super[epoch & 1], fences, then stores the epoch into the root with a
+**   single 8 byte store and fences again. A crash before the root store
+**   leaves the previous commit in place, entries above the root are
+**   ignored and cleared before the next batch writes to the table. The
+**   commit announces its epoch in the header before the first entry, so
+**   connections that stay open and see the root unchanged still find
+**   the entries of a writer that died when they take RESERVED.
+**
+**   The slots replaced by a commit are free as soon as the root is
+**   persisted: a writer needs the EXCLUSIVE lock to commit, so no reader
+**   of the old version is left. Reclaiming them is a push onto the free
+**   slot stack per written page, there is no checkpoint.
+**
+**   Batches end with SQLITE_FCNTL_COMMIT_ATOMIC_WRITE (the VFS reports
+**   SQLITE_IOCAP_BATCH_ATOMIC, used when SQLite is built with
+**   SQLITE_ENABLE_BATCH_ATOMIC_WRITE), with SQLITE_FCNTL_SYNC, which the
+**   pager sends at every commit even with synchronous=OFF, or with xSync,
+**   whichever comes first. A batch still open when the lock drops below
+**   RESERVED or the file is closed is rolled back: the pager only gets
+**   there without a commit on its error path. journal_mode=MEMORY or
+**   journal_mode=DELETE with batch atomic writes then write every page
+**   exactly once.
+**
+**   The page -> slot map and the free slots are kept in DRAM and rebuilt
+**   from the page table on open and whenever a SHARED lock finds a root
+**   written by another connection. Locking of the main database, journals
+**   and temp files goes to the "unix" VFS. There is no shared memory, so
+**   SQLite refuses WAL mode unless locking_mode=EXCLUSIVE: a WAL reader
+**   holds SHARED as long as its connection is open and would keep reading
+**   slots that a checkpoint of another connection freed and reused.
+**
+** URI PARAMETERS
+**
+**     max_pages=N        page table capacity of a newly created file
+*/
+
+#if !defined(SQLITE_TEST) || SQLITE_OS_UNIX
+
+#include "pmem_shadow_vfs.h"
+#include "pmem_emulation.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* "PMHPSHDW" */
+#define SHADOW_MAGIC 0x5744485350484d50ULL
+
+#define SHADOW_PS ((sqlite3_int64)PMEM_SHADOW_PAGE_SIZE)
+
+#define SHADOW_SLOT_BITS 24
+#define SHADOW_MAX_SLOTS ((1u << SHADOW_SLOT_BITS) - 1)
+#define SHADOW_SLOT(e) ((u32)((e) & SHADOW_MAX_SLOTS))
+#define SHADOW_EPOCH(e) ((e) >> SHADOW_SLOT_BITS)
+#define SHADOW_ENTRY(epoch, slot) (((u64)(epoch) << SHADOW_SLOT_BITS) | (slot))
+
+/*
+** Header at offset 0 of the database file. The root and the superblocks
+** each have a cache line of their own.
+*/
+typedef struct Shadow_Header Shadow_Header;
+struct Shadow_Header {
+  u64 magic;              /* SHADOW_MAGIC once the header is valid */
+  u32 page_size;          /* PMEM_SHADOW_PAGE_SIZE at creation time */
+  u32 max_pages;          /* pages covered by the page table */
+  u64 table_offset;       /* offset of the page table */
+  u64 slot_offset;        /* offset of slot 1 */
+  u32 table_used;         /* pages below this may have table entries */
+  u32 unused[7];
+  u64 root;               /* epoch of the last commit */
+  u64 pending;            /* epoch of a commit writing entries, above root
+                          ** until it stores the root */
+  u64 pad[6];
+  struct {
+    u64 epoch;            /* commit this superblock belongs to */
+    u64 size;             /* database size in bytes */
+    u64 pad[6];
+  } super[2];
+};
+
+/*
+** When using this VFS, the sqlite3_file* handles of main databases are
+** actually pointers to instances of type Shadow_File. The "unix" handle of
+** the same file, used for locking only, is placed directly behind it.
+*/
+typedef struct Shadow_File Shadow_File;
+struct Shadow_File {
+  sqlite3_file base;                  /* Base class. Must be first. */
+  sqlite3_file *lock;     /* database file opened through "unix" */
+  char path[MAXPATHNAME+1];
+  char *file;             /* the mapped database file */
+  size_t size;            /* mapped size */
+  int is_pmem;
+  Shadow_Header *hdr;
+  u64 *table;             /* entry[max_pages][2] */
+  char *slots;            /* slot 1 */
+  u32 n_slots;
+  u32 max_pages;
+  u64 root;               /* commit the volatile state below belongs to */
+  u64 next_epoch;         /* epoch of the open batch, above every entry */
+  sqlite3_int64 committed_size;
+  sqlite3_int64 db_size;  /* size including the open batch */
+  u64 valid_pages;        /* committed slots of pages from here on were
+                          ** truncated by the open batch */
+  u32 *page_slot;         /* page -> slot including the open batch, 0: hole */
+  u8 *page_dirty;         /* page has a fresh slot in the open batch */
+  u32 *dirty;             /* pages with a fresh slot */
+  u32 *dirty_old;         /* their committed slots */
+  u32 n_dirty;
+  u32 n_dirty_alloc;
+  u32 *free_slots;        /* stack of free slot numbers */
+  u32 n_free;
+  int garbage;            /* table entries of a crashed batch were seen */
+  int lock_level;
+  pmem_shadow_stats stats;
+};
+
+static char *shadow_slot(Shadow_File *p, u32 slot){
+  return &p->slots[(slot - 1) * SHADOW_PS];
+}
+
+/*
+** Flush a range, pmem_msync() on mappings that are not pmem. The fence
+** of shadow_drain() makes flushed ranges durable.
+*/
+static int shadow_flush(Shadow_File *p, const void *addr, size_t len){
+  if(p->is_pmem){
+    pmem_emu_flush(addr, len);
+    return SQLITE_OK;
+  }
+  return pmem_msync(addr, len) ? SQLITE_IOERR_FSYNC : SQLITE_OK;
+}
+
+static void shadow_drain(Shadow_File *p){
+  if(p->is_pmem){
+    pmem_emu_drain();
+  }
+}
+
+/*
+** Index of the committed entry of page pg as of root, -1 if the page has
+** none.
+*/
+static int shadow_current(Shadow_File *p, u64 pg, u64 root){
+  u64 *e = &p->table[2 * pg];
+  int best = -1;
+  for(int i = 0; i < 2; i++){
+    if(SHADOW_SLOT(e[i]) && SHADOW_EPOCH(e[i]) <= root
+        && (best < 0 || SHADOW_EPOCH(e[i]) > SHADOW_EPOCH(e[best]))){
+      best = i;
+    }
+  }
+  return best;
+}
+
+static void shadow_set_pointers(Shadow_File *p){
+  p->hdr = (Shadow_Header*)p->file;
+  p->table = (u64*)&p->file[p->hdr->table_offset];
+  p->slots = &p->file[p->hdr->slot_offset];
+  p->n_slots = (p->size - p->hdr->slot_offset) / SHADOW_PS;
+  if(p->n_slots > SHADOW_MAX_SLOTS){
+    p->n_slots = SHADOW_MAX_SLOTS;
+  }
+}
+
+/*
+** Map the file with at least size bytes, extending it if needed.
+*/
+static int shadow_map(Shadow_File *p, size_t size){
+  if(p->file){
+    pmem_unmap(p->file, p->size);
+    p->file = 0;
+  }
+  int is_pmem;
+  if(size){
+    p->file = (char *)pmem_map_file(p->path, size, PMEM_FILE_CREATE, 0666, &p->size, &is_pmem);
+  }
+  else{
+    p->file = (char *)pmem_map_file(p->path, 0, 0, 0666, &p->size, &is_pmem);
+  }
+  if(p->file == 0){
+    return SQLITE_IOERR_MMAP;
+  }
+  p->is_pmem = pmem_emu_is_pmem(is_pmem);
+  shadow_set_pointers(p);
+  return SQLITE_OK;
+}
+
+/*
+** Grow the file by GROW_FACTOR_FILE and put the new slots on the free
+** stack. Never shrinks a file another connection has grown further.
+*/
+static int shadow_grow(Shadow_File *p){
+  u64 n = (u64)p->n_slots * GROW_FACTOR_FILE;
+  if(n > SHADOW_MAX_SLOTS){
+    n = SHADOW_MAX_SLOTS;
+  }
+  if(n <= p->n_slots){
+    return SQLITE_FULL;
+  }
+  size_t size = p->hdr->slot_offset + n * SHADOW_PS;
+  struct stat st;
+  if(stat(p->path, &st) == 0 && (size_t)st.st_size > size){
+    size = st.st_size;
+    n = (size - p->hdr->slot_offset) / SHADOW_PS;
+    n = n > SHADOW_MAX_SLOTS ? SHADOW_MAX_SLOTS : n;
+  }
+  u32 *free_slots = realloc(p->free_slots, n * sizeof(u32));
+  if(free_slots == 0){
+    return SQLITE_NOMEM;
+  }
+  p->free_slots = free_slots;
+  u32 old = p->n_slots;
+  int rc = shadow_map(p, size);
+  if(rc){
+    return rc;
+  }
+  for(u32 s = p->n_slots; s > old; s--){
+    p->free_slots[p->n_free++] = s;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Rebuild the volatile state from the persistent page table.
+*/
+static int shadow_load(Shadow_File *p){
+  struct stat st;
+  if(stat(p->path, &st) == 0 && (size_t)st.st_size > p->size){
+    int rc = shadow_map(p, 0);
+    if(rc){
+      return rc;
+    }
+  }
+  u64 root = __atomic_load_n(&p->hdr->root, __ATOMIC_ACQUIRE);
+  if(p->hdr->super[root & 1].epoch != root){
+    return SQLITE_CORRUPT;
+  }
+  sqlite3_int64 size = p->hdr->super[root & 1].size;
+  u64 n_pages = (size + SHADOW_PS - 1) / SHADOW_PS;
+  u32 table_used = p->hdr->table_used;
+  if(n_pages > p->max_pages || table_used > p->max_pages){
+    return SQLITE_CORRUPT;
+  }
+
+  u32 *free_slots = realloc(p->free_slots, (p->n_slots ? p->n_slots : 1) * sizeof(u32));
+  u8 *used = calloc(p->n_slots + 1, 1);
+  if(free_slots == 0 || used == 0){
+    if(free_slots){
+      p->free_slots = free_slots;
+    }
+    free(used);
+    return SQLITE_NOMEM;
+  }
+  p->free_slots = free_slots;
+  memset(p->page_slot, 0, (size_t)p->max_pages * sizeof(u32));
+  memset(p->page_dirty, 0, p->max_pages);
+  p->n_dirty = 0;
+  p->garbage = 0;
+
+  u64 max_epoch = root;
+  for(u64 pg = 0; pg < table_used; pg++){
+    u64 *e = &p->table[2 * pg];
+    int cur = pg < n_pages ? shadow_current(p, pg, root) : -1;
+    for(int i = 0; i < 2; i++){
+      u32 slot = SHADOW_SLOT(e[i]);
+      if(slot == 0){
+        continue;
+      }
+      if(SHADOW_EPOCH(e[i]) > max_epoch){
+        max_epoch = SHADOW_EPOCH(e[i]);
+      }
+      if(i == cur){
+        if(slot > p->n_slots || used[slot]){
+          free(used);
+          return SQLITE_CORRUPT;
+        }
+        used[slot] = 1;
+        p->page_slot[pg] = slot;
+      }
+      else if(SHADOW_EPOCH(e[i]) > root || pg >= n_pages){
+        p->garbage = 1;
+      }
+    }
+  }
+  p->n_free = 0;
+  for(u32 s = p->n_slots; s > 0; s--){
+    if(!used[s]){
+      p->free_slots[p->n_free++] = s;
+    }
+  }
+  free(used);
+
+  p->root = root;
+  p->next_epoch = max_epoch + 1;
+  p->committed_size = size;
+  p->db_size = size;
+  p->valid_pages = n_pages;
+  return SQLITE_OK;
+}
+
+/*
+** Clear the entries left by a batch that never committed and by pages
+** beyond the committed size, so the next root cannot expose them. Called
+** by the writer before its first write to the table.
+*/
+static int shadow_clean(Shadow_File *p){
+  u64 n_pages = (p->committed_size + SHADOW_PS - 1) / SHADOW_PS;
+  int rc = SQLITE_OK;
+  for(u64 pg = 0; pg < p->hdr->table_used && rc == SQLITE_OK; pg++){
+    u64 *e = &p->table[2 * pg];
+    int cur = pg < n_pages ? shadow_current(p, pg, p->root) : -1;
+    for(int i = 0; i < 2; i++){
+      if(i != cur && SHADOW_SLOT(e[i])
+          && (SHADOW_EPOCH(e[i]) > p->root || pg >= n_pages)){
+        e[i] = 0;
+        rc = shadow_flush(p, &e[i], sizeof(u64));
+      }
+    }
+  }
+  shadow_drain(p);
+  if(rc == SQLITE_OK){
+    p->garbage = 0;
+    __atomic_store_n(&p->hdr->pending, p->root, __ATOMIC_RELEASE);
+  }
+  return rc;
+}
+
+/*
+** Give page pg a fresh slot for the open batch. The committed content is
+** carried over unless the write covers the whole page.
+*/
+static int shadow_dirty_page(Shadow_File *p, u32 pg, int whole){
+  if(p->n_free == 0){
+    int rc = shadow_grow(p);
+    if(rc){
+      return rc;
+    }
+  }
+  if(p->n_dirty == p->n_dirty_alloc){
+    u32 n = p->n_dirty_alloc ? p->n_dirty_alloc * 2 : 64;
+    u32 *dirty = realloc(p->dirty, n * sizeof(u32));
+    if(dirty == 0){
+      return SQLITE_NOMEM;
+    }
+    p->dirty = dirty;
+    u32 *dirty_old = realloc(p->dirty_old, n * sizeof(u32));
+    if(dirty_old == 0){
+      return SQLITE_NOMEM;
+    }
+    p->dirty_old = dirty_old;
+    p->n_dirty_alloc = n;
+  }
+  u32 slot = p->free_slots[--p->n_free];
+  u32 old = p->page_slot[pg];
+  if(!whole){
+    char *dst = shadow_slot(p, slot);
+    if(old && pg < p->valid_pages){
+      memcpy(dst, shadow_slot(p, old), SHADOW_PS);
+    }
+    else{
+      memset(dst, 0, SHADOW_PS);
+    }
+    p->stats.data_bytes += SHADOW_PS;
+  }
+  p->dirty[p->n_dirty] = pg;
+  p->dirty_old[p->n_dirty] = old;
+  p->n_dirty++;
+  p->page_dirty[pg] = 1;
+  p->page_slot[pg] = slot;
+  p->stats.page_writes++;
+  return SQLITE_OK;
+}
+
+/*
+** Make the open batch the committed state of the file.
+*/
+static int shadow_commit(Shadow_File *p){
+  int rc = SQLITE_OK;
+  u64 n_pages = (p->db_size + SHADOW_PS - 1) / SHADOW_PS;
+  u64 old_pages = (p->committed_size + SHADOW_PS - 1) / SHADOW_PS;
+  /* pages truncated and extended again by the batch commit as zeros */
+  for(u64 pg = p->valid_pages; pg < n_pages && pg < old_pages; pg++){
+    if(!p->page_dirty[pg] && p->page_slot[pg]){
+      if(p->garbage){
+        rc = shadow_clean(p);
+      }
+      if(rc == SQLITE_OK){
+        rc = shadow_dirty_page(p, pg, 0);
+      }
+      if(rc){
+        return rc;
+      }
+    }
+  }
+  if(p->n_dirty == 0 && p->db_size == p->committed_size){
+    return SQLITE_OK;
+  }
+  u64 epoch = p->next_epoch;
+  Shadow_Header *h = p->hdr;
+
+  /* the new slots, then the entries pointing at them */
+  u32 table_used = h->table_used;
+  for(u32 i = 0; i < p->n_dirty && rc == SQLITE_OK; i++){
+    u32 pg = p->dirty[i];
+    if(pg < n_pages){
+      rc = shadow_flush(p, shadow_slot(p, p->page_slot[pg]), SHADOW_PS);
+      if(pg >= table_used){
+        table_used = pg + 1;
+      }
+    }
+  }
+  if(rc == SQLITE_OK && table_used != h->table_used){
+    /* durable before any entry it covers, or a crash could hide one */
+    h->table_used = table_used;
+    rc = shadow_flush(p, &h->table_used, sizeof(u32));
+    shadow_drain(p);
+  }
+  /*
+  ** Other connections see it before any entry, no flush needed: after a
+  ** power failure every connection loads the table again.
+  */
+  __atomic_store_n(&h->pending, epoch, __ATOMIC_RELEASE);
+  for(u32 i = 0; i < p->n_dirty && rc == SQLITE_OK; i++){
+    u32 pg = p->dirty[i];
+    if(pg < n_pages){
+      int cur = shadow_current(p, pg, p->root);
+      u64 *e = &p->table[2 * (u64)pg + (cur == 0)];
+      __atomic_store_n(e, SHADOW_ENTRY(epoch, p->page_slot[pg]), __ATOMIC_RELAXED);
+      rc = shadow_flush(p, e, sizeof(u64));
+      p->stats.meta_bytes += sizeof(u64);
+    }
+  }
+  if(rc == SQLITE_OK){
+    h->super[epoch & 1].epoch = epoch;
+    h->super[epoch & 1].size = p->db_size;
+    rc = shadow_flush(p, &h->super[epoch & 1], 2 * sizeof(u64));
+  }
+  if(rc){
+    /* some entries of the epoch may be in the table, never reuse it */
+    p->garbage = 1;
+    p->next_epoch = epoch + 1;
+    return rc;
+  }
+  shadow_drain(p);
+
+  /* the commit point */
+  __atomic_store_n(&h->root, epoch, __ATOMIC_RELEASE);
+  rc = shadow_flush(p, &h->root, sizeof(u64));
+  shadow_drain(p);
+  if(rc){
+    return rc;
+  }
+  p->stats.meta_bytes += 3 * sizeof(u64);
+  p->stats.commits++;
+  p->root = epoch;
+  p->next_epoch = epoch + 1;
+
+  /* release the replaced slots */
+  for(u32 i = 0; i < p->n_dirty; i++){
+    u32 pg = p->dirty[i];
+    p->page_dirty[pg] = 0;
+    if(pg < n_pages){
+      if(p->dirty_old[i]){
+        p->free_slots[p->n_free++] = p->dirty_old[i];
+      }
+    }
+    else{
+      p->free_slots[p->n_free++] = p->page_slot[pg];
+      p->page_slot[pg] = p->dirty_old[i];
+    }
+  }
+  p->n_dirty = 0;
+
+  /* and those of truncated pages, whose entries must not come back */
+  for(u64 pg = n_pages; pg < old_pages; pg++){
+    u64 *e = &p->table[2 * pg];
+    e[0] = e[1] = 0;
+    shadow_flush(p, e, 2 * sizeof(u64));
+    if(p->page_slot[pg]){
+      p->free_slots[p->n_free++] = p->page_slot[pg];
+      p->page_slot[pg] = 0;
+    }
+  }
+  p->committed_size = p->db_size;
+  p->valid_pages = n_pages;
+  return SQLITE_OK;
+}
+
+/*
+** Drop the open batch.
+*/
+static void shadow_rollback(Shadow_File *p){
+  for(u32 i = p->n_dirty; i > 0; i--){
+    u32 pg = p->dirty[i - 1];
+    p->free_slots[p->n_free++] = p->page_slot[pg];
+    p->page_slot[pg] = p->dirty_old[i - 1];
+    p->page_dirty[pg] = 0;
+  }
+  p->n_dirty = 0;
+  p->db_size = p->committed_size;
+  p->valid_pages = (p->committed_size + SHADOW_PS - 1) / SHADOW_PS;
+  p->stats.rollbacks++;
+}
+
+static int shadow_close(sqlite3_file *pFile){
+  Shadow_File *p = (Shadow_File*)pFile;
+  if(p->n_dirty || p->db_size != p->committed_size){
+    /* nobody committed it, SQLite unlocks before a regular close */
+    shadow_rollback(p);
+  }
+  pmem_unmap(p->file, p->size);
+  free(p->page_slot);
+  free(p->page_dirty);
+  free(p->dirty);
+  free(p->dirty_old);
+  free(p->free_slots);
+  return p->lock->pMethods->xClose(p->lock);
+}
+
+/*
+** Read data from a file. Holes and everything beyond the end read as
+** zeros.
+*/
+static int shadow_read(
+  sqlite3_file *pFile,
+  void *buffer,
+  int buffer_size,
+  sqlite_int64 offset
+){
+  Shadow_File *p = (Shadow_File*)pFile;
+  char *out = (char*)buffer;
+  int rc = SQLITE_OK;
+
+  pmem_emu_read(buffer_size);
+  if(offset + buffer_size > p->db_size){
+    sqlite_int64 valid = offset < p->db_size ? p->db_size - offset : 0;
+    memset(out + valid, 0, buffer_size - valid);
+    buffer_size = valid;
+    rc = SQLITE_IOERR_SHORT_READ;
+  }
+  while(buffer_size > 0){
+    u64 pg = offset / SHADOW_PS;
+    int in_page = offset % SHADOW_PS;
+    int amount = SHADOW_PS - in_page;
+    if(amount > buffer_size){
+      amount = buffer_size;
+    }
+    u32 slot = p->page_slot[pg];
+    if(slot && (pg < p->valid_pages || p->page_dirty[pg])){
+      memcpy(out, shadow_slot(p, slot) + in_page, amount);
+    }
+    else{
+      memset(out, 0, amount);
+    }
+    out += amount;
+    offset += amount;
+    buffer_size -= amount;
+  }
+  return rc;
+}
+
+/*
+** Write data from a buffer into a file. Pages go to their slot of the
+** open batch, the committed copies stay untouched.
+*/
+static int shadow_write(
+  sqlite3_file *pFile,
+  const void *buffer,
+  int buffer_size,
+  sqlite_int64 offset
+){
+  Shadow_File *p = (Shadow_File*)pFile;
+  const char *in = (const char*)buffer;
+  int rc = SQLITE_OK;
+
+  if((offset + buffer_size + SHADOW_PS - 1) / SHADOW_PS > p->max_pages){
+    return SQLITE_FULL;
+  }
+  if(p->garbage){
+    rc = shadow_clean(p);
+  }
+  while(buffer_size > 0 && rc == SQLITE_OK){
+    u64 pg = offset / SHADOW_PS;
+    int in_page = offset % SHADOW_PS;
+    int amount = SHADOW_PS - in_page;
+    if(amount > buffer_size){
+      amount = buffer_size;
+    }
+    if(!p->page_dirty[pg]){
+      rc = shadow_dirty_page(p, pg, amount == SHADOW_PS);
+      if(rc){
+        break;
+      }
+    }
+    char *dst = shadow_slot(p, p->page_slot[pg]) + in_page;
+    if(p->is_pmem){
+      pmem_memcpy_nodrain(dst, in, amount);
+      pmem_emu_media(dst, amount);
+    }
+    else{
+      memcpy(dst, in, amount);
+    }
+    p->stats.data_bytes += amount;
+    in += amount;
+    offset += amount;
+    buffer_size -= amount;
+  }
+  if(offset > p->db_size){
+    p->db_size = offset;
+  }
+  return rc;
+}
+
+/*
+** Truncation is part of the open batch like any write. Pages cut off read
+** as zeros if the batch extends the file again: the committed slots of
+** whole pages are hidden behind valid_pages, slots of the batch and the
+** tail of a page cut in the middle are cleared.
+*/
+static int shadow_truncate(sqlite3_file *pFile, sqlite_int64 size){
+  Shadow_File *p = (Shadow_File*)pFile;
+  u64 n_pages = (size + SHADOW_PS - 1) / SHADOW_PS;
+  int rc = SQLITE_OK;
+
+  if(size >= p->db_size){
+    p->db_size = size;
+    return SQLITE_OK;
+  }
+  if(size % SHADOW_PS){
+    u64 pg = size / SHADOW_PS;
+    if(p->garbage){
+      rc = shadow_clean(p);
+    }
+    if(rc == SQLITE_OK && !p->page_dirty[pg]){
+      rc = shadow_dirty_page(p, pg, 0);
+    }
+    if(rc){
+      return rc;
+    }
+    memset(shadow_slot(p, p->page_slot[pg]) + size % SHADOW_PS, 0, SHADOW_PS - size % SHADOW_PS);
+  }
+  for(u32 i = 0; i < p->n_dirty; i++){
+    u32 pg = p->dirty[i];
+    if(pg >= n_pages && p->page_dirty[pg]){
+      memset(shadow_slot(p, p->page_slot[pg]), 0, SHADOW_PS);
+    }
+  }
+  if(n_pages < p->valid_pages){
+    p->valid_pages = n_pages;
+  }
+  p->db_size = size;
+  return SQLITE_OK;
+}
+
+static int shadow_sync(sqlite3_file *pFile, int flags){
+  return shadow_commit((Shadow_File*)pFile);
+}
+
+static int shadow_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
+  *pSize = ((Shadow_File*)pFile)->db_size;
+  return SQLITE_OK;
+}
+
+/*
+** Locking belongs to the "unix" handle. A new SHARED lock picks up commits
+** of other connections, dropping below RESERVED drops what is left of the
+** batch: a transaction that got to its commit already ended it with
+** SQLITE_FCNTL_SYNC.
+*/
+static int shadow_lock(sqlite3_file *pFile, int eLock){
+  Shadow_File *p = (Shadow_File*)pFile;
+  int rc = p->lock->pMethods->xLock(p->lock, eLock);
+  if(rc == SQLITE_OK && p->lock_level == SQLITE_LOCK_NONE && eLock >= SQLITE_LOCK_SHARED
+      && __atomic_load_n(&p->hdr->root, __ATOMIC_ACQUIRE) != p->root){
+    rc = shadow_load(p);
+    p->stats.reloads++;
+    if(rc){
+      p->lock->pMethods->xUnlock(p->lock, SQLITE_LOCK_NONE);
+      return rc;
+    }
+  }
+  if(rc == SQLITE_OK && eLock >= SQLITE_LOCK_RESERVED && p->lock_level < SQLITE_LOCK_RESERVED){
+    /* the root is ours to move now, a pending epoch above it died */
+    u64 pending = __atomic_load_n(&p->hdr->pending, __ATOMIC_ACQUIRE);
+    if(pending > p->root){
+      p->garbage = 1;
+      if(pending >= p->next_epoch){
+        p->next_epoch = pending + 1;
+      }
+    }
+  }
+  if(rc == SQLITE_OK){
+    p->lock_level = eLock;
+  }
+  return rc;
+}
+static int shadow_unlock(sqlite3_file *pFile, int eLock){
+  Shadow_File *p = (Shadow_File*)pFile;
+  if(eLock <= SQLITE_LOCK_SHARED && (p->n_dirty || p->db_size != p->committed_size)){
+    shadow_rollback(p);
+  }
+  p->lock_level = eLock;
+  return p->lock->pMethods->xUnlock(p->lock, eLock);
+}
+static int shadow_check_reserved_lock(sqlite3_file *pFile, int *pResOut){
+  Shadow_File *p = (Shadow_File*)pFile;
+  return p->lock->pMethods->xCheckReservedLock(p->lock, pResOut);
+}
+
+static int shadow_file_control(sqlite3_file *pFile, int op, void *pArg){
+  Shadow_File *p = (Shadow_File*)pFile;
+  switch(op){
+    case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+      return SQLITE_OK;
+    case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
+    case SQLITE_FCNTL_SYNC:
+      return shadow_commit(p);
+    case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+      shadow_rollback(p);
+      return SQLITE_OK;
+    case SQLITE_FCNTL_SIZE_HINT:
+      /* the "unix" handle must not grow the file behind the mapping */
+      return SQLITE_OK;
+    case SQLITE_FCNTL_PMEM_SHADOW_STATS:
+      *(pmem_shadow_stats*)pArg = p->stats;
+      ((pmem_shadow_stats*)pArg)->slots = p->n_slots;
+      ((pmem_shadow_stats*)pArg)->slots_used = p->n_slots - p->n_free;
+      return SQLITE_OK;
+  }
+  return p->lock->pMethods->xFileControl(p->lock, op, pArg);
+}
+
+static int shadow_sector_size(sqlite3_file *pFile){
+  return PMEM_SHADOW_PAGE_SIZE;
+}
+static int shadow_device_characteristics(sqlite3_file *pFile){
+  return SQLITE_IOCAP_BATCH_ATOMIC | SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+}
+
+/*
+** Pages are not contiguous in the file, so xFetch never hands out a
+** pointer and SQLite falls back to xRead.
+*/
+static int shadow_fetch(sqlite3_file *pFile, sqlite3_int64 offset, int amount, void **pp){
+  *pp = 0;
+  return SQLITE_OK;
+}
+static int shadow_unfetch(sqlite3_file *pFile, sqlite3_int64 offset, void *p){
+  return SQLITE_OK;
+}
+
+/*
+** Map an existing shadow file, or lay out a new one if the file is empty.
+*/
+static int shadow_map_file(Shadow_File *p, u64 max_pages){
+  struct stat st;
+  if(stat(p->path, &st)){
+    return SQLITE_CANTOPEN;
+  }
+  if(st.st_size > 0){
+    int rc = shadow_map(p, 0);
+    if(rc){
+      return SQLITE_CANTOPEN;
+    }
+    Shadow_Header *h = (Shadow_Header*)p->file;
+    if(p->size < SHADOW_PS || h->magic != SHADOW_MAGIC || h->page_size != PMEM_SHADOW_PAGE_SIZE
+        || h->slot_offset > p->size){
+      return SQLITE_NOTADB;
+    }
+    p->max_pages = h->max_pages;
+    return SQLITE_OK;
+  }
+
+  u64 table_offset = SHADOW_PS;
+  u64 table_bytes = max_pages * 2 * sizeof(u64);
+  u64 slot_offset = table_offset + ((table_bytes + SHADOW_PS - 1) / SHADOW_PS) * SHADOW_PS;
+  int rc = shadow_map(p, slot_offset + PMEM_SHADOW_INITIAL_SLOTS * SHADOW_PS);
+  if(rc){
+    return SQLITE_CANTOPEN;
+  }
+  Shadow_Header *h = (Shadow_Header*)p->file;
+  memset(h, 0, sizeof(Shadow_Header));
+  h->page_size = PMEM_SHADOW_PAGE_SIZE;
+  h->max_pages = max_pages;
+  h->table_offset = table_offset;
+  h->slot_offset = slot_offset;
+  rc = shadow_flush(p, h, sizeof(Shadow_Header));
+  shadow_drain(p);
+  h->magic = SHADOW_MAGIC;
+  if(rc == SQLITE_OK){
+    rc = shadow_flush(p, &h->magic, sizeof(u64));
+  }
+  shadow_drain(p);
+  shadow_set_pointers(p);
+  p->max_pages = max_pages;
+  return rc;
+}
+
+/*
+** Open a file handle. Only main databases are shadow paged.
+*/
+static int shadow_open(
+  sqlite3_vfs *pVfs,
+  const char *file_path,
+  sqlite3_file *pFile,
+  int flags,
+  int *pOutFlags
+){
+  static const sqlite3_io_methods shadow_io = {
+    3,                              /* iVersion */
+    shadow_close,                   /* xClose */
+    shadow_read,                    /* xRead */
+    shadow_write,                   /* xWrite */
+    shadow_truncate,                /* xTruncate */
+    shadow_sync,                    /* xSync */
+    shadow_file_size,               /* xFileSize */
+    shadow_lock,                    /* xLock */
+    shadow_unlock,                  /* xUnlock */
+    shadow_check_reserved_lock,     /* xCheckReservedLock */
+    shadow_file_control,            /* xFileControl */
+    shadow_sector_size,             /* xSectorSize */
+    shadow_device_characteristics,  /* xDeviceCharacteristics */
+    0,                              /* xShmMap */
+    0,                              /* xShmLock */
+    0,                              /* xShmBarrier */
+    0,                              /* xShmUnmap */
+    shadow_fetch,                   /* xFetch */
+    shadow_unfetch,                 /* xUnfetch */
+  };
+  sqlite3_vfs *root = (sqlite3_vfs*)pVfs->pAppData;
+
+  if(file_path == 0 || (flags & SQLITE_OPEN_MAIN_DB) == 0){
+    return root->xOpen(root, file_path, pFile, flags, pOutFlags);
+  }
+
+  Shadow_File *p = (Shadow_File*)pFile;
+  memset(p, 0, sizeof(Shadow_File));
+  p->lock = (sqlite3_file*)&p[1];
+  int rc = root->xOpen(root, file_path, p->lock, flags, pOutFlags);
+  if(rc){
+    return rc;
+  }
+  sqlite3_snprintf(MAXPATHNAME, p->path, "%s", file_path);
+
+  sqlite3_int64 max_pages = sqlite3_uri_int64(file_path, "max_pages", PMEM_SHADOW_MAX_PAGES);
+  if(max_pages <= 0 || max_pages > SHADOW_MAX_SLOTS){
+    rc = SQLITE_MISUSE;
+  }
+  if(rc == SQLITE_OK){
+    rc = shadow_map_file(p, max_pages);
+  }
+  if(rc == SQLITE_OK){
+    p->page_slot = malloc((size_t)p->max_pages * sizeof(u32));
+    p->page_dirty = malloc(p->max_pages);
+    if(p->page_slot == 0 || p->page_dirty == 0){
+      rc = SQLITE_NOMEM;
+    }
+  }
+  if(rc == SQLITE_OK){
+    rc = shadow_load(p);
+  }
+  if(rc){
+    if(p->file){
+      pmem_unmap(p->file, p->size);
+    }
+    free(p->page_slot);
+    free(p->page_dirty);
+    free(p->free_slots);
+    p->lock->pMethods->xClose(p->lock);
+    return rc;
+  }
+  p->base.pMethods = &shadow_io;
+  return SQLITE_OK;
+}
+
+/*
+** Everything except xOpen is forwarded to the "unix" VFS.
+*/
+#define ROOT(v) ((sqlite3_vfs*)(v)->pAppData)
+
+static int shadow_delete(sqlite3_vfs *pVfs, const char *zPath, int dirSync){
+  return ROOT(pVfs)->xDelete(ROOT(pVfs), zPath, dirSync);
+}
+static int shadow_access(sqlite3_vfs *pVfs, const char *zPath, int flags, int *pResOut){
+  return ROOT(pVfs)->xAccess(ROOT(pVfs), zPath, flags, pResOut);
+}
+static int shadow_full_pathname(sqlite3_vfs *pVfs, const char *zPath, int nOut, char *zOut){
+  return ROOT(pVfs)->xFullPathname(ROOT(pVfs), zPath, nOut, zOut);
+}
+static void *shadow_dl_open(sqlite3_vfs *pVfs, const char *zPath){
+  return ROOT(pVfs)->xDlOpen(ROOT(pVfs), zPath);
+}
+static void shadow_dl_error(sqlite3_vfs *pVfs, int nByte, char *zErrMsg){
+  ROOT(pVfs)->xDlError(ROOT(pVfs), nByte, zErrMsg);
+}
+static void (*shadow_dl_sym(sqlite3_vfs *pVfs, void *pH, const char *z))(void){
+  return ROOT(pVfs)->xDlSym(ROOT(pVfs), pH, z);
+}
+static void shadow_dl_close(sqlite3_vfs *pVfs, void *pHandle){
+  ROOT(pVfs)->xDlClose(ROOT(pVfs), pHandle);
+}
+static int shadow_randomness(sqlite3_vfs *pVfs, int nByte, char *zByte){
+  return ROOT(pVfs)->xRandomness(ROOT(pVfs), nByte, zByte);
+}
+static int shadow_sleep(sqlite3_vfs *pVfs, int microseconds){
+  return ROOT(pVfs)->xSleep(ROOT(pVfs), microseconds);
+}
+static int shadow_current_time(sqlite3_vfs *pVfs, double *pTime){
+  return ROOT(pVfs)->xCurrentTime(ROOT(pVfs), pTime);
+}
+static int shadow_get_last_error(sqlite3_vfs *pVfs, int nBuf, char *zBuf){
+  return ROOT(pVfs)->xGetLastError(ROOT(pVfs), nBuf, zBuf);
+}
+static int shadow_current_time_int64(sqlite3_vfs *pVfs, sqlite3_int64 *piNow){
+  return ROOT(pVfs)->xCurrentTimeInt64(ROOT(pVfs), piNow);
+}
+
+/*
+** This function returns a pointer to the VFS implemented in this file.
+** To make the VFS available to SQLite:
+**
+**   sqlite3_vfs_register(sqlite3_pmem_shadow_vfs(), 0);
+*/
+sqlite3_vfs *sqlite3_pmem_shadow_vfs(void){
+  static sqlite3_vfs shadow_vfs = {
+    2,                              /* iVersion */
+    0,                              /* szOsFile, set below */
+    MAXPATHNAME,                    /* mxPathname */
+    0,                              /* pNext */
+    "PMem_VFS_shadow",              /* zName */
+    0,                              /* pAppData, the "unix" VFS */
+    shadow_open,                    /* xOpen */
+    shadow_delete,                  /* xDelete */
+    shadow_access,                  /* xAccess */
+    shadow_full_pathname,           /* xFullPathname */
+    shadow_dl_open,                 /* xDlOpen */
+    shadow_dl_error,                /* xDlError */
+    shadow_dl_sym,                  /* xDlSym */
+    shadow_dl_close,                /* xDlClose */
+    shadow_randomness,              /* xRandomness */
+    shadow_sleep,                   /* xSleep */
+    shadow_current_time,            /* xCurrentTime */
+    shadow_get_last_error,          /* xGetLastError */
+    shadow_current_time_int64,      /* xCurrentTimeInt64 */
+  };
+  if(shadow_vfs.pAppData == 0){
+    sqlite3_vfs *root = sqlite3_vfs_find("unix");
+    if(root == 0){
+      return 0;
+    }
+    shadow_vfs.pAppData = root;
+    shadow_vfs.szOsFile = sizeof(Shadow_File) + root->szOsFile;
+    shadow_vfs.mxPathname = root->mxPathname;
+  }
+  return &shadow_vfs;
+}
+
+#endif /* !defined(SQLITE_TEST) || SQLITE_OS_UNIX */
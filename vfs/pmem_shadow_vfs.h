@@ -0,0 +1,53 @@
+#ifndef PMEM_SHADOW_VFS_H
+#define PMEM_SHADOW_VFS_H
+#include "pmem_vfs.h"
+
+/*
+** Granularity of the page table. Larger SQLite pages take several slots,
+** smaller ones share a slot.
+*/
+#ifndef PMEM_SHADOW_PAGE_SIZE
+# define PMEM_SHADOW_PAGE_SIZE 4096
+#endif
+
+/* page table capacity of a new database file, 2^20 pages ~ 4GB */
+#ifndef PMEM_SHADOW_MAX_PAGES
+# define PMEM_SHADOW_MAX_PAGES (1 << 20)
+#endif
+
+/* page slots of a new database file, grown by GROW_FACTOR_FILE when full */
+#ifndef PMEM_SHADOW_INITIAL_SLOTS
+# define PMEM_SHADOW_INITIAL_SLOTS 1024
+#endif
+
+/*
+** Counters returned by SQLITE_FCNTL_PMEM_SHADOW_STATS on the main database.
+*/
+typedef struct pmem_shadow_stats pmem_shadow_stats;
+struct pmem_shadow_stats {
+  u64 commits;            /* root swaps */
+  u64 rollbacks;          /* batches dropped by SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE */
+  u64 page_writes;        /* pages that got a fresh slot */
+  u64 data_bytes;         /* bytes copied into slots */
+  u64 meta_bytes;         /* page table, superblock and root bytes persisted */
+  u64 reloads;            /* page table rescans after another connection committed */
+  u32 slots;              /* page slots in the file */
+  u32 slots_used;         /* slots holding a committed or pending page */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Returns the "PMem_VFS_shadow" VFS. Main database files are kept as
+** shadow pages on pmem and committed with an atomic root swap, all other
+** files go to the "unix" VFS. Must be called after sqlite3_initialize().
+*/
+sqlite3_vfs *sqlite3_pmem_shadow_vfs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PMEM_SHADOW_VFS_H
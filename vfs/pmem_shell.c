@@ -0,0 +1,15 @@
+/*
+** Initialisation hook for the sqlite3 shell (SQLITE_SHELL_INIT_PROC).
+** Registers the PMem VFSes so they can be selected with "-vfs NAME" and
+** used by dot-commands like ".snapshot".
+*/
+#include "pmem_vfs.h"
+#include "pmem_tiered_vfs.h"
+#include "pmem_shadow_vfs.h"
+
+void sqlite3_pmem_shell_init(void){
+  sqlite3_initialize();
+  sqlite3_vfs_register(sqlite3_pmem_vfs(), 0);
+  sqlite3_vfs_register(sqlite3_pmem_tiered_vfs(), 0);
+  sqlite3_vfs_register(sqlite3_pmem_shadow_vfs(), 0);
+}
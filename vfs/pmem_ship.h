@@ -0,0 +1,73 @@
+#ifndef PMEM_SHIP_H
+#define PMEM_SHIP_H
+/*
+** WAL shipping ring shared between a primary using the PMem VFS and local
+** follower processes (see tools/pmem_follower.c).
+**
+** The primary publishes every xWrite() of a WAL opened with the "ship=NAME"
+** uri parameter into the POSIX shared memory object NAME:
+**
+**        offset 0                Ship_Ring header
+**        PMEM_SHIP_DATA          capacity bytes of records, used as a ring
+**
+** A record is a Ship_Record followed by len bytes of data, padded to 8
+** bytes. Positions are byte counts since the ring was created, a record at
+** position pos starts at PMEM_SHIP_DATA + pos % capacity and may wrap. The
+** writer stores the end of the record into reserved, copies the record and
+** then advances head with a release store, so a reader sees only complete
+** records. The writer never waits for readers: a reader checks reserved
+** after copying a record, like a seqlock, and if it is more than capacity
+** bytes past the record the copy may be torn. A reader that fell that far
+** behind has lost records and must start over from the files.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#define PMEM_SHIP_MAGIC 0x5053484950000002ULL
+#define PMEM_SHIP_DATA 64
+
+/* ring size of a new ring, overridden by the "ship_size" uri parameter */
+#ifndef PMEM_SHIP_RING_SIZE
+# define PMEM_SHIP_RING_SIZE ((uint64_t)64 << 20)
+#endif
+
+typedef struct Ship_Ring Ship_Ring;
+struct Ship_Ring {
+  uint64_t magic;
+  uint64_t capacity;        /* bytes of the record area */
+  uint64_t head;            /* position after the last complete record */
+  uint64_t generation;      /* bumped when the primary recreates the ring */
+  uint64_t reserved;        /* end of the record being copied, >= head */
+};
+
+typedef struct Ship_Record Ship_Record;
+struct Ship_Record {
+  uint32_t len;             /* bytes of data following the record */
+  uint32_t pad;
+  uint64_t offset;          /* WAL offset the data was written to */
+  uint64_t ts_ns;           /* CLOCK_REALTIME of the write */
+};
+
+static inline uint64_t pmem_ship_record_size(uint32_t len){
+  return (sizeof(Ship_Record) + len + 7) & ~(uint64_t)7;
+}
+
+/* copy n bytes at position pos out of the ring */
+static inline void pmem_ship_read(const Ship_Ring *r, uint64_t pos, void *out, uint64_t n){
+  const char *data = (const char*)r + PMEM_SHIP_DATA;
+  uint64_t at = pos % r->capacity;
+  uint64_t first = n < r->capacity - at ? n : r->capacity - at;
+  memcpy(out, data + at, first);
+  memcpy((char*)out + first, data, n - first);
+}
+
+/* copy n bytes into the ring at position pos */
+static inline void pmem_ship_write(Ship_Ring *r, uint64_t pos, const void *in, uint64_t n){
+  char *data = (char*)r + PMEM_SHIP_DATA;
+  uint64_t at = pos % r->capacity;
+  uint64_t first = n < r->capacity - at ? n : r->capacity - at;
+  memcpy(data + at, in, first);
+  memcpy(data, (const char*)in + first, n - first);
+}
+
+#endif // PMEM_SHIP_H
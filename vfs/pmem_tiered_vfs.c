@@ -0,0 +1,992 @@
+/*
+** This file implements a VFS that splits the main database file into a
+** hot and a cold tier.
+**
+** OVERVIEW
+**
+**   The database file itself (the cold tier) stays where the user put it,
+**   usually on an SSD, and is accessed through the "unix" VFS. Next to it a
+**   fixed-capacity hot file lives on pmem and holds copies of the most
+**   frequently accessed pages:
+**
+**        offset 0            Tier_Header
+**        map_offset          u64 slot_page[n_slots]   (persistent page map)
+**        slot_offset         n_slots * PMEM_TIER_PAGE_SIZE page slots
+**
+**   slot_page[s] is the logical page number + 1 that slot s holds, 0 if the
+**   slot is free. A page held in a slot is authoritative, the cold copy of
+**   it is stale until the page gets demoted again. The reverse map
+**   (page -> slot) and the access counters are kept in DRAM and rebuilt
+**   from slot_page[] on open.
+**
+**   Every pass through xRead()/xWrite() bumps the access counter of the
+**   touched page. When a cold page crosses PMEM_TIER_PROMOTE_THRESHOLD it is
+**   queued for the migration thread. That thread promotes queued pages into
+**   free slots or, if the hot tier is full, into the slot of a victim found
+**   with a CLOCK sweep that halves the counters it passes. The victim is
+**   written back and synced to the cold file before its slot is reused.
+**   Migration is throttled to "migrate_mbps" MB/s so it never competes
+**   with the foreground for more than that much bandwidth.
+**
+**   Ordering of a promotion: copy page into slot, persist slot, store and
+**   persist slot_page[s]. Ordering of a demotion: write page to cold file,
+**   sync cold file, clear and persist slot_page[s]. A crash at any point
+**   leaves every page with exactly one authoritative copy.
+**
+**   No I/O to the cold file happens under the mutex of the node. The
+**   migrator reserves the slot and marks the page it moves as busy, drops
+**   the mutex for the copy and takes it again to publish the new map
+**   entry; handles that touch a busy page wait for it. A handle marks a
+**   cold page it writes for the duration of the write, the migrator does
+**   not promote such a page.
+**
+**   Connections of one process share the maps, the hot file and the
+**   migration thread of a database. The maps live in this process only,
+**   so the hot file is flock()ed and another process opening the database
+**   gets SQLITE_BUSY. Journals, the WAL, temp files and the wal-index are
+**   not tiered and go straight to the "unix" VFS, as do locking and shared
+**   memory of the main database file.
+**
+** URI PARAMETERS
+**
+**     hot_file=PATH      location of the hot file
+**                        (default PMEM_TIER_HOT_DIR/<db name>-<hash>-hot,
+**                        hash of the full path of the database)
+**     hot_pages=N        capacity of a newly created hot file in pages
+**     migrate_mbps=N     migration bandwidth limit in MB/s
+*/
+
+#if !defined(SQLITE_TEST) || SQLITE_OS_UNIX
+
+#include "pmem_tiered_vfs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* "PMHPTIER" */
+#define TIER_MAGIC 0x5245495450484d50ULL
+
+/* size of the promotion candidate ring, must be a power of two */
+#define TIER_CANDIDATES 1024
+
+/* heat counters saturate at this value */
+#define TIER_MAX_HEAT 255
+
+#define TIER_PS ((sqlite3_int64)PMEM_TIER_PAGE_SIZE)
+
+/*
+** Header at offset 0 of the hot file.
+*/
+typedef struct Tier_Header Tier_Header;
+struct Tier_Header {
+  u64 magic;              /* TIER_MAGIC once the header is valid */
+  u32 page_size;          /* PMEM_TIER_PAGE_SIZE at creation time */
+  u32 n_slots;            /* number of page slots */
+  u64 map_offset;         /* offset of slot_page[] */
+  u64 slot_offset;        /* offset of the first page slot */
+  u64 cold_ino;           /* inode of the cold file the map belongs to */
+  u64 cold_dev;           /* and its device */
+};
+
+/*
+** The tiers of one database file, shared by all handles of the process
+** that have it open.
+*/
+typedef struct Tier_Node Tier_Node;
+struct Tier_Node {
+  Tier_Node *next;        /* list of open nodes */
+  int refs;               /* handles using the node */
+  dev_t dev;              /* identity of the cold file */
+  ino_t ino;
+  int fd;                 /* the cold file, for migration I/O */
+  int lock_fd;            /* holds the flock() of the hot file */
+  char hot_path[MAXPATHNAME+1];
+  char *hot_file;         /* the mapped hot file */
+  size_t hot_size;        /* mapped size of the hot file */
+  int hot_is_pmem;
+  int hot_dirty;          /* stores into slots not yet persisted */
+  Tier_Header *hdr;
+  u64 *slot_page;         /* persistent slot -> page + 1 map */
+  char *slots;            /* first page slot */
+  u32 n_slots;
+  u32 *free_slots;        /* stack of free slot numbers */
+  u32 n_free;
+  u32 clock_hand;         /* CLOCK position for victim selection */
+  u32 *page_slot;         /* volatile page -> slot + 1 map */
+  u8 *heat;               /* volatile access counter per page */
+  u16 *cold_writes;       /* writes to the cold copy in flight per page */
+  u64 n_pages;            /* entries in page_slot[], heat[] and cold_writes[] */
+  u64 busy;               /* page + 1 the migrator is moving, 0 if none */
+  u64 candidates[TIER_CANDIDATES];
+  u32 cand_head;
+  u32 cand_tail;
+  u64 migrate_bps;        /* migration bandwidth limit in bytes/s */
+  pthread_mutex_t mutex;  /* guards everything above against the migrator */
+  pthread_cond_t wake;
+  pthread_cond_t moved;   /* busy went back to 0 */
+  pthread_t migrator;
+  int stop;
+  pmem_tier_stats stats;
+};
+
+/*
+** When using this VFS, the sqlite3_file* handles of main databases are
+** actually pointers to instances of type Tiered_File. The "unix" handle of
+** the cold file is placed directly behind it.
+*/
+typedef struct Tiered_File Tiered_File;
+struct Tiered_File {
+  sqlite3_file base;                  /* Base class. Must be first. */
+  sqlite3_file *cold;     /* database file opened through "unix" */
+  Tier_Node *node;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  Tier_Node *list;
+} tier_nodes = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static int tier_persist(Tier_Node *p, const void *addr, size_t len){
+  if(p->hot_is_pmem){
+    pmem_persist(addr, len);
+    return SQLITE_OK;
+  }
+  return pmem_msync(addr, len) ? SQLITE_IOERR_FSYNC : SQLITE_OK;
+}
+
+/*
+** Make sure the volatile per-page arrays cover page n_pages-1.
+*/
+static int tier_grow_pages(Tier_Node *p, u64 n_pages){
+  if(n_pages <= p->n_pages){
+    return SQLITE_OK;
+  }
+  u64 n = p->n_pages ? p->n_pages : 1024;
+  while(n < n_pages){
+    n *= GROW_FACTOR_FILE;
+  }
+  u32 *page_slot = realloc(p->page_slot, n * sizeof(u32));
+  if(page_slot == 0){
+    return SQLITE_NOMEM;
+  }
+  p->page_slot = page_slot;
+  u8 *heat = realloc(p->heat, n);
+  if(heat == 0){
+    return SQLITE_NOMEM;
+  }
+  p->heat = heat;
+  u16 *cold_writes = realloc(p->cold_writes, n * sizeof(u16));
+  if(cold_writes == 0){
+    return SQLITE_NOMEM;
+  }
+  p->cold_writes = cold_writes;
+  memset(&p->page_slot[p->n_pages], 0, (n - p->n_pages) * sizeof(u32));
+  memset(&p->heat[p->n_pages], 0, n - p->n_pages);
+  memset(&p->cold_writes[p->n_pages], 0, (n - p->n_pages) * sizeof(u16));
+  p->n_pages = n;
+  return SQLITE_OK;
+}
+
+/*
+** Record an access to page pg and queue it for promotion once it gets hot.
+*/
+static void tier_touch(Tier_Node *p, u64 pg){
+  if(pg >= p->n_pages && tier_grow_pages(p, pg + 1)){
+    return;
+  }
+  if(p->heat[pg] < TIER_MAX_HEAT){
+    p->heat[pg]++;
+  }
+  if(p->heat[pg] == PMEM_TIER_PROMOTE_THRESHOLD && p->page_slot[pg] == 0){
+    if(p->cand_head - p->cand_tail < TIER_CANDIDATES){
+      p->candidates[p->cand_head++ % TIER_CANDIDATES] = pg;
+      pthread_cond_signal(&p->wake);
+    }
+  }
+}
+
+static void tier_free_slot(Tier_Node *p, u32 slot){
+  u64 pg = p->slot_page[slot] - 1;
+  p->slot_page[slot] = 0;
+  tier_persist(p, &p->slot_page[slot], sizeof(u64));
+  if(pg < p->n_pages){
+    p->page_slot[pg] = 0;
+    p->heat[pg] = 0;
+  }
+  p->free_slots[p->n_free++] = slot;
+}
+
+/*
+** Wait until the migrator is done with page pg. Called with the mutex
+** held.
+*/
+static void tier_wait_busy(Tier_Node *p, u64 pg){
+  while(p->busy == pg + 1){
+    pthread_cond_wait(&p->moved, &p->mutex);
+  }
+}
+
+static void tier_end_busy(Tier_Node *p){
+  p->busy = 0;
+  pthread_cond_broadcast(&p->moved);
+}
+
+/*
+** Write the page in slot back to the cold file, sync it and release the
+** slot. Called with the mutex held, which is dropped for the I/O.
+*/
+static int tier_demote(Tier_Node *p, u32 slot){
+  u64 pg = p->slot_page[slot] - 1;
+  const char *in = &p->slots[slot * TIER_PS];
+  int rc = SQLITE_OK;
+  p->busy = pg + 1;
+  pthread_mutex_unlock(&p->mutex);
+  for(sqlite3_int64 done = 0; done < TIER_PS && rc == SQLITE_OK;){
+    ssize_t n = pwrite(p->fd, in + done, TIER_PS - done, pg * TIER_PS + done);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n <= 0){
+      rc = errno == ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+    }
+    else{
+      done += n;
+    }
+  }
+  if(rc == SQLITE_OK && fdatasync(p->fd)){
+    rc = SQLITE_IOERR_FSYNC;
+  }
+  pthread_mutex_lock(&p->mutex);
+  tier_end_busy(p);
+  if(rc == SQLITE_OK){
+    tier_free_slot(p, slot);
+    p->stats.demotions++;
+    p->stats.migrated_bytes += TIER_PS;
+  }
+  return rc;
+}
+
+/*
+** Find a slot for a page with the given heat. Returns the slot number or
+** -1 if every hot page is hotter than the candidate. Evicting a page
+** drops the mutex.
+*/
+static i64 tier_take_slot(Tier_Node *p, u8 heat){
+  if(p->n_free == 0){
+    for(u64 i = 0; i < 2 * (u64)p->n_slots; i++){
+      u32 s = p->clock_hand;
+      p->clock_hand = (p->clock_hand + 1) % p->n_slots;
+      u64 pg = p->slot_page[s] - 1;
+      if(p->heat[pg] < heat){
+        if(tier_demote(p, s) != SQLITE_OK){
+          return -1;
+        }
+        break;
+      }
+      p->heat[pg] >>= 1;
+    }
+    if(p->n_free == 0){
+      return -1;
+    }
+  }
+  return p->free_slots[--p->n_free];
+}
+
+/*
+** Copy cold page pg into a hot slot. Called with the mutex held, which is
+** dropped for the I/O. A page being written is left cold, it cools down
+** so that it can cross the threshold again.
+*/
+static void tier_promote(Tier_Node *p, u64 pg){
+  struct stat st;
+  if(pg >= p->n_pages || p->page_slot[pg]){
+    return;
+  }
+  if(fstat(p->fd, &st) || (sqlite3_int64)(pg + 1) * TIER_PS > st.st_size){
+    return;
+  }
+  i64 slot = p->cold_writes[pg] ? -1 : tier_take_slot(p, p->heat[pg]);
+  /* a demotion let the foreground in */
+  if(slot >= 0 && p->cold_writes[pg]){
+    p->free_slots[p->n_free++] = slot;
+    slot = -1;
+  }
+  if(slot < 0){
+    p->heat[pg] >>= 1;
+    return;
+  }
+  char *dst = &p->slots[slot * TIER_PS];
+  p->busy = pg + 1;
+  pthread_mutex_unlock(&p->mutex);
+  int ok = pread(p->fd, dst, TIER_PS, pg * TIER_PS) == TIER_PS;
+  if(ok){
+    tier_persist(p, dst, TIER_PS);
+  }
+  pthread_mutex_lock(&p->mutex);
+  tier_end_busy(p);
+  if(!ok){
+    p->free_slots[p->n_free++] = slot;
+    return;
+  }
+  p->slot_page[slot] = pg + 1;
+  tier_persist(p, &p->slot_page[slot], sizeof(u64));
+  p->page_slot[pg] = slot + 1;
+  p->stats.promotions++;
+  p->stats.migrated_bytes += TIER_PS;
+}
+
+static u64 tier_now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+** Background migration. Sleeps until candidates are queued, then promotes
+** them while keeping the copied bytes below migrate_bps.
+*/
+static void *tier_migrate(void *arg){
+  Tier_Node *p = (Tier_Node*)arg;
+  u64 window_start = tier_now_ns();
+  u64 window_bytes = 0;
+
+  pthread_mutex_lock(&p->mutex);
+  while(!p->stop){
+    if(p->cand_head == p->cand_tail){
+      pthread_cond_wait(&p->wake, &p->mutex);
+      continue;
+    }
+    u64 pg = p->candidates[p->cand_tail++ % TIER_CANDIDATES];
+    u64 before = p->stats.migrated_bytes;
+    tier_promote(p, pg);
+    window_bytes += p->stats.migrated_bytes - before;
+
+    /* throttle: sleep until the window is back under the budget */
+    u64 elapsed = tier_now_ns() - window_start;
+    u64 allowed = p->migrate_bps * elapsed / 1000000000ULL;
+    if(window_bytes > allowed){
+      u64 wait_ns = (window_bytes - allowed) * 1000000000ULL / p->migrate_bps;
+      struct timespec ts = { wait_ns / 1000000000ULL, wait_ns % 1000000000ULL };
+      pthread_mutex_unlock(&p->mutex);
+      nanosleep(&ts, 0);
+      pthread_mutex_lock(&p->mutex);
+    }
+    if(elapsed > 1000000000ULL){
+      window_start = tier_now_ns();
+      window_bytes = 0;
+    }
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+/*
+** Map the hot file, creating it with n_slots slots if it is new. A hot
+** file of another cold file holds the only copy of its pages, it is
+** never reused.
+*/
+static int tier_map_hot(Tier_Node *p, u64 n_slots, struct stat *cold){
+  struct stat st;
+  if(stat(p->hot_path, &st) == 0 && st.st_size >= (off_t)sizeof(Tier_Header)){
+    p->hot_file = (char *)pmem_map_file(p->hot_path, 0, 0, 0666, &p->hot_size, &p->hot_is_pmem);
+    if(p->hot_file == 0){
+      return SQLITE_CANTOPEN;
+    }
+    Tier_Header *h = (Tier_Header*)p->hot_file;
+    if(h->magic == TIER_MAGIC){
+      if(h->page_size != PMEM_TIER_PAGE_SIZE || h->cold_ino != (u64)cold->st_ino
+          || h->cold_dev != (u64)cold->st_dev
+          || h->slot_offset + (u64)h->n_slots * TIER_PS > p->hot_size){
+        return SQLITE_CANTOPEN;
+      }
+      p->hdr = h;
+      return SQLITE_OK;
+    }
+    /* creation never finished, no page made it into a slot */
+    pmem_unmap(p->hot_file, p->hot_size);
+    p->hot_file = 0;
+  }
+
+  u64 map_offset = TIER_PS;
+  u64 slot_offset = map_offset + ((n_slots * sizeof(u64) + TIER_PS - 1) / TIER_PS) * TIER_PS;
+  size_t size = slot_offset + n_slots * TIER_PS;
+  p->hot_file = (char *)pmem_map_file(p->hot_path, size, PMEM_FILE_CREATE, 0666, &p->hot_size, &p->hot_is_pmem);
+  if(p->hot_file == 0){
+    return SQLITE_CANTOPEN;
+  }
+  Tier_Header *h = (Tier_Header*)p->hot_file;
+  h->page_size = PMEM_TIER_PAGE_SIZE;
+  h->n_slots = n_slots;
+  h->map_offset = map_offset;
+  h->slot_offset = slot_offset;
+  h->cold_ino = cold->st_ino;
+  h->cold_dev = cold->st_dev;
+  tier_persist(p, h, sizeof(Tier_Header));
+  h->magic = TIER_MAGIC;
+  tier_persist(p, &h->magic, sizeof(u64));
+  p->hdr = h;
+  return SQLITE_OK;
+}
+
+/*
+** Rebuild the volatile maps from the persistent slot map.
+*/
+static int tier_load_map(Tier_Node *p, sqlite3_int64 cold_size){
+  u64 cold_pages = (cold_size + TIER_PS - 1) / TIER_PS;
+
+  p->n_slots = p->hdr->n_slots;
+  p->slot_page = (u64*)&p->hot_file[p->hdr->map_offset];
+  p->slots = &p->hot_file[p->hdr->slot_offset];
+  p->free_slots = malloc(p->n_slots * sizeof(u32));
+  if(p->free_slots == 0){
+    return SQLITE_NOMEM;
+  }
+  int rc = tier_grow_pages(p, cold_pages);
+  if(rc){
+    return rc;
+  }
+  for(i64 s = p->n_slots - 1; s >= 0; s--){
+    u64 pg = p->slot_page[s];
+    if(pg && pg - 1 < cold_pages && p->page_slot[pg - 1] == 0){
+      p->page_slot[pg - 1] = s + 1;
+      p->heat[pg - 1] = PMEM_TIER_PROMOTE_THRESHOLD;
+    }
+    else{
+      if(pg){
+        p->slot_page[s] = 0;
+        tier_persist(p, &p->slot_page[s], sizeof(u64));
+      }
+      p->free_slots[p->n_free++] = s;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Stop the migrator and release the node. Called without any lock once
+** the last handle is gone.
+*/
+static void tier_node_free(Tier_Node *p){
+  if(p->migrator){
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->migrator, 0);
+    pthread_cond_destroy(&p->moved);
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->mutex);
+  }
+  if(p->hot_file){
+    if(p->hot_dirty){
+      tier_persist(p, p->slots, (size_t)p->n_slots * TIER_PS);
+    }
+    pmem_unmap(p->hot_file, p->hot_size);
+  }
+  if(p->fd >= 0){
+    close(p->fd);
+  }
+  if(p->lock_fd >= 0){
+    close(p->lock_fd);
+  }
+  free(p->free_slots);
+  free(p->page_slot);
+  free(p->heat);
+  free(p->cold_writes);
+  free(p);
+}
+
+/*
+** Open the node of the database file_path. Called with tier_nodes.mutex
+** held.
+*/
+static int tier_node_open(const char *file_path, struct stat *st, Tier_Node **pp){
+  Tier_Node *p = calloc(1, sizeof(Tier_Node));
+  if(p == 0){
+    return SQLITE_NOMEM;
+  }
+  p->fd = -1;
+  p->lock_fd = -1;
+  p->dev = st->st_dev;
+  p->ino = st->st_ino;
+
+  const char *hot = sqlite3_uri_parameter(file_path, "hot_file");
+  if(hot){
+    sqlite3_snprintf(MAXPATHNAME, p->hot_path, "%s", hot);
+  }
+  else{
+    /* databases of the same name in other directories get their own */
+    u64 hash = 0xcbf29ce484222325ULL;
+    for(const char *c = file_path; *c; c++){
+      hash = (hash ^ (u8)*c) * 0x100000001b3ULL;
+    }
+    const char *base = strrchr(file_path, '/');
+    sqlite3_snprintf(MAXPATHNAME, p->hot_path, "%s/%s-%016llx-hot", PMEM_TIER_HOT_DIR,
+                     base ? base + 1 : file_path, hash);
+  }
+  u64 n_slots = sqlite3_uri_int64(file_path, "hot_pages", PMEM_TIER_HOT_PAGES);
+  p->migrate_bps = (u64)sqlite3_uri_int64(file_path, "migrate_mbps", PMEM_TIER_MIGRATE_MBPS) * 1000000;
+  int rc = SQLITE_OK;
+  if(n_slots == 0 || p->migrate_bps == 0){
+    rc = SQLITE_MISUSE;
+  }
+
+  if(rc == SQLITE_OK){
+    p->fd = open(file_path, O_RDWR | O_CLOEXEC);
+    if(p->fd < 0){
+      rc = SQLITE_CANTOPEN;
+    }
+  }
+  if(rc == SQLITE_OK){
+    /* the maps live in this process only */
+    p->lock_fd = open(p->hot_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(p->lock_fd < 0){
+      rc = SQLITE_CANTOPEN;
+    }
+    else if(flock(p->lock_fd, LOCK_EX | LOCK_NB)){
+      rc = SQLITE_BUSY;
+    }
+  }
+  if(rc == SQLITE_OK){
+    rc = tier_map_hot(p, n_slots, st);
+  }
+  if(rc == SQLITE_OK){
+    rc = tier_load_map(p, st->st_size);
+  }
+  if(rc == SQLITE_OK){
+    pthread_mutex_init(&p->mutex, 0);
+    pthread_cond_init(&p->wake, 0);
+    pthread_cond_init(&p->moved, 0);
+    if(pthread_create(&p->migrator, 0, tier_migrate, p)){
+      p->migrator = 0;
+      pthread_cond_destroy(&p->moved);
+      pthread_cond_destroy(&p->wake);
+      pthread_mutex_destroy(&p->mutex);
+      rc = SQLITE_CANTOPEN;
+    }
+  }
+  if(rc){
+    tier_node_free(p);
+    return rc;
+  }
+  *pp = p;
+  return SQLITE_OK;
+}
+
+static int tier_close(sqlite3_file *pFile){
+  Tiered_File *p = (Tiered_File*)pFile;
+  Tier_Node *n = p->node;
+
+  pthread_mutex_lock(&tier_nodes.mutex);
+  if(--n->refs == 0){
+    Tier_Node **pp = &tier_nodes.list;
+    while(*pp != n){
+      pp = &(*pp)->next;
+    }
+    *pp = n->next;
+  }
+  else{
+    n = 0;
+  }
+  pthread_mutex_unlock(&tier_nodes.mutex);
+  if(n){
+    tier_node_free(n);
+  }
+  return p->cold->pMethods->xClose(p->cold);
+}
+
+/*
+** Read data from a file. Every page touched is read from its slot if it
+** is hot and from the cold file, without the mutex, otherwise.
+*/
+static int tier_read(
+  sqlite3_file *pFile,
+  void *buffer,
+  int buffer_size,
+  sqlite_int64 offset
+){
+  Tiered_File *p = (Tiered_File*)pFile;
+  Tier_Node *n = p->node;
+  char *out = (char*)buffer;
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock(&n->mutex);
+  while(buffer_size > 0){
+    u64 pg = offset / TIER_PS;
+    int in_page = offset % TIER_PS;
+    int amount = TIER_PS - in_page;
+    if(amount > buffer_size){
+      amount = buffer_size;
+    }
+    tier_wait_busy(n, pg);
+    u32 slot = pg < n->n_pages ? n->page_slot[pg] : 0;
+    tier_touch(n, pg);
+    if(slot){
+      memcpy(out, &n->slots[(slot - 1) * TIER_PS + in_page], amount);
+      n->stats.hot_reads++;
+    }
+    else{
+      n->stats.cold_reads++;
+      pthread_mutex_unlock(&n->mutex);
+      int rc2 = p->cold->pMethods->xRead(p->cold, out, amount, offset);
+      pthread_mutex_lock(&n->mutex);
+      if(rc2 != SQLITE_OK){
+        rc = rc2;
+        if(rc2 != SQLITE_IOERR_SHORT_READ){
+          break;
+        }
+      }
+    }
+    out += amount;
+    offset += amount;
+    buffer_size -= amount;
+  }
+  pthread_mutex_unlock(&n->mutex);
+  return rc;
+}
+
+/*
+** Write data from a buffer into a file. Hot pages are updated in place on
+** pmem, cold pages in the cold file without the mutex.
+*/
+static int tier_write(
+  sqlite3_file *pFile,
+  const void *buffer,
+  int buffer_size,
+  sqlite_int64 offset
+){
+  Tiered_File *p = (Tiered_File*)pFile;
+  Tier_Node *n = p->node;
+  const char *in = (const char*)buffer;
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock(&n->mutex);
+  while(buffer_size > 0 && rc == SQLITE_OK){
+    u64 pg = offset / TIER_PS;
+    int in_page = offset % TIER_PS;
+    int amount = TIER_PS - in_page;
+    if(amount > buffer_size){
+      amount = buffer_size;
+    }
+    tier_wait_busy(n, pg);
+    u32 slot = pg < n->n_pages ? n->page_slot[pg] : 0;
+    tier_touch(n, pg);
+    if(slot){
+      char *dst = &n->slots[(slot - 1) * TIER_PS + in_page];
+      if(n->hot_is_pmem){
+        pmem_memcpy_nodrain(dst, in, amount);
+      }
+      else{
+        memcpy(dst, in, amount);
+      }
+      n->hot_dirty = 1;
+      n->stats.hot_writes++;
+    }
+    else{
+      n->stats.cold_writes++;
+      /* keeps the migrator from copying the page before the write lands */
+      int mark = pg < n->n_pages;
+      if(mark){
+        n->cold_writes[pg]++;
+      }
+      pthread_mutex_unlock(&n->mutex);
+      rc = p->cold->pMethods->xWrite(p->cold, in, amount, offset);
+      pthread_mutex_lock(&n->mutex);
+      if(mark){
+        n->cold_writes[pg]--;
+      }
+    }
+    in += amount;
+    offset += amount;
+    buffer_size -= amount;
+  }
+  pthread_mutex_unlock(&n->mutex);
+  return rc;
+}
+
+/*
+** Truncate the cold file and drop every slot beyond the new end.
+*/
+static int tier_truncate(sqlite3_file *pFile, sqlite_int64 size){
+  Tiered_File *p = (Tiered_File*)pFile;
+  Tier_Node *n = p->node;
+  u64 n_pages = (size + TIER_PS - 1) / TIER_PS;
+
+  pthread_mutex_lock(&n->mutex);
+  /* a demotion in flight would write the page back past the new end */
+  while(n->busy){
+    pthread_cond_wait(&n->moved, &n->mutex);
+  }
+  int rc = p->cold->pMethods->xTruncate(p->cold, size);
+  for(u32 s = 0; rc == SQLITE_OK && s < n->n_slots; s++){
+    if(n->slot_page[s] && n->slot_page[s] - 1 >= n_pages){
+      tier_free_slot(n, s);
+    }
+  }
+  pthread_mutex_unlock(&n->mutex);
+  return rc;
+}
+
+/*
+** Sync both tiers. Slot stores were issued with non-temporal copies, so a
+** drain is enough on real pmem.
+*/
+static int tier_sync(sqlite3_file *pFile, int flags){
+  Tiered_File *p = (Tiered_File*)pFile;
+  Tier_Node *n = p->node;
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock(&n->mutex);
+  if(n->hot_dirty){
+    if(n->hot_is_pmem){
+      pmem_drain();
+    }
+    else{
+      rc = tier_persist(n, n->slots, (size_t)n->n_slots * TIER_PS);
+    }
+    n->hot_dirty = 0;
+  }
+  pthread_mutex_unlock(&n->mutex);
+  if(rc == SQLITE_OK){
+    rc = p->cold->pMethods->xSync(p->cold, flags);
+  }
+  return rc;
+}
+
+static int tier_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xFileSize(p->cold, pSize);
+}
+
+/*
+** Locking and shared memory belong to the cold file.
+*/
+static int tier_lock(sqlite3_file *pFile, int eLock){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xLock(p->cold, eLock);
+}
+static int tier_unlock(sqlite3_file *pFile, int eLock){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xUnlock(p->cold, eLock);
+}
+static int tier_check_reserved_lock(sqlite3_file *pFile, int *pResOut){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xCheckReservedLock(p->cold, pResOut);
+}
+
+static int tier_file_control(sqlite3_file *pFile, int op, void *pArg){
+  Tiered_File *p = (Tiered_File*)pFile;
+  if(op == SQLITE_FCNTL_PMEM_TIER_STATS){
+    Tier_Node *n = p->node;
+    pthread_mutex_lock(&n->mutex);
+    *(pmem_tier_stats*)pArg = n->stats;
+    ((pmem_tier_stats*)pArg)->hot_slots = n->n_slots;
+    ((pmem_tier_stats*)pArg)->hot_used = n->n_slots - n->n_free;
+    pthread_mutex_unlock(&n->mutex);
+    return SQLITE_OK;
+  }
+  return p->cold->pMethods->xFileControl(p->cold, op, pArg);
+}
+
+static int tier_sector_size(sqlite3_file *pFile){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xSectorSize(p->cold);
+}
+static int tier_device_characteristics(sqlite3_file *pFile){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xDeviceCharacteristics(p->cold);
+}
+
+static int tier_shm_map(sqlite3_file *pFile, int region_number, int region_size, int extend, void volatile **pp){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xShmMap(p->cold, region_number, region_size, extend, pp);
+}
+static int tier_shm_lock(sqlite3_file *pFile, int ofst, int n, int flags){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xShmLock(p->cold, ofst, n, flags);
+}
+static void tier_shm_barrier(sqlite3_file *pFile){
+  Tiered_File *p = (Tiered_File*)pFile;
+  p->cold->pMethods->xShmBarrier(p->cold);
+}
+static int tier_shm_unmap(sqlite3_file *pFile, int deleteFlag){
+  Tiered_File *p = (Tiered_File*)pFile;
+  return p->cold->pMethods->xShmUnmap(p->cold, deleteFlag);
+}
+
+/*
+** Memory mapped reads would bypass the hot tier, so xFetch never hands out
+** a pointer and SQLite falls back to xRead.
+*/
+static int tier_fetch(sqlite3_file *pFile, sqlite3_int64 offset, int amount, void **pp){
+  *pp = 0;
+  return SQLITE_OK;
+}
+static int tier_unfetch(sqlite3_file *pFile, sqlite3_int64 offset, void *p){
+  return SQLITE_OK;
+}
+
+/*
+** Open a file handle. Only main databases are tiered.
+*/
+static int tier_open(
+  sqlite3_vfs *pVfs,
+  const char *file_path,
+  sqlite3_file *pFile,
+  int flags,
+  int *pOutFlags
+){
+  static const sqlite3_io_methods tier_io = {
+    3,                            /* iVersion */
+    tier_close,                   /* xClose */
+    tier_read,                    /* xRead */
+    tier_write,                   /* xWrite */
+    tier_truncate,                /* xTruncate */
+    tier_sync,                    /* xSync */
+    tier_file_size,               /* xFileSize */
+    tier_lock,                    /* xLock */
+    tier_unlock,                  /* xUnlock */
+    tier_check_reserved_lock,     /* xCheckReservedLock */
+    tier_file_control,            /* xFileControl */
+    tier_sector_size,             /* xSectorSize */
+    tier_device_characteristics,  /* xDeviceCharacteristics */
+    tier_shm_map,                 /* xShmMap */
+    tier_shm_lock,                /* xShmLock */
+    tier_shm_barrier,             /* xShmBarrier */
+    tier_shm_unmap,               /* xShmUnmap */
+    tier_fetch,                   /* xFetch */
+    tier_unfetch,                 /* xUnfetch */
+  };
+  sqlite3_vfs *root = (sqlite3_vfs*)pVfs->pAppData;
+
+  if(file_path == 0 || (flags & SQLITE_OPEN_MAIN_DB) == 0){
+    return root->xOpen(root, file_path, pFile, flags, pOutFlags);
+  }
+
+  Tiered_File *p = (Tiered_File*)pFile;
+  memset(p, 0, sizeof(Tiered_File));
+  p->cold = (sqlite3_file*)&p[1];
+  int rc = root->xOpen(root, file_path, p->cold, flags, pOutFlags);
+  if(rc){
+    return rc;
+  }
+
+  struct stat st;
+  if(stat(file_path, &st)){
+    p->cold->pMethods->xClose(p->cold);
+    return SQLITE_CANTOPEN;
+  }
+  pthread_mutex_lock(&tier_nodes.mutex);
+  Tier_Node *n = tier_nodes.list;
+  while(n && (n->dev != st.st_dev || n->ino != st.st_ino)){
+    n = n->next;
+  }
+  if(n == 0){
+    rc = tier_node_open(file_path, &st, &n);
+    if(rc == SQLITE_OK){
+      n->next = tier_nodes.list;
+      tier_nodes.list = n;
+    }
+  }
+  if(rc == SQLITE_OK){
+    n->refs++;
+  }
+  pthread_mutex_unlock(&tier_nodes.mutex);
+  if(rc){
+    p->cold->pMethods->xClose(p->cold);
+    return rc;
+  }
+  p->node = n;
+  p->base.pMethods = &tier_io;
+  return SQLITE_OK;
+}
+
+/*
+** Everything except xOpen is forwarded to the "unix" VFS.
+*/
+#define ROOT(v) ((sqlite3_vfs*)(v)->pAppData)
+
+static int tier_delete(sqlite3_vfs *pVfs, const char *zPath, int dirSync){
+  return ROOT(pVfs)->xDelete(ROOT(pVfs), zPath, dirSync);
+}
+static int tier_access(sqlite3_vfs *pVfs, const char *zPath, int flags, int *pResOut){
+  return ROOT(pVfs)->xAccess(ROOT(pVfs), zPath, flags, pResOut);
+}
+static int tier_full_pathname(sqlite3_vfs *pVfs, const char *zPath, int nOut, char *zOut){
+  return ROOT(pVfs)->xFullPathname(ROOT(pVfs), zPath, nOut, zOut);
+}
+static void *tier_dl_open(sqlite3_vfs *pVfs, const char *zPath){
+  return ROOT(pVfs)->xDlOpen(ROOT(pVfs), zPath);
+}
+static void tier_dl_error(sqlite3_vfs *pVfs, int nByte, char *zErrMsg){
+  ROOT(pVfs)->xDlError(ROOT(pVfs), nByte, zErrMsg);
+}
+static void (*tier_dl_sym(sqlite3_vfs *pVfs, void *pH, const char *z))(void){
+  return ROOT(pVfs)->xDlSym(ROOT(pVfs), pH, z);
+}
+static void tier_dl_close(sqlite3_vfs *pVfs, void *pHandle){
+  ROOT(pVfs)->xDlClose(ROOT(pVfs), pHandle);
+}
+static int tier_randomness(sqlite3_vfs *pVfs, int nByte, char *zByte){
+  return ROOT(pVfs)->xRandomness(ROOT(pVfs), nByte, zByte);
+}
+static int tier_sleep(sqlite3_vfs *pVfs, int microseconds){
+  return ROOT(pVfs)->xSleep(ROOT(pVfs), microseconds);
+}
+static int tier_current_time(sqlite3_vfs *pVfs, double *pTime){
+  return ROOT(pVfs)->xCurrentTime(ROOT(pVfs), pTime);
+}
+static int tier_get_last_error(sqlite3_vfs *pVfs, int nBuf, char *zBuf){
+  return ROOT(pVfs)->xGetLastError(ROOT(pVfs), nBuf, zBuf);
+}
+static int tier_current_time_int64(sqlite3_vfs *pVfs, sqlite3_int64 *piNow){
+  return ROOT(pVfs)->xCurrentTimeInt64(ROOT(pVfs), piNow);
+}
+
+/*
+** This function returns a pointer to the VFS implemented in this file.
+** To make the VFS available to SQLite:
+**
+**   sqlite3_vfs_register(sqlite3_pmem_tiered_vfs(), 0);
+*/
+sqlite3_vfs *sqlite3_pmem_tiered_vfs(void){
+  static sqlite3_vfs tiered_vfs = {
+    2,                            /* iVersion */
+    0,                            /* szOsFile, set below */
+    MAXPATHNAME,                  /* mxPathname */
+    0,                            /* pNext */
+    "PMem_VFS_tiered",            /* zName */
+    0,                            /* pAppData, the "unix" VFS */
+    tier_open,                    /* xOpen */
+    tier_delete,                  /* xDelete */
+    tier_access,                  /* xAccess */
+    tier_full_pathname,           /* xFullPathname */
+    tier_dl_open,                 /* xDlOpen */
+    tier_dl_error,                /* xDlError */
+    tier_dl_sym,                  /* xDlSym */
+    tier_dl_close,                /* xDlClose */
+    tier_randomness,              /* xRandomness */
+    tier_sleep,                   /* xSleep */
+    tier_current_time,            /* xCurrentTime */
+    tier_get_last_error,          /* xGetLastError */
+    tier_current_time_int64,      /* xCurrentTimeInt64 */
+  };
+  if(tiered_vfs.pAppData == 0){
+    sqlite3_vfs *root = sqlite3_vfs_find("unix");
+    if(root == 0){
+      return 0;
+    }
+    tiered_vfs.pAppData = root;
+    tiered_vfs.szOsFile = sizeof(Tiered_File) + root->szOsFile;
+    tiered_vfs.mxPathname = root->mxPathname;
+  }
+  return &tiered_vfs;
+}
+
+#endif /* !defined(SQLITE_TEST) || SQLITE_OS_UNIX */
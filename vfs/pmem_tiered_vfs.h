@@ -0,0 +1,65 @@
+#ifndef PMEM_TIERED_VFS_H
+#define PMEM_TIERED_VFS_H
+#include "pmem_vfs.h"
+
+/*
+** Granularity of the hot/cold split. Matches SQLite's default page size,
+** partial accesses are split at these boundaries.
+*/
+#ifndef PMEM_TIER_PAGE_SIZE
+# define PMEM_TIER_PAGE_SIZE 4096
+#endif
+
+/* directory of the hot tier file, overridden by the "hot_file" uri param */
+#ifndef PMEM_TIER_HOT_DIR
+# define PMEM_TIER_HOT_DIR "/mnt/pmem0/scheinost"
+#endif
+
+/* number of hot slots (pages) of a new hot file, 2^18 pages ~ 1GB */
+#ifndef PMEM_TIER_HOT_PAGES
+# define PMEM_TIER_HOT_PAGES (1 << 18)
+#endif
+
+/* upper bound for the background migration bandwidth in MB/s */
+#ifndef PMEM_TIER_MIGRATE_MBPS
+# define PMEM_TIER_MIGRATE_MBPS 64
+#endif
+
+/* accesses after which a cold page becomes a promotion candidate */
+#ifndef PMEM_TIER_PROMOTE_THRESHOLD
+# define PMEM_TIER_PROMOTE_THRESHOLD 4
+#endif
+
+/*
+** Counters returned by SQLITE_FCNTL_PMEM_TIER_STATS on the main database.
+*/
+typedef struct pmem_tier_stats pmem_tier_stats;
+struct pmem_tier_stats {
+  u64 hot_reads;          /* page reads served from pmem */
+  u64 cold_reads;         /* page reads served from the cold file */
+  u64 hot_writes;         /* page writes into pmem slots */
+  u64 cold_writes;        /* page writes into the cold file */
+  u64 promotions;         /* pages moved cold -> hot */
+  u64 demotions;          /* pages moved hot -> cold */
+  u64 migrated_bytes;     /* bytes copied by the migration thread */
+  u32 hot_slots;          /* capacity of the hot tier in pages */
+  u32 hot_used;           /* slots currently holding a page */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Returns the "PMem_VFS_tiered" VFS. Main database files are split into
+** PMEM_TIER_PAGE_SIZE pages, hot pages live in a pmem file, cold pages in
+** the database file itself. All other files go to the "unix" VFS.
+** Must be called after sqlite3_initialize().
+*/
+sqlite3_vfs *sqlite3_pmem_tiered_vfs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PMEM_TIERED_VFS_H
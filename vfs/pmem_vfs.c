@@ -117,10 +117,22 @@
 #include "pmem_vfs.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "../sqlite/sqlite/sqlite3.h"
+#include "pmem_ship.h"
+#include "pmem_probes.h"
+#include "pmem_emulation.h"
+#if defined(__AVX512F__) || defined(__AVX2__)
+# include <immintrin.h>
+#endif
 
 // 2^30 ~ 1GB
 // u_int64_t PMEM_MAX_LEN = 1 << 35;
@@ -365,54 +377,2075 @@ struct Persistent_File {
   char *shm_path;
   int tmp;
   //int write_calls;
+  size_t wal_capacity;  /* preallocated size of a WAL ring, 0 if none */
+  int chunk_size;       /* SQLITE_FCNTL_CHUNK_SIZE, 0 grows by GROW_FACTOR_FILE */
+  int persist_wal;      /* SQLITE_FCNTL_PERSIST_WAL setting of a database */
+  struct Pmem_Combine *combine; /* write combining buffer or NULL */
+  size_t dirty_lo;      /* byte range written since the last sync */
+  size_t dirty_hi;
+  int is_main_db;
+  int is_journal;       /* rollback journal of a database */
+  char *dirtymap;       /* mapped "<db>-dirtymap" or NULL */
+  size_t dirtymap_size;
+  int dirtymap_is_pmem;
+  size_t dirtymap_lo;   /* bitmap bytes changed since the last sync */
+  size_t dirtymap_hi;
+  int dirtymap_fd;      /* flock()ed by a backup, see pmem_dirtymap_enter() */
+  int dirtymap_lock;    /* LOCK_EX while this handle runs a backup, else 0 */
+  int dirtymap_slot;    /* writer slot held until the next sync, or -1 */
+  Ship_Ring *ship;      /* WAL shipping ring of a WAL or NULL */
+  size_t ship_size;
+  ino_t ino;            /* identity of a main database for snapshots */
+  dev_t dev;
+  int async;            /* syncs are queued for the flusher, see below */
+  u64 async_epoch;      /* last persistence epoch queued for this file */
+  struct Pmem_Heat *heat; /* heat table of the page access tracer or NULL */
+  size_t readahead;     /* read-ahead window, 0 if disabled */
+  sqlite_int64 ra_last; /* offset of the last read of the current stride */
+  sqlite_int64 ra_stride;
+  int ra_run;           /* reads that continued the stride */
+  int ra_missed;        /* a read off the stride was skipped */
+  size_t ra_done;       /* next strided offset not prefetched yet */
+  struct Pmem_Mapping *map; /* mapping shared with other handles or NULL */
+  struct Pmem_View *view;   /* view of map that pmem_file points into */
+  const char *db_name;  /* file name SQLite opened a main database with */
+  Persistent_File *next_db; /* next open main database, see pmem_dbs */
+  int wal_logging;      /* PMEM_LOGGING_* for the WAL of a main database */
+  Persistent_File *owner; /* main database of a WAL or NULL */
+  int logging;          /* PMEM_LOGGING_* of a WAL */
+  int streaming;        /* the open transaction is written non-temporally */
+  int nt_stores;        /* non-temporal stores since the last sync */
+  int txn_commit;       /* the last frame header written was a commit */
+  char commit_hdr[8];   /* its page number and database size */
+  u64 txn_pages;        /* pages and bytes of the open transaction */
+  u64 txn_bytes;
+  int quiesced;         /* PMEM_QUIESCE_* spans holding pmem_snap.quiesce */
+};
+
+/*
+** DRAM write combining buffer of one file. Buffered XPLines are kept in
+** line_data[], line_key[i] is the line number (offset / PMEM_XPLINE_SIZE)
+** of slot i. hash[] is an open addressing table of slot + 1 by line number.
+*/
+typedef struct Pmem_Combine Pmem_Combine;
+struct Pmem_Combine {
+  int n_lines;
+  int *hash;
+  int hash_mask;
+  u64 *line_key;
+  struct Pmem_Combine_Order {
+    u64 line;
+    int slot;
+  } *order;               /* scratch for sorting slots by line number */
+  char *line_data;
+};
+
+static pmem_xpline_stats xpline_stats;
+static pmem_read_stats read_stats;
+static pmem_logging_stats logging_stats;
+
+/*
+** VFS wide defaults, see sqlite3_pmem_config().
+*/
+static struct {
+  sqlite3_int64 wal_capacity;   /* PMEM_CONFIG_WAL_CAPACITY */
+  int write_combine;            /* PMEM_CONFIG_WRITE_COMBINE */
+  int group_commit_us;          /* PMEM_CONFIG_GROUP_COMMIT_US */
+  int dirty_map;                /* PMEM_CONFIG_DIRTY_MAP */
+  int trace;                    /* PMEM_CONFIG_TRACE */
+  int readahead;                /* PMEM_CONFIG_READAHEAD */
+  int super_journal;            /* PMEM_CONFIG_SUPER_JOURNAL */
+  int logging;                  /* PMEM_CONFIG_LOGGING */
+  int logging_pages;            /* PMEM_CONFIG_LOGGING_THRESHOLD */
+  sqlite3_int64 logging_bytes;
+} pmem_config = {
+  PMEM_WAL_CAPACITY,
+  PMEM_WRITE_COMBINE,
+  PMEM_GROUP_COMMIT_US,
+  PMEM_DIRTY_MAP,
+  PMEM_TRACE,
+  PMEM_READAHEAD,
+  PMEM_SUPER_JOURNAL,
+  PMEM_LOGGING,
+  PMEM_LOGGING_PAGES,
+  PMEM_LOGGING_BYTES,
+};
+
+int sqlite3_pmem_config(int op, ...){
+  va_list ap;
+  int rc = SQLITE_OK;
+  va_start(ap, op);
+  switch(op){
+    case PMEM_CONFIG_WAL_CAPACITY:
+      pmem_config.wal_capacity = va_arg(ap, sqlite3_int64);
+      break;
+    case PMEM_CONFIG_WRITE_COMBINE:
+      pmem_config.write_combine = va_arg(ap, int);
+      break;
+    case PMEM_CONFIG_GROUP_COMMIT_US:
+      pmem_config.group_commit_us = va_arg(ap, int);
+      break;
+    case PMEM_CONFIG_DIRTY_MAP:
+      pmem_config.dirty_map = va_arg(ap, int);
+      break;
+    case PMEM_CONFIG_TRACE:
+      __atomic_store_n(&pmem_config.trace, va_arg(ap, int), __ATOMIC_RELAXED);
+      break;
+    case PMEM_CONFIG_READAHEAD:
+      pmem_config.readahead = va_arg(ap, int);
+      break;
+    case PMEM_CONFIG_SUPER_JOURNAL:
+      pmem_config.super_journal = va_arg(ap, int);
+      break;
+    case PMEM_CONFIG_LOGGING: {
+      int mode = va_arg(ap, int);
+      if(mode < -1 || mode > PMEM_LOGGING_ADAPTIVE){
+        rc = SQLITE_MISUSE;
+      }
+      else{
+        pmem_config.logging = mode;
+      }
+      break;
+    }
+    case PMEM_CONFIG_LOGGING_THRESHOLD:
+      pmem_config.logging_pages = va_arg(ap, int);
+      pmem_config.logging_bytes = va_arg(ap, sqlite3_int64);
+      break;
+    default:
+      rc = SQLITE_MISUSE;
+  }
+  va_end(ap);
+  return rc;
+}
+
+void sqlite3_pmem_xpline_stats(pmem_xpline_stats *out, int reset){
+  *out = xpline_stats;
+  if(reset){
+    memset(&xpline_stats, 0, sizeof(xpline_stats));
+  }
+}
+
+void sqlite3_pmem_read_stats(pmem_read_stats *out, int reset){
+  *out = read_stats;
+  if(reset){
+    memset(&read_stats, 0, sizeof(read_stats));
+  }
+}
+
+void sqlite3_pmem_logging_stats(pmem_logging_stats *out, int reset){
+  *out = logging_stats;
+  if(reset){
+    memset(&logging_stats, 0, sizeof(logging_stats));
+  }
+}
+
+/*
+** In-process side of the probes in pmem_probes.h: cycles and calls per
+** commit path component, summed over all threads.
+*/
+static pmem_probe_stats probe_stats;
+
+#ifdef PMEM_VFS_USDT
+void pmem_probe_count(int component, u64 start, u64 end){
+  if(component >= 0){
+    __atomic_fetch_add(&probe_stats.cycles[component], end - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&probe_stats.calls[component], 1, __ATOMIC_RELAXED);
+  }
+}
+#endif
+
+void sqlite3_pmem_probe_stats(pmem_probe_stats *out, int reset){
+  for(int i = 0; i < PMEM_PROBE_COMPONENTS; i++){
+    out->cycles[i] = __atomic_load_n(&probe_stats.cycles[i], __ATOMIC_RELAXED);
+    out->calls[i] = __atomic_load_n(&probe_stats.calls[i], __ATOMIC_RELAXED);
+    if(reset){
+      __atomic_store_n(&probe_stats.cycles[i], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&probe_stats.calls[i], 0, __ATOMIC_RELAXED);
+    }
+  }
+  out->cycles_per_us = 0;
+#ifdef PMEM_VFS_USDT
+  static double rate;
+  if(rate == 0){
+    struct timespec t0, t1, pause = {0, 10000000};
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    u64 c0 = __rdtsc();
+    nanosleep(&pause, NULL);
+    u64 c1 = __rdtsc();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    rate = (c1 - c0) / ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+  }
+  out->cycles_per_us = rate;
+#endif
+}
+
+
+/*
+** Asynchronous durability. A sync of a file in async mode does not flush
+** itself; it queues its dirty range under a new persistence epoch and
+** returns. A background flusher flushes all queued ranges, issues one
+** fence, advances the durable epoch and runs the callbacks of commits
+** whose epoch is now covered. Synchronous syncs and remaps of a file with
+** queued ranges first wait until everything issued before is durable, and
+** so do writes and truncates of a main database: the async flag of a WAL
+** stays set for the whole COMMIT, so the WAL sync of an auto-checkpoint
+** running inside it is queued too, and its backfill must not get ahead.
+*/
+typedef struct Pmem_Async_Range Pmem_Async_Range;
+struct Pmem_Async_Range {
+  const char *addr;
+  size_t len;
+  Pmem_Async_Range *next;
+};
+
+typedef struct Pmem_Async_Callback Pmem_Async_Callback;
+struct Pmem_Async_Callback {
+  u64 epoch;
+  void (*xDurable)(void*);
+  void *ctx;
+  Pmem_Async_Callback *next;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t work;        /* ranges or callbacks were queued */
+  pthread_cond_t durable;     /* durable_epoch advanced */
+  Pmem_Async_Range *ranges;
+  Pmem_Async_Callback *callbacks;       /* in epoch order */
+  Pmem_Async_Callback **callbacks_tail;
+  u64 issued_epoch;
+  u64 durable_epoch;
+  int started;
+} pmem_async = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  0, 0, &pmem_async.callbacks, 0, 0, 0,
+};
+
+static void *pmem_async_flusher(void *unused){
+  (void)unused;
+  pthread_mutex_lock(&pmem_async.mutex);
+  for(;;){
+    while(pmem_async.ranges == 0 && pmem_async.durable_epoch == pmem_async.issued_epoch){
+      pthread_cond_wait(&pmem_async.work, &pmem_async.mutex);
+    }
+    Pmem_Async_Range *ranges = pmem_async.ranges;
+    u64 epoch = pmem_async.issued_epoch;
+    pmem_async.ranges = 0;
+    pthread_mutex_unlock(&pmem_async.mutex);
+
+    while(ranges){
+      Pmem_Async_Range *r = ranges;
+      ranges = r->next;
+      if(r->len){
+        pmem_emu_flush(r->addr, r->len);
+      }
+      free(r);
+    }
+    pmem_emu_drain();
+
+    pthread_mutex_lock(&pmem_async.mutex);
+    pmem_async.durable_epoch = epoch;
+    pthread_cond_broadcast(&pmem_async.durable);
+    Pmem_Async_Callback *done = 0;
+    Pmem_Async_Callback **tail = &done;
+    while(pmem_async.callbacks && pmem_async.callbacks->epoch <= epoch){
+      *tail = pmem_async.callbacks;
+      tail = &(*tail)->next;
+      pmem_async.callbacks = pmem_async.callbacks->next;
+    }
+    *tail = 0;
+    if(pmem_async.callbacks == 0){
+      pmem_async.callbacks_tail = &pmem_async.callbacks;
+    }
+    pthread_mutex_unlock(&pmem_async.mutex);
+    while(done){
+      Pmem_Async_Callback *c = done;
+      done = c->next;
+      c->xDurable(c->ctx);
+      free(c);
+    }
+    pthread_mutex_lock(&pmem_async.mutex);
+  }
+  return 0;
+}
+
+/* called with pmem_async.mutex held */
+static int pmem_async_start(void){
+  pthread_t thread;
+  if(pmem_async.started){
+    return SQLITE_OK;
+  }
+  if(pthread_create(&thread, 0, pmem_async_flusher, 0)){
+    return SQLITE_ERROR;
+  }
+  pthread_detach(thread);
+  __atomic_store_n(&pmem_async.started, 1, __ATOMIC_RELEASE);
+  return SQLITE_OK;
+}
+
+/* block until everything issued up to epoch is durable */
+static void pmem_async_wait(u64 epoch){
+  pthread_mutex_lock(&pmem_async.mutex);
+  while(pmem_async.durable_epoch < epoch){
+    pthread_cond_wait(&pmem_async.durable, &pmem_async.mutex);
+  }
+  pthread_mutex_unlock(&pmem_async.mutex);
+}
+
+/* block until everything issued so far is durable */
+static void pmem_async_wait_all(void){
+  pthread_mutex_lock(&pmem_async.mutex);
+  while(pmem_async.durable_epoch < pmem_async.issued_epoch){
+    pthread_cond_wait(&pmem_async.durable, &pmem_async.mutex);
+  }
+  pthread_mutex_unlock(&pmem_async.mutex);
+}
+
+/* queue addr[0..len) under a new epoch, which is returned (0 on error) */
+static u64 pmem_async_queue(const char *addr, size_t len){
+  Pmem_Async_Range *r = malloc(sizeof(Pmem_Async_Range));
+  u64 epoch = 0;
+  if(r == 0){
+    return 0;
+  }
+  r->addr = addr;
+  r->len = len;
+  pthread_mutex_lock(&pmem_async.mutex);
+  if(pmem_async_start() == SQLITE_OK){
+    r->next = pmem_async.ranges;
+    pmem_async.ranges = r;
+    epoch = ++pmem_async.issued_epoch;
+    pthread_cond_signal(&pmem_async.work);
+  }
+  else{
+    free(r);
+  }
+  pthread_mutex_unlock(&pmem_async.mutex);
+  return epoch;
+}
+
+/*
+** Mappings shared by all handles of a file in this process, keyed by device
+** and inode, so N connections to a database hold one mapping and agree on
+** its size. Growing maps a new, larger view and retires the old one. A
+** retired view stays mapped until the last handle using it has switched
+** over, which every handle does at the start of its next method call
+** (pmem_map_refresh()). Mappings only shrink once a single handle is
+** left. Temp files are not shared.
+*/
+typedef struct Pmem_View Pmem_View;
+struct Pmem_View {
+  char *addr;
+  size_t size;
+  int is_pmem;
+  int users;            /* handles whose pmem_file points into this view */
+  Pmem_View *next;      /* older views of the same mapping */
+};
+
+typedef struct Pmem_Mapping Pmem_Mapping;
+struct Pmem_Mapping {
+  dev_t dev;
+  ino_t ino;
+  int refs;             /* handles attached */
+  Pmem_View *current;   /* newest view, NULL until the first map_pmem() */
+  Pmem_View *views;     /* every view still mapped, newest first */
+  size_t used_size;     /* logical size of the file */
+  Pmem_Mapping *next;
 };
 
+static struct {
+  pthread_mutex_t mutex;
+  Pmem_Mapping *list;
+} pmem_maps = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+/* unmap view v if it is retired and no handle uses it any more */
+static void pmem_view_drop(Pmem_Mapping *m, Pmem_View *v){
+  if(v->users > 0 || v == m->current){
+    return;
+  }
+  for(Pmem_View **pv = &m->views; *pv; pv = &(*pv)->next){
+    if(*pv == v){
+      *pv = v->next;
+      break;
+    }
+  }
+  pmem_unmap(v->addr, v->size);
+  free(v);
+}
+
+static void pmem_view_release(Pmem_Mapping *m, Pmem_View *v){
+  v->users--;
+  pmem_view_drop(m, v);
+}
+
+/* point the handle at view v, called with pmem_maps.mutex held */
+static void pmem_view_use(Persistent_File *p, Pmem_View *v){
+  if(p->view == v){
+    return;
+  }
+  if(p->view){
+    pmem_view_release(p->map, p->view);
+  }
+  v->users++;
+  p->view = v;
+  p->pmem_file = v->addr;
+  p->pmem_size = v->size;
+  p->is_pmem = v->is_pmem;
+}
+
+/*
+** Attach the handle to the shared mapping of its file. Sets *attached to
+** 1 if the mapping already has a view, which the handle then uses, to 0 if
+** the caller has to map the file first. Returns an SQLite error code.
+*/
+static int pmem_map_attach(Persistent_File *p, int *attached){
+  struct stat st;
+  *attached = 0;
+  if(stat(p->path, &st)){
+    return SQLITE_IOERR;
+  }
+  pthread_mutex_lock(&pmem_maps.mutex);
+  Pmem_Mapping *m = pmem_maps.list;
+  while(m && (m->dev != st.st_dev || m->ino != st.st_ino)){
+    m = m->next;
+  }
+  if(m == 0){
+    m = calloc(1, sizeof(Pmem_Mapping));
+    if(m == 0){
+      pthread_mutex_unlock(&pmem_maps.mutex);
+      return SQLITE_NOMEM;
+    }
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->next = pmem_maps.list;
+    pmem_maps.list = m;
+  }
+  m->refs++;
+  p->map = m;
+  if(m->current){
+    pmem_view_use(p, m->current);
+    p->used_size = m->used_size;
+    *attached = 1;
+  }
+  pthread_mutex_unlock(&pmem_maps.mutex);
+  return SQLITE_OK;
+}
+
+/*
+** Map view of at least new_size bytes for a shared handle, called with
+** pmem_maps.mutex held. A larger view mapped by another handle is used
+** as it is.
+*/
+static int pmem_map_resize(Persistent_File *p, size_t new_size){
+  Pmem_Mapping *m = p->map;
+  Pmem_View *cur = m->current;
+  if(cur && (cur->size == new_size || (cur->size > new_size && m->refs > 1))){
+    pmem_view_use(p, cur);
+    return SQLITE_OK;
+  }
+  Pmem_View *v = calloc(1, sizeof(Pmem_View));
+  if(v == 0){
+    return SQLITE_NOMEM;
+  }
+  int is_pmem;
+  v->addr = (char *)pmem_map_file(p->path, new_size, PMEM_FILE_CREATE, 0666, &v->size, &is_pmem);
+  if(v->addr == NULL){
+    free(v);
+    return SQLITE_IOERR_MMAP;
+  }
+  v->is_pmem = pmem_emu_is_pmem(is_pmem);
+  v->next = m->views;
+  m->views = v;
+  m->current = v;
+  if(cur){
+    pmem_view_drop(m, cur);
+  }
+  pmem_view_use(p, v);
+  return SQLITE_OK;
+}
+
+/*
+** Catch up with views and appends of the other handles of the file.
+*/
+static void pmem_map_refresh(Persistent_File *p){
+  Pmem_Mapping *m = p->map;
+  if(m == 0){
+    return;
+  }
+  p->used_size = __atomic_load_n(&m->used_size, __ATOMIC_RELAXED);
+  if(__atomic_load_n(&m->current, __ATOMIC_ACQUIRE) != p->view){
+    /* queued flushes still point into the old view */
+    if(p->async_epoch){
+      pmem_async_wait(p->async_epoch);
+    }
+    pthread_mutex_lock(&pmem_maps.mutex);
+    pmem_view_use(p, m->current);
+    pthread_mutex_unlock(&pmem_maps.mutex);
+  }
+}
+
+static void pmem_map_publish(Persistent_File *p){
+  if(p->map){
+    __atomic_store_n(&p->map->used_size, p->used_size, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+** Detach the handle. The last handle trims the file to its logical size
+** if trim is set, like an unshared close does.
+*/
+static void pmem_map_detach(Persistent_File *p, int trim){
+  Pmem_Mapping *m = p->map;
+  pthread_mutex_lock(&pmem_maps.mutex);
+  p->used_size = m->used_size;
+  if(trim && m->refs == 1 && p->used_size > p->wal_capacity){
+    pmem_map_resize(p, p->used_size);
+  }
+  if(p->view){
+    pmem_view_release(m, p->view);
+  }
+  if(--m->refs == 0){
+    for(Pmem_Mapping **pm = &pmem_maps.list; *pm; pm = &(*pm)->next){
+      if(*pm == m){
+        *pm = m->next;
+        break;
+      }
+    }
+    while(m->views){
+      Pmem_View *v = m->views;
+      m->views = v->next;
+      pmem_unmap(v->addr, v->size);
+      free(v);
+    }
+    free(m);
+  }
+  pthread_mutex_unlock(&pmem_maps.mutex);
+  p->map = 0;
+  p->view = 0;
+  p->pmem_file = 0;
+  p->pmem_size = 0;
+  p->used_size = 0;
+  p->is_pmem = 0;
+}
 
 int map_pmem(Persistent_File* p, size_t new_size){
   //printf("map_pmem%s\t%li\n",p->path, new_size);
+  PMEM_PROBE_ENTRY(t, remap, PMEM_PROBE_KIND(p), new_size, p->pmem_size);
+  /* queued flushes still point into the current view */
+  if(p->async_epoch){
+    pmem_async_wait(p->async_epoch);
+  }
   if(new_size == 0 ){
     struct stat st;
     int rc = stat(p->path, &st);
     if(rc){
+      PMEM_PROBE_EXIT(t, remap, PMEM_PROBE_KIND(p), SQLITE_IOERR, PMEM_PROBE_REMAP);
       return SQLITE_IOERR;
     }
     new_size = st.st_size;
   }
 
+  if(p->map){
+    pthread_mutex_lock(&pmem_maps.mutex);
+    int rc = pmem_map_resize(p, new_size);
+    pthread_mutex_unlock(&pmem_maps.mutex);
+    PMEM_PROBE_EXIT(t, remap, PMEM_PROBE_KIND(p), rc, PMEM_PROBE_REMAP);
+    return rc;
+  }
   if(p->pmem_size == new_size){
+    PMEM_PROBE_EXIT(t, remap, PMEM_PROBE_KIND(p), SQLITE_OK, PMEM_PROBE_REMAP);
+    return SQLITE_OK;
+  }
+  // if(new_size > PMEM_MAX_LEN){
+  //   new_size = PMEM_MAX_LEN;
+  // }
+
+  size_t mapped_size;
+  int is_pmem;
+  char *mapped = (char *)pmem_map_file(p->path, new_size, PMEM_FILE_CREATE, 0666, &mapped_size, &is_pmem);
+  if(mapped == NULL){
+    PMEM_PROBE_EXIT(t, remap, PMEM_PROBE_KIND(p), SQLITE_IOERR_MMAP, PMEM_PROBE_REMAP);
+    return SQLITE_IOERR_MMAP;
+  }
+  /* the old view is no longer referenced, nothing hands out pointers into it */
+  if(p->pmem_file){
+    pmem_unmap(p->pmem_file, p->pmem_size);
+  }
+  p->pmem_file = mapped;
+  p->pmem_size = mapped_size;
+  p->is_pmem = pmem_emu_is_pmem(is_pmem);
+  PMEM_PROBE_EXIT(t, remap, PMEM_PROBE_KIND(p), SQLITE_OK, PMEM_PROBE_REMAP);
+  return SQLITE_OK;
+}
+
+/*
+** The mapping size needed to hold at least `needed` bytes. With a chunk
+** size set by SQLITE_FCNTL_CHUNK_SIZE the size is rounded up to the next
+** chunk. Otherwise the current mapping is grown by GROW_FACTOR_FILE until
+** it fits, except for size hints (`exact`) that are more than one growth
+** step away: those are mapped at exactly the announced size.
+*/
+static size_t pmem_grow_target(Persistent_File* p, size_t needed, int exact){
+  if(p->chunk_size > 0){
+    return ((needed + p->chunk_size - 1) / p->chunk_size) * p->chunk_size;
+  }
+  size_t size = p->pmem_size > PMEM_LEN ? p->pmem_size : PMEM_LEN;
+  if(exact && needed > size * GROW_FACTOR_FILE){
+    return needed;
+  }
+  while(size < needed){
+    size *= GROW_FACTOR_FILE;
+  }
+  return size;
+}
+
+void unmap_pmem(Persistent_File* p){
+  if(p->map){
+    pmem_map_detach(p, 0);
+    return;
+  }
+  pmem_unmap(p->pmem_file, p->pmem_size);
+  p->pmem_size = 0;
+  p->used_size = 0;
+  p->pmem_file = 0;
+  p->is_pmem = 0;
+}
+
+/*
+** Grow a WAL file to its ring capacity and touch every byte of the new
+** range once, so later appends neither fault nor allocate blocks.
+*/
+static int pmem_prealloc_wal(Persistent_File* p){
+  size_t old_size = p->pmem_size;
+  int rc = map_pmem(p, p->wal_capacity);
+  if(rc != SQLITE_OK || p->pmem_file == 0){
+    return rc ? rc : SQLITE_IOERR;
+  }
+  if(p->pmem_size > old_size){
+    if(p->is_pmem){
+      pmem_memset_persist(p->pmem_file + old_size, 0, p->pmem_size - old_size);
+      pmem_emu_media(p->pmem_file + old_size, p->pmem_size - old_size);
+    }
+    else{
+      memset(p->pmem_file + old_size, 0, p->pmem_size - old_size);
+      pmem_msync(p->pmem_file + old_size, p->pmem_size - old_size);
+    }
+  }
+  return SQLITE_OK;
+}
+
+static Pmem_Combine *pmem_combine_create(void){
+  Pmem_Combine *c = calloc(1, sizeof(Pmem_Combine));
+  if(c == 0){
+    return 0;
+  }
+  c->hash_mask = 2 * PMEM_COMBINE_LINES - 1;
+  c->hash = calloc(2 * PMEM_COMBINE_LINES, sizeof(int));
+  c->line_key = malloc(PMEM_COMBINE_LINES * sizeof(u64));
+  c->order = malloc(PMEM_COMBINE_LINES * sizeof(*c->order));
+  if(c->hash == 0 || c->line_key == 0 || c->order == 0
+      || posix_memalign((void**)&c->line_data, 64, (size_t)PMEM_COMBINE_LINES * PMEM_XPLINE_SIZE)){
+    free(c->hash);
+    free(c->line_key);
+    free(c->order);
+    free(c);
+    return 0;
+  }
+  return c;
+}
+
+static void pmem_combine_destroy(Pmem_Combine *c){
+  if(c){
+    free(c->hash);
+    free(c->line_key);
+    free(c->order);
+    free(c->line_data);
+    free(c);
+  }
+}
+
+/* the hash slot holding line or the empty slot where it belongs */
+static int *pmem_combine_slot(Pmem_Combine *c, u64 line){
+  u64 h = (line * 0x9E3779B97F4A7C15ULL) >> 32;
+  for(;; h++){
+    int *slot = &c->hash[h & c->hash_mask];
+    if(*slot == 0 || c->line_key[*slot - 1] == line){
+      return slot;
+    }
+  }
+}
+
+static int pmem_combine_cmp(const void *a, const void *b){
+  u64 ka = ((const struct Pmem_Combine_Order*)a)->line;
+  u64 kb = ((const struct Pmem_Combine_Order*)b)->line;
+  return ka < kb ? -1 : ka > kb;
+}
+
+/*
+** Write all buffered lines in address order as full, aligned lines with
+** non-temporal stores. No fence is issued, that is left to the caller.
+*/
+static void pmem_combine_flush(Persistent_File *p){
+  Pmem_Combine *c = p->combine;
+  if(c->n_lines == 0){
+    return;
+  }
+  for(int i = 0; i < c->n_lines; i++){
+    c->order[i].line = c->line_key[i];
+    c->order[i].slot = i;
+  }
+  qsort(c->order, c->n_lines, sizeof(*c->order), pmem_combine_cmp);
+  for(int i = 0; i < c->n_lines; i++){
+    int slot = c->order[i].slot;
+    size_t off = c->order[i].line * PMEM_XPLINE_SIZE;
+    size_t len = PMEM_XPLINE_SIZE;
+    if(off >= p->pmem_size){
+      continue;
+    }
+    if(off + len > p->pmem_size){
+      len = p->pmem_size - off;
+    }
+    if(p->is_pmem){
+      pmem_memcpy(p->pmem_file + off, &c->line_data[(size_t)slot * PMEM_XPLINE_SIZE], len,
+                  PMEM_F_MEM_NONTEMPORAL | PMEM_F_MEM_NODRAIN);
+      pmem_emu_media(p->pmem_file + off, len);
+    }
+    else{
+      memcpy(p->pmem_file + off, &c->line_data[(size_t)slot * PMEM_XPLINE_SIZE], len);
+    }
+  }
+  xpline_stats.media_combined += (u64)c->n_lines * PMEM_XPLINE_SIZE;
+  memset(c->hash, 0, (c->hash_mask + 1) * sizeof(int));
+  c->n_lines = 0;
+  p->nt_stores = 1;
+}
+
+/* write through the cache with non-temporal stores, no fence */
+static void pmem_stream_write(Persistent_File *p, const char *buffer, int buffer_size, sqlite_int64 offset){
+  if(p->is_pmem){
+    pmem_memcpy(p->pmem_file + offset, buffer, buffer_size, PMEM_F_MEM_NONTEMPORAL | PMEM_F_MEM_NODRAIN);
+    pmem_emu_media(p->pmem_file + offset, buffer_size);
+  }
+  else{
+    memcpy(p->pmem_file + offset, buffer, buffer_size);
+  }
+  p->nt_stores = 1;
+}
+
+/*
+** Merge a write into the buffer. Lines not buffered yet are first filled
+** with their current content, so every line can later be written whole.
+*/
+static void pmem_combine_write(Persistent_File *p, const char *buffer, int buffer_size, sqlite_int64 offset){
+  Pmem_Combine *c = p->combine;
+  u64 first = offset / PMEM_XPLINE_SIZE;
+  u64 last = (offset + buffer_size - 1) / PMEM_XPLINE_SIZE;
+
+  xpline_stats.bytes_submitted += buffer_size;
+  xpline_stats.media_uncombined += (last - first + 1) * PMEM_XPLINE_SIZE;
+  if(c->n_lines + (last - first + 1) > PMEM_COMBINE_LINES){
+    pmem_combine_flush(p);
+  }
+  if(last - first + 1 > PMEM_COMBINE_LINES){
+    /* larger than the whole buffer, stream it out directly */
+    pmem_stream_write(p, buffer, buffer_size, offset);
+    xpline_stats.media_combined += (last - first + 1) * PMEM_XPLINE_SIZE;
+    return;
+  }
+  for(u64 line = first; line <= last; line++){
+    int *slot = pmem_combine_slot(c, line);
+    sqlite_int64 line_off = line * PMEM_XPLINE_SIZE;
+    if(*slot == 0){
+      size_t len = line_off + PMEM_XPLINE_SIZE <= p->pmem_size ? PMEM_XPLINE_SIZE : p->pmem_size - line_off;
+      memcpy(&c->line_data[(size_t)c->n_lines * PMEM_XPLINE_SIZE], p->pmem_file + line_off, len);
+      c->line_key[c->n_lines] = line;
+      *slot = ++c->n_lines;
+    }
+    sqlite_int64 from = offset > line_off ? offset : line_off;
+    sqlite_int64 to = offset + buffer_size < line_off + PMEM_XPLINE_SIZE ? offset + buffer_size : line_off + PMEM_XPLINE_SIZE;
+    memcpy(&c->line_data[(size_t)(*slot - 1) * PMEM_XPLINE_SIZE + (from - line_off)], buffer + (from - offset), to - from);
+  }
+}
+
+/*
+** Copy buffered lines over a read from the mapping, so a file reads its own
+** writes before they are synced.
+*/
+static void pmem_combine_read(Persistent_File *p, char *buffer, int buffer_size, sqlite_int64 offset){
+  Pmem_Combine *c = p->combine;
+  if(c->n_lines == 0){
+    return;
+  }
+  u64 first = offset / PMEM_XPLINE_SIZE;
+  u64 last = (offset + buffer_size - 1) / PMEM_XPLINE_SIZE;
+  for(u64 line = first; line <= last; line++){
+    int slot = *pmem_combine_slot(c, line);
+    if(slot == 0){
+      continue;
+    }
+    sqlite_int64 line_off = line * PMEM_XPLINE_SIZE;
+    sqlite_int64 from = offset > line_off ? offset : line_off;
+    sqlite_int64 to = offset + buffer_size < line_off + PMEM_XPLINE_SIZE ? offset + buffer_size : line_off + PMEM_XPLINE_SIZE;
+    memcpy(buffer + (from - offset), &c->line_data[(size_t)(slot - 1) * PMEM_XPLINE_SIZE + (from - line_off)], to - from);
+  }
+}
+
+/*
+** Open main databases of the VFS. A WAL finds the database it belongs to
+** here by the file name pointer SQLite opened both with, and takes its
+** logging mode from it at the start of every transaction. SQLite closes a
+** WAL before its database, so the owner outlives the WAL.
+*/
+static struct {
+  pthread_mutex_t mutex;
+  Persistent_File *list;
+} pmem_dbs = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static const char *const pmem_logging_names[] = { "copy", "combine", "stream", "adaptive" };
+
+/* the PMEM_LOGGING_* mode called name, -1 if there is none */
+static int pmem_logging_mode(const char *name){
+  for(int i = 0; i < (int)(sizeof(pmem_logging_names) / sizeof(pmem_logging_names[0])); i++){
+    if(sqlite3_stricmp(name, pmem_logging_names[i]) == 0){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* the mode of WALs of the database file_path unless a PRAGMA changes it */
+static int pmem_logging_default(const char *file_path){
+  const char *name = sqlite3_uri_parameter(file_path, "logging");
+  int mode = name ? pmem_logging_mode(name) : -1;
+  if(mode < 0){
+    mode = pmem_config.logging;
+  }
+  if(mode < 0){
+    mode = sqlite3_uri_boolean(file_path, "write_combine", pmem_config.write_combine)
+           ? PMEM_LOGGING_COMBINE : PMEM_LOGGING_COPY;
+  }
+  return mode;
+}
+
+/*
+** Switch a WAL to mode between two transactions. Only combine and adaptive
+** keep a write combining buffer, the lines buffered so far are written out
+** when it goes.
+*/
+static int pmem_logging_set(Persistent_File *p, int mode){
+  int combines = mode == PMEM_LOGGING_COMBINE || mode == PMEM_LOGGING_ADAPTIVE;
+  if(combines && p->combine == 0){
+    p->combine = pmem_combine_create();
+    if(p->combine == 0){
+      return SQLITE_NOMEM;
+    }
+  }
+  else if(!combines && p->combine){
+    pmem_combine_flush(p);
+    pmem_combine_destroy(p->combine);
+    p->combine = 0;
+  }
+  p->logging = mode;
+  return SQLITE_OK;
+}
+
+/*
+** Set up the logging mode of a WAL when it is opened. Followers bootstrap
+** from a shipped WAL, its writes must reach the file at once and it stays
+** with copy.
+*/
+static int pmem_logging_open(Persistent_File *p, const char *file_path){
+  const char *db_name;
+  if(sqlite3_uri_parameter(file_path, "ship")){
+    p->logging = PMEM_LOGGING_COPY;
     return SQLITE_OK;
   }
-  // if(new_size > PMEM_MAX_LEN){
-  //   new_size = PMEM_MAX_LEN;
-  // }
-
-  p->pmem_file = (char *)pmem_map_file(p->path, new_size, PMEM_FILE_CREATE, 0666, &p->pmem_size, &p->is_pmem);
-  return SQLITE_OK;
-}
-
-void unmap_pmem(Persistent_File* p){
-  pmem_unmap(p->pmem_file, p->pmem_size);
-  p->pmem_size = 0;
-  p->used_size = 0;
-  p->pmem_file = 0;
-  p->is_pmem = 0;
+  db_name = sqlite3_filename_database(file_path);
+  pthread_mutex_lock(&pmem_dbs.mutex);
+  for(Persistent_File *d = pmem_dbs.list; d; d = d->next_db){
+    if(d->db_name == db_name){
+      p->owner = d;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pmem_dbs.mutex);
+  return pmem_logging_set(p, p->owner ? p->owner->wal_logging : pmem_logging_default(file_path));
+}
+
+static void pmem_logging_end(Persistent_File *p){
+  if(p->txn_bytes == 0){
+    return;
+  }
+  if(p->streaming){
+    __atomic_fetch_add(&logging_stats.streamed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&logging_stats.bytes_streamed, p->txn_bytes, __ATOMIC_RELAXED);
+    if(p->logging == PMEM_LOGGING_ADAPTIVE){
+      __atomic_fetch_add(&logging_stats.switched, 1, __ATOMIC_RELAXED);
+    }
+  }
+  else if(p->logging != PMEM_LOGGING_COPY){
+    __atomic_fetch_add(&logging_stats.combined, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&logging_stats.bytes_combined, p->txn_bytes, __ATOMIC_RELAXED);
+  }
+  else{
+    __atomic_fetch_add(&logging_stats.copied, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&logging_stats.bytes_copied, p->txn_bytes, __ATOMIC_RELAXED);
+  }
+  p->txn_pages = p->txn_bytes = 0;
+  p->txn_commit = 0;
+  p->streaming = 0;
+}
+
+/*
+** Account a write to a WAL to its transaction and choose how it is stored.
+** SQLite writes a frame as its 24 byte header followed by the page, a
+** header with a database size marks the last frame of a transaction. The
+** transaction ends at the next sync or header, except for headers that
+** repeat the commit frame to pad the WAL to a sector. The first write of a
+** transaction picks up the mode of the connection.
+*/
+static int pmem_logging_write(Persistent_File *p, const char *buffer, int buffer_size){
+  if(buffer_size == 24){
+    if(p->txn_commit && memcmp(buffer, p->commit_hdr, sizeof(p->commit_hdr)) != 0){
+      pmem_logging_end(p);
+    }
+    p->txn_commit = (buffer[4] | buffer[5] | buffer[6] | buffer[7]) != 0;
+    memcpy(p->commit_hdr, buffer, sizeof(p->commit_hdr));
+  }
+  if(p->txn_bytes == 0){
+    int mode = p->owner ? p->owner->wal_logging : p->logging;
+    if(mode != p->logging){
+      int rc = pmem_logging_set(p, mode);
+      if(rc != SQLITE_OK){
+        return rc;
+      }
+    }
+    p->streaming = p->logging == PMEM_LOGGING_STREAM;
+  }
+  p->txn_bytes += buffer_size;
+  if(buffer_size >= 512){
+    p->txn_pages++;
+  }
+  if(p->logging == PMEM_LOGGING_ADAPTIVE && !p->streaming
+     && (p->txn_pages > (u64)pmem_config.logging_pages
+         || p->txn_bytes > (u64)pmem_config.logging_bytes)){
+    /* lines combined so far go first, later writes may overlap them */
+    pmem_combine_flush(p);
+    p->streaming = 1;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Group commit state shared by all files. A sync enqueues its dirty range
+** as a Pmem_Sync_Req and waits until done_batch reaches the batch it was
+** queued in. Whoever finds no leader active takes the lead for the open
+** batch, so a batch queued while the previous leader was flushing is
+** picked up by one of its own members.
+*/
+typedef struct Pmem_Sync_Req Pmem_Sync_Req;
+struct Pmem_Sync_Req {
+  const char *addr;
+  size_t len;
+  Pmem_Sync_Req *next;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t done;        /* a batch finished */
+  pthread_cond_t full;        /* the open batch reached PMEM_GROUP_COMMIT_MAX */
+  Pmem_Sync_Req *pending;     /* requests of the open batch */
+  int n_pending;
+  int leader;                 /* a leader is waiting or flushing */
+  u64 open_batch;
+  u64 done_batch;
+  int window_us;              /* current adaptive wait */
+  int solo_batches;           /* batches of one since the last larger one */
+  int connections;            /* open main databases, nobody to wait for if 1 */
+} pmem_group = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  0, 0, 0, 1, 0, 0, 0, 0,
+};
+
+static void pmem_group_lead(void){
+  struct timespec deadline;
+  Pmem_Sync_Req *batch;
+  int n;
+  u64 id;
+
+  pmem_group.leader = 1;
+  if(pmem_group.window_us > 0 && pmem_group.connections > 1){
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)pmem_group.window_us * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while(pmem_group.n_pending < PMEM_GROUP_COMMIT_MAX){
+      if(pthread_cond_timedwait(&pmem_group.full, &pmem_group.mutex, &deadline)){
+        break;
+      }
+    }
+  }
+  batch = pmem_group.pending;
+  n = pmem_group.n_pending;
+  id = pmem_group.open_batch++;
+  pmem_group.pending = 0;
+  pmem_group.n_pending = 0;
+  pthread_mutex_unlock(&pmem_group.mutex);
+
+  PMEM_PROBE_ENTRY(tf, flush, 3, n, 0);
+  for(Pmem_Sync_Req *r = batch; r; r = r->next){
+    if(r->len){
+      pmem_emu_flush(r->addr, r->len);
+    }
+  }
+  PMEM_PROBE_EXIT(tf, flush, 3, SQLITE_OK, PMEM_PROBE_FLUSH);
+  PMEM_PROBE_ENTRY(td, fence, 3, 0, 0);
+  pmem_emu_drain();
+  PMEM_PROBE_EXIT(td, fence, 3, SQLITE_OK, PMEM_PROBE_FENCE);
+
+  pthread_mutex_lock(&pmem_group.mutex);
+  /*
+  ** Widen the window while syncs overlap and shrink it when they do not.
+  ** Once closed it is reopened fully after a while to probe for company.
+  */
+  if(n > 1){
+    pmem_group.window_us = pmem_group.window_us ? pmem_group.window_us * 2 : 1;
+    pmem_group.solo_batches = 0;
+  }
+  else if(pmem_group.window_us > 0){
+    pmem_group.window_us /= 2;
+  }
+  else if(++pmem_group.solo_batches >= 32){
+    pmem_group.window_us = pmem_config.group_commit_us;
+    pmem_group.solo_batches = 0;
+  }
+  if(pmem_group.window_us > pmem_config.group_commit_us){
+    pmem_group.window_us = pmem_config.group_commit_us;
+  }
+  pmem_group.done_batch = id;
+  pmem_group.leader = 0;
+  pthread_cond_broadcast(&pmem_group.done);
+}
+
+/*
+** Make addr[0..len) durable together with the concurrent syncs of other
+** connections.
+*/
+static void pmem_group_sync(const char *addr, size_t len){
+  Pmem_Sync_Req req = { addr, len, 0 };
+  u64 my_batch;
+
+  pthread_mutex_lock(&pmem_group.mutex);
+  req.next = pmem_group.pending;
+  pmem_group.pending = &req;
+  if(++pmem_group.n_pending >= PMEM_GROUP_COMMIT_MAX){
+    pthread_cond_signal(&pmem_group.full);
+  }
+  my_batch = pmem_group.open_batch;
+  while(pmem_group.done_batch < my_batch){
+    if(pmem_group.leader){
+      pthread_cond_wait(&pmem_group.done, &pmem_group.mutex);
+    }
+    else{
+      pmem_group_lead();
+    }
+  }
+  pthread_mutex_unlock(&pmem_group.mutex);
+}
+
+/*
+** Database snapshots (SQLITE_FCNTL_PMEM_SNAPSHOT). The database file is
+** cloned with a FICLONE reflink where the filesystem supports it. Else
+** the target is filled page by page by a background copier while every
+** write or truncate of the database first copies the pages it is about
+** to change (copy-on-write), so the target still becomes the image of
+** the moment the snapshot was taken.
+**
+** A main database is only changed by a transaction that holds the
+** EXCLUSIVE lock (rollback journal) or by a checkpoint that holds the
+** checkpoint lock of the WAL index. Both spans hold quiesce shared, and
+** starting a snapshot holds it exclusively, so the image is always taken
+** between two of them. Starting one waits up to PMEM_SNAPSHOT_BUSY_MS for
+** the spans to end, unless the calling thread is inside one itself on
+** another connection: that one would never end.
+*/
+#define PMEM_QUIESCE_LOCK 1
+#define PMEM_QUIESCE_CKPT 2
+typedef struct Pmem_Snapshot Pmem_Snapshot;
+struct Pmem_Snapshot {
+  dev_t dev;
+  ino_t ino;
+  int src_fd;
+  int dst_fd;
+  size_t size;            /* bytes of the image */
+  size_t n_pages;
+  u8 *copied;             /* one flag per PMEM_SNAPSHOT_PAGE page */
+  int done;
+  int rc;
+  Pmem_Snapshot *next;
+};
+
+static struct {
+  pthread_rwlock_t quiesce;
+  pthread_mutex_t mutex;
+  pthread_cond_t done;
+  Pmem_Snapshot *list;
+  int active;             /* snapshots still copying */
+} pmem_snap = {
+  PTHREAD_RWLOCK_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  0, 0,
+};
+
+/* spans the calling thread holds over all its connections */
+static __thread int pmem_quiesce_depth;
+
+static void pmem_quiesce_enter(Persistent_File *p, int span){
+  if(p->quiesced == 0){
+    pthread_rwlock_rdlock(&pmem_snap.quiesce);
+    pmem_quiesce_depth++;
+  }
+  p->quiesced |= span;
+}
+
+static void pmem_quiesce_leave(Persistent_File *p, int span){
+  if(p->quiesced & span){
+    p->quiesced &= ~span;
+    if(p->quiesced == 0){
+      pthread_rwlock_unlock(&pmem_snap.quiesce);
+      pmem_quiesce_depth--;
+    }
+  }
+}
+
+/* copy page i of s unless already done, called with pmem_snap.mutex held */
+static void pmem_snapshot_page(Pmem_Snapshot *s, size_t i){
+  char page[PMEM_SNAPSHOT_PAGE];
+  off_t off = (off_t)i * PMEM_SNAPSHOT_PAGE;
+  size_t len = s->size - off < PMEM_SNAPSHOT_PAGE ? s->size - off : PMEM_SNAPSHOT_PAGE;
+  if(s->copied[i]){
+    return;
+  }
+  if(pread(s->src_fd, page, len, off) != (ssize_t)len
+      || pwrite(s->dst_fd, page, len, off) != (ssize_t)len){
+    s->rc = SQLITE_IOERR_WRITE;
+  }
+  s->copied[i] = 1;
+}
+
+static void *pmem_snapshot_copier(void *arg){
+  Pmem_Snapshot *s = (Pmem_Snapshot*)arg;
+  for(size_t i = 0; i < s->n_pages; i++){
+    pthread_mutex_lock(&pmem_snap.mutex);
+    pmem_snapshot_page(s, i);
+    pthread_mutex_unlock(&pmem_snap.mutex);
+  }
+  if(fsync(s->dst_fd) && s->rc == SQLITE_OK){
+    s->rc = SQLITE_IOERR_FSYNC;
+  }
+  pthread_mutex_lock(&pmem_snap.mutex);
+  close(s->src_fd);
+  close(s->dst_fd);
+  free(s->copied);
+  s->copied = 0;
+  s->done = 1;
+  __atomic_sub_fetch(&pmem_snap.active, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&pmem_snap.done);
+  pthread_mutex_unlock(&pmem_snap.mutex);
+  return 0;
+}
+
+/*
+** Preserve the snapshot pages of p in [offset, offset + len) before they
+** are changed. Called within a quiesced span.
+*/
+static void pmem_snapshot_cow(Persistent_File *p, sqlite_int64 offset, sqlite_int64 len){
+  pthread_mutex_lock(&pmem_snap.mutex);
+  for(Pmem_Snapshot *s = pmem_snap.list; s; s = s->next){
+    if(s->done || s->ino != p->ino || s->dev != p->dev || (size_t)offset >= s->size){
+      continue;
+    }
+    size_t first = offset / PMEM_SNAPSHOT_PAGE;
+    size_t last = (offset + len - 1) / PMEM_SNAPSHOT_PAGE;
+    for(size_t i = first; i <= last && i < s->n_pages; i++){
+      pmem_snapshot_page(s, i);
+    }
+  }
+  pthread_mutex_unlock(&pmem_snap.mutex);
+}
+
+/*
+** Start a snapshot of the main database p into the new file target.
+** Returns once the image is fixed; the copy may still be running.
+*/
+static int pmem_snapshot_start(Persistent_File *p, const char *target){
+  Pmem_Snapshot *s;
+  int rc = SQLITE_OK;
+
+  if(p->quiesced){
+    /* its own transaction or checkpoint would have to end first */
+    return SQLITE_BUSY;
+  }
+  if(p->combine){
+    pmem_combine_flush(p);
+    pmem_emu_drain();
+  }
+  if(pthread_rwlock_trywrlock(&pmem_snap.quiesce)){
+    struct timespec deadline;
+    if(pmem_quiesce_depth){
+      return SQLITE_BUSY;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)PMEM_SNAPSHOT_BUSY_MS * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    if(pthread_rwlock_timedwrlock(&pmem_snap.quiesce, &deadline)){
+      return SQLITE_BUSY;
+    }
+  }
+  /* the size other handles of the database left behind */
+  pmem_map_refresh(p);
+  pthread_mutex_lock(&pmem_snap.mutex);
+  for(Pmem_Snapshot **pp = &pmem_snap.list; *pp; ){
+    s = *pp;
+    if(s->ino == p->ino && s->dev == p->dev){
+      if(!s->done){
+        rc = SQLITE_BUSY;
+        break;
+      }
+      /* a finished snapshot nobody waited for */
+      *pp = s->next;
+      free(s);
+      continue;
+    }
+    pp = &s->next;
+  }
+  pthread_mutex_unlock(&pmem_snap.mutex);
+  if(rc != SQLITE_OK){
+    pthread_rwlock_unlock(&pmem_snap.quiesce);
+    return rc;
+  }
+
+  int src_fd = open(p->path, O_RDONLY);
+  int dst_fd = open(target, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(src_fd < 0 || dst_fd < 0){
+    rc = SQLITE_CANTOPEN;
+  }
+  else if(ioctl(dst_fd, FICLONE, src_fd) == 0){
+    /* reflinked, the clone already is the image */
+    if(ftruncate(dst_fd, p->used_size) || fsync(dst_fd)){
+      rc = SQLITE_IOERR_FSYNC;
+    }
+  }
+  else if(ftruncate(dst_fd, p->used_size)){
+    rc = SQLITE_IOERR_TRUNCATE;
+  }
+  else if(p->used_size > 0){
+    pthread_t thread;
+    s = calloc(1, sizeof(Pmem_Snapshot));
+    if(s){
+      s->n_pages = (p->used_size + PMEM_SNAPSHOT_PAGE - 1) / PMEM_SNAPSHOT_PAGE;
+      s->copied = calloc(s->n_pages, 1);
+    }
+    if(s == 0 || s->copied == 0){
+      if(s){
+        free(s->copied);
+      }
+      free(s);
+      rc = SQLITE_NOMEM;
+    }
+    else{
+      s->dev = p->dev;
+      s->ino = p->ino;
+      s->src_fd = src_fd;
+      s->dst_fd = dst_fd;
+      s->size = p->used_size;
+      pthread_mutex_lock(&pmem_snap.mutex);
+      if(pthread_create(&thread, 0, pmem_snapshot_copier, s)){
+        free(s->copied);
+        free(s);
+        rc = SQLITE_ERROR;
+      }
+      else{
+        pthread_detach(thread);
+        s->next = pmem_snap.list;
+        pmem_snap.list = s;
+        __atomic_add_fetch(&pmem_snap.active, 1, __ATOMIC_RELAXED);
+        src_fd = dst_fd = -1;     /* owned by the copier now */
+      }
+      pthread_mutex_unlock(&pmem_snap.mutex);
+    }
+  }
+  pthread_rwlock_unlock(&pmem_snap.quiesce);
+  if(src_fd >= 0){
+    close(src_fd);
+  }
+  if(dst_fd >= 0){
+    close(dst_fd);
+  }
+  return rc;
+}
+
+/* wait for the copy of the last snapshot of p, returns its result */
+static int pmem_snapshot_wait(Persistent_File *p){
+  int rc = SQLITE_OK;
+  pthread_mutex_lock(&pmem_snap.mutex);
+  for(Pmem_Snapshot **pp = &pmem_snap.list; *pp; pp = &(*pp)->next){
+    Pmem_Snapshot *s = *pp;
+    if(s->ino == p->ino && s->dev == p->dev){
+      while(!s->done){
+        pthread_cond_wait(&pmem_snap.done, &pmem_snap.mutex);
+      }
+      rc = s->rc;
+      *pp = s->next;
+      free(s);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pmem_snap.mutex);
+  return rc;
+}
+
+/*
+** Dirty page map of a main database, kept in "<db>-dirtymap":
+**
+**        offset 0                  Dirtymap_Header
+**        PMEM_DIRTYMAP_BITS        one bit per PMEM_DIRTYMAP_PAGE bytes
+**
+** Bits are set by pmem_write() and reach the media with the next
+** pmem_sync() of the database. A map created for a database that already
+** has content starts with all its pages marked.
+**
+** No write may slip in between the copy of a backup and the clearing of
+** its bit. A handle puts its pid into a writer slot of the header from its
+** first marked write until the sync that makes the bits durable, which
+** costs no system call. An incremental backup takes an exclusive flock()
+** on the sidecar and publishes its pid in the header from
+** SQLITE_FCNTL_PMEM_DIRTYMAP_GET until the reset. It starts only once no
+** slot is held, and writers that find it running wait for the flock() in
+** pmem_write(). Slots and backups of dead processes are taken over.
+*/
+#define PMEM_DIRTYMAP_MAGIC 0x50444d4150000002ULL
+#define PMEM_DIRTYMAP_BITS 64
+#define PMEM_DIRTYMAP_WRITERS 11
+
+typedef struct Dirtymap_Header Dirtymap_Header;
+struct Dirtymap_Header {
+  u64 magic;
+  u64 epoch;                /* bumped by every reset */
+  u32 backup;               /* pid of a running backup, 0 if none */
+  u32 writers[PMEM_DIRTYMAP_WRITERS];   /* pids of handles with unsynced marks */
+};
+
+/*
+** Once a database has a map, every handle keeps it, whatever its own
+** "dirtymap" parameter: a single untracked write would be missing from
+** the next incremental backup.
+*/
+static int pmem_dirtymap_exists(Persistent_File *p){
+  char path[MAXPATHNAME + 16];
+  snprintf(path, sizeof(path), "%s-dirtymap", p->path);
+  return access(path, F_OK) == 0;
+}
+
+/* map the sidecar so that it covers at least n_pages pages */
+static int pmem_dirtymap_map(Persistent_File *p, u64 n_pages){
+  char path[MAXPATHNAME + 16];
+  struct stat st;
+  size_t size = PMEM_DIRTYMAP_BITS + (n_pages + 7) / 8;
+  if(size < PMEM_DIRTYMAP_BITS + PMEM_DIRTYMAP_PAGE){
+    size = PMEM_DIRTYMAP_BITS + PMEM_DIRTYMAP_PAGE;
+  }
+  size_t mapped_size;
+  int is_pmem;
+  int fresh;
+
+  snprintf(path, sizeof(path), "%s-dirtymap", p->path);
+  fresh = stat(path, &st) != 0 || st.st_size < PMEM_DIRTYMAP_BITS;
+  if(!fresh && (size_t)st.st_size > size){
+    /* another handle may have grown it already, never shrink */
+    size = st.st_size;
+  }
+  if(p->dirtymap && size <= p->dirtymap_size){
+    return SQLITE_OK;
+  }
+  if(p->dirtymap){
+    size = size < 2 * p->dirtymap_size ? 2 * p->dirtymap_size : size;
+  }
+  else if((p->dirtymap_fd = open(path, O_RDWR | O_CREAT, 0666)) < 0){
+    return SQLITE_CANTOPEN;
+  }
+  char *mapped = (char *)pmem_map_file(path, size, PMEM_FILE_CREATE, 0666, &mapped_size, &is_pmem);
+  if(mapped == NULL){
+    return SQLITE_IOERR_MMAP;
+  }
+  is_pmem = pmem_emu_is_pmem(is_pmem);
+  if(p->dirtymap){
+    /* bytes not yet synced were written through the old view */
+    if(p->dirtymap_is_pmem){
+      pmem_emu_persist(p->dirtymap, p->dirtymap_size);
+    }
+    pmem_unmap(p->dirtymap, p->dirtymap_size);
+  }
+  p->dirtymap = mapped;
+  p->dirtymap_size = mapped_size;
+  p->dirtymap_is_pmem = is_pmem;
+  if(fresh){
+    Dirtymap_Header *h = (Dirtymap_Header*)mapped;
+    u64 used = (p->used_size + PMEM_DIRTYMAP_PAGE - 1) / PMEM_DIRTYMAP_PAGE;
+    memset(mapped + PMEM_DIRTYMAP_BITS, 0, mapped_size - PMEM_DIRTYMAP_BITS);
+    memset(mapped + PMEM_DIRTYMAP_BITS, 0xff, used / 8);
+    for(u64 i = used & ~(u64)7; i < used; i++){
+      mapped[PMEM_DIRTYMAP_BITS + i / 8] |= 1 << (i % 8);
+    }
+    h->magic = PMEM_DIRTYMAP_MAGIC;
+    h->epoch = 1;
+    h->backup = 0;
+    memset(h->writers, 0, sizeof(h->writers));
+    if(is_pmem){
+      pmem_emu_persist(mapped, mapped_size);
+    }
+    else if(pmem_msync(mapped, mapped_size)){
+      return SQLITE_IOERR_FSYNC;
+    }
+  }
+  else if(((Dirtymap_Header*)mapped)->magic != PMEM_DIRTYMAP_MAGIC){
+    return SQLITE_CORRUPT;
+  }
+  return SQLITE_OK;
+}
+
+/* a pid in the header whose process is gone */
+static int pmem_dirtymap_dead(u32 pid){
+  return pid && kill(pid, 0) && errno == ESRCH;
+}
+
+/* take a writer slot for pid, waiting for one if all are held */
+static int pmem_dirtymap_claim(Dirtymap_Header *h, u32 pid){
+  for(;;){
+    for(int i = 0; i < PMEM_DIRTYMAP_WRITERS; i++){
+      u32 cur = __atomic_load_n(&h->writers[i], __ATOMIC_SEQ_CST);
+      if((cur == 0 || pmem_dirtymap_dead(cur))
+          && __atomic_compare_exchange_n(&h->writers[i], &cur, pid, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+        return i;
+      }
+    }
+    sched_yield();
+  }
+}
+
+/*
+** Called before the first marked write since the last sync. Returns with
+** a writer slot held and no backup running.
+*/
+static int pmem_dirtymap_enter(Persistent_File *p){
+  u32 pid = getpid();
+  if(p->dirtymap_lock == LOCK_EX){
+    /* the backup of this handle would clear the bit */
+    return SQLITE_MISUSE;
+  }
+  for(;;){
+    Dirtymap_Header *h = (Dirtymap_Header*)p->dirtymap;
+    int slot = pmem_dirtymap_claim(h, pid);
+    if(__atomic_load_n(&h->backup, __ATOMIC_SEQ_CST) == 0){
+      p->dirtymap_slot = slot;
+      return SQLITE_OK;
+    }
+    __atomic_store_n(&h->writers[slot], 0, __ATOMIC_SEQ_CST);
+    if(flock(p->dirtymap_fd, LOCK_SH)){
+      return SQLITE_IOERR_LOCK;
+    }
+    /* a backup still published although nobody holds the flock died */
+    u32 backup = __atomic_load_n(&h->backup, __ATOMIC_SEQ_CST);
+    if(backup){
+      __atomic_compare_exchange_n(&h->backup, &backup, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    flock(p->dirtymap_fd, LOCK_UN);
+  }
+}
+
+static void pmem_dirtymap_leave(Persistent_File *p){
+  if(p->dirtymap_slot >= 0){
+    Dirtymap_Header *h = (Dirtymap_Header*)p->dirtymap;
+    __atomic_store_n(&h->writers[p->dirtymap_slot], 0, __ATOMIC_SEQ_CST);
+    p->dirtymap_slot = -1;
+  }
+}
+
+/* mark the pages of [offset, offset + len) dirty */
+static int pmem_dirtymap_mark(Persistent_File *p, sqlite_int64 offset, int len){
+  u64 first = offset / PMEM_DIRTYMAP_PAGE;
+  u64 last = (offset + len - 1) / PMEM_DIRTYMAP_PAGE;
+  if(p->dirtymap_slot < 0){
+    int rc = pmem_dirtymap_enter(p);
+    if(rc != SQLITE_OK){
+      return rc;
+    }
+  }
+  if(PMEM_DIRTYMAP_BITS + last / 8 >= p->dirtymap_size){
+    int rc = pmem_dirtymap_map(p, last + 1);
+    if(rc != SQLITE_OK){
+      return rc;
+    }
+  }
+  for(u64 i = first; i <= last; i++){
+    size_t byte = PMEM_DIRTYMAP_BITS + i / 8;
+    u8 bit = 1 << (i % 8);
+    /* only touch lines that change, a clean line costs no flush */
+    if(!(p->dirtymap[byte] & bit)){
+      p->dirtymap[byte] |= bit;
+      if(p->dirtymap_hi == 0 || byte < p->dirtymap_lo){
+        p->dirtymap_lo = byte;
+      }
+      if(byte + 1 > p->dirtymap_hi){
+        p->dirtymap_hi = byte + 1;
+      }
+    }
+  }
+  return SQLITE_OK;
+}
+
+/* make the bits set since the last sync durable */
+static int pmem_dirtymap_sync(Persistent_File *p){
+  int rc = 0;
+  if(p->dirtymap_hi > p->dirtymap_lo){
+    if(p->dirtymap_is_pmem){
+      pmem_emu_persist(p->dirtymap + p->dirtymap_lo, p->dirtymap_hi - p->dirtymap_lo);
+    }
+    else{
+      rc = pmem_msync(p->dirtymap + p->dirtymap_lo, p->dirtymap_hi - p->dirtymap_lo);
+    }
+  }
+  p->dirtymap_lo = p->dirtymap_hi = 0;
+  if(rc){
+    return SQLITE_IOERR_FSYNC;
+  }
+  pmem_dirtymap_leave(p);
+  return SQLITE_OK;
+}
+
+/* end the backup of p, writers waiting for it go on */
+static void pmem_dirtymap_end_backup(Persistent_File *p){
+  if(p->dirtymap_lock == LOCK_EX){
+    Dirtymap_Header *h = (Dirtymap_Header*)p->dirtymap;
+    __atomic_store_n(&h->backup, 0, __ATOMIC_SEQ_CST);
+    flock(p->dirtymap_fd, LOCK_UN);
+    p->dirtymap_lock = 0;
+  }
+}
+
+/* the map is locked against all writers until pmem_dirtymap_reset() */
+static int pmem_dirtymap_get(Persistent_File *p, pmem_dirtymap *out){
+  size_t n_bytes;
+  if(p->dirtymap_lock != LOCK_EX){
+    int rc = pmem_dirtymap_sync(p);
+    if(rc != SQLITE_OK){
+      return rc;
+    }
+    if(flock(p->dirtymap_fd, LOCK_EX | LOCK_NB)){
+      return errno == EWOULDBLOCK ? SQLITE_BUSY : SQLITE_IOERR_LOCK;
+    }
+    p->dirtymap_lock = LOCK_EX;
+    Dirtymap_Header *h = (Dirtymap_Header*)p->dirtymap;
+    __atomic_store_n(&h->backup, getpid(), __ATOMIC_SEQ_CST);
+    for(int i = 0; i < PMEM_DIRTYMAP_WRITERS; i++){
+      u32 cur = __atomic_load_n(&h->writers[i], __ATOMIC_SEQ_CST);
+      if(pmem_dirtymap_dead(cur)){
+        __atomic_compare_exchange_n(&h->writers[i], &cur, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      }
+      else if(cur){
+        /* its writes may land after the copy */
+        pmem_dirtymap_end_backup(p);
+        return SQLITE_BUSY;
+      }
+    }
+  }
+  /* another handle may have grown the map */
+  struct stat st;
+  if(fstat(p->dirtymap_fd, &st) == 0 && (size_t)st.st_size > p->dirtymap_size){
+    int rc = pmem_dirtymap_map(p, (st.st_size - PMEM_DIRTYMAP_BITS) * 8);
+    if(rc != SQLITE_OK){
+      return rc;
+    }
+  }
+  n_bytes = p->dirtymap_size - PMEM_DIRTYMAP_BITS;
+  out->epoch = ((Dirtymap_Header*)p->dirtymap)->epoch;
+  out->n_pages = (u64)n_bytes * 8;
+  out->page_size = PMEM_DIRTYMAP_PAGE;
+  out->bits = sqlite3_malloc64(n_bytes);
+  if(out->bits == 0){
+    return SQLITE_NOMEM;
+  }
+  memcpy(out->bits, p->dirtymap + PMEM_DIRTYMAP_BITS, n_bytes);
+  return SQLITE_OK;
+}
+
+static int pmem_dirtymap_reset(Persistent_File *p, u64 *epoch){
+  Dirtymap_Header *h = (Dirtymap_Header*)p->dirtymap;
+  if(p->dirtymap_lock != LOCK_EX){
+    /* writers may have run since the bits were copied */
+    return SQLITE_MISUSE;
+  }
+  if(h->epoch != *epoch){
+    return SQLITE_BUSY;
+  }
+  /* clear the bits before the new epoch becomes visible */
+  pmem_memset_persist(p->dirtymap + PMEM_DIRTYMAP_BITS, 0, p->dirtymap_size - PMEM_DIRTYMAP_BITS);
+  h->epoch++;
+  if(p->dirtymap_is_pmem){
+    pmem_emu_persist(&h->epoch, sizeof(h->epoch));
+  }
+  else if(pmem_msync(p->dirtymap, p->dirtymap_size)){
+    return SQLITE_IOERR_FSYNC;
+  }
+  p->dirtymap_lo = p->dirtymap_hi = 0;
+  *epoch = h->epoch;
+  pmem_dirtymap_end_backup(p);
+  return SQLITE_OK;
+}
+
+/*
+** WAL shipping, see pmem_ship.h. A ring that already exists with the
+** requested capacity is reused, so followers stay attached when the
+** primary reopens the database.
+*/
+static pthread_mutex_t pmem_ship_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int pmem_ship_open(Persistent_File *p, const char *name, sqlite3_int64 capacity){
+  struct stat st;
+  size_t size;
+  int fd;
+
+  if(capacity < (1 << 20)){
+    capacity = 1 << 20;           /* must hold the largest frame */
+  }
+  size = PMEM_SHIP_DATA + capacity;
+  fd = shm_open(name, O_RDWR | O_CREAT, 0666);
+  if(fd < 0){
+    return SQLITE_CANTOPEN;
+  }
+  if(fstat(fd, &st) || ((size_t)st.st_size != size && ftruncate(fd, size))){
+    close(fd);
+    return SQLITE_IOERR;
+  }
+  Ship_Ring *r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(r == MAP_FAILED){
+    return SQLITE_IOERR_MMAP;
+  }
+  if(r->magic != PMEM_SHIP_MAGIC || r->capacity != (u64)capacity){
+    r->capacity = capacity;
+    __atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->reserved, 0, __ATOMIC_RELEASE);
+    r->generation++;
+    __atomic_store_n(&r->magic, PMEM_SHIP_MAGIC, __ATOMIC_RELEASE);
+  }
+  p->ship = r;
+  p->ship_size = size;
+  return SQLITE_OK;
+}
+
+/* publish a WAL write, never waits for followers */
+static void pmem_ship_publish(Persistent_File *p, const void *buffer, int buffer_size, sqlite_int64 offset){
+  Ship_Ring *r = p->ship;
+  Ship_Record rec;
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec.len = buffer_size;
+  rec.pad = 0;
+  rec.offset = offset;
+  rec.ts_ns = (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  pthread_mutex_lock(&pmem_ship_mutex);
+  u64 head = r->head;
+  /* readers of the bytes about to be overwritten see it after their copy */
+  __atomic_store_n(&r->reserved, head + pmem_ship_record_size(buffer_size), __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  pmem_ship_write(r, head, &rec, sizeof(rec));
+  pmem_ship_write(r, head + sizeof(rec), buffer, buffer_size);
+  __atomic_store_n(&r->head, head + pmem_ship_record_size(buffer_size), __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pmem_ship_mutex);
+}
+
+/*
+** Page access tracer. With PMEM_CONFIG_TRACE set to n, one in n reads and
+** writes is recorded as an event in a buffer of the calling thread. The
+** owner appends to its buffer without taking a lock, it is drained under
+** pmem_trace.mutex only when it is full or a dump is taken. Draining folds
+** the events into the heat table of their file: read and write counts per
+** PMEM_TRACE_PAGE bytes and the time between sampled accesses of a page.
+** Heat tables live as long as the process, events may outlive their file.
+*/
+typedef struct Pmem_Heat Pmem_Heat;
+struct Pmem_Heat {
+  Pmem_Heat *next;
+  char *path;
+  u64 n_pages;
+  struct Pmem_Heat_Page {
+    u64 reads;
+    u64 writes;
+    u64 last_ns;          /* time of the last sampled access */
+    u64 gap_ns;           /* sum of the times between sampled accesses */
+    u64 gaps;
+  } *pages;
+};
+
+typedef struct Pmem_Trace_Event Pmem_Trace_Event;
+struct Pmem_Trace_Event {
+  Pmem_Heat *heat;
+  u64 page;
+  u64 ns;
+  u32 n_pages;
+  u32 write;
+};
+
+typedef struct Pmem_Trace_Buffer Pmem_Trace_Buffer;
+struct Pmem_Trace_Buffer {
+  Pmem_Trace_Buffer *next;
+  u64 head;               /* advanced by the owning thread only */
+  u64 tail;               /* advanced under pmem_trace.mutex only */
+  int countdown;          /* accesses until the next sample */
+  int in_use;             /* owned by a live thread */
+  Pmem_Trace_Event events[PMEM_TRACE_BUFFER];
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_once_t once;
+  pthread_key_t key;      /* releases the buffer of an exiting thread */
+  Pmem_Heat *files;
+  Pmem_Trace_Buffer *buffers;
+} pmem_trace = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_ONCE_INIT,
+};
+
+static __thread Pmem_Trace_Buffer *pmem_trace_local;
+
+static u64 pmem_trace_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* pmem_trace.mutex is held */
+static void pmem_trace_drain(Pmem_Trace_Buffer *b){
+  u64 head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+  for(u64 i = b->tail; i < head; i++){
+    Pmem_Trace_Event *e = &b->events[i % PMEM_TRACE_BUFFER];
+    Pmem_Heat *h = e->heat;
+    if(e->page + e->n_pages > h->n_pages){
+      u64 n = h->n_pages ? h->n_pages : 64;
+      while(n < e->page + e->n_pages){
+        n *= 2;
+      }
+      struct Pmem_Heat_Page *pages = realloc(h->pages, n * sizeof(*pages));
+      if(pages == 0){
+        continue;
+      }
+      memset(pages + h->n_pages, 0, (n - h->n_pages) * sizeof(*pages));
+      h->pages = pages;
+      h->n_pages = n;
+    }
+    for(u64 j = e->page; j < e->page + e->n_pages; j++){
+      struct Pmem_Heat_Page *pg = &h->pages[j];
+      if(e->write){
+        pg->writes++;
+      }
+      else{
+        pg->reads++;
+      }
+      if(pg->last_ns && e->ns > pg->last_ns){
+        pg->gap_ns += e->ns - pg->last_ns;
+        pg->gaps++;
+      }
+      pg->last_ns = e->ns;
+    }
+  }
+  __atomic_store_n(&b->tail, head, __ATOMIC_RELEASE);
+}
+
+static void pmem_trace_release(void *arg){
+  Pmem_Trace_Buffer *b = arg;
+  pthread_mutex_lock(&pmem_trace.mutex);
+  pmem_trace_drain(b);
+  b->in_use = 0;
+  pthread_mutex_unlock(&pmem_trace.mutex);
+}
+
+static void pmem_trace_init(void){
+  pthread_key_create(&pmem_trace.key, pmem_trace_release);
+}
+
+/* the buffer of the calling thread, a released one is reused */
+static Pmem_Trace_Buffer *pmem_trace_buffer(void){
+  Pmem_Trace_Buffer *b;
+  pthread_once(&pmem_trace.once, pmem_trace_init);
+  pthread_mutex_lock(&pmem_trace.mutex);
+  for(b = pmem_trace.buffers; b && b->in_use; b = b->next);
+  if(b == 0 && (b = calloc(1, sizeof(Pmem_Trace_Buffer))) != 0){
+    b->next = pmem_trace.buffers;
+    pmem_trace.buffers = b;
+  }
+  if(b){
+    b->in_use = 1;
+    b->countdown = 1;
+  }
+  pthread_mutex_unlock(&pmem_trace.mutex);
+  if(b){
+    pthread_setspecific(pmem_trace.key, b);
+  }
+  return pmem_trace_local = b;
+}
+
+/* the heat table of a path, created on first use */
+static Pmem_Heat *pmem_trace_heat(const char *path){
+  Pmem_Heat *h;
+  pthread_mutex_lock(&pmem_trace.mutex);
+  for(h = pmem_trace.files; h && strcmp(h->path, path); h = h->next);
+  if(h == 0 && (h = calloc(1, sizeof(Pmem_Heat))) != 0){
+    h->path = strdup(path);
+    if(h->path == 0){
+      free(h);
+      h = 0;
+    }
+    else{
+      h->next = pmem_trace.files;
+      pmem_trace.files = h;
+    }
+  }
+  pthread_mutex_unlock(&pmem_trace.mutex);
+  return h;
+}
+
+static void pmem_trace_access(Persistent_File *p, sqlite_int64 offset, int len, int write){
+  Pmem_Trace_Buffer *b = pmem_trace_local;
+  if(b == 0 && (b = pmem_trace_buffer()) == 0){
+    return;
+  }
+  if(--b->countdown > 0){
+    return;
+  }
+  b->countdown = __atomic_load_n(&pmem_config.trace, __ATOMIC_RELAXED);
+  if(p->heat == 0 && (p->heat = pmem_trace_heat(p->path)) == 0){
+    return;
+  }
+  u64 head = b->head;
+  if(head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) == PMEM_TRACE_BUFFER){
+    pthread_mutex_lock(&pmem_trace.mutex);
+    pmem_trace_drain(b);
+    pthread_mutex_unlock(&pmem_trace.mutex);
+  }
+  Pmem_Trace_Event *e = &b->events[head % PMEM_TRACE_BUFFER];
+  e->heat = p->heat;
+  e->page = offset / PMEM_TRACE_PAGE;
+  e->n_pages = (offset + len - 1) / PMEM_TRACE_PAGE - e->page + 1;
+  e->ns = pmem_trace_now();
+  e->write = write;
+  __atomic_store_n(&b->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int sqlite3_pmem_trace_dump(const char *path, int reset){
+  FILE *f = fopen(path, "w");
+  if(f == 0){
+    return SQLITE_CANTOPEN;
+  }
+  pthread_mutex_lock(&pmem_trace.mutex);
+  for(Pmem_Trace_Buffer *b = pmem_trace.buffers; b; b = b->next){
+    pmem_trace_drain(b);
+  }
+  fprintf(f, "# pmem heat trace, sample 1/%d, page %d\n", pmem_config.trace, PMEM_TRACE_PAGE);
+  for(Pmem_Heat *h = pmem_trace.files; h; h = h->next){
+    fprintf(f, "file %s\n", h->path);
+    for(u64 i = 0; i < h->n_pages; i++){
+      struct Pmem_Heat_Page *pg = &h->pages[i];
+      if(pg->reads || pg->writes){
+        fprintf(f, "%llu %llu %llu %.1f\n", (unsigned long long)i,
+                (unsigned long long)pg->reads, (unsigned long long)pg->writes,
+                pg->gaps ? pg->gap_ns / 1000.0 / pg->gaps : 0.0);
+      }
+    }
+    if(reset){
+      memset(h->pages, 0, h->n_pages * sizeof(*h->pages));
+    }
+  }
+  pthread_mutex_unlock(&pmem_trace.mutex);
+  return fclose(f) ? SQLITE_IOERR : SQLITE_OK;
+}
+
+/* probe component of writes and syncs of p, see PMEM_PROBE_WAL_APPEND */
+static inline int pmem_probe_component(Persistent_File *p, int wal){
+  return p->is_wal ? wal : p->is_main_db ? PMEM_PROBE_CHECKPOINT : -1;
+}
+
+static int demoDelete(sqlite3_vfs *pVfs, const char *zPath, int dirSync);
+/*
+*/
+static int pmem_close(sqlite3_file *pFile){
+  Persistent_File *p = (Persistent_File*)pFile;
+  PMEM_PROBE_ENTRY(t, close, PMEM_PROBE_KIND(p), 0, 0);
+  if(p->async_epoch){
+    pmem_async_wait(p->async_epoch);
+  }
+  pmem_quiesce_leave(p, PMEM_QUIESCE_LOCK | PMEM_QUIESCE_CKPT);
+  if(p->is_main_db){
+    pthread_mutex_lock(&pmem_group.mutex);
+    pmem_group.connections--;
+    pthread_mutex_unlock(&pmem_group.mutex);
+    pthread_mutex_lock(&pmem_dbs.mutex);
+    for(Persistent_File **pp = &pmem_dbs.list; *pp; pp = &(*pp)->next_db){
+      if(*pp == p){
+        *pp = p->next_db;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&pmem_dbs.mutex);
+  }
+  if(p->is_wal){
+    pmem_logging_end(p);
+  }
+  if(p->combine){
+    pmem_combine_flush(p);
+    pmem_emu_drain();
+    pmem_combine_destroy(p->combine);
+    p->combine = 0;
+  }
+  if(p->dirtymap){
+    pmem_dirtymap_sync(p);
+    pmem_dirtymap_leave(p);
+    pmem_dirtymap_end_backup(p);
+    pmem_unmap(p->dirtymap, p->dirtymap_size);
+    close(p->dirtymap_fd);
+    p->dirtymap = 0;
+  }
+  if(p->ship){
+    munmap(p->ship, p->ship_size);
+    p->ship = 0;
+  }
+  // printf("sync_calls: %s  %i\n", p->path, p->sync_calls);
+  // printf("write_calls: %s  %i\n", p->path, p->write_calls);
+  //fflush(stdout);
+  /* a WAL ring keeps its preallocated size */
+  if(p->map){
+    pmem_map_detach(p, 1);
+  }
+  else{
+    if(p->used_size > p->wal_capacity){
+      map_pmem(p, p->used_size);
+    }
+    unmap_pmem(p);
+  }
+  if(p->tmp){
+    demoDelete(NULL, p->path, 1);
+  }
+  //printf("close %s\n", p->path);
+  PMEM_PROBE_EXIT(t, close, PMEM_PROBE_KIND(p), SQLITE_OK, -1);
+  return SQLITE_OK;
+}
+
+/*
+** Read-ahead of strided reads. A read p->ra_stride bytes after the last one
+** continues the stride, one read off the stride (an interior page of the
+** btree being scanned, say) is skipped once a stride is established. From
+** PMEM_READAHEAD_TRIGGER reads on, the strided reads of the next readahead
+** bytes are prefetched whenever less than half the window is left, so a
+** scan issues one batch per half window rather than one per page. Lines of
+** pmem mappings are software prefetched into L2, other mappings get
+** MADV_WILLNEED to start the page cache read-ahead.
+*/
+static void pmem_readahead(Persistent_File *p, sqlite_int64 offset, int amount){
+  if(offset == p->ra_last + p->ra_stride && p->ra_stride > 0){
+    p->ra_last = offset;
+    p->ra_run++;
+    p->ra_missed = 0;
+  }
+  else if(p->ra_run >= PMEM_READAHEAD_TRIGGER && !p->ra_missed){
+    p->ra_missed = 1;
+    return;
+  }
+  else{
+    p->ra_stride = offset - p->ra_last;
+    p->ra_last = offset;
+    p->ra_run = 0;
+    p->ra_missed = 0;
+    p->ra_done = 0;
+    return;
+  }
+  if(p->ra_run < PMEM_READAHEAD_TRIGGER || p->ra_stride > (sqlite_int64)p->readahead){
+    return;
+  }
+  __atomic_fetch_add(&read_stats.strided, 1, __ATOMIC_RELAXED);
+
+  size_t stride = p->ra_stride;
+  size_t end = offset + p->readahead;
+  if(p->ra_done >= offset + p->readahead / 2){
+    return;
+  }
+  if(end > p->used_size){
+    end = p->used_size;
+  }
+  size_t from = p->ra_done > offset + stride ? p->ra_done : offset + stride;
+  if(from >= end){
+    return;
+  }
+  size_t o = from;
+  if(p->is_pmem){
+    for(; o < end; o += stride){
+      size_t line_end = o + amount < end ? o + amount : end;
+      for(size_t line = o & ~(size_t)63; line < line_end; line += 64){
+        __builtin_prefetch(p->pmem_file + line, 0, 2);
+      }
+      __atomic_fetch_add(&read_stats.prefetched_bytes, line_end - o, __ATOMIC_RELAXED);
+    }
+  }
+  else{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t lo = from & ~(page - 1);
+    madvise(p->pmem_file + lo, end - lo, MADV_WILLNEED);
+    __atomic_fetch_add(&read_stats.madvised_bytes, end - lo, __ATOMIC_RELAXED);
+    o = from + (end - from + stride - 1) / stride * stride;
+  }
+  p->ra_done = o;
 }
 
-static int demoDelete(sqlite3_vfs *pVfs, const char *zPath, int dirSync);
 /*
+** Copy of a read out of the mapping. Page sized and larger reads use 256
+** (AVX-512) or 128 (AVX2) bytes per iteration with the loads issued ahead
+** of the stores, whichever the build targets (-march=native).
 */
-static int pmem_close(sqlite3_file *pFile){
-  Persistent_File *p = (Persistent_File*)pFile;
-  // printf("sync_calls: %s  %i\n", p->path, p->sync_calls);
-  // printf("write_calls: %s  %i\n", p->path, p->write_calls);
-  //fflush(stdout);
-  map_pmem(p, p->used_size);
-  unmap_pmem(p);
-  if(p->tmp){
-    demoDelete(NULL, p->path, 1);
+static void pmem_read_copy(void *dst, const char *src, size_t n){
+#if defined(__AVX512F__) || defined(__AVX2__)
+  if(n >= PMEM_WIDE_COPY){
+    char *d = (char*)dst;
+    size_t i = 0;
+# if defined(__AVX512F__)
+    for(; i + 256 <= n; i += 256){
+      __m512i a = _mm512_loadu_si512(src + i);
+      __m512i b = _mm512_loadu_si512(src + i + 64);
+      __m512i c = _mm512_loadu_si512(src + i + 128);
+      __m512i e = _mm512_loadu_si512(src + i + 192);
+      _mm512_storeu_si512(d + i, a);
+      _mm512_storeu_si512(d + i + 64, b);
+      _mm512_storeu_si512(d + i + 128, c);
+      _mm512_storeu_si512(d + i + 192, e);
+    }
+# else
+    for(; i + 128 <= n; i += 128){
+      __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+      __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+      __m256i c = _mm256_loadu_si256((const __m256i*)(src + i + 64));
+      __m256i e = _mm256_loadu_si256((const __m256i*)(src + i + 96));
+      _mm256_storeu_si256((__m256i*)(d + i), a);
+      _mm256_storeu_si256((__m256i*)(d + i + 32), b);
+      _mm256_storeu_si256((__m256i*)(d + i + 64), c);
+      _mm256_storeu_si256((__m256i*)(d + i + 96), e);
+    }
+# endif
+    memcpy(d + i, src + i, n - i);
+    __atomic_fetch_add(&read_stats.wide_copies, 1, __ATOMIC_RELAXED);
+    return;
   }
-  //printf("close %s\n", p->path);
-  return SQLITE_OK;
+#endif
+  memcpy(dst, src, n);
 }
 
 /*
@@ -426,16 +2459,37 @@ static int pmem_read(
 ){
   // // printf("read\n");
   Persistent_File *p = (Persistent_File*)pFile;
+  PMEM_PROBE_ENTRY(t, read, PMEM_PROBE_KIND(p), offset, buffer_size);
+  pmem_map_refresh(p);
 
+  if(__atomic_load_n(&pmem_config.trace, __ATOMIC_RELAXED) > 0){
+    pmem_trace_access(p, offset, buffer_size, 0);
+  }
+  pmem_emu_read(buffer_size);
+  __atomic_fetch_add(&read_stats.reads, 1, __ATOMIC_RELAXED);
+  if(p->readahead){
+    pmem_readahead(p, offset, buffer_size);
+  }
   if(offset + buffer_size <= p->used_size){
-    memcpy(buffer,&((char*)p->pmem_file)[offset], buffer_size);
+    pmem_read_copy(buffer, &((char*)p->pmem_file)[offset], buffer_size);
+    if(p->combine){
+      pmem_combine_read(p, buffer, buffer_size, offset);
+    }
+    PMEM_PROBE_EXIT(t, read, PMEM_PROBE_KIND(p), SQLITE_OK, -1);
     return SQLITE_OK;
   }
   else{
+    int size = 0;
     if(offset < p->used_size){
-      int size = p->used_size - offset;
-      memcpy(buffer, &((char*)p->pmem_file)[offset], size);
+      size = p->used_size - offset;
+      pmem_read_copy(buffer, &((char*)p->pmem_file)[offset], size);
+      if(p->combine){
+        pmem_combine_read(p, buffer, size, offset);
+      }
     }
+    /* SQLite expects the unread tail of a short read to be zeroed */
+    memset((char*)buffer + size, 0, buffer_size - size);
+    PMEM_PROBE_EXIT(t, read, PMEM_PROBE_KIND(p), SQLITE_IOERR_SHORT_READ, -1);
     return SQLITE_IOERR_SHORT_READ;
   }
 }
@@ -457,9 +2511,15 @@ static int pmem_write (
   //printf("try to write %i bytes at offset %lli to %s\n", buffer_size,offset,  p->path);
   assert ( pFile );
   assert( buffer_size > 0);
-
-  while(p->pmem_size < offset + buffer_size){
-    map_pmem(p, p->pmem_size * GROW_FACTOR_FILE);
+  PMEM_PROBE_ENTRY(t, write, PMEM_PROBE_KIND(p), offset, buffer_size);
+  pmem_map_refresh(p);
+
+  if(p->pmem_size < offset + buffer_size){
+    int rc = map_pmem(p, pmem_grow_target(p, offset + buffer_size, 0));
+    if(rc != SQLITE_OK){
+      PMEM_PROBE_EXIT(t, write, PMEM_PROBE_KIND(p), rc, pmem_probe_component(p, PMEM_PROBE_WAL_APPEND));
+      return rc;
+    }
   }
       /* automatically flushes data to pmem no extra call needed*/
     //pmem_memcpy(p->pmem_file + offset, buffer, buffer_size, 0);
@@ -474,26 +2534,97 @@ static int pmem_write (
    //     pmem_msync(&((char*)p->pmem_file)[offset], buffer_size);
    // }
   
-  memcpy(&((char*)p->pmem_file)[offset], buffer, buffer_size);
+  if(__atomic_load_n(&pmem_config.trace, __ATOMIC_RELAXED) > 0){
+    pmem_trace_access(p, offset, buffer_size, 1);
+  }
+  if(p->dirtymap){
+    int rc = pmem_dirtymap_mark(p, offset, buffer_size);
+    if(rc != SQLITE_OK){
+      PMEM_PROBE_EXIT(t, write, PMEM_PROBE_KIND(p), rc, pmem_probe_component(p, PMEM_PROBE_WAL_APPEND));
+      return rc;
+    }
+  }
+  if(p->is_main_db && __atomic_load_n(&pmem_async.started, __ATOMIC_ACQUIRE)){
+    /* a checkpoint may be copying frames whose sync is still queued */
+    pmem_async_wait_all();
+  }
+  if(p->is_main_db && __atomic_load_n(&pmem_snap.active, __ATOMIC_RELAXED)){
+    pmem_snapshot_cow(p, offset, buffer_size);
+  }
+  if(p->is_wal && !p->tmp){
+    int rc = pmem_logging_write(p, buffer, buffer_size);
+    if(rc != SQLITE_OK){
+      PMEM_PROBE_EXIT(t, write, PMEM_PROBE_KIND(p), rc, pmem_probe_component(p, PMEM_PROBE_WAL_APPEND));
+      return rc;
+    }
+  }
+  if(p->streaming){
+    pmem_stream_write(p, buffer, buffer_size, offset);
+  }
+  else if(p->combine){
+    pmem_combine_write(p, buffer, buffer_size, offset);
+    if(p->txn_commit && buffer_size != 24){
+      /* the commit frame is complete, readers of the WAL may look for it */
+      pmem_combine_flush(p);
+    }
+  }
+  else{
+    memcpy(&((char*)p->pmem_file)[offset], buffer, buffer_size);
+    if(p->dirty_hi == 0 || offset < p->dirty_lo){
+      p->dirty_lo = offset;
+    }
+    if(offset + buffer_size > p->dirty_hi){
+      p->dirty_hi = offset + buffer_size;
+    }
+  }
+  if(p->ship){
+    pmem_ship_publish(p, buffer, buffer_size, offset);
+  }
 
   if(offset + buffer_size > p->used_size){
     p->used_size = offset + buffer_size;
+    pmem_map_publish(p);
   }
+  PMEM_PROBE_EXIT(t, write, PMEM_PROBE_KIND(p), SQLITE_OK, pmem_probe_component(p, PMEM_PROBE_WAL_APPEND));
   return SQLITE_OK; 
 }
 
 /*
 ** Truncate a file to the dedicated size
+**
+** Below the capacity of a WAL ring only the logical size changes, the
+** mapping stays as it is. A ring that grew beyond its capacity is shrunk
+** back to it, which gives journal_size_limit semantics.
 */
 static int pmem_truncate(sqlite3_file *pFile, sqlite_int64 size){
   Persistent_File *p = (Persistent_File*)pFile;
   int rc = SQLITE_OK;
-  if(size * 1.25 < p->pmem_size || size > p->pmem_size){
-    rc = map_pmem(p, size * 1.25);
+  PMEM_PROBE_ENTRY(t, truncate, PMEM_PROBE_KIND(p), size, 0);
+  pmem_map_refresh(p);
+  if(p->combine){
+    /* buffered lines must not outlive a shrinking mapping */
+    pmem_combine_flush(p);
+  }
+  if(p->is_main_db && __atomic_load_n(&pmem_async.started, __ATOMIC_ACQUIRE)){
+    pmem_async_wait_all();
+  }
+  if(p->is_main_db && __atomic_load_n(&pmem_snap.active, __ATOMIC_RELAXED)
+      && size < (sqlite_int64)p->used_size){
+    pmem_snapshot_cow(p, size, p->used_size - size);
+  }
+  if(p->wal_capacity && size <= p->wal_capacity){
+    if(p->pmem_size > p->wal_capacity){
+      rc = map_pmem(p, p->wal_capacity);
+    }
+  }
+  else if(size * 1.25 < p->pmem_size || size > p->pmem_size){
+    rc = map_pmem(p, p->chunk_size ? pmem_grow_target(p, size, 1) : size * 1.25);
   }
   if(p->used_size > size){
     p->used_size = size;
+    pmem_map_publish(p);
   }
+  PMEM_PROBE_EXIT(t, truncate, PMEM_PROBE_KIND(p), rc, pmem_probe_component(p, -1));
   return rc;
 }
 
@@ -503,11 +2634,70 @@ static int pmem_truncate(sqlite3_file *pFile, sqlite_int64 size){
 static int pmem_sync(sqlite3_file *pFile, int flags){
   Persistent_File *p = (Persistent_File*)pFile;
   // p->sync_calls++;
+  PMEM_PROBE_ENTRY(t, sync, PMEM_PROBE_KIND(p), flags, 0);
+  pmem_map_refresh(p);
+  if(p->dirtymap){
+    int rc = pmem_dirtymap_sync(p);
+    if(rc != SQLITE_OK){
+      PMEM_PROBE_EXIT(t, sync, PMEM_PROBE_KIND(p), rc, pmem_probe_component(p, PMEM_PROBE_WAL_SYNC));
+      return rc;
+    }
+  }
+  if(p->is_wal){
+    pmem_logging_end(p);
+  }
+  if(p->combine){
+    /* written with non-temporal stores, these only need the fence below */
+    pmem_combine_flush(p);
+  }
   if(p->is_pmem){
-    return pmem_deep_persist(p->pmem_file, p->pmem_size);
+    /* only the range written since the last sync can be dirty */
+    size_t lo = p->dirty_lo;
+    size_t hi = p->dirty_hi < p->pmem_size ? p->dirty_hi : p->pmem_size;
+    size_t len = hi > lo ? hi - lo : 0;
+    int nt_stores = p->nt_stores;
+    p->dirty_lo = p->dirty_hi = 0;
+    p->nt_stores = 0;
+    if(nt_stores && (p->async || pmem_config.group_commit_us > 0)){
+      /*
+      ** non-temporal stores are only ordered by a fence of this thread,
+      ** not by that of the flusher or of a group commit leader
+      */
+      pmem_emu_drain();
+    }
+    if(p->async){
+      u64 epoch = pmem_async_queue(p->pmem_file + lo, len);
+      if(epoch){
+        p->async_epoch = epoch;
+        PMEM_PROBE_EXIT(t, sync, PMEM_PROBE_KIND(p), SQLITE_OK, pmem_probe_component(p, PMEM_PROBE_WAL_SYNC));
+        return SQLITE_OK;
+      }
+    }
+    else if(pmem_async.started){
+      /* a synchronous sync must not overtake earlier asynchronous ones */
+      pmem_async_wait_all();
+    }
+    if(pmem_config.group_commit_us > 0){
+      pmem_group_sync(p->pmem_file + lo, len);
+    }
+    else{
+      /* flushes and fences of database syncs are part of the checkpoint */
+      PMEM_PROBE_ENTRY(tf, flush, PMEM_PROBE_KIND(p), len, 0);
+      if(len){
+        pmem_emu_flush(p->pmem_file + lo, len);
+      }
+      PMEM_PROBE_EXIT(tf, flush, PMEM_PROBE_KIND(p), SQLITE_OK, p->is_wal ? PMEM_PROBE_FLUSH : -1);
+      PMEM_PROBE_ENTRY(td, fence, PMEM_PROBE_KIND(p), 0, 0);
+      pmem_emu_drain();
+      PMEM_PROBE_EXIT(td, fence, PMEM_PROBE_KIND(p), SQLITE_OK, p->is_wal ? PMEM_PROBE_FENCE : -1);
+    }
+    PMEM_PROBE_EXIT(t, sync, PMEM_PROBE_KIND(p), SQLITE_OK, pmem_probe_component(p, PMEM_PROBE_WAL_SYNC));
+    return SQLITE_OK;
   }
   else{
-    return pmem_msync(p->pmem_file, p->pmem_size);
+    int rc = pmem_msync(p->pmem_file, p->pmem_size);
+    PMEM_PROBE_EXIT(t, sync, PMEM_PROBE_KIND(p), rc, pmem_probe_component(p, PMEM_PROBE_WAL_SYNC));
+    return rc;
   }
 }
 
@@ -517,6 +2707,7 @@ static int pmem_sync(sqlite3_file *pFile, int flags){
 static int pmem_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
   // // printf("file size\n");
   Persistent_File *p = (Persistent_File*)pFile;
+  pmem_map_refresh(p);
   *pSize = p->used_size;
   return SQLITE_OK;
 }
@@ -527,12 +2718,23 @@ static int pmem_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
 ** a reserved lock on the database file. This ensures that if a hot-journal
 ** file is found in the file-system it is rolled back.
 */
+/*
+** No locking in this vfs either, but a main database only changes under
+** the EXCLUSIVE lock of a rollback journal transaction, which snapshots
+** wait for.
+*/
 inline static int pmem_lock(sqlite3_file *pFile, int eLock){
-  // // printf("lock\n");
+  Persistent_File *p = (Persistent_File*)pFile;
+  if(eLock >= SQLITE_LOCK_EXCLUSIVE && p->is_main_db){
+    pmem_quiesce_enter(p, PMEM_QUIESCE_LOCK);
+  }
   return SQLITE_OK;
 }
 inline static int pmem_unlock(sqlite3_file *pFile, int eLock){
-  // // printf("unlock\n");
+  Persistent_File *p = (Persistent_File*)pFile;
+  if(eLock < SQLITE_LOCK_EXCLUSIVE){
+    pmem_quiesce_leave(p, PMEM_QUIESCE_LOCK);
+  }
   return SQLITE_OK;
 }
 inline static int pmem_check_reserved_lock(sqlite3_file *pFile, int *pResOut){
@@ -542,10 +2744,117 @@ inline static int pmem_check_reserved_lock(sqlite3_file *pFile, int *pResOut){
 }
 
 /*
-** No xFileControl() verbs are implemented by this VFS.
+** File control verbs implemented by this VFS:
+**
+**   SQLITE_FCNTL_PERSIST_WAL   keep the WAL (ring) when the last connection
+**                              closes, queried on the main database
+**   SQLITE_FCNTL_SIZE_HINT     grow the mapping to the announced size at
+**                              once instead of doubling towards it
+**   SQLITE_FCNTL_CHUNK_SIZE    grow and truncate the mapping in multiples
+**                              of the given chunk size
+**   SQLITE_FCNTL_PMEM_ASYNC_SYNC
+**                              queue syncs of a WAL for the background
+**                              flusher, see sqlite3_pmem_commit_async()
+**   SQLITE_FCNTL_PMEM_SNAPSHOT write a point-in-time image of the main
+**                              database to the file named by pArg. The
+**                              caller checkpoints first, the WAL is not
+**                              part of the image. SQLITE_BUSY if the
+**                              calling thread is inside a transaction or
+**                              checkpoint on another connection, or if
+**                              those of other threads do not end within
+**                              PMEM_SNAPSHOT_BUSY_MS
+**   SQLITE_FCNTL_PMEM_SNAPSHOT_WAIT
+**                              wait until the image is complete
+**   SQLITE_FCNTL_PMEM_DIRTYMAP_GET / _RESET
+**                              read and clear the dirty page map, see
+**                              struct pmem_dirtymap
+**   SQLITE_FCNTL_PRAGMA        PRAGMA pmem_logging = copy | combine |
+**                              stream | adaptive, the logging mode of the
+**                              WAL of this connection from its next
+**                              transaction on. Without a value it returns
+**                              the current one
 */
-inline static int pmem_file_control(sqlite3_file *pFile, int op, void *pArg){
-  // // printf("file control\n");
+static int pmem_file_control(sqlite3_file *pFile, int op, void *pArg){
+  Persistent_File *p = (Persistent_File*)pFile;
+  pmem_map_refresh(p);
+  switch(op){
+    case SQLITE_FCNTL_PERSIST_WAL: {
+      int *arg = (int*)pArg;
+      if(*arg < 0){
+        *arg = p->persist_wal;
+      }
+      else{
+        p->persist_wal = *arg != 0;
+      }
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_PMEM_ASYNC_SYNC: {
+      /* only WAL appends may be acknowledged early */
+      if(!p->is_wal || !p->is_pmem){
+        return SQLITE_NOTFOUND;
+      }
+      if(*(int*)pArg == 0 && p->async
+          && (p->dirty_hi > p->dirty_lo || p->nt_stores || (p->combine && p->combine->n_lines))){
+        /* a commit SQLite did not sync (synchronous=NORMAL) is queued here */
+        int rc = pmem_sync(pFile, SQLITE_SYNC_NORMAL);
+        if(rc != SQLITE_OK){
+          return rc;
+        }
+      }
+      p->async = *(int*)pArg != 0;
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_PMEM_SNAPSHOT: {
+      if(!p->is_main_db || pArg == 0){
+        return SQLITE_NOTFOUND;
+      }
+      return pmem_snapshot_start(p, (const char*)pArg);
+    }
+    case SQLITE_FCNTL_PMEM_SNAPSHOT_WAIT: {
+      if(!p->is_main_db){
+        return SQLITE_NOTFOUND;
+      }
+      return pmem_snapshot_wait(p);
+    }
+    case SQLITE_FCNTL_PMEM_DIRTYMAP_GET: {
+      if(p->dirtymap == 0){
+        return SQLITE_NOTFOUND;
+      }
+      return pmem_dirtymap_get(p, (pmem_dirtymap*)pArg);
+    }
+    case SQLITE_FCNTL_PMEM_DIRTYMAP_RESET: {
+      if(p->dirtymap == 0){
+        return SQLITE_NOTFOUND;
+      }
+      return pmem_dirtymap_reset(p, (u64*)pArg);
+    }
+    case SQLITE_FCNTL_PRAGMA: {
+      char **args = (char**)pArg;
+      if(!p->is_main_db || sqlite3_stricmp(args[1], "pmem_logging") != 0){
+        return SQLITE_NOTFOUND;
+      }
+      if(args[2]){
+        int mode = pmem_logging_mode(args[2]);
+        if(mode < 0){
+          args[0] = sqlite3_mprintf("unknown pmem_logging mode: %s", args[2]);
+          return SQLITE_ERROR;
+        }
+        p->wal_logging = mode;
+      }
+      args[0] = sqlite3_mprintf("%s", pmem_logging_names[p->wal_logging]);
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_SIZE_HINT: {
+      sqlite3_int64 hint = *(sqlite3_int64*)pArg;
+      if(hint > (sqlite3_int64)p->pmem_size){
+        return map_pmem(p, pmem_grow_target(p, hint, 1));
+      }
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_CHUNK_SIZE:
+      p->chunk_size = *(int*)pArg > 0 ? *(int*)pArg : 0;
+      return SQLITE_OK;
+  }
   return SQLITE_NOTFOUND;
 }
 
@@ -613,6 +2922,7 @@ static int pmem_open_shm(Persistent_File *p, size_t size){
   if ((p->shm_file = (char *)pmem_map_file(sp, size, PMEM_FILE_CREATE,0666, &p->shm_size, &p->shm_is_pmem)) == NULL) {
     return SQLITE_NOMEM;
   }
+  p->shm_is_pmem = pmem_emu_is_pmem(p->shm_is_pmem);
   return SQLITE_OK;
 }
 
@@ -644,6 +2954,7 @@ static int pmem_map_shm(
 ){
   Persistent_File *p = (Persistent_File*)pFile;
   //printf("Mapped-shm with: %i size %i number\n", region_size, region_number);
+  PMEM_PROBE_ENTRY(t, shm_map, PMEM_PROBE_KIND(p), region_number, region_size);
 
   /** 
    * if file was not allocated and extending is allowed, allocate the file
@@ -655,7 +2966,8 @@ static int pmem_map_shm(
     }
     else{
       *pp = 0;
-    return SQLITE_OK;
+      PMEM_PROBE_EXIT(t, shm_map, PMEM_PROBE_KIND(p), SQLITE_OK, PMEM_PROBE_SHM);
+      return SQLITE_OK;
     } 
   }
   int number_region = region_number +1;
@@ -672,11 +2984,13 @@ static int pmem_map_shm(
   //if(p->shm < region_size * region_number){
   //  p->used_size = offset + buffer_size;
   //}
+  PMEM_PROBE_EXIT(t, shm_map, PMEM_PROBE_KIND(p), SQLITE_OK, PMEM_PROBE_SHM);
   return SQLITE_OK;
 }
 
 /**
- * no locking in this vfs
+ * no locking in this vfs, only the span of a checkpoint is tracked for
+ * snapshots (WAL_CKPT_LOCK is lock 1)
 */
 inline static int pmem_shm_lock(
   sqlite3_file *fd,          /* Database file holding the shared memory */
@@ -684,7 +2998,15 @@ inline static int pmem_shm_lock(
   int n,                     /* Number of locks to acquire or release */
   int flags                  /* What to do with the lock */
 ){
-  // // printf("shm-lock\n");
+  Persistent_File *p = (Persistent_File*)fd;
+  if((flags & SQLITE_SHM_EXCLUSIVE) && ofst <= 1 && ofst + n > 1 && p->is_main_db){
+    if(flags & SQLITE_SHM_LOCK){
+      pmem_quiesce_enter(p, PMEM_QUIESCE_CKPT);
+    }
+    else{
+      pmem_quiesce_leave(p, PMEM_QUIESCE_CKPT);
+    }
+  }
   return SQLITE_OK;
 }
 
@@ -699,13 +3021,15 @@ static void pmem_shm_barrier(
 ){
   // printf("shm-barrier");
   Persistent_File *p = (Persistent_File*)pFile;
+  PMEM_PROBE_ENTRY(t, shm_barrier, PMEM_PROBE_KIND(p), 0, 0);
 
   if(p->shm_is_pmem){
-    pmem_persist(p->shm_file, p->shm_size);
+    pmem_emu_persist(p->shm_file, p->shm_size);
   }
   else{
     pmem_msync(p->pmem_file, p->pmem_size);
   }
+  PMEM_PROBE_EXIT(t, shm_barrier, PMEM_PROBE_KIND(p), SQLITE_OK, PMEM_PROBE_SHM);
 }
 
 /*
@@ -758,6 +3082,9 @@ static int pmem_fetch(sqlite3_file *fd, sqlite3_int64 offset, int amount, void *
       if (offset + amount <= p->pmem_size) {
           *pp = (char *) p->pmem_file + offset;
           p->times_mapped++;
+          if(__atomic_load_n(&pmem_config.trace, __ATOMIC_RELAXED) > 0){
+            pmem_trace_access(p, offset, amount, 0);
+          }
       }
   }
   return SQLITE_OK;
@@ -794,6 +3121,374 @@ static int pmem_unfetch(sqlite3_file *fd, sqlite3_int64 offset, void *p){
 
 
 
+/*
+** PMem super-journals.
+**
+** A transaction that writes to several attached databases lists their
+** journals in a super-journal "<main>-mjXXXXXXXXX". SQLite creates and
+** syncs it before the journals name it, and deleting it with a directory
+** sync is the commit point; a hot journal whose super-journal still exists
+** is rolled back. With PMEM_CONFIG_SUPER_JOURNAL the super-journals of a
+** main database live in the slots of one persistent area "<main>-super":
+**
+**        offset 0                              Super_Header
+**        PMEM_SUPER_SLOT_SIZE * (i + 1)        Super_Slot i
+**                    + SUPER_DATA              journal names of slot i
+**
+** Creating a super-journal claims a free slot with a CAS of its state word
+** to OPEN, xSync persists the names and then the state LIVE, and xDelete
+** persists FREE. The commit point becomes one 8 byte store and a fence,
+** without a file create, unlink or directory sync. xAccess and xOpen find
+** super-journals by name in the area, so recovery works unchanged.
+**
+** The state word holds the pid of the claiming process next to the state.
+** An OPEN slot of a process that is gone is free again: no journal can
+** name a super-journal before it is LIVE. A LIVE slot stays until SQLite
+** deletes it, like the file it replaces. Areas stay mapped until the
+** process exits.
+**
+** A list of names that outgrows its slot moves to a file of its own on the
+** write that overflows, the handle is reopened in place as a regular one.
+*/
+#define SUPER_MAGIC 0x4d50454d53555052ull   /* "RPUSMEPM" */
+#define SUPER_FREE 0
+#define SUPER_OPEN 1
+#define SUPER_LIVE 2
+#define SUPER_STATE(w) ((w) & 0xff)
+#define SUPER_WORD(pid, state) (((u64)(pid) << 8) | (state))
+#define SUPER_DATA 1024
+#define SUPER_SLOT(a, i) ((Super_Slot*)((a)->base + PMEM_SUPER_SLOT_SIZE * ((size_t)(i) + 1)))
+
+typedef struct Super_Header Super_Header;
+struct Super_Header {
+  u64 magic;
+};
+
+typedef struct Super_Slot Super_Slot;
+struct Super_Slot {
+  u64 state;                /* SUPER_WORD(pid, SUPER_*) */
+  u64 size;                 /* bytes of journal names */
+  char name[MAXPATHNAME + 1];
+};
+
+typedef struct Super_Area Super_Area;
+struct Super_Area {
+  char path[MAXPATHNAME + 16];
+  char *base;
+  size_t size;
+  int is_pmem;
+  Super_Area *next;
+};
+
+/* the sqlite3_file of a super-journal in a slot, fits a Persistent_File */
+typedef struct Super_File Super_File;
+struct Super_File {
+  sqlite3_file base;
+  Super_Area *area;
+  Super_Slot *slot;
+  int writer;               /* claimed the slot */
+  const char *path;         /* as passed to pmem_open(), for a spill */
+  int flags;
+};
+
+static int pmem_open(sqlite3_vfs*, const char*, sqlite3_file*, int, int*);
+
+static struct {
+  pthread_mutex_t mutex;
+  Super_Area *list;
+} pmem_super = { PTHREAD_MUTEX_INITIALIZER };
+
+/* length of the main database name if path names a super-journal, else 0 */
+static size_t pmem_super_main_len(const char *path){
+  size_t n = path ? strlen(path) : 0;
+  if(n <= 12 || n > MAXPATHNAME || memcmp(path + n - 12, "-mj", 3) != 0){
+    return 0;
+  }
+  for(size_t i = n - 9; i < n; i++){
+    char c = path[i];
+    if(!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))){
+      return 0;
+    }
+  }
+  return n - 12;
+}
+
+static void pmem_super_persist(Super_Area *a, const void *addr, size_t len){
+  if(a->is_pmem){
+    pmem_emu_persist(addr, len);
+  }
+  else{
+    pmem_msync(addr, len);
+  }
+}
+
+/*
+** The area of the main database of the super-journal path, mapped on first
+** use. Without create, NULL if there is none yet.
+*/
+static Super_Area *pmem_super_area(const char *path, int create){
+  char area_path[MAXPATHNAME + 16];
+  size_t main_len = pmem_super_main_len(path);
+  size_t size = (size_t)PMEM_SUPER_SLOT_SIZE * (PMEM_SUPER_SLOTS + 1);
+  struct stat st;
+  size_t mapped;
+  int is_pmem;
+  Super_Area *a;
+  if(main_len == 0){
+    return NULL;
+  }
+  snprintf(area_path, sizeof(area_path), "%.*s-super", (int)main_len, path);
+  pthread_mutex_lock(&pmem_super.mutex);
+  for(a = pmem_super.list; a; a = a->next){
+    if(strcmp(a->path, area_path) == 0){
+      pthread_mutex_unlock(&pmem_super.mutex);
+      return a;
+    }
+  }
+  if(!create && (stat(area_path, &st) != 0 || (size_t)st.st_size < size)){
+    pthread_mutex_unlock(&pmem_super.mutex);
+    return NULL;
+  }
+  a = sqlite3_malloc(sizeof(Super_Area));
+  if(a){
+    memset(a, 0, sizeof(Super_Area));
+    strcpy(a->path, area_path);
+    a->base = pmem_map_file(area_path, size, PMEM_FILE_CREATE, 0666, &mapped, &is_pmem);
+    if(a->base == NULL){
+      sqlite3_free(a);
+      a = NULL;
+    }
+  }
+  if(a){
+    Super_Header *h = (Super_Header*)a->base;
+    a->size = size;
+    a->is_pmem = pmem_emu_is_pmem(is_pmem);
+    if(h->magic != SUPER_MAGIC){
+      for(int i = 0; i < PMEM_SUPER_SLOTS; i++){
+        SUPER_SLOT(a, i)->state = SUPER_FREE;
+        pmem_super_persist(a, SUPER_SLOT(a, i), sizeof(u64));
+      }
+      h->magic = SUPER_MAGIC;
+      pmem_super_persist(a, h, sizeof(Super_Header));
+    }
+    a->next = pmem_super.list;
+    pmem_super.list = a;
+  }
+  pthread_mutex_unlock(&pmem_super.mutex);
+  return a;
+}
+
+static Super_Slot *pmem_super_find(Super_Area *a, const char *name){
+  for(int i = 0; i < PMEM_SUPER_SLOTS; i++){
+    Super_Slot *s = SUPER_SLOT(a, i);
+    if(SUPER_STATE(__atomic_load_n(&s->state, __ATOMIC_ACQUIRE)) != SUPER_FREE
+        && strcmp(s->name, name) == 0){
+      return s;
+    }
+  }
+  return NULL;
+}
+
+/* claim a free slot for name, reclaiming OPEN slots of dead processes */
+static Super_Slot *pmem_super_claim(Super_Area *a, const char *name){
+  pid_t pid = getpid();
+  for(int i = 0; i < PMEM_SUPER_SLOTS; i++){
+    Super_Slot *s = SUPER_SLOT(a, i);
+    u64 word = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+    if(SUPER_STATE(word) == SUPER_OPEN && (pid_t)(word >> 8) != pid
+        && kill((pid_t)(word >> 8), 0) != 0 && errno == ESRCH){
+      __atomic_compare_exchange_n(&s->state, &word, SUPER_FREE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      word = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+    }
+    if(word == SUPER_FREE
+        && __atomic_compare_exchange_n(&s->state, &word, SUPER_WORD(pid, SUPER_OPEN), 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+      s->size = 0;
+      strcpy(s->name, name);
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static int pmem_super_close(sqlite3_file *pFile){
+  return SQLITE_OK;
+}
+
+static int pmem_super_read(sqlite3_file *pFile, void *buffer, int amount, sqlite_int64 offset){
+  Super_File *f = (Super_File*)pFile;
+  sqlite_int64 size = f->slot->size;
+  int n = offset >= size ? 0 : (int)(size - offset < amount ? size - offset : amount);
+  memcpy(buffer, (char*)f->slot + SUPER_DATA + offset, n);
+  if(n < amount){
+    memset((char*)buffer + n, 0, amount - n);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Move the names of f into a file of its own. The slot is still OPEN, so
+** no journal names it yet and it is freed before pFile becomes a
+** Persistent_File of the same path.
+*/
+static int pmem_super_spill(Super_File *f){
+  Super_Slot *s = f->slot;
+  sqlite3_file *pFile = &f->base;
+  u64 size = s->size;
+  char *names = sqlite3_malloc64(size + 1);
+  int rc;
+  if(names == NULL){
+    return SQLITE_NOMEM;
+  }
+  memcpy(names, (char*)s + SUPER_DATA, size);
+  __atomic_store_n(&s->state, SUPER_FREE, __ATOMIC_RELEASE);
+  pmem_super_persist(f->area, &s->state, sizeof(u64));
+  /* without the flag pmem_open() would look for a slot again */
+  rc = pmem_open(0, f->path, pFile, f->flags & ~SQLITE_OPEN_SUPER_JOURNAL, 0);
+  if(rc == SQLITE_OK){
+    ((Persistent_File*)pFile)->is_journal = 1;
+    if(size > 0){
+      rc = pFile->pMethods->xWrite(pFile, names, (int)size, 0);
+    }
+  }
+  else{
+    pFile->pMethods = 0;
+  }
+  sqlite3_free(names);
+  return rc;
+}
+
+static int pmem_super_write(sqlite3_file *pFile, const void *buffer, int amount, sqlite_int64 offset){
+  Super_File *f = (Super_File*)pFile;
+  if(!f->writer){
+    return SQLITE_READONLY;
+  }
+  if(offset + amount > PMEM_SUPER_SLOT_SIZE - SUPER_DATA){
+    int rc = pmem_super_spill(f);
+    return rc == SQLITE_OK ? pFile->pMethods->xWrite(pFile, buffer, amount, offset) : rc;
+  }
+  memcpy((char*)f->slot + SUPER_DATA + offset, buffer, amount);
+  if((u64)(offset + amount) > f->slot->size){
+    f->slot->size = offset + amount;
+  }
+  return SQLITE_OK;
+}
+
+static int pmem_super_truncate(sqlite3_file *pFile, sqlite_int64 size){
+  Super_File *f = (Super_File*)pFile;
+  if(f->writer && (u64)size < f->slot->size){
+    f->slot->size = size;
+  }
+  return SQLITE_OK;
+}
+
+/* names and size first, then the state that makes them count */
+static int pmem_super_sync(sqlite3_file *pFile, int flags){
+  Super_File *f = (Super_File*)pFile;
+  Super_Slot *s = f->slot;
+  if(!f->writer){
+    return SQLITE_OK;
+  }
+  pmem_super_persist(f->area, &s->size, SUPER_DATA - sizeof(u64) + s->size);
+  __atomic_store_n(&s->state, SUPER_WORD(getpid(), SUPER_LIVE), __ATOMIC_RELEASE);
+  pmem_super_persist(f->area, &s->state, sizeof(u64));
+  return SQLITE_OK;
+}
+
+static int pmem_super_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
+  *pSize = ((Super_File*)pFile)->slot->size;
+  return SQLITE_OK;
+}
+
+static int pmem_super_file_control(sqlite3_file *pFile, int op, void *pArg){
+  return SQLITE_NOTFOUND;
+}
+
+static int pmem_super_device_characteristics(sqlite3_file *pFile){
+  return 0;
+}
+
+/*
+** Open the super-journal file_path in its slot. SQLITE_NOTFOUND if it is
+** not in an area and cannot be created there, pmem_open() then makes it a
+** file.
+*/
+static int pmem_super_open(const char *file_path, sqlite3_file *pFile, int flags){
+  static const sqlite3_io_methods super_io = {
+    1,                            /* iVersion */
+    pmem_super_close,             /* xClose */
+    pmem_super_read,              /* xRead */
+    pmem_super_write,             /* xWrite */
+    pmem_super_truncate,          /* xTruncate */
+    pmem_super_sync,              /* xSync */
+    pmem_super_file_size,         /* xFileSize */
+    pmem_lock,                    /* xLock */
+    pmem_unlock,                  /* xUnlock */
+    pmem_check_reserved_lock,     /* xCheckReservedLock */
+    pmem_super_file_control,      /* xFileControl */
+    pmem_sector_size,             /* xSectorSize */
+    pmem_super_device_characteristics, /* xDeviceCharacteristics */
+  };
+  Super_File *f = (Super_File*)pFile;
+  int create = (flags & SQLITE_OPEN_CREATE) && pmem_config.super_journal;
+  Super_Area *a = pmem_super_area(file_path, create);
+  Super_Slot *s = NULL;
+  if(a == NULL){
+    return SQLITE_NOTFOUND;
+  }
+  s = pmem_super_find(a, file_path);
+  if(s == NULL && create){
+    s = pmem_super_claim(a, file_path);
+    f->writer = s != NULL;
+  }
+  if(s == NULL){
+    return SQLITE_NOTFOUND;
+  }
+  f->area = a;
+  f->slot = s;
+  f->path = file_path;
+  f->flags = flags;
+  f->base.pMethods = &super_io;
+  return SQLITE_OK;
+}
+
+/* the commit point of a multi-database transaction */
+static int pmem_super_delete(const char *path){
+  Super_Area *a = pmem_super_area(path, 0);
+  Super_Slot *s = a ? pmem_super_find(a, path) : NULL;
+  if(s == NULL){
+    return SQLITE_NOTFOUND;
+  }
+  __atomic_store_n(&s->state, SUPER_FREE, __ATOMIC_RELEASE);
+  pmem_super_persist(a, &s->state, sizeof(u64));
+  return SQLITE_OK;
+}
+
+/*
+** SQLite appends the name of the super-journal to a journal of a multi
+** database commit and looks for it at xFileSize() - 16 when the journal is
+** hot. A journal closed normally is trimmed to used_size, but after a crash
+** the file still has the zeroed growth slack of GROW_FACTOR_FILE behind
+** it, the name would not be found and the journal rolled back even though
+** its super-journal committed. So an existing journal that ends in the
+** journal magic followed by zeros is shortened to the magic. Any other
+** journal keeps the size of its file as before.
+*/
+static void pmem_journal_size(Persistent_File *p){
+  static const unsigned char magic[8] = {
+    0xd9, 0xd5, 0x05, 0xf9, 0x20, 0xa1, 0x63, 0xd7
+  };
+  size_t end = p->used_size;
+  while(end > 0 && p->pmem_file[end - 1] == 0){
+    end--;
+  }
+  if(end < p->used_size && end >= sizeof(magic)
+     && memcmp(p->pmem_file + end - sizeof(magic), magic, sizeof(magic)) == 0){
+    p->used_size = end;
+  }
+}
+
 /*
 ** Open a file handle.
 */
@@ -833,6 +3528,12 @@ static int pmem_open(
 
   /* completly zeros p*/
   memset(p, 0, sizeof(Persistent_File));
+  p->dirtymap_slot = -1;
+  PMEM_PROBE_ENTRY(t, open, PMEM_PROBE_FLAGS_KIND(flags), flags, 0);
+  if((flags & SQLITE_OPEN_SUPER_JOURNAL) && pmem_super_open(file_path, pFile, flags) == SQLITE_OK){
+    PMEM_PROBE_EXIT(t, open, PMEM_PROBE_FLAGS_KIND(flags), SQLITE_OK, -1);
+    return SQLITE_OK;
+  }
     if( file_path == 0 ){
     //return SQLITE_IOERR;
     file_path = "/mnt/pmem0/scheinost/tmp.sb";
@@ -845,29 +3546,121 @@ retry:
 // printf("OPEN_FLAGS:\t%i\n", flags);
 
   p->is_wal = flags & SQLITE_OPEN_WAL;
+  /* pager_delsuper() opens the child journals as super-journals */
+  p->is_journal = (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_SUPER_JOURNAL)) != 0;
+  if(!p->tmp){
+    sqlite3_int64 capacity = sqlite3_uri_int64(file_path, "wal_capacity", pmem_config.wal_capacity);
+    if(p->is_wal && capacity > 0){
+      p->wal_capacity = capacity;
+    }
+    if(flags & SQLITE_OPEN_MAIN_DB){
+      p->persist_wal = sqlite3_uri_boolean(file_path, "persist_wal", capacity > 0);
+    }
+  }
   
   struct stat st;
+  int attached = 0;
   int rc = stat(p->path, &st);
-  if(rc == 0){
+  /* an empty file left by a crash right after its creation is new */
+  if(rc == 0 && (st.st_size > 0 || p->tmp)){
     if(p->tmp){
       file_path = "/mnt/pmem0/scheinost/tmp1.sb";
       p->tmp++;
       goto retry;
     }
     p->used_size = st.st_size;
-    rc = map_pmem(p, p->used_size);
+    rc = pmem_map_attach(p, &attached);
+    if(rc == SQLITE_OK && !attached){
+      /* the first handle of the file, the others share its mapping */
+      rc = map_pmem(p, p->used_size);
+      if(rc == SQLITE_OK && p->is_journal){
+        pmem_journal_size(p);
+      }
+      pmem_map_publish(p);
+    }
   }
   else{
     p->used_size = 0;
     FILE *f = fopen(p->path, "w");
     if(f == NULL){
       printf("failed open %s\n", p->path);
+      PMEM_PROBE_EXIT(t, open, PMEM_PROBE_FLAGS_KIND(flags), SQLITE_IOERR, -1);
       return SQLITE_IOERR;
     }
     fclose(f);
-    rc = map_pmem(p, PMEM_LEN);
+    if(!p->tmp){
+      rc = pmem_map_attach(p, &attached);
+    }
+    if(rc == SQLITE_OK && !attached){
+      rc = map_pmem(p, PMEM_LEN);
+      pmem_map_publish(p);
+    }
+  }
+  if(rc != SQLITE_OK && p->map){
+    pmem_map_detach(p, 0);
+  }
+  if(rc == SQLITE_OK && p->wal_capacity > p->pmem_size){
+    rc = pmem_prealloc_wal(p);
+  }
+  /* a WAL combines by its logging mode */
+  if(rc == SQLITE_OK && !p->tmp && !p->is_wal
+      && sqlite3_uri_boolean(file_path, "write_combine", pmem_config.write_combine)){
+    p->combine = pmem_combine_create();
+    if(p->combine == 0){
+      unmap_pmem(p);
+      rc = SQLITE_NOMEM;
+    }
+  }
+  if(rc == SQLITE_OK && !p->tmp && p->is_wal){
+    rc = pmem_logging_open(p, file_path);
+    if(rc != SQLITE_OK){
+      unmap_pmem(p);
+    }
+  }
+  if(rc == SQLITE_OK && p->is_wal && sqlite3_uri_parameter(file_path, "ship")){
+    rc = pmem_ship_open(p, sqlite3_uri_parameter(file_path, "ship"),
+                        sqlite3_uri_int64(file_path, "ship_size", PMEM_SHIP_RING_SIZE));
+    if(rc != SQLITE_OK){
+      unmap_pmem(p);
+    }
+  }
+  if(rc == SQLITE_OK && (flags & SQLITE_OPEN_MAIN_DB) && !p->tmp
+      && (sqlite3_uri_boolean(file_path, "dirtymap", pmem_config.dirty_map)
+          || pmem_dirtymap_exists(p))){
+    rc = pmem_dirtymap_map(p, (p->used_size + PMEM_DIRTYMAP_PAGE - 1) / PMEM_DIRTYMAP_PAGE);
+    if(rc != SQLITE_OK){
+      if(p->dirtymap){
+        pmem_unmap(p->dirtymap, p->dirtymap_size);
+      }
+      if(p->dirtymap_fd >= 0){
+        close(p->dirtymap_fd);
+      }
+      pmem_combine_destroy(p->combine);
+      unmap_pmem(p);
+    }
+  }
+  if(rc == SQLITE_OK){
+    sqlite3_int64 window = sqlite3_uri_int64(file_path, "readahead", pmem_config.readahead);
+    p->readahead = window > 0 ? window : 0;
+  }
+  if(rc == SQLITE_OK && (flags & SQLITE_OPEN_MAIN_DB)){
+    p->is_main_db = 1;
+    if(stat(p->path, &st) == 0){
+      p->ino = st.st_ino;
+      p->dev = st.st_dev;
+    }
+    pthread_mutex_lock(&pmem_group.mutex);
+    pmem_group.connections++;
+    pthread_mutex_unlock(&pmem_group.mutex);
+    p->db_name = file_path;
+    p->wal_logging = pmem_logging_default(file_path);
+    pthread_mutex_lock(&pmem_dbs.mutex);
+    p->next_db = pmem_dbs.list;
+    pmem_dbs.list = p;
+    pthread_mutex_unlock(&pmem_dbs.mutex);
   }
   // printf("open %s\n", file_path);
+  PMEM_PROBE_EXIT(t, open, PMEM_PROBE_FLAGS_KIND(flags), rc, -1);
   return rc;
 }
 
@@ -880,6 +3673,9 @@ retry:
 static int demoDelete(sqlite3_vfs *pVfs, const char *zPath, int dirSync){
   int rc;                         /* Return code */
 
+  if(pmem_super_delete(zPath) == SQLITE_OK){
+    return SQLITE_OK;
+  }
   rc = unlink(zPath);
   if( rc!=0 && errno==ENOENT ) return SQLITE_OK;
 
@@ -962,6 +3758,13 @@ static int unixAccess(
   ** two of them are actually used */
   assert( flags==SQLITE_ACCESS_EXISTS || flags==SQLITE_ACCESS_READWRITE );
 
+  if( pmem_super_main_len(zPath) ){
+    Super_Area *a = pmem_super_area(zPath, 0);
+    if( a && pmem_super_find(a, zPath) ){
+      *pResOut = 1;
+      return SQLITE_OK;
+    }
+  }
   if( flags==SQLITE_ACCESS_EXISTS ){
     struct stat buf;
     *pResOut = 0==osStat(zPath, &buf) &&
@@ -1324,6 +4127,53 @@ sqlite3_vfs *sqlite3_pmem_vfs(void){
   return &pmem_vfs;
 }
 
+int sqlite3_pmem_commit_async(sqlite3 *db, void (*xDurable)(void*), void *ctx){
+  sqlite3_file *wal = 0;
+  int on = 1;
+  int rc;
+
+  if(sqlite3_file_control(db, "main", SQLITE_FCNTL_JOURNAL_POINTER, &wal) != SQLITE_OK
+      || wal == 0 || wal->pMethods == 0
+      || wal->pMethods->xFileControl(wal, SQLITE_FCNTL_PMEM_ASYNC_SYNC, &on) != SQLITE_OK){
+    rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    if(rc == SQLITE_OK){
+      xDurable(ctx);
+    }
+    return rc;
+  }
+  rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  /* queues the frames of the commit if SQLite did not sync them itself */
+  on = 0;
+  int sync_rc = wal->pMethods->xFileControl(wal, SQLITE_FCNTL_PMEM_ASYNC_SYNC, &on);
+  if(rc != SQLITE_OK){
+    return rc;
+  }
+  if(sync_rc != SQLITE_OK){
+    return sync_rc;
+  }
+
+  Pmem_Async_Callback *c = malloc(sizeof(Pmem_Async_Callback));
+  pthread_mutex_lock(&pmem_async.mutex);
+  if(c == 0 || pmem_async.durable_epoch == pmem_async.issued_epoch){
+    pthread_mutex_unlock(&pmem_async.mutex);
+    free(c);
+    if(c == 0){
+      pmem_async_wait_all();
+    }
+    xDurable(ctx);
+    return SQLITE_OK;
+  }
+  c->epoch = pmem_async.issued_epoch;
+  c->xDurable = xDurable;
+  c->ctx = ctx;
+  c->next = 0;
+  *pmem_async.callbacks_tail = c;
+  pmem_async.callbacks_tail = &c->next;
+  pthread_cond_signal(&pmem_async.work);
+  pthread_mutex_unlock(&pmem_async.mutex);
+  return SQLITE_OK;
+}
+
 
 #endif /* !defined(SQLITE_TEST) || SQLITE_OS_UNIX */
 
@@ -1372,4 +4222,4 @@ int Sqlitetest_demovfs_Init(Tcl_Interp *interp){
 int Sqlitetest_demovfs_Init(Tcl_Interp *interp){ return TCL_OK; }
 #endif
 
-#endif /* SQLITE_TEST */
\ No newline at end of file
+#endif /* SQLITE_TEST */
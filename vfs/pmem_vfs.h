@@ -47,6 +47,152 @@ typedef int8_t i8;
 # define PMEM_LEN ((off_t)(1 << 13))
 #endif
 
+/*
+** Default capacity of a preallocated WAL ring in bytes. 0 keeps the old
+** behaviour of growing the WAL from PMEM_LEN on demand. Can be changed with
+** PMEM_CONFIG_WAL_CAPACITY or the "wal_capacity" uri parameter.
+*/
+#ifndef PMEM_WAL_CAPACITY
+# define PMEM_WAL_CAPACITY 0
+#endif
+
+/*
+** Write combining. When enabled, writes between two syncs are gathered in
+** DRAM in units of the 256 byte Optane media line (XPLine) and written out
+** as full, aligned lines with non-temporal stores at sync time. A WAL also
+** writes them out with the commit frame of every transaction, other
+** mappings of the WAL must see what was committed without a sync.
+** PMEM_COMBINE_LINES bounds the buffer per file; a full buffer is written
+** out early (without a fence).
+*/
+#ifndef PMEM_WRITE_COMBINE
+# define PMEM_WRITE_COMBINE 0
+#endif
+
+#define PMEM_XPLINE_SIZE 256
+
+#ifndef PMEM_COMBINE_LINES
+# define PMEM_COMBINE_LINES 4096
+#endif
+
+/*
+** WAL logging modes, chosen per connection with PRAGMA pmem_logging:
+**
+**   copy      cached stores, the written range is flushed at sync
+**   combine   the write combining buffer above
+**   stream    non-temporal stores as frames are written, a sync only fences
+**   adaptive  combine a transaction while it is small, stream the rest of
+**             it once it wrote more than PMEM_LOGGING_PAGES pages or
+**             PMEM_LOGGING_BYTES bytes
+**
+** Small transactions share XPLines between frames and gain from combining,
+** large ones fill whole lines on their own and only pay for the detour
+** through DRAM. PMEM_LOGGING is the default mode, -1 follows the write
+** combining setting.
+*/
+#define PMEM_LOGGING_COPY 0
+#define PMEM_LOGGING_COMBINE 1
+#define PMEM_LOGGING_STREAM 2
+#define PMEM_LOGGING_ADAPTIVE 3
+
+#ifndef PMEM_LOGGING
+# define PMEM_LOGGING (-1)
+#endif
+
+#ifndef PMEM_LOGGING_PAGES
+# define PMEM_LOGGING_PAGES 16
+#endif
+
+#ifndef PMEM_LOGGING_BYTES
+# define PMEM_LOGGING_BYTES (256 * 1024)
+#endif
+
+/*
+** Group commit. Concurrent syncs of PMem files are batched: the first one
+** becomes leader, waits up to PMEM_GROUP_COMMIT_US microseconds for others,
+** flushes all dirty ranges of the batch and issues a single fence for it.
+** The wait adapts between 0 and this bound to the observed batch sizes.
+** 0 disables batching, every sync flushes and fences on its own.
+*/
+#ifndef PMEM_GROUP_COMMIT_US
+# define PMEM_GROUP_COMMIT_US 0
+#endif
+
+/* a leader stops waiting once this many syncs joined its batch */
+#ifndef PMEM_GROUP_COMMIT_MAX
+# define PMEM_GROUP_COMMIT_MAX 64
+#endif
+
+/*
+** Dirty page map. With it enabled, every main database keeps a persistent
+** bitmap "<db>-dirtymap" with one bit per PMEM_DIRTYMAP_PAGE bytes that is
+** set on write, flushed at sync and cleared by an incremental backup.
+*/
+#ifndef PMEM_DIRTY_MAP
+# define PMEM_DIRTY_MAP 0
+#endif
+
+#ifndef PMEM_DIRTYMAP_PAGE
+# define PMEM_DIRTYMAP_PAGE 4096
+#endif
+
+/*
+** Page access tracer. PMEM_TRACE is the default sampling period, one in
+** PMEM_TRACE reads and writes is recorded per thread, 0 disables it.
+** Accesses are counted per PMEM_TRACE_PAGE bytes; every thread buffers up
+** to PMEM_TRACE_BUFFER events before it folds them into the heat tables.
+*/
+#ifndef PMEM_TRACE
+# define PMEM_TRACE 0
+#endif
+
+#ifndef PMEM_TRACE_PAGE
+# define PMEM_TRACE_PAGE 4096
+#endif
+
+#ifndef PMEM_TRACE_BUFFER
+# define PMEM_TRACE_BUFFER 1024
+#endif
+
+/*
+** Read-ahead of strided reads. After PMEM_READAHEAD_TRIGGER reads of a file
+** with the same forward stride, the next PMEM_READAHEAD bytes of the stride
+** are prefetched (pmem) or madvised (other mappings). Off by default, point
+** lookups gain nothing from it; scans turn it on with PMEM_CONFIG_READAHEAD
+** or the "readahead" uri parameter, 256 KiB is a good window.
+*/
+#ifndef PMEM_READAHEAD
+# define PMEM_READAHEAD 0
+#endif
+
+#ifndef PMEM_READAHEAD_TRIGGER
+# define PMEM_READAHEAD_TRIGGER 3
+#endif
+
+/* reads of at least this many bytes use the AVX2/AVX-512 copy loop */
+#ifndef PMEM_WIDE_COPY
+# define PMEM_WIDE_COPY 4096
+#endif
+
+/*
+** Super-journals of multi-database commits are kept in one of
+** PMEM_SUPER_SLOTS slots of a persistent area "<main>-super" instead of a
+** file of their own. A slot holds up to PMEM_SUPER_SLOT_SIZE - 1024 bytes
+** of journal names, longer lists and commits finding no free slot fall
+** back to a file. 0 disables it.
+*/
+#ifndef PMEM_SUPER_JOURNAL
+# define PMEM_SUPER_JOURNAL 1
+#endif
+
+#ifndef PMEM_SUPER_SLOTS
+# define PMEM_SUPER_SLOTS 16
+#endif
+
+#ifndef PMEM_SUPER_SLOT_SIZE
+# define PMEM_SUPER_SLOT_SIZE (64 * 1024)
+#endif
+
 //// 2^30 ~ 1GB
 //#ifndef PMEM_MAX_LEN
 //#define PMEM_MAX_LEN ((off_t)(1 << 31))
@@ -57,7 +203,226 @@ typedef int8_t i8;
 */
 #define MAXPATHNAME 512
 
+/* SQLITE_FCNTL_PMEM_* opcodes */
+#include "pmem_fcntl.h"
+
+/* page granularity of the copy-on-write snapshot fallback */
+#ifndef PMEM_SNAPSHOT_PAGE
+# define PMEM_SNAPSHOT_PAGE 4096
+#endif
+
+/* how long starting a snapshot waits for running transactions to end */
+#ifndef PMEM_SNAPSHOT_BUSY_MS
+# define PMEM_SNAPSHOT_BUSY_MS 5000
+#endif
+
+/*
+** Media write estimate of the write combining buffer, summed over all files
+** of the PMem VFS (see sqlite3_pmem_xpline_stats()).
+*/
+typedef struct pmem_xpline_stats pmem_xpline_stats;
+struct pmem_xpline_stats {
+  u64 bytes_submitted;    /* bytes passed to xWrite */
+  u64 media_uncombined;   /* XPLine bytes the writes would cost one by one */
+  u64 media_combined;     /* XPLine bytes actually written at sync */
+};
+
+/*
+** WAL transactions and their bytes by the way they were written, summed
+** over all files (see sqlite3_pmem_logging_stats()). A transaction of an
+** adaptive WAL that started combined and streamed the rest counts as
+** streamed and as switched.
+*/
+typedef struct pmem_logging_stats pmem_logging_stats;
+struct pmem_logging_stats {
+  u64 copied;
+  u64 combined;
+  u64 streamed;
+  u64 switched;
+  u64 bytes_copied;
+  u64 bytes_combined;
+  u64 bytes_streamed;
+};
+
+/*
+** Time spent in the PMem VFS by commit path component, counted at the exit
+** probes of a PMEM_VFS_USDT build (see pmem_probes.h, all zero otherwise):
+**
+**   WAL_APPEND   xWrite of WAL files
+**   WAL_SYNC     xSync of WAL files, including FLUSH and FENCE
+**   FLUSH        cache line flushes of WAL syncs and group commit leaders
+**   FENCE        the fence following them
+**   CHECKPOINT   xWrite, xSync and xTruncate of main databases, which only
+**                happen when checkpointing in WAL mode
+**   REMAP        growing or shrinking a mapping
+**   SHM          xShmMap and xShmBarrier
+*/
+#define PMEM_PROBE_WAL_APPEND 0
+#define PMEM_PROBE_WAL_SYNC 1
+#define PMEM_PROBE_FLUSH 2
+#define PMEM_PROBE_FENCE 3
+#define PMEM_PROBE_CHECKPOINT 4
+#define PMEM_PROBE_REMAP 5
+#define PMEM_PROBE_SHM 6
+#define PMEM_PROBE_COMPONENTS 7
+
+/*
+** Read path counters, summed over all files (see sqlite3_pmem_read_stats()).
+*/
+typedef struct pmem_read_stats pmem_read_stats;
+struct pmem_read_stats {
+  u64 reads;              /* xRead calls */
+  u64 strided;            /* reads continuing a detected stride */
+  u64 prefetched_bytes;   /* bytes covered by software prefetches */
+  u64 madvised_bytes;     /* bytes passed to madvise(MADV_WILLNEED) */
+  u64 wide_copies;        /* reads copied with the AVX2/AVX-512 loop */
+};
+
+typedef struct pmem_probe_stats pmem_probe_stats;
+struct pmem_probe_stats {
+  u64 cycles[PMEM_PROBE_COMPONENTS];  /* rdtsc cycles */
+  u64 calls[PMEM_PROBE_COMPONENTS];
+  double cycles_per_us;               /* measured rdtsc rate */
+};
+
+/*
+** Options for sqlite3_pmem_config(). They set VFS wide defaults and only
+** affect files opened afterwards.
+**
+** PMEM_CONFIG_WAL_CAPACITY (sqlite3_int64)
+**   WAL files are preallocated to this many bytes once and keep their
+**   mapping across checkpoints; truncating below the capacity only resets
+**   the logical size. Databases using a WAL ring persist their WAL
+**   (SQLITE_FCNTL_PERSIST_WAL) unless the "persist_wal" uri parameter is
+**   false.
+*/
+#define PMEM_CONFIG_WAL_CAPACITY 1
+
+/*
+** PMEM_CONFIG_WRITE_COMBINE (int)
+**   Enable the XPLine write combining buffer for files opened afterwards.
+**   The "write_combine" uri parameter overrides it per database.
+*/
+#define PMEM_CONFIG_WRITE_COMBINE 2
+
+/*
+** PMEM_CONFIG_GROUP_COMMIT_US (int)
+**   Upper bound in microseconds a group commit leader waits for other
+**   syncs to join its batch. 0 disables group commit. Takes effect
+**   immediately for all files.
+*/
+#define PMEM_CONFIG_GROUP_COMMIT_US 3
+
+/*
+** PMEM_CONFIG_DIRTY_MAP (int)
+**   Maintain the dirty page map of main databases opened afterwards. The
+**   "dirtymap" uri parameter overrides it per database. A database whose
+**   "<db>-dirtymap" exists is always tracked.
+*/
+#define PMEM_CONFIG_DIRTY_MAP 4
+
+/*
+** PMEM_CONFIG_TRACE (int)
+**   Sample one in n page accesses of every file into the heat tables
+**   written by sqlite3_pmem_trace_dump(). 0 stops tracing. Takes effect
+**   immediately for all files.
+*/
+#define PMEM_CONFIG_TRACE 5
+
+/*
+** PMEM_CONFIG_READAHEAD (int)
+**   Read-ahead window in bytes of files opened afterwards, 0 (the default)
+**   disables it.
+**   The "readahead" uri parameter overrides it per database.
+*/
+#define PMEM_CONFIG_READAHEAD 6
+
+/*
+** PMEM_CONFIG_SUPER_JOURNAL (int)
+**   1 keeps new super-journals in the persistent slot area of the main
+**   database, 0 creates files. Super-journals already in the area are
+**   found either way.
+*/
+#define PMEM_CONFIG_SUPER_JOURNAL 7
+
+/*
+** PMEM_CONFIG_LOGGING (int)
+**   One of the PMEM_LOGGING_* modes for WALs opened afterwards, or -1 to
+**   follow PMEM_CONFIG_WRITE_COMBINE. The "logging" uri parameter, a mode
+**   name, overrides it per database and PRAGMA pmem_logging per connection.
+*/
+#define PMEM_CONFIG_LOGGING 8
+
+/*
+** PMEM_CONFIG_LOGGING_THRESHOLD (int, sqlite3_int64)
+**   Pages and bytes after which an adaptive WAL streams the rest of a
+**   transaction. Takes effect immediately for all files.
+*/
+#define PMEM_CONFIG_LOGGING_THRESHOLD 9
+
+/*
+** Argument of SQLITE_FCNTL_PMEM_DIRTYMAP_GET. Receives a copy of the dirty
+** page map, bits must be released with sqlite3_free(). Bit i covers bytes
+** [i * page_size, (i + 1) * page_size) of the database file. It returns
+** SQLITE_BUSY while another handle has marked writes that are not synced
+** yet, otherwise writes of all handles wait from then on until
+** SQLITE_FCNTL_PMEM_DIRTYMAP_RESET. That takes a pointer to the epoch
+** returned here, clears the map if it still is at that epoch and stores
+** the new one. Closing the handle ends the wait as well.
+*/
+typedef struct pmem_dirtymap pmem_dirtymap;
+struct pmem_dirtymap {
+  u64 epoch;
+  u64 n_pages;
+  u32 page_size;
+  u8 *bits;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*The only function visible from the outside*/
 sqlite3_vfs *sqlite3_pmem_vfs(void);
 
+/* change a VFS wide default, returns SQLITE_MISUSE for unknown options */
+int sqlite3_pmem_config(int op, ...);
+
+/*
+** Commit the open transaction of db without waiting for the WAL flush.
+** Returns the result of COMMIT as soon as the frames are appended; once
+** the flush covering them completed, xDurable(ctx) is called, possibly
+** from a background thread. Frames SQLite does not sync at commit, as with
+** synchronous=NORMAL, are queued for the flush all the same. An
+** auto-checkpoint run by the COMMIT waits for the flush before it writes
+** the database. Databases not in WAL mode on the PMem VFS commit
+** synchronously and call xDurable before returning.
+*/
+int sqlite3_pmem_commit_async(sqlite3 *db, void (*xDurable)(void*), void *ctx);
+
+/* copy the write combining counters, reset them if reset is non-zero */
+void sqlite3_pmem_xpline_stats(pmem_xpline_stats *out, int reset);
+
+/*
+** Write the heat tables of the page access tracer to the file path, one
+** "file PATH" line per traced file followed by a "PAGE READS WRITES GAP_US"
+** line per accessed page (see tools/pmem_heatmap.c). Counts are of sampled
+** accesses, GAP_US is the mean time between them. The tables are cleared
+** afterwards if reset is non-zero.
+*/
+int sqlite3_pmem_trace_dump(const char *path, int reset);
+
+/* copy the read path counters, reset them if reset is non-zero */
+void sqlite3_pmem_read_stats(pmem_read_stats *out, int reset);
+
+/* copy the logging mode counters, reset them if reset is non-zero */
+void sqlite3_pmem_logging_stats(pmem_logging_stats *out, int reset);
+
+/* copy the probe counters, reset them if reset is non-zero */
+void sqlite3_pmem_probe_stats(pmem_probe_stats *out, int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // PMEM_VFS_H
\ No newline at end of file
@@ -621,7 +621,10 @@ static int pmem_map_shm(
   */
   if(p->shm_file == 0){
     if(extend){
-      pmem_open_shm(p,0);
+      int rc = pmem_open_shm(p,0);
+      if(rc != SQLITE_OK){
+        return rc;
+      }
     }
     else{
       *pp = 0;
@@ -631,7 +634,10 @@ static int pmem_map_shm(
   int number_region = region_number +1;
   while(p->shm_size < region_size * number_region){
     //printf("extended shm to: %li\n", p->shm_size * GROW_FACTOR_FILE);
-    pmem_open_shm(p, p->shm_size * GROW_FACTOR_FILE);
+    int rc = pmem_open_shm(p, p->shm_size * GROW_FACTOR_FILE);
+    if(rc != SQLITE_OK){
+      return rc;
+    }
   }
   *pp = &((char*)p->shm_file)[region_number*region_size];
 
@@ -58,7 +58,15 @@ typedef int8_t i8;
 */
 #define MAXPATHNAME 512
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*The only function visible from the outside*/
 sqlite3_vfs *sqlite3_pmem_wal_only_vfs(void);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // PMEM_VFS_WAL_ONLY_H
\ No newline at end of file
@@ -0,0 +1,1305 @@
+/*
+** This file implements a VFS that puts a persistent write-back cache on
+** pmem in front of a main database file on an SSD.
+**
+** OVERVIEW
+**
+**   The database file (the backing file) stays where the user put it and
+**   is accessed through the "unix" VFS. Next to it a cache file on pmem
+**   holds a circular log of page slots:
+**
+**        offset 0            Wb_Header, root, tail and the two superblocks
+**        entry_offset        Wb_Entry entry[n_slots]   (page of each slot)
+**        slot_offset         n_slots * PMEM_WB_PAGE_SIZE page slots
+**
+**   Log positions only grow, position pos lives in slot pos % n_slots.
+**   xWrite() appends every page it touches at the head of the log, or
+**   overwrites the slot the page already got in the open batch. A page
+**   remap index in DRAM maps each page to the position of its latest
+**   copy, xRead() checks it first and reads pages it does not know from
+**   the backing file.
+**
+**   A batch ends with xSync(), SQLITE_FCNTL_COMMIT_ATOMIC_WRITE,
+**   SQLITE_FCNTL_SYNC, which the pager sends at every commit even with
+**   synchronous=OFF, or SQLITE_FCNTL_CKPT_DONE after a checkpoint. A batch
+**   still open when the lock drops below RESERVED or the handle closes
+**   belongs to a transaction that failed and is rolled back. Its slots are contiguous in the log, so
+**   the commit flushes them and their entries in one or two sequential
+**   ranges, stores the database size and the new head into
+**   super[epoch & 1], fences, then stores the epoch into the root and
+**   fences again. Nothing reaches the backing file on the commit path. A
+**   crash before the root store leaves the previous head in place and the
+**   slots of the lost batch are reused.
+**
+**   A destager thread writes committed pages back. Each round takes up to
+**   PMEM_WB_DESTAGE_BATCH slots from the tail of the log, skips those
+**   whose page has a later committed copy or lies beyond the end of the
+**   database, sorts the rest by page number and writes runs of adjacent
+**   pages with one pwritev() straight from the slots each, so random page
+**   writes reach the SSD as a few large sequential ones. Data I/O uses a file
+**   descriptor of its own, the "unix" VFS caps a write at 128KB. After an
+**   fsync of the backing file it persists the new tail, which frees the
+**   slots. It runs when PMEM_WB_DESTAGE_HIGH percent of the log is used,
+**   every PMEM_WB_DESTAGE_MS while it is not empty, and writers wait for
+**   it when the log is full. The last close of a database writes
+**   everything back and resets the log to root 0, so the backing file is a
+**   complete database again whenever no connection has it open.
+**
+**   The cache file is tied to the device and inode of its database file.
+**   On open the index is rebuilt from the entries between the persisted
+**   tail and the committed head. Connections of one process share the
+**   cache of a database, another process opening it gets SQLITE_BUSY.
+**   Locking and shared memory of the main database, journals, the WAL and
+**   temp files go to the "unix" VFS. The VFS reports
+**   SQLITE_IOCAP_BATCH_ATOMIC, with journal_mode=MEMORY every transaction
+**   is one batch and commits at pmem latency.
+**
+** URI PARAMETERS
+**
+**     cache_file=PATH    location of the cache file
+**                        (default PMEM_WB_CACHE_DIR/<db name>-<hash>-wb,
+**                        hash of the full path of the database)
+**     cache_pages=N      log capacity of a newly created cache file
+**     destage_batch=N    most slots written back per destage round
+*/
+
+#if !defined(SQLITE_TEST) || SQLITE_OS_UNIX
+
+#include "pmem_wb_vfs.h"
+#include "pmem_emulation.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* "PMHPWBLG" */
+#define WB_MAGIC 0x474c425750484d50ULL
+
+#define WB_PS ((sqlite3_int64)PMEM_WB_PAGE_SIZE)
+
+/* adjacent pages the destager writes with one pwritev() */
+#define WB_RUN_PAGES 256
+
+/*
+** Header at offset 0 of the cache file. The root, the tail and the
+** superblocks each have a cache line of their own.
+*/
+typedef struct Wb_Header Wb_Header;
+struct Wb_Header {
+  u64 magic;              /* WB_MAGIC once the header is valid */
+  u32 page_size;          /* PMEM_WB_PAGE_SIZE at creation time */
+  u32 n_slots;            /* number of log slots */
+  u64 entry_offset;       /* offset of entry[] */
+  u64 slot_offset;        /* offset of the first slot */
+  u64 backing_ino;        /* inode of the database file the log belongs to */
+  u64 backing_dev;        /* and its device */
+  u64 unused[2];
+  u64 root;               /* epoch of the last commit */
+  u64 pad[7];
+  u64 tail;               /* first position not written back */
+  u64 pad2[7];
+  struct {
+    u64 epoch;            /* commit this superblock belongs to */
+    u64 size;             /* database size in bytes */
+    u64 head;             /* first position after the commit */
+    u64 pad[5];
+  } super[2];
+};
+
+/*
+** Log entry of a slot, written together with the slot. pos guards
+** against entries of a lap of the log that was never committed.
+*/
+typedef struct Wb_Entry Wb_Entry;
+struct Wb_Entry {
+  u64 page;
+  u64 pos;
+};
+
+/*
+** Page and log position of a slot picked by a destage round.
+*/
+typedef struct Wb_Destage Wb_Destage;
+struct Wb_Destage {
+  u64 page;
+  u64 pos;
+};
+
+/*
+** The cache of one database file, shared by all handles of the process
+** that have it open.
+*/
+typedef struct Wb_Cache Wb_Cache;
+struct Wb_Cache {
+  Wb_Cache *next;         /* list of open caches */
+  int refs;               /* handles using the cache */
+  dev_t dev;              /* identity of the backing file */
+  ino_t ino;
+  int fd;                 /* the backing file, for all data I/O */
+  int lock_fd;            /* holds the flock() of the cache file */
+  char path[MAXPATHNAME+1];
+  char *file;             /* the mapped cache file */
+  size_t size;
+  int is_pmem;
+  Wb_Header *hdr;
+  Wb_Entry *entries;
+  char *slots;
+  u64 n_slots;
+  u64 *index_key;         /* page + 1 of each index slot, 0 if empty */
+  u64 *index_pos;         /* log position of its latest copy */
+  u64 index_mask;
+  u64 tail;               /* first position not written back */
+  u64 committed_head;     /* first position after the last commit */
+  u64 head;               /* next position to append */
+  u64 root;
+  sqlite3_int64 committed_size;
+  sqlite3_int64 db_size;  /* size including the open batch */
+  void *writer;           /* handle that owns the open batch */
+  u64 *batch_page;        /* pages that got a slot in the open batch */
+  u64 *batch_prev;        /* their previous position + 1, 0 if none */
+  u32 n_batch;
+  u32 n_batch_alloc;
+  u32 destage_batch;
+  Wb_Destage *destage;    /* scratch of the destager */
+  struct iovec *run;      /* slots of a run of adjacent pages */
+  pthread_mutex_t mutex;  /* guards everything above against the destager */
+  pthread_cond_t wake;    /* wakes the destager */
+  pthread_cond_t drained; /* signalled when the tail moved */
+  pthread_t destager;
+  int stop;
+  pmem_wb_stats stats;
+};
+
+/*
+** When using this VFS, the sqlite3_file* handles of main databases are
+** actually pointers to instances of type Wb_File. The "unix" handle of
+** the same file, used for locking only, is placed directly behind it.
+*/
+typedef struct Wb_File Wb_File;
+struct Wb_File {
+  sqlite3_file base;                  /* Base class. Must be first. */
+  sqlite3_file *lock;     /* database file opened through "unix" */
+  Wb_Cache *cache;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  Wb_Cache *list;
+} wb_caches = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static char *wb_slot(Wb_Cache *c, u64 pos){
+  return &c->slots[(pos % c->n_slots) * WB_PS];
+}
+
+/*
+** Flush a range, pmem_msync() on mappings that are not pmem. The fence
+** of wb_drain() makes flushed ranges durable.
+*/
+static int wb_flush(Wb_Cache *c, const void *addr, size_t len){
+  if(c->is_pmem){
+    pmem_emu_flush(addr, len);
+    return SQLITE_OK;
+  }
+  return pmem_msync(addr, len) ? SQLITE_IOERR_FSYNC : SQLITE_OK;
+}
+
+static void wb_drain(Wb_Cache *c){
+  if(c->is_pmem){
+    pmem_emu_drain();
+  }
+}
+
+/*
+** Read from the backing file. Its end lags behind the database while the
+** log holds the last pages, the zeros read there are right.
+*/
+static int wb_pread(Wb_Cache *c, void *buf, int len, sqlite3_int64 offset){
+  char *out = (char*)buf;
+  while(len > 0){
+    ssize_t n = pread(c->fd, out, len, offset);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n < 0){
+      return SQLITE_IOERR_READ;
+    }
+    if(n == 0){
+      memset(out, 0, len);
+      return SQLITE_IOERR_SHORT_READ;
+    }
+    out += n;
+    offset += n;
+    len -= n;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Write the iovecs of a run to the backing file at offset.
+*/
+static int wb_pwritev(Wb_Cache *c, struct iovec *iov, int cnt, sqlite3_int64 offset){
+  while(cnt > 0){
+    ssize_t n = pwritev(c->fd, iov, cnt, offset);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n <= 0){
+      return errno == ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+    }
+    offset += n;
+    while(cnt > 0 && (size_t)n >= iov->iov_len){
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if(cnt > 0){
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** The page remap index, open addressing with linear probing. It never
+** holds more pages than the log has slots and has twice that many.
+*/
+static u64 wb_index_home(Wb_Cache *c, u64 page){
+  return (page * 0x9E3779B97F4A7C15ULL >> 20) & c->index_mask;
+}
+
+/* position + 1 of the latest copy of page, 0 if it is not in the log */
+static u64 wb_index_get(Wb_Cache *c, u64 page){
+  for(u64 i = wb_index_home(c, page); c->index_key[i]; i = (i + 1) & c->index_mask){
+    if(c->index_key[i] == page + 1){
+      return c->index_pos[i] + 1;
+    }
+  }
+  return 0;
+}
+
+static void wb_index_put(Wb_Cache *c, u64 page, u64 pos){
+  u64 i = wb_index_home(c, page);
+  while(c->index_key[i] && c->index_key[i] != page + 1){
+    i = (i + 1) & c->index_mask;
+  }
+  c->index_key[i] = page + 1;
+  c->index_pos[i] = pos;
+}
+
+/*
+** Remove page and shift the entries behind it back, so no tombstones are
+** needed.
+*/
+static void wb_index_del(Wb_Cache *c, u64 page){
+  u64 i = wb_index_home(c, page);
+  while(c->index_key[i] != page + 1){
+    if(c->index_key[i] == 0){
+      return;
+    }
+    i = (i + 1) & c->index_mask;
+  }
+  for(u64 j = i;;){
+    j = (j + 1) & c->index_mask;
+    if(c->index_key[j] == 0){
+      c->index_key[i] = 0;
+      return;
+    }
+    u64 h = wb_index_home(c, c->index_key[j] - 1);
+    /* stays if its home lies cyclically in (i, j] */
+    if(i <= j ? (i < h && h <= j) : (i < h || h <= j)){
+      continue;
+    }
+    c->index_key[i] = c->index_key[j];
+    c->index_pos[i] = c->index_pos[j];
+    i = j;
+  }
+}
+
+static int wb_destage_cmp(const void *a, const void *b){
+  u64 x = ((const Wb_Destage*)a)->page;
+  u64 y = ((const Wb_Destage*)b)->page;
+  return x < y ? -1 : x > y;
+}
+
+/*
+** Position + 1 of the latest committed copy of page, 0 if there is none.
+** Copies of the open batch are not committed yet, the chain of their
+** batch_prev leads back to the one they replace. Called with the mutex
+** held.
+*/
+static u64 wb_committed_get(Wb_Cache *c, u64 page){
+  u64 pos = wb_index_get(c, page);
+  while(pos && pos - 1 >= c->committed_head){
+    pos = c->batch_prev[pos - 1 - c->committed_head];
+  }
+  return pos;
+}
+
+/*
+** Write one destage round back to the backing file. Called with the
+** mutex held, which is released during the I/O. Committed slots are never
+** written again, so they can be read without the mutex.
+*/
+static int wb_destage(Wb_Cache *c){
+  u64 from = c->tail;
+  u64 to = c->committed_head;
+  if(to - from > c->destage_batch){
+    to = from + c->destage_batch;
+  }
+  u64 n_pages = (c->committed_size + WB_PS - 1) / WB_PS;
+  u32 n = 0;
+  for(u64 pos = from; pos < to; pos++){
+    u64 page = c->entries[pos % c->n_slots].page;
+    /* a copy in the open batch may still be rolled back */
+    if(page < n_pages && wb_committed_get(c, page) == pos + 1){
+      c->destage[n].page = page;
+      c->destage[n].pos = pos;
+      n++;
+    }
+  }
+  c->stats.superseded += (to - from) - n;
+  pthread_mutex_unlock(&c->mutex);
+
+  qsort(c->destage, n, sizeof(Wb_Destage), wb_destage_cmp);
+  int rc = SQLITE_OK;
+  u64 writes = 0;
+  for(u32 i = 0; i < n && rc == SQLITE_OK;){
+    u32 len = 1;
+    while(i + len < n && len < WB_RUN_PAGES && c->destage[i + len].page == c->destage[i].page + len){
+      len++;
+    }
+    for(u32 k = 0; k < len; k++){
+      c->run[k].iov_base = wb_slot(c, c->destage[i + k].pos);
+      c->run[k].iov_len = WB_PS;
+    }
+    pmem_emu_read(len * WB_PS);
+    rc = wb_pwritev(c, c->run, len, c->destage[i].page * WB_PS);
+    writes++;
+    i += len;
+  }
+
+  /* pages beyond the end must not come back, the log has the rest */
+  pthread_mutex_lock(&c->mutex);
+  sqlite3_int64 size = c->committed_size;
+  pthread_mutex_unlock(&c->mutex);
+  struct stat st;
+  if(rc == SQLITE_OK && fstat(c->fd, &st)){
+    rc = SQLITE_IOERR_FSTAT;
+  }
+  if(rc == SQLITE_OK && st.st_size > size && ftruncate(c->fd, size)){
+    rc = SQLITE_IOERR_TRUNCATE;
+  }
+  if(rc == SQLITE_OK && fdatasync(c->fd)){
+    rc = SQLITE_IOERR_FSYNC;
+  }
+  if(rc == SQLITE_OK){
+    /* durable before the slots are reused, or recovery would read them */
+    c->hdr->tail = to;
+    rc = wb_flush(c, &c->hdr->tail, sizeof(u64));
+    wb_drain(c);
+  }
+
+  pthread_mutex_lock(&c->mutex);
+  if(rc == SQLITE_OK){
+    for(u32 i = 0; i < n; i++){
+      if(wb_index_get(c, c->destage[i].page) == c->destage[i].pos + 1){
+        wb_index_del(c, c->destage[i].page);
+      }
+    }
+    c->tail = to;
+    c->stats.destaged += n;
+    c->stats.destage_writes += writes;
+    c->stats.destage_rounds++;
+    pthread_cond_broadcast(&c->drained);
+  }
+  return rc;
+}
+
+static u64 wb_used(Wb_Cache *c){
+  return c->committed_head - c->tail;
+}
+
+/*
+** Background write-back. Destages while the log is above the high water
+** mark, and whatever is committed after PMEM_WB_DESTAGE_MS of quiet.
+*/
+static void *wb_destager(void *arg){
+  Wb_Cache *c = (Wb_Cache*)arg;
+  int timed_out = 0;
+
+  pthread_mutex_lock(&c->mutex);
+  while(!c->stop){
+    u64 used = wb_used(c);
+    if(used == 0 || (used * 100 < (u64)PMEM_WB_DESTAGE_HIGH * c->n_slots && !timed_out
+        && c->head - c->tail < c->n_slots)){
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      u64 ns = ts.tv_nsec + (u64)PMEM_WB_DESTAGE_MS * 1000000ULL;
+      ts.tv_sec += ns / 1000000000ULL;
+      ts.tv_nsec = ns % 1000000000ULL;
+      timed_out = pthread_cond_timedwait(&c->wake, &c->mutex, &ts) == ETIMEDOUT;
+      continue;
+    }
+    timed_out = 0;
+    if(wb_destage(c) != SQLITE_OK){
+      /* retry on the next tick rather than spin on a failing device */
+      pthread_cond_broadcast(&c->drained);
+      pthread_cond_wait(&c->wake, &c->mutex);
+    }
+  }
+  pthread_mutex_unlock(&c->mutex);
+  return 0;
+}
+
+/*
+** Make the open batch the committed state of the file. Called with the
+** mutex held.
+*/
+static int wb_commit(Wb_Cache *c){
+  int rc = SQLITE_OK;
+  if(c->head == c->committed_head && c->db_size == c->committed_size){
+    c->writer = 0;
+    return SQLITE_OK;
+  }
+  Wb_Header *h = c->hdr;
+  u64 epoch = c->root + 1;
+
+  /* the batch is one or, across the end of the log, two sequential ranges */
+  for(u64 pos = c->committed_head; pos < c->head && rc == SQLITE_OK;){
+    u64 slot = pos % c->n_slots;
+    u64 len = c->head - pos;
+    if(slot + len > c->n_slots){
+      len = c->n_slots - slot;
+    }
+    rc = wb_flush(c, &c->slots[slot * WB_PS], len * WB_PS);
+    if(rc == SQLITE_OK){
+      rc = wb_flush(c, &c->entries[slot], len * sizeof(Wb_Entry));
+    }
+    pos += len;
+  }
+  if(rc == SQLITE_OK){
+    h->super[epoch & 1].epoch = epoch;
+    h->super[epoch & 1].size = c->db_size;
+    h->super[epoch & 1].head = c->head;
+    rc = wb_flush(c, &h->super[epoch & 1], 3 * sizeof(u64));
+  }
+  if(rc){
+    return rc;
+  }
+  wb_drain(c);
+
+  /* the commit point */
+  __atomic_store_n(&h->root, epoch, __ATOMIC_RELEASE);
+  rc = wb_flush(c, &h->root, sizeof(u64));
+  wb_drain(c);
+  if(rc){
+    return rc;
+  }
+  c->root = epoch;
+
+  /* copies of truncated pages must not come back when the file grows */
+  if(c->db_size < c->committed_size){
+    u64 first = (c->db_size + WB_PS - 1) / WB_PS;
+    u64 end = (c->committed_size + WB_PS - 1) / WB_PS;
+    for(u64 page = first; page < end; page++){
+      wb_index_del(c, page);
+    }
+    for(u32 i = 0; i < c->n_batch; i++){
+      if(c->batch_page[i] >= first){
+        wb_index_del(c, c->batch_page[i]);
+      }
+    }
+  }
+  c->committed_head = c->head;
+  c->committed_size = c->db_size;
+  c->n_batch = 0;
+  c->writer = 0;
+  c->stats.commits++;
+  if(wb_used(c) * 100 >= (u64)PMEM_WB_DESTAGE_HIGH * c->n_slots){
+    pthread_cond_signal(&c->wake);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Drop the open batch. Previous copies the destager wrote back meanwhile
+** are read from the backing file again.
+*/
+static void wb_rollback(Wb_Cache *c){
+  for(u32 i = c->n_batch; i > 0; i--){
+    u64 page = c->batch_page[i - 1];
+    u64 prev = c->batch_prev[i - 1];
+    if(prev && prev - 1 >= c->tail){
+      wb_index_put(c, page, prev - 1);
+    }
+    else{
+      wb_index_del(c, page);
+    }
+  }
+  c->n_batch = 0;
+  c->head = c->committed_head;
+  c->db_size = c->committed_size;
+  c->writer = 0;
+  c->stats.rollbacks++;
+}
+
+/*
+** Give page a slot at the head of the log for the open batch. Waits for
+** the destager while the log is full. Called with the mutex held.
+*/
+static int wb_append(Wb_Cache *c, u64 page, int whole){
+  if(c->n_batch == c->n_batch_alloc){
+    u32 n = c->n_batch_alloc ? c->n_batch_alloc * 2 : 64;
+    u64 *batch_page = realloc(c->batch_page, n * sizeof(u64));
+    if(batch_page == 0){
+      return SQLITE_NOMEM;
+    }
+    c->batch_page = batch_page;
+    u64 *batch_prev = realloc(c->batch_prev, n * sizeof(u64));
+    if(batch_prev == 0){
+      return SQLITE_NOMEM;
+    }
+    c->batch_prev = batch_prev;
+    c->n_batch_alloc = n;
+  }
+  if(c->head - c->tail == c->n_slots){
+    c->stats.stalls++;
+  }
+  while(c->head - c->tail == c->n_slots){
+    if(c->tail == c->committed_head){
+      /* the open batch alone fills the log */
+      return SQLITE_FULL;
+    }
+    u64 tail = c->tail;
+    pthread_cond_signal(&c->wake);
+    pthread_cond_wait(&c->drained, &c->mutex);
+    if(c->tail == tail && c->head - c->tail == c->n_slots){
+      return SQLITE_IOERR_WRITE;
+    }
+  }
+  /* the destager may have written the previous copy back meanwhile */
+  u64 prev = wb_index_get(c, page);
+  u64 pos = c->head++;
+  char *dst = wb_slot(c, pos);
+  if(!whole){
+    /* the rest of the page keeps its current content */
+    if(prev){
+      memcpy(dst, wb_slot(c, prev - 1), WB_PS);
+    }
+    else if((sqlite3_int64)page * WB_PS < c->db_size){
+      int rc = wb_pread(c, dst, WB_PS, page * WB_PS);
+      if(rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ){
+        c->head--;
+        return rc;
+      }
+    }
+    else{
+      memset(dst, 0, WB_PS);
+    }
+  }
+  Wb_Entry *e = &c->entries[pos % c->n_slots];
+  e->page = page;
+  e->pos = pos;
+  wb_index_put(c, page, pos);
+  c->batch_page[c->n_batch] = page;
+  c->batch_prev[c->n_batch] = prev;
+  c->n_batch++;
+  c->stats.log_writes++;
+  return SQLITE_OK;
+}
+
+/*
+** Read data from a file. Pages with a copy in the log are read from it,
+** all others from the backing file without holding the mutex.
+*/
+static int wb_read(
+  sqlite3_file *pFile,
+  void *buffer,
+  int buffer_size,
+  sqlite_int64 offset
+){
+  Wb_Cache *c = ((Wb_File*)pFile)->cache;
+  char *out = (char*)buffer;
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock(&c->mutex);
+  if(offset + buffer_size > c->db_size){
+    sqlite_int64 valid = offset < c->db_size ? c->db_size - offset : 0;
+    memset(out + valid, 0, buffer_size - valid);
+    buffer_size = valid;
+    rc = SQLITE_IOERR_SHORT_READ;
+  }
+  while(buffer_size > 0){
+    u64 page = offset / WB_PS;
+    int in_page = offset % WB_PS;
+    int amount = WB_PS - in_page;
+    if(amount > buffer_size){
+      amount = buffer_size;
+    }
+    u64 pos = wb_index_get(c, page);
+    if(pos){
+      memcpy(out, wb_slot(c, pos - 1) + in_page, amount);
+      pmem_emu_read(amount);
+      c->stats.cache_reads++;
+    }
+    else{
+      c->stats.backing_reads++;
+      pthread_mutex_unlock(&c->mutex);
+      int rc2 = wb_pread(c, out, amount, offset);
+      pthread_mutex_lock(&c->mutex);
+      if(rc2 != SQLITE_OK && rc2 != SQLITE_IOERR_SHORT_READ){
+        rc = rc2;
+        break;
+      }
+    }
+    out += amount;
+    offset += amount;
+    buffer_size -= amount;
+  }
+  pthread_mutex_unlock(&c->mutex);
+  return rc;
+}
+
+/*
+** Write data from a buffer into a file. Every page goes to its slot of
+** the open batch, committed slots stay untouched.
+*/
+static int wb_write(
+  sqlite3_file *pFile,
+  const void *buffer,
+  int buffer_size,
+  sqlite_int64 offset
+){
+  Wb_File *p = (Wb_File*)pFile;
+  Wb_Cache *c = p->cache;
+  const char *in = (const char*)buffer;
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock(&c->mutex);
+  c->writer = p;
+  while(buffer_size > 0 && rc == SQLITE_OK){
+    u64 page = offset / WB_PS;
+    int in_page = offset % WB_PS;
+    int amount = WB_PS - in_page;
+    if(amount > buffer_size){
+      amount = buffer_size;
+    }
+    u64 pos = wb_index_get(c, page);
+    if(pos == 0 || pos - 1 < c->committed_head){
+      rc = wb_append(c, page, amount == WB_PS);
+      if(rc){
+        break;
+      }
+      pos = c->head;
+    }
+    char *dst = wb_slot(c, pos - 1) + in_page;
+    if(c->is_pmem){
+      pmem_memcpy_nodrain(dst, in, amount);
+      pmem_emu_media(dst, amount);
+    }
+    else{
+      memcpy(dst, in, amount);
+    }
+    in += amount;
+    offset += amount;
+    buffer_size -= amount;
+  }
+  if(offset > c->db_size){
+    c->db_size = offset;
+  }
+  pthread_mutex_unlock(&c->mutex);
+  return rc;
+}
+
+/*
+** Truncation is part of the open batch like any write.
+*/
+static int wb_truncate(sqlite3_file *pFile, sqlite_int64 size){
+  Wb_File *p = (Wb_File*)pFile;
+  Wb_Cache *c = p->cache;
+  pthread_mutex_lock(&c->mutex);
+  c->writer = p;
+  c->db_size = size;
+  pthread_mutex_unlock(&c->mutex);
+  return SQLITE_OK;
+}
+
+/*
+** Commit the batch of this handle. Only pmem is synced, the backing file
+** is the destager's business.
+*/
+static int wb_sync_batch(Wb_File *p){
+  Wb_Cache *c = p->cache;
+  int rc = SQLITE_OK;
+  pthread_mutex_lock(&c->mutex);
+  if(c->writer == p){
+    rc = wb_commit(c);
+  }
+  pthread_mutex_unlock(&c->mutex);
+  return rc;
+}
+
+/*
+** Drop the batch of this handle.
+*/
+static void wb_rollback_batch(Wb_File *p){
+  Wb_Cache *c = p->cache;
+  pthread_mutex_lock(&c->mutex);
+  if(c->writer == p){
+    wb_rollback(c);
+  }
+  pthread_mutex_unlock(&c->mutex);
+}
+
+static int wb_sync(sqlite3_file *pFile, int flags){
+  return wb_sync_batch((Wb_File*)pFile);
+}
+
+static int wb_file_size(sqlite3_file *pFile, sqlite_int64 *pSize){
+  Wb_Cache *c = ((Wb_File*)pFile)->cache;
+  pthread_mutex_lock(&c->mutex);
+  *pSize = c->db_size;
+  pthread_mutex_unlock(&c->mutex);
+  return SQLITE_OK;
+}
+
+/*
+** Locking belongs to the "unix" handle. A batch still open when the lock
+** drops below RESERVED was not committed, the pager gives up on its
+** transaction, so it is rolled back.
+*/
+static int wb_lock(sqlite3_file *pFile, int eLock){
+  Wb_File *p = (Wb_File*)pFile;
+  return p->lock->pMethods->xLock(p->lock, eLock);
+}
+static int wb_unlock(sqlite3_file *pFile, int eLock){
+  Wb_File *p = (Wb_File*)pFile;
+  if(eLock <= SQLITE_LOCK_SHARED){
+    wb_rollback_batch(p);
+  }
+  return p->lock->pMethods->xUnlock(p->lock, eLock);
+}
+static int wb_check_reserved_lock(sqlite3_file *pFile, int *pResOut){
+  Wb_File *p = (Wb_File*)pFile;
+  return p->lock->pMethods->xCheckReservedLock(p->lock, pResOut);
+}
+
+static int wb_file_control(sqlite3_file *pFile, int op, void *pArg){
+  Wb_File *p = (Wb_File*)pFile;
+  Wb_Cache *c = p->cache;
+  switch(op){
+    case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+      return SQLITE_OK;
+    case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
+    case SQLITE_FCNTL_SYNC:
+    case SQLITE_FCNTL_CKPT_DONE:
+      return wb_sync_batch(p);
+    case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+      wb_rollback_batch(p);
+      return SQLITE_OK;
+    case SQLITE_FCNTL_SIZE_HINT:
+      /* the size of the backing file follows the destager */
+      return SQLITE_OK;
+    case SQLITE_FCNTL_PMEM_WB_STATS:
+      pthread_mutex_lock(&c->mutex);
+      *(pmem_wb_stats*)pArg = c->stats;
+      ((pmem_wb_stats*)pArg)->slots = c->n_slots;
+      ((pmem_wb_stats*)pArg)->slots_used = c->head - c->tail;
+      pthread_mutex_unlock(&c->mutex);
+      return SQLITE_OK;
+  }
+  return p->lock->pMethods->xFileControl(p->lock, op, pArg);
+}
+
+static int wb_sector_size(sqlite3_file *pFile){
+  return PMEM_WB_PAGE_SIZE;
+}
+static int wb_device_characteristics(sqlite3_file *pFile){
+  return SQLITE_IOCAP_BATCH_ATOMIC | SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+}
+
+static int wb_shm_map(sqlite3_file *pFile, int region_number, int region_size, int extend, void volatile **pp){
+  Wb_File *p = (Wb_File*)pFile;
+  return p->lock->pMethods->xShmMap(p->lock, region_number, region_size, extend, pp);
+}
+static int wb_shm_lock(sqlite3_file *pFile, int ofst, int n, int flags){
+  Wb_File *p = (Wb_File*)pFile;
+  return p->lock->pMethods->xShmLock(p->lock, ofst, n, flags);
+}
+static void wb_shm_barrier(sqlite3_file *pFile){
+  Wb_File *p = (Wb_File*)pFile;
+  p->lock->pMethods->xShmBarrier(p->lock);
+}
+static int wb_shm_unmap(sqlite3_file *pFile, int deleteFlag){
+  Wb_File *p = (Wb_File*)pFile;
+  return p->lock->pMethods->xShmUnmap(p->lock, deleteFlag);
+}
+
+/*
+** Memory mapped reads would bypass the log, so xFetch never hands out a
+** pointer and SQLite falls back to xRead.
+*/
+static int wb_fetch(sqlite3_file *pFile, sqlite3_int64 offset, int amount, void **pp){
+  *pp = 0;
+  return SQLITE_OK;
+}
+static int wb_unfetch(sqlite3_file *pFile, sqlite3_int64 offset, void *p){
+  return SQLITE_OK;
+}
+
+/*
+** Map an existing cache file, or lay out a new one with n_slots slots if
+** there is none, its creation never finished, or it belongs to another
+** database file and holds nothing that is not written back.
+*/
+static int wb_map_cache(Wb_Cache *c, u64 n_slots){
+  struct stat st;
+  int is_pmem;
+  if(stat(c->path, &st) == 0 && st.st_size >= (off_t)sizeof(Wb_Header)){
+    c->file = (char *)pmem_map_file(c->path, 0, 0, 0666, &c->size, &is_pmem);
+    if(c->file == 0){
+      return SQLITE_CANTOPEN;
+    }
+    c->is_pmem = pmem_emu_is_pmem(is_pmem);
+    Wb_Header *h = (Wb_Header*)c->file;
+    if(h->magic == WB_MAGIC && h->page_size == PMEM_WB_PAGE_SIZE
+        && h->slot_offset + (u64)h->n_slots * WB_PS <= c->size){
+      u64 root = h->root;
+      if(h->backing_ino == c->ino && h->backing_dev == c->dev){
+        c->hdr = h;
+        return SQLITE_OK;
+      }
+      if(h->super[root & 1].epoch == root && h->super[root & 1].head != h->tail){
+        /* committed pages of another file, dropping them would lose data */
+        return SQLITE_CANTOPEN;
+      }
+    }
+    /* laid out again in place, lock_fd holds the lock of this file */
+    pmem_unmap(c->file, c->size);
+    c->file = 0;
+  }
+
+  u64 entry_offset = WB_PS;
+  u64 slot_offset = entry_offset + ((n_slots * sizeof(Wb_Entry) + WB_PS - 1) / WB_PS) * WB_PS;
+  size_t size = slot_offset + n_slots * WB_PS;
+  c->file = (char *)pmem_map_file(c->path, size, PMEM_FILE_CREATE, 0666, &c->size, &is_pmem);
+  if(c->file == 0){
+    return SQLITE_CANTOPEN;
+  }
+  c->is_pmem = pmem_emu_is_pmem(is_pmem);
+  Wb_Header *h = (Wb_Header*)c->file;
+  memset(h, 0, sizeof(Wb_Header));
+  h->page_size = PMEM_WB_PAGE_SIZE;
+  h->n_slots = n_slots;
+  h->entry_offset = entry_offset;
+  h->slot_offset = slot_offset;
+  h->backing_ino = c->ino;
+  h->backing_dev = c->dev;
+  int rc = wb_flush(c, h, sizeof(Wb_Header));
+  wb_drain(c);
+  h->magic = WB_MAGIC;
+  if(rc == SQLITE_OK){
+    rc = wb_flush(c, &h->magic, sizeof(u64));
+  }
+  wb_drain(c);
+  c->hdr = h;
+  return rc;
+}
+
+/*
+** Rebuild the index from the committed part of the log. A root of 0 means
+** the last close wrote everything back, the backing file is the database
+** then and may have been changed through another VFS since.
+*/
+static int wb_load(Wb_Cache *c){
+  Wb_Header *h = c->hdr;
+  c->n_slots = h->n_slots;
+  c->entries = (Wb_Entry*)&c->file[h->entry_offset];
+  c->slots = &c->file[h->slot_offset];
+
+  u64 n = 1;
+  while(n < 2 * c->n_slots){
+    n <<= 1;
+  }
+  c->index_mask = n - 1;
+  c->index_key = calloc(n, sizeof(u64));
+  c->index_pos = malloc(n * sizeof(u64));
+  c->destage = malloc(c->destage_batch * sizeof(Wb_Destage));
+  c->run = malloc(WB_RUN_PAGES * sizeof(struct iovec));
+  if(c->index_key == 0 || c->index_pos == 0 || c->destage == 0 || c->run == 0){
+    return SQLITE_NOMEM;
+  }
+
+  c->root = h->root;
+  if(c->root == 0){
+    struct stat st;
+    if(fstat(c->fd, &st)){
+      return SQLITE_IOERR_FSTAT;
+    }
+    c->committed_size = st.st_size;
+    if(h->tail){
+      /* a crash during the reset, the next commit must find it done */
+      h->tail = 0;
+      int rc = wb_flush(c, &h->tail, sizeof(u64));
+      wb_drain(c);
+      if(rc){
+        return rc;
+      }
+    }
+  }
+  else if(h->super[c->root & 1].epoch != c->root){
+    return SQLITE_CORRUPT;
+  }
+  else{
+    c->tail = h->tail;
+    c->committed_head = h->super[c->root & 1].head;
+    c->committed_size = h->super[c->root & 1].size;
+    if(c->tail > c->committed_head || c->committed_head - c->tail > c->n_slots){
+      return SQLITE_CORRUPT;
+    }
+  }
+  u64 n_pages = (c->committed_size + WB_PS - 1) / WB_PS;
+  for(u64 pos = c->tail; pos < c->committed_head; pos++){
+    Wb_Entry *e = &c->entries[pos % c->n_slots];
+    if(e->pos != pos){
+      return SQLITE_CORRUPT;
+    }
+    if(e->page < n_pages){
+      wb_index_put(c, e->page, pos);
+    }
+  }
+  c->head = c->committed_head;
+  c->db_size = c->committed_size;
+  return SQLITE_OK;
+}
+
+/*
+** Mark a log that is written back completely as empty. A commit that only
+** truncated the database gave the destager nothing to do, so the backing
+** file gets its final size here.
+*/
+static void wb_reset(Wb_Cache *c){
+  struct stat st;
+  if(fstat(c->fd, &st) || (st.st_size > c->committed_size && ftruncate(c->fd, c->committed_size))
+      || fdatasync(c->fd)){
+    return;
+  }
+  /* the root first, a crash in between leaves a root of 0 and a stale tail */
+  c->hdr->root = 0;
+  wb_flush(c, &c->hdr->root, sizeof(u64));
+  wb_drain(c);
+  c->hdr->tail = 0;
+  wb_flush(c, &c->hdr->tail, sizeof(u64));
+  wb_drain(c);
+}
+
+/*
+** Write everything back and release the cache. Called without any lock
+** once the last handle is gone.
+*/
+static void wb_cache_free(Wb_Cache *c){
+  if(c->destager){
+    pthread_mutex_lock(&c->mutex);
+    c->stop = 1;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->mutex);
+    pthread_join(c->destager, 0);
+
+    pthread_mutex_lock(&c->mutex);
+    int rc = SQLITE_OK;
+    while(wb_used(c) > 0 && rc == SQLITE_OK){
+      rc = wb_destage(c);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    if(rc == SQLITE_OK){
+      wb_reset(c);
+    }
+    pthread_cond_destroy(&c->drained);
+    pthread_cond_destroy(&c->wake);
+    pthread_mutex_destroy(&c->mutex);
+  }
+  if(c->file){
+    pmem_unmap(c->file, c->size);
+  }
+  if(c->fd >= 0){
+    close(c->fd);
+  }
+  if(c->lock_fd >= 0){
+    close(c->lock_fd);
+  }
+  free(c->index_key);
+  free(c->index_pos);
+  free(c->destage);
+  free(c->run);
+  free(c->batch_page);
+  free(c->batch_prev);
+  free(c);
+}
+
+/*
+** Open the cache of the database file_path. Called with wb_caches.mutex
+** held.
+*/
+static int wb_cache_open(const char *file_path, struct stat *st, Wb_Cache **pp){
+  Wb_Cache *c = calloc(1, sizeof(Wb_Cache));
+  if(c == 0){
+    return SQLITE_NOMEM;
+  }
+  c->fd = -1;
+  c->lock_fd = -1;
+  c->dev = st->st_dev;
+  c->ino = st->st_ino;
+
+  const char *path = sqlite3_uri_parameter(file_path, "cache_file");
+  if(path){
+    sqlite3_snprintf(MAXPATHNAME, c->path, "%s", path);
+  }
+  else{
+    /* databases of the same name in different directories get a file each */
+    u64 hash = 0xcbf29ce484222325ULL;
+    for(const char *s = file_path; *s; s++){
+      hash = (hash ^ (u8)*s) * 0x100000001b3ULL;
+    }
+    const char *base = strrchr(file_path, '/');
+    sqlite3_snprintf(MAXPATHNAME, c->path, "%s/%s-%016llx-wb", PMEM_WB_CACHE_DIR,
+                     base ? base + 1 : file_path, hash);
+  }
+  sqlite3_int64 n_slots = sqlite3_uri_int64(file_path, "cache_pages", PMEM_WB_SLOTS);
+  sqlite3_int64 batch = sqlite3_uri_int64(file_path, "destage_batch", PMEM_WB_DESTAGE_BATCH);
+  int rc = SQLITE_OK;
+  if(n_slots <= 0 || n_slots > 0xffffffffLL || batch <= 0 || batch > 0xffffffffLL){
+    rc = SQLITE_MISUSE;
+  }
+  c->destage_batch = batch;
+
+  if(rc == SQLITE_OK){
+    c->fd = open(file_path, O_RDWR | O_CLOEXEC);
+    if(c->fd < 0){
+      rc = SQLITE_CANTOPEN;
+    }
+  }
+  if(rc == SQLITE_OK){
+    /* the index lives in this process only */
+    c->lock_fd = open(c->path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(c->lock_fd < 0){
+      rc = SQLITE_CANTOPEN;
+    }
+    else if(flock(c->lock_fd, LOCK_EX | LOCK_NB)){
+      rc = SQLITE_BUSY;
+    }
+  }
+  if(rc == SQLITE_OK){
+    rc = wb_map_cache(c, n_slots);
+  }
+  if(rc == SQLITE_OK){
+    rc = wb_load(c);
+  }
+  if(rc == SQLITE_OK){
+    pthread_mutex_init(&c->mutex, 0);
+    pthread_cond_init(&c->wake, 0);
+    pthread_cond_init(&c->drained, 0);
+    if(pthread_create(&c->destager, 0, wb_destager, c)){
+      c->destager = 0;
+      pthread_cond_destroy(&c->drained);
+      pthread_cond_destroy(&c->wake);
+      pthread_mutex_destroy(&c->mutex);
+      rc = SQLITE_CANTOPEN;
+    }
+  }
+  if(rc){
+    wb_cache_free(c);
+    return rc;
+  }
+  *pp = c;
+  return SQLITE_OK;
+}
+
+static int wb_close(sqlite3_file *pFile){
+  Wb_File *p = (Wb_File*)pFile;
+  Wb_Cache *c = p->cache;
+  /* a batch nobody committed is not part of the database */
+  wb_rollback_batch(p);
+
+  pthread_mutex_lock(&wb_caches.mutex);
+  if(--c->refs == 0){
+    Wb_Cache **pp = &wb_caches.list;
+    while(*pp != c){
+      pp = &(*pp)->next;
+    }
+    *pp = c->next;
+  }
+  else{
+    c = 0;
+  }
+  pthread_mutex_unlock(&wb_caches.mutex);
+  if(c){
+    wb_cache_free(c);
+  }
+  return p->lock->pMethods->xClose(p->lock);
+}
+
+/*
+** Open a file handle. Only main databases get a cache.
+*/
+static int wb_open(
+  sqlite3_vfs *pVfs,
+  const char *file_path,
+  sqlite3_file *pFile,
+  int flags,
+  int *pOutFlags
+){
+  static const sqlite3_io_methods wb_io = {
+    3,                            /* iVersion */
+    wb_close,                     /* xClose */
+    wb_read,                      /* xRead */
+    wb_write,                     /* xWrite */
+    wb_truncate,                  /* xTruncate */
+    wb_sync,                      /* xSync */
+    wb_file_size,                 /* xFileSize */
+    wb_lock,                      /* xLock */
+    wb_unlock,                    /* xUnlock */
+    wb_check_reserved_lock,       /* xCheckReservedLock */
+    wb_file_control,              /* xFileControl */
+    wb_sector_size,               /* xSectorSize */
+    wb_device_characteristics,    /* xDeviceCharacteristics */
+    wb_shm_map,                   /* xShmMap */
+    wb_shm_lock,                  /* xShmLock */
+    wb_shm_barrier,               /* xShmBarrier */
+    wb_shm_unmap,                 /* xShmUnmap */
+    wb_fetch,                     /* xFetch */
+    wb_unfetch,                   /* xUnfetch */
+  };
+  sqlite3_vfs *root = (sqlite3_vfs*)pVfs->pAppData;
+
+  if(file_path == 0 || (flags & SQLITE_OPEN_MAIN_DB) == 0){
+    return root->xOpen(root, file_path, pFile, flags, pOutFlags);
+  }
+
+  Wb_File *p = (Wb_File*)pFile;
+  memset(p, 0, sizeof(Wb_File));
+  p->lock = (sqlite3_file*)&p[1];
+  int rc = root->xOpen(root, file_path, p->lock, flags, pOutFlags);
+  if(rc){
+    return rc;
+  }
+
+  struct stat st;
+  if(stat(file_path, &st)){
+    p->lock->pMethods->xClose(p->lock);
+    return SQLITE_CANTOPEN;
+  }
+  pthread_mutex_lock(&wb_caches.mutex);
+  Wb_Cache *c = wb_caches.list;
+  while(c && (c->dev != st.st_dev || c->ino != st.st_ino)){
+    c = c->next;
+  }
+  if(c == 0){
+    rc = wb_cache_open(file_path, &st, &c);
+    if(rc == SQLITE_OK){
+      c->next = wb_caches.list;
+      wb_caches.list = c;
+    }
+  }
+  if(rc == SQLITE_OK){
+    c->refs++;
+  }
+  pthread_mutex_unlock(&wb_caches.mutex);
+  if(rc){
+    p->lock->pMethods->xClose(p->lock);
+    return rc;
+  }
+  p->cache = c;
+  p->base.pMethods = &wb_io;
+  return SQLITE_OK;
+}
+
+/*
+** Everything except xOpen is forwarded to the "unix" VFS.
+*/
+#define ROOT(v) ((sqlite3_vfs*)(v)->pAppData)
+
+static int wb_delete(sqlite3_vfs *pVfs, const char *zPath, int dirSync){
+  return ROOT(pVfs)->xDelete(ROOT(pVfs), zPath, dirSync);
+}
+static int wb_access(sqlite3_vfs *pVfs, const char *zPath, int flags, int *pResOut){
+  return ROOT(pVfs)->xAccess(ROOT(pVfs), zPath, flags, pResOut);
+}
+static int wb_full_pathname(sqlite3_vfs *pVfs, const char *zPath, int nOut, char *zOut){
+  return ROOT(pVfs)->xFullPathname(ROOT(pVfs), zPath, nOut, zOut);
+}
+static void *wb_dl_open(sqlite3_vfs *pVfs, const char *zPath){
+  return ROOT(pVfs)->xDlOpen(ROOT(pVfs), zPath);
+}
+static void wb_dl_error(sqlite3_vfs *pVfs, int nByte, char *zErrMsg){
+  ROOT(pVfs)->xDlError(ROOT(pVfs), nByte, zErrMsg);
+}
+static void (*wb_dl_sym(sqlite3_vfs *pVfs, void *pH, const char *z))(void){
+  return ROOT(pVfs)->xDlSym(ROOT(pVfs), pH, z);
+}
+static void wb_dl_close(sqlite3_vfs *pVfs, void *pHandle){
+  ROOT(pVfs)->xDlClose(ROOT(pVfs), pHandle);
+}
+static int wb_randomness(sqlite3_vfs *pVfs, int nByte, char *zByte){
+  return ROOT(pVfs)->xRandomness(ROOT(pVfs), nByte, zByte);
+}
+static int wb_sleep(sqlite3_vfs *pVfs, int microseconds){
+  return ROOT(pVfs)->xSleep(ROOT(pVfs), microseconds);
+}
+static int wb_current_time(sqlite3_vfs *pVfs, double *pTime){
+  return ROOT(pVfs)->xCurrentTime(ROOT(pVfs), pTime);
+}
+static int wb_get_last_error(sqlite3_vfs *pVfs, int nBuf, char *zBuf){
+  return ROOT(pVfs)->xGetLastError(ROOT(pVfs), nBuf, zBuf);
+}
+static int wb_current_time_int64(sqlite3_vfs *pVfs, sqlite3_int64 *piNow){
+  return ROOT(pVfs)->xCurrentTimeInt64(ROOT(pVfs), piNow);
+}
+
+/*
+** This function returns a pointer to the VFS implemented in this file.
+** To make the VFS available to SQLite:
+**
+**   sqlite3_vfs_register(sqlite3_pmem_wb_vfs(), 0);
+*/
+sqlite3_vfs *sqlite3_pmem_wb_vfs(void){
+  static sqlite3_vfs wb_vfs = {
+    2,                            /* iVersion */
+    0,                            /* szOsFile, set below */
+    MAXPATHNAME,                  /* mxPathname */
+    0,                            /* pNext */
+    "PMem_VFS_wb",                /* zName */
+    0,                            /* pAppData, the "unix" VFS */
+    wb_open,                      /* xOpen */
+    wb_delete,                    /* xDelete */
+    wb_access,                    /* xAccess */
+    wb_full_pathname,             /* xFullPathname */
+    wb_dl_open,                   /* xDlOpen */
+    wb_dl_error,                  /* xDlError */
+    wb_dl_sym,                    /* xDlSym */
+    wb_dl_close,                  /* xDlClose */
+    wb_randomness,                /* xRandomness */
+    wb_sleep,                     /* xSleep */
+    wb_current_time,              /* xCurrentTime */
+    wb_get_last_error,            /* xGetLastError */
+    wb_current_time_int64,        /* xCurrentTimeInt64 */
+  };
+  if(wb_vfs.pAppData == 0){
+    sqlite3_vfs *root = sqlite3_vfs_find("unix");
+    if(root == 0){
+      return 0;
+    }
+    wb_vfs.pAppData = root;
+    wb_vfs.szOsFile = sizeof(Wb_File) + root->szOsFile;
+    wb_vfs.mxPathname = root->mxPathname;
+  }
+  return &wb_vfs;
+}
+
+#endif /* !defined(SQLITE_TEST) || SQLITE_OS_UNIX */
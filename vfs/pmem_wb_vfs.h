@@ -0,0 +1,73 @@
+#ifndef PMEM_WB_VFS_H
+#define PMEM_WB_VFS_H
+#include "pmem_vfs.h"
+
+/*
+** Granularity of the cache. Larger SQLite pages take several slots,
+** partial writes of a page not in the cache read the rest of it first.
+*/
+#ifndef PMEM_WB_PAGE_SIZE
+# define PMEM_WB_PAGE_SIZE 4096
+#endif
+
+/* directory of the cache file, overridden by the "cache_file" uri param */
+#ifndef PMEM_WB_CACHE_DIR
+# define PMEM_WB_CACHE_DIR "/mnt/pmem0/scheinost"
+#endif
+
+/* log slots (pages) of a new cache file, 2^18 pages ~ 1GB */
+#ifndef PMEM_WB_SLOTS
+# define PMEM_WB_SLOTS (1 << 18)
+#endif
+
+/* most log slots written back to the database file per destage round */
+#ifndef PMEM_WB_DESTAGE_BATCH
+# define PMEM_WB_DESTAGE_BATCH 8192
+#endif
+
+/* percentage of used log slots that wakes the destager */
+#ifndef PMEM_WB_DESTAGE_HIGH
+# define PMEM_WB_DESTAGE_HIGH 50
+#endif
+
+/* the destager also runs this often while the log is not empty */
+#ifndef PMEM_WB_DESTAGE_MS
+# define PMEM_WB_DESTAGE_MS 100
+#endif
+
+/*
+** Counters returned by SQLITE_FCNTL_PMEM_WB_STATS on the main database.
+*/
+typedef struct pmem_wb_stats pmem_wb_stats;
+struct pmem_wb_stats {
+  u64 commits;            /* batches made durable on pmem */
+  u64 rollbacks;          /* batches dropped by SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE */
+  u64 log_writes;         /* pages appended to the log */
+  u64 cache_reads;        /* page reads served from the log */
+  u64 backing_reads;      /* page reads served from the database file */
+  u64 destaged;           /* pages written back to the database file */
+  u64 superseded;         /* log slots skipped, a later slot has the page */
+  u64 destage_writes;     /* sequential writes issued by the destager */
+  u64 destage_rounds;     /* destage rounds, each ends with one fsync */
+  u64 stalls;             /* writes that waited for a full log to drain */
+  u32 slots;              /* log capacity in pages */
+  u32 slots_used;         /* slots not destaged yet */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Returns the "PMem_VFS_wb" VFS. Main database files stay where they are,
+** usually on an SSD, with a pmem log in front of them that absorbs all
+** writes and is written back in the background. All other files go to the
+** "unix" VFS. Must be called after sqlite3_initialize().
+*/
+sqlite3_vfs *sqlite3_pmem_wb_vfs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PMEM_WB_VFS_H
@@ -33,7 +33,15 @@
 */
 #define MAXPATHNAME 512
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*The only function visible from the outside*/
 sqlite3_vfs *sqlite3_demovfs(void);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // DEMO_VFS_H
\ No newline at end of file